@@ -0,0 +1,2444 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "chrono.h"
+#include "clock_sync.h"
+#include "io_engine.h"
+#include "log.h"
+#include "metrics.h"
+#include "motion.h"
+#include "pixels.h"
+#include "poller.h"
+#include "protocol.h"
+#include "rate_control.h"
+#include "sockets.h"
+#include "stripe_pool.h"
+#include "triple_buffer.h"
+#include "zero_copy.h"
+#include "simd.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+// Smooth-ish texture with some noise, so block matching has a clear minimum
+// but the diamond search still has a gradient to follow
+static void FillTexturedYUYV(byte* yuyv, uint32_t width, uint32_t height,
+  int32_t offset_x, int32_t offset_y, uint32_t seed) {
+  for (uint32_t y = 0; y < height; ++y) {
+    byte* row = yuyv + y * width * 2;
+    for (uint32_t x = 0; x < width; ++x) {
+      int32_t sx = (int32_t)x + offset_x;
+      int32_t sy = (int32_t)y + offset_y;
+      float value = 128.0f
+        + 60.0f * sinf(sx * 0.11f) * cosf(sy * 0.07f)
+        + 40.0f * sinf((sx + sy) * 0.031f);
+      // cheap hash noise anchored to the scene, not the frame
+      uint32_t h = ((uint32_t)sx * 73856093u) ^ ((uint32_t)sy * 19349663u) ^ seed;
+      h = (h ^ (h >> 13)) * 0x5bd1e995;
+      value += (float)((h >> 24) & 0x0F) - 8.0f;
+      if (value < 0.0f) value = 0.0f;
+      else if (value > 255.0f) value = 255.0f;
+
+      row[x * 2 + 0] = (byte)value;
+      row[x * 2 + 1] = (byte)(x & 1 ? 160 : 96);
+    }
+  }
+}
+
+// [Motion estimation]
+static void BenchMotionEstimation(uint32_t width, uint32_t height, uint32_t iterations) {
+  std::vector<byte> reference(width * height * 2);
+  std::vector<byte> current(width * height * 2);
+
+  // Camera pan of (3, -2) pixels between frames
+  FillTexturedYUYV(&reference[0], width, height, 0, 0, 1234);
+  FillTexturedYUYV(&current[0], width, height, 3, -2, 1234);
+
+  MotionSearchParams params;
+  MotionField field;
+
+  const SimdLevel levels[4] = { SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::NEON };
+  const SimdLevel original_level = GetMotionKernel();
+
+  for (uint32_t l = 0; l < 4; ++l) {
+    if (!SetMotionKernel(levels[l])) {
+      continue;
+    }
+
+    // warm up
+    EstimateMotion(&current[0], &reference[0], width, height, width * 2,
+      LumaLayout::YUYV, params, &field);
+
+    Chrono c;
+    c.start();
+    for (uint32_t i = 0; i < iterations; ++i) {
+      EstimateMotion(&current[0], &reference[0], width, height, width * 2,
+        LumaLayout::YUYV, params, &field);
+    }
+    c.stop();
+
+    const uint32_t blocks = field.blocks_x * field.blocks_y;
+    const double seconds = c.timeAsSeconds();
+    const double blocks_per_second = (double)blocks * iterations / seconds;
+    const double avg_sad = (double)field.total_sad / blocks;
+    const double avg_zero_sad = (double)field.total_zero_sad / blocks;
+    const double reduction = avg_zero_sad > 0.0 ? 100.0 * (1.0 - avg_sad / avg_zero_sad) : 0.0;
+
+    uint32_t exact = 0;
+    for (uint32_t i = 0; i < field.vectors.size(); ++i) {
+      if (field.vectors[i].dx == 3 && field.vectors[i].dy == -2) {
+        ++exact;
+      }
+    }
+
+    printf("motion %ux%u %-6s: %10.0f blocks/s  %6.2f ms/frame  candidates/block %5.1f  "
+      "SAD/block %7.1f (zero motion %7.1f, -%.1f%%)  exact vectors %u/%u\n",
+      width, height, SimdLevelName(levels[l]), blocks_per_second,
+      seconds * 1000.0 / iterations, (double)field.candidates_tested / blocks,
+      avg_sad, avg_zero_sad, reduction, exact, blocks);
+  }
+
+  SetMotionKernel(original_level);
+}
+// [\Motion estimation]
+
+// [CPU decode]
+// Client --cpu-decode at a given size: frames per second converting to
+// RGBA on one thread and split in stripes across 'threads' threads
+static bool BenchStripedDecode(uint32_t width, uint32_t height, uint32_t threads, uint32_t iterations) {
+  std::vector<byte> yuyv(FrameSize(PixelFormat::YUYV, width, height));
+  std::vector<byte> payload(yuyv.size());
+  std::vector<byte> expected(width * height * 4);
+  std::vector<byte> rgba(width * height * 4);
+  FillTexturedYUYV(&yuyv[0], width, height, 0, 0, 4321);
+
+  StripePool pool(threads);
+  bool all_match = true;
+  for (uint8_t f = 0; f < (uint8_t)PixelFormat::Count; ++f) {
+    const PixelFormat format = (PixelFormat)f;
+    if (format == PixelFormat::YUYV) {
+      payload = yuyv;
+    }
+    else if (format == PixelFormat::I420) {
+      ConvertYUYVToI420(&yuyv[0], width * 2, width, height, &payload[0]);
+    }
+    else {
+      ConvertYUYVToNV12(&yuyv[0], width * 2, width, height, &payload[0]);
+    }
+
+    Chrono c;
+    c.start();
+    for (uint32_t i = 0; i < iterations; ++i) {
+      ConvertToRGBA(format, &payload[0], width, height, &expected[0]);
+    }
+    c.stop();
+    const double single_fps = iterations / c.timeAsSeconds();
+
+    c.start();
+    for (uint32_t i = 0; i < iterations; ++i) {
+      ConvertToRGBAStriped(&pool, format, &payload[0], width, height, &rgba[0]);
+    }
+    c.stop();
+    const double striped_fps = iterations / c.timeAsSeconds();
+
+    const bool match = (rgba == expected);
+    all_match = all_match && match;
+    printf("decode %ux%u %-4s: %7.1f fps on 1 thread, %7.1f fps on %u threads (x%.2f)%s\n",
+      width, height, PixelFormatName(format), single_fps, striped_fps, pool.threadCount(),
+      striped_fps / single_fps, match ? "" : "  MISMATCH");
+  }
+
+  return all_match;
+}
+// [\CPU decode]
+
+// [Rate control]
+// In-process throttled link: a bottleneck that drains 'capacity' bytes/s
+// behind a send queue of 'send_buffer' bytes. Writing more than fits in the
+// queue blocks the sender, like a blocking send() on a full socket.
+struct ThrottledLink {
+  double capacity;
+  double backlog;
+  double send_buffer;
+
+  void drain(double ms) {
+    backlog = std::max(0.0, backlog - capacity * ms / 1000.0);
+  }
+
+  // Returns how long the write blocked
+  double write(double bytes) {
+    backlog += bytes;
+    if (backlog <= send_buffer) {
+      return 0.0;
+    }
+
+    const double blocked_ms = (backlog - send_buffer) * 1000.0 / capacity;
+    backlog = send_buffer;
+    return blocked_ms;
+  }
+};
+
+// Feeds a 30 fps 640x480 YUYV stream through the link while its capacity
+// changes, and prints what the controller settles on in each phase
+static void SimulateRateControl() {
+  struct Phase {
+    double seconds;
+    double capacity;    // bytes/s
+  };
+  const Phase phases[] = {
+    { 10.0, 40.0e6 },   // room for full resolution at 30 fps (18.4 MB/s)
+    { 20.0,  3.0e6 },   // congested
+    { 20.0, 10.0e6 },   // partial recovery
+    { 15.0, 40.0e6 },
+  };
+  const double frame_ms = 1000.0 / 30.0;
+  const uint32_t header_size = 20;
+
+  RateControlParams params;
+  RateController rate(params);
+  ThrottledLink link = { phases[0].capacity, 0.0, 2.0e6 };
+
+  double now_ms = 0.0;
+  uint32_t sequence = 0;
+  for (uint32_t p = 0; p < sizeof(phases) / sizeof(phases[0]); ++p) {
+    link.capacity = phases[p].capacity;
+    const double phase_end = now_ms + phases[p].seconds * 1000.0;
+    const double settle = now_ms + phases[p].seconds * 500.0;
+    const uint32_t changes_before = rate.stepChanges();
+
+    double delay_sum = 0.0;
+    double delay_max = 0.0;
+    double bytes_sent = 0.0;
+    uint32_t samples = 0;
+    uint32_t frames_sent = 0;
+    while (now_ms < phase_end) {
+      ++sequence;
+      if (rate.shouldSend(sequence)) {
+        const uint32_t layer = rate.currentStep().layer;
+        const uint32_t bytes = header_size + (640 >> layer) * (480 >> layer) * 2;
+        const double blocked_ms = link.write(bytes);
+        now_ms += blocked_ms;
+        link.drain(blocked_ms);
+
+        rate.markSent(sequence);
+        rate.onFrameSent(bytes, (float)blocked_ms, (uint32_t)link.backlog, now_ms);
+
+        // Second half of the phase: has it converged?
+        if (now_ms >= settle) {
+          // Queueing only, the frame's own transmission time isn't delay
+          const double delay = blocked_ms + std::max(0.0, link.backlog - bytes) * 1000.0 / link.capacity;
+          delay_sum += delay;
+          delay_max = std::max(delay_max, delay);
+          bytes_sent += bytes;
+          ++samples;
+          ++frames_sent;
+        }
+      }
+
+      now_ms += frame_ms;
+      link.drain(frame_ms);
+    }
+
+    const double settled_seconds = phases[p].seconds * 0.5;
+    printf("rate link %5.1f MB/s: step %u (layer %u, 1/%u fps)  sent %5.2f MB/s %4.1f fps  "
+      "delay avg %6.1fms max %6.1fms (target %.0fms)  estimate %5.2f MB/s  step changes %u\n",
+      phases[p].capacity / 1.0e6, rate.step(), rate.currentStep().layer,
+      rate.currentStep().frame_divisor, bytes_sent / settled_seconds / 1.0e6,
+      frames_sent / settled_seconds, samples ? delay_sum / samples : 0.0, delay_max,
+      params.target_delay_ms, rate.throughput() / 1.0e6, rate.stepChanges() - changes_before);
+  }
+}
+
+// Right after start the delay is above target but going down (a queue
+// draining): the controller must hold its step, and step down only once
+// the delay grows again
+static bool CheckRateStartupDraining() {
+  RateControlParams params;
+  params.hold_ms = 0.0f;
+  RateController rate(params);
+
+  double now_ms = 0.0;
+  rate.onFrameSent(1000, 0.0f, 0, now_ms);
+  bool held = true;
+  for (float delay_ms = params.target_delay_ms * 4.0f; delay_ms > params.target_delay_ms; delay_ms -= 50.0f) {
+    now_ms += 33.0;
+    rate.onFrameSent(1000, delay_ms, 0, now_ms);
+    held = held && rate.step() == 0;
+  }
+
+  now_ms += 33.0;
+  rate.onFrameSent(1000, params.target_delay_ms * 4.0f, 0, now_ms);
+  const bool stepped = rate.step() == 1;
+
+  printf("rate startup draining: held while draining %s, stepped down on growth %s -> %s\n",
+    held ? "yes" : "no", stepped ? "yes" : "no", (held && stepped) ? "OK" : "FAILED");
+  return held && stepped;
+}
+// [\Rate control]
+
+// [Triple buffer]
+// Stress test: the producer fills every word of a slot with the value's
+// sequence number as fast as it can, the consumer checks it never sees a
+// torn or older value. Build with -fsanitize=thread to have TSan check the
+// handoff as well.
+struct StressValue {
+  uint64_t sequence;
+  uint64_t words[61];
+};
+
+static bool StressTripleBuffer(uint64_t values) {
+  TripleBuffer<StressValue> buffer;
+  for (uint32_t i = 0; i < TripleBuffer<StressValue>::SlotCount(); ++i) {
+    memset(&buffer.slot(i), 0, sizeof(StressValue));
+  }
+
+  std::atomic<bool> producer_done(false);
+  std::thread producer([&]() {
+    for (uint64_t sequence = 1; sequence <= values; ++sequence) {
+      StressValue& value = buffer.writeSlot();
+      value.sequence = sequence;
+      for (uint32_t w = 0; w < 61; ++w) {
+        value.words[w] = sequence;
+      }
+      buffer.publish();
+    }
+    producer_done = true;
+  });
+
+  uint64_t last_sequence = 0;
+  uint64_t updates = 0;
+  uint64_t polls = 0;
+  uint32_t torn = 0;
+  uint32_t out_of_order = 0;
+  Chrono c;
+  c.start();
+  while (true) {
+    // Read the flag first: after it, one more update() sees the last value
+    const bool done = producer_done;
+    ++polls;
+    if (buffer.update()) {
+      const StressValue& value = buffer.readSlot();
+      for (uint32_t w = 0; w < 61; ++w) {
+        if (value.words[w] != value.sequence) {
+          ++torn;
+          break;
+        }
+      }
+      if (value.sequence <= last_sequence) {
+        ++out_of_order;
+      }
+      last_sequence = value.sequence;
+      ++updates;
+    }
+    if (done && !buffer.update()) {
+      break;
+    }
+  }
+  c.stop();
+  producer.join();
+
+  const bool success = torn == 0 && out_of_order == 0 && last_sequence == values;
+  printf("triple buffer: %llu values published, %llu taken by the consumer (%llu polls) in %.2fms, "
+    "last %llu, torn %u, out of order %u: %s\n",
+    (unsigned long long)values, (unsigned long long)updates, (unsigned long long)polls,
+    c.timeAsMilliseconds(), (unsigned long long)last_sequence, torn, out_of_order,
+    success ? "OK" : "FAILED");
+
+  return success;
+}
+// [\Triple buffer]
+
+// [Metrics]
+static Histogram g_bench_histogram("bench.scoped_timer");
+static Histogram g_bench_span_histogram("bench.timed_span");
+static Counter g_bench_counter("bench.counter");
+
+// Most a ScopedTimer may cost, both clock reads and the record() included.
+// Best of kMetricsTimerRuns runs, so a preempted run doesn't fail it.
+static const double kScopedTimerBudgetNs = 100.0;
+static const uint32_t kMetricsTimerRuns = 3;
+// A span timed with ScopedTimer, to check ticks convert to nanoseconds
+static const uint64_t kMetricsSpanNs = 10000000;
+
+// What a ScopedTimer costs in a hot loop (failing above the budget),
+// whether its ticks come out as the right nanoseconds, whether bucketing
+// keeps values within its precision and whether concurrent recording
+// loses samples
+static bool BenchMetrics(uint32_t threads, uint64_t records) {
+  // Every value maps to a bucket whose middle is within ~3% of it
+  double worst_error = 0.0;
+  for (uint64_t value = 1; value < (1ull << 40); value = value * 5 / 4 + 1) {
+    const uint64_t bucket_value = LatencyHistogram::BucketValue(LatencyHistogram::BucketIndex(value));
+    worst_error = std::max(worst_error, fabs((double)bucket_value - (double)value) / value);
+  }
+
+  Chrono c;
+  double timer_ns = 0.0;
+  for (uint32_t run = 0; run < kMetricsTimerRuns; ++run) {
+    c.start();
+    for (uint64_t i = 0; i < records; ++i) {
+      ScopedTimer timer(&g_bench_histogram);
+    }
+    c.stop();
+    const double run_ns = c.timeAsMilliseconds() * 1.0e6 / records;
+    timer_ns = run == 0 ? run_ns : std::min(timer_ns, run_ns);
+  }
+
+  uint64_t clock_sum = 0;
+  c.start();
+  for (uint64_t i = 0; i < records; ++i) {
+    clock_sum += TimerTicks();
+  }
+  c.stop();
+  const double ticks_ns = c.timeAsMilliseconds() * 1.0e6 / records;
+
+  c.start();
+  for (uint64_t i = 0; i < records; ++i) {
+    clock_sum += MonotonicNanos();
+  }
+  c.stop();
+  const double clock_ns = c.timeAsMilliseconds() * 1.0e6 / records;
+
+  {
+    ScopedTimer timer(&g_bench_span_histogram);
+    const uint64_t start_ns = MonotonicNanos();
+    while (MonotonicNanos() - start_ns < kMetricsSpanNs) {
+    }
+  }
+  const double span_ns = g_bench_span_histogram.snapshot().mean();
+
+  // Every thread records the same known values
+  const LatencyHistogram before = g_bench_histogram.snapshot();
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads; ++t) {
+    workers.push_back(std::thread([records]() {
+      MetricsRegisterThread();
+      for (uint64_t i = 0; i < records; ++i) {
+        g_bench_histogram.record(1000 + i % 1000);
+        g_bench_counter.add();
+      }
+    }));
+  }
+  for (uint32_t t = 0; t < threads; ++t) {
+    workers[t].join();
+  }
+  LatencyHistogram recorded = g_bench_histogram.snapshot();
+  recorded.subtract(before);
+
+  const bool counts_match = recorded.count() == threads * records && g_bench_counter.value() == threads * records;
+  const bool precise = worst_error < 0.04;
+  // mean() comes from the exact sum, so this is the calibration error
+  const bool span_matches = fabs(span_ns - kMetricsSpanNs) < kMetricsSpanNs * 0.05;
+  const bool within_budget = timer_ns <= kScopedTimerBudgetNs;
+  const bool success = counts_match && precise && span_matches && within_budget;
+  printf("metrics: ScopedTimer %.1f ns (budget %.0f ns; tick read %.1f ns, clock read %.1f ns), "
+    "%.3fms span timed as %.3fms, worst bucket error %.2f%%, "
+    "%u threads x %llu records: %llu counted, p50 %llu ns (expected ~1500): %s\n",
+    timer_ns, kScopedTimerBudgetNs, ticks_ns, clock_ns, kMetricsSpanNs / 1.0e6, span_ns / 1.0e6,
+    worst_error * 100.0, threads, (unsigned long long)records,
+    (unsigned long long)recorded.count(), (unsigned long long)recorded.percentile(0.5),
+    success ? "OK" : "FAILED");
+  (void)clock_sum;
+
+  return success;
+}
+// [\Metrics]
+
+// [Results]
+// Kernel and socket results go through ReportResult(): a line of text, or
+// with --json one JSON object per line, to compare runs across commits.
+// Timings are the median of kBenchTrials trials after a warm up run, on
+// inputs that are the same every run.
+static const uint32_t kBenchTrials = 5;
+// Each trial runs the kernel for about this long
+static const double kBenchTrialSeconds = 0.05;
+
+static bool g_json_output = false;
+
+struct BenchResult {
+  std::string name;           // "group.variant", e.g. "convert.nv12.avx2"
+  uint32_t width = 0;         // 0 when not about pixels
+  uint32_t height = 0;
+  uint64_t bytes = 0;         // frame data read per run (payload for sockets)
+  double seconds = 0.0;       // per run
+  uint64_t output_bytes = 0;  // encoders: compressed size
+  double loss = -1.0;         // datagrams lost, 0..1; negative if reliable
+};
+
+static void ReportResult(const BenchResult& result) {
+  const uint64_t pixels = (uint64_t)result.width * result.height;
+  const double ns_per_pixel = pixels > 0 ? result.seconds * 1.0e9 / pixels : 0.0;
+  const double gb_per_second = result.seconds > 0.0 ? result.bytes / result.seconds / 1.0e9 : 0.0;
+  const double fps = result.seconds > 0.0 ? 1.0 / result.seconds : 0.0;
+
+  if (g_json_output) {
+    printf("{\"name\":\"%s\",\"width\":%u,\"height\":%u,\"bytes\":%llu,\"ns_per_run\":%.1f,"
+      "\"ns_per_pixel\":%.4f,\"gb_per_s\":%.3f,\"fps\":%.2f", result.name.c_str(), result.width,
+      result.height, (unsigned long long)result.bytes, result.seconds * 1.0e9, ns_per_pixel,
+      gb_per_second, fps);
+    if (result.output_bytes > 0) {
+      printf(",\"output_bytes\":%llu", (unsigned long long)result.output_bytes);
+    }
+    if (result.loss >= 0.0) {
+      printf(",\"loss\":%.4f", result.loss);
+    }
+    printf("}\n");
+    return;
+  }
+
+  if (pixels > 0) {
+    printf("%-26s %5ux%-5u %8.3f ns/pixel", result.name.c_str(), result.width, result.height, ns_per_pixel);
+  }
+  else {
+    printf("%-26s %8llu bytes %8.1f us/frame", result.name.c_str(), (unsigned long long)result.bytes,
+      result.seconds * 1.0e6);
+  }
+  printf(" %8.2f GB/s %9.1f fps", gb_per_second, fps);
+  if (result.output_bytes > 0) {
+    printf("  %llu bytes (%.1f:1)", (unsigned long long)result.output_bytes,
+      (double)result.bytes / result.output_bytes);
+  }
+  if (result.loss >= 0.0) {
+    printf("  %.2f%% lost", result.loss * 100.0);
+  }
+  printf("\n");
+}
+
+// Seconds per call of 'run': one call to warm up and size the trials,
+// then the median of kBenchTrials trials
+template <typename Run>
+static double MedianSeconds(Run run) {
+  Chrono c;
+  c.start();
+  run();
+  c.stop();
+  const double once = std::max((double)c.timeAsSeconds(), 1.0e-9);
+  const uint32_t iterations = std::max(1u, (uint32_t)(kBenchTrialSeconds / once));
+
+  double trials[kBenchTrials];
+  for (uint32_t t = 0; t < kBenchTrials; ++t) {
+    c.start();
+    for (uint32_t i = 0; i < iterations; ++i) {
+      run();
+    }
+    c.stop();
+    trials[t] = c.timeAsSeconds() / iterations;
+  }
+  std::sort(trials, trials + kBenchTrials);
+
+  return trials[kBenchTrials / 2];
+}
+
+static BenchResult MakeResult(const std::string& name, uint32_t width, uint32_t height, uint64_t bytes) {
+  BenchResult result;
+  result.name = name;
+  result.width = width;
+  result.height = height;
+  result.bytes = bytes;
+  return result;
+}
+// [\Results]
+
+// [Kernels]
+static const SimdLevel kSimdLevels[4] = { SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::NEON };
+
+static std::string LowerCase(const char* name) {
+  std::string result = name;
+  for (uint32_t i = 0; i < result.size(); ++i) {
+    result[i] = (char)tolower(result[i]);
+  }
+  return result;
+}
+
+// Every source format to RGBA (scalar only, SetPixelKernel() doesn't
+// change it), and YUYV to 4:2:0 with every kernel the machine runs
+static void BenchConversion(uint32_t width, uint32_t height) {
+  std::vector<byte> yuyv(FrameSize(PixelFormat::YUYV, width, height));
+  std::vector<byte> payload(yuyv.size());
+  std::vector<byte> rgba(width * height * 4);
+  FillTexturedYUYV(&yuyv[0], width, height, 0, 0, 4321);
+
+  for (uint8_t f = 0; f < (uint8_t)PixelFormat::Count; ++f) {
+    const PixelFormat format = (PixelFormat)f;
+    if (format == PixelFormat::YUYV) {
+      payload = yuyv;
+    }
+    else if (format == PixelFormat::I420) {
+      ConvertYUYVToI420(&yuyv[0], width * 2, width, height, &payload[0]);
+    }
+    else {
+      ConvertYUYVToNV12(&yuyv[0], width * 2, width, height, &payload[0]);
+    }
+
+    BenchResult result = MakeResult(std::string("convert.") + PixelFormatName(format) + "_rgba", width, height,
+      FrameSize(format, width, height));
+    result.seconds = MedianSeconds([&]() {
+      ConvertToRGBA(format, &payload[0], width, height, &rgba[0]);
+    });
+    ReportResult(result);
+  }
+
+  // YUYV to 4:2:0, what the server does before sending I420/NV12
+  const SimdLevel original_level = GetPixelKernel();
+  for (uint32_t l = 0; l < 4; ++l) {
+    if (!SetPixelKernel(kSimdLevels[l])) {
+      continue;
+    }
+
+    const std::string level = LowerCase(SimdLevelName(kSimdLevels[l]));
+    BenchResult i420 = MakeResult("convert.yuyv_i420." + level, width, height, yuyv.size());
+    i420.seconds = MedianSeconds([&]() {
+      ConvertYUYVToI420(&yuyv[0], width * 2, width, height, &payload[0]);
+    });
+    ReportResult(i420);
+
+    BenchResult nv12 = MakeResult("convert.yuyv_nv12." + level, width, height, yuyv.size());
+    nv12.seconds = MedianSeconds([&]() {
+      ConvertYUYVToNV12(&yuyv[0], width * 2, width, height, &payload[0]);
+    });
+    ReportResult(nv12);
+  }
+  SetPixelKernel(original_level);
+}
+
+// Frame difference: SAD of every 16x16 block against the previous frame
+// at zero motion, with every kernel the machine runs
+static void BenchFrameDiff(uint32_t width, uint32_t height) {
+  std::vector<byte> previous(FrameSize(PixelFormat::YUYV, width, height));
+  std::vector<byte> current(previous.size());
+  FillTexturedYUYV(&previous[0], width, height, 0, 0, 99);
+  FillTexturedYUYV(&current[0], width, height, 2, 1, 99);
+
+  const SimdLevel original_level = GetMotionKernel();
+  for (uint32_t l = 0; l < 4; ++l) {
+    if (!SetMotionKernel(kSimdLevels[l])) {
+      continue;
+    }
+
+    volatile uint64_t sink = 0;
+    BenchResult result = MakeResult(std::string("diff.sad16.") + LowerCase(SimdLevelName(kSimdLevels[l])),
+      width, height, previous.size() * 2);
+    result.seconds = MedianSeconds([&]() {
+      uint64_t total = 0;
+      for (uint32_t y = 0; y + kMotionBlockSize <= height; y += kMotionBlockSize) {
+        for (uint32_t x = 0; x + kMotionBlockSize <= width; x += kMotionBlockSize) {
+          const uint32_t offset = y * width * 2 + x * 2;
+          total += BlockSAD16x16(&current[offset], &previous[offset], width * 2, LumaLayout::YUYV);
+        }
+      }
+      sink = total;
+    });
+    (void)sink;
+    ReportResult(result);
+  }
+  SetMotionKernel(original_level);
+}
+
+static void BenchScaling(uint32_t width, uint32_t height) {
+  std::vector<byte> yuyv(FrameSize(PixelFormat::YUYV, width, height));
+  std::vector<byte> i420(FrameSize(PixelFormat::I420, width, height));
+  std::vector<byte> scaled(yuyv.size() / 4);
+  FillTexturedYUYV(&yuyv[0], width, height, 0, 0, 7);
+  ConvertYUYVToI420(&yuyv[0], width * 2, width, height, &i420[0]);
+
+  BenchResult yuyv_result = MakeResult("scale.yuyv_2x", width, height, yuyv.size());
+  yuyv_result.seconds = MedianSeconds([&]() {
+    DownscaleYUYV2x(&yuyv[0], width * 2, width, height, &scaled[0], width);
+  });
+  ReportResult(yuyv_result);
+
+  BenchResult i420_result = MakeResult("scale.i420_2x", width, height, i420.size());
+  i420_result.seconds = MedianSeconds([&]() {
+    DownscaleI4202x(&i420[0], width, height, &scaled[0]);
+  });
+  ReportResult(i420_result);
+}
+
+static void CountJpegBytes(void* context, void* data, int size) {
+  (void)data;
+  *(uint64_t*)context += (uint64_t)size;
+}
+
+// What a snapshot or an MJPEG stream would cost, with stb_image_write
+static void BenchJpegEncode(uint32_t width, uint32_t height) {
+  std::vector<byte> yuyv(FrameSize(PixelFormat::YUYV, width, height));
+  std::vector<byte> rgba(width * height * 4);
+  FillTexturedYUYV(&yuyv[0], width, height, 0, 0, 11);
+  ConvertToRGBA(PixelFormat::YUYV, &yuyv[0], width, height, &rgba[0]);
+
+  uint64_t output_bytes = 0;
+  BenchResult result = MakeResult("encode.jpeg_q80", width, height, rgba.size());
+  result.seconds = MedianSeconds([&]() {
+    output_bytes = 0;
+    stbi_write_jpg_to_func(CountJpegBytes, &output_bytes, (int)width, (int)height, 4, &rgba[0], 80);
+  });
+  result.output_bytes = output_bytes;
+  ReportResult(result);
+}
+
+// Baselines for the rest: one frame copied, from cache sized to DRAM sized
+static void BenchMemcpy() {
+  const uint32_t sizes[3][2] = { { 640, 480 }, { 1920, 1080 }, { 3840, 2160 } };
+  for (uint32_t s = 0; s < 3; ++s) {
+    const uint32_t width = sizes[s][0];
+    const uint32_t height = sizes[s][1];
+    std::vector<byte> src(FrameSize(PixelFormat::YUYV, width, height));
+    std::vector<byte> dst(src.size());
+    FillTexturedYUYV(&src[0], width, height, 0, 0, 5);
+
+    BenchResult result = MakeResult("memcpy.yuyv_frame", width, height, src.size());
+    result.seconds = MedianSeconds([&]() {
+      memcpy(&dst[0], &src[0], src.size());
+    });
+    ReportResult(result);
+  }
+}
+
+static void BenchKernels() {
+  printf(g_json_output ? "" : "Pixel kernels, best SIMD level %s\n", SimdLevelName(DetectSimdLevel()));
+  const uint32_t sizes[2][2] = { { 640, 480 }, { 1920, 1080 } };
+  for (uint32_t s = 0; s < 2; ++s) {
+    BenchConversion(sizes[s][0], sizes[s][1]);
+    BenchFrameDiff(sizes[s][0], sizes[s][1]);
+    BenchScaling(sizes[s][0], sizes[s][1]);
+    BenchJpegEncode(sizes[s][0], sizes[s][1]);
+  }
+  BenchMemcpy();
+}
+// [\Kernels]
+
+// [Socket loopback]
+// Throughput of the Socket classes over 127.0.0.1, one sender thread and
+// one receiver thread, blocking sockets. Frames are sent back to back.
+static const uint32_t kBenchTCPPort = 14290;
+static const uint32_t kBenchUDPPort = 14291;
+// Largest datagram that fits in an IPv4 UDP packet, rounded down
+static const uint32_t kUDPDatagramSize = 65000;
+static const uint32_t kSocketTrials = 3;
+// Data per trial, whatever the frame size
+static const uint64_t kSocketTrialBytes = 256ull << 20;
+
+static void BenchTCPLoopback(uint32_t frame_size) {
+  TCPListener listener(Socket::Type::Block);
+  if (!listener.bind(kBenchTCPPort) || !listener.listen()) {
+    printf("tcp: can't listen on port %u\n", kBenchTCPPort);
+    return;
+  }
+
+  const uint32_t frames = (uint32_t)std::max<uint64_t>(4, kSocketTrialBytes / frame_size);
+  std::atomic<uint32_t> trials_received(0);
+  std::thread receiver([&]() {
+    TCPSocket* socket = listener.accept();
+    if (!socket) {
+      return;
+    }
+
+    std::vector<byte> buffer(frame_size);
+    for (uint32_t t = 0; t < kSocketTrials; ++t) {
+      for (uint32_t f = 0; f < frames; ++f) {
+        uint32_t received = 0;
+        while (received < frame_size && socket->isConnected()) {
+          received += socket->receiveData(&buffer[received], frame_size - received);
+        }
+      }
+      trials_received = t + 1;
+    }
+    socket->close();
+    delete socket;
+  });
+
+  TCPSocket socket(Socket::Type::Block);
+  while (!socket.connect("127.0.0.1", kBenchTCPPort)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  std::vector<byte> frame(frame_size, 0x5A);
+  double trials[kSocketTrials];
+  for (uint32_t t = 0; t < kSocketTrials; ++t) {
+    Chrono c;
+    c.start();
+    for (uint32_t f = 0; f < frames && socket.isConnected(); ++f) {
+      uint32_t sent = 0;
+      while (sent < frame_size && socket.isConnected()) {
+        sent += socket.sendData(&frame[sent], frame_size - sent);
+      }
+    }
+    // Done when the receiver has it all
+    while (trials_received < t + 1 && socket.isConnected()) {
+      std::this_thread::yield();
+    }
+    c.stop();
+    trials[t] = c.timeAsSeconds() / frames;
+  }
+  receiver.join();
+  socket.close();
+  listener.close();
+
+  std::sort(trials, trials + kSocketTrials);
+  BenchResult result = MakeResult("socket.tcp", 0, 0, frame_size);
+  result.seconds = trials[kSocketTrials / 2];
+  ReportResult(result);
+}
+
+// UDP has no flow control: each frame goes out as a burst of datagrams of
+// kUDPDatagramSize bytes, and what doesn't fit in the receive buffer while
+// the receiver catches up is lost. The next frame waits for the receiver
+// to drain the previous one, like a camera that sends a frame at a time.
+// Frame times include that wait (1 ms without data): compare loss, and
+// throughput across runs, not with TCP.
+static void BenchUDPLoopback(uint32_t frame_size) {
+  UDPSocket receiver_socket(Socket::Type::NonBlock);
+  if (!receiver_socket.bind(kBenchUDPPort)) {
+    printf("udp: can't bind port %u\n", kBenchUDPPort);
+    return;
+  }
+
+  const uint32_t frames = (uint32_t)std::max<uint64_t>(4, (kSocketTrialBytes / 4) / frame_size);
+  const Socket::Peer peer("127.0.0.1", kBenchUDPPort);
+  std::atomic<bool> sending(true);
+  std::atomic<uint64_t> received_bytes(0);
+  std::atomic<uint64_t> last_receive_ns(0);
+  std::thread receiver([&]() {
+    std::vector<byte> datagram(kUDPDatagramSize);
+    uint64_t idle_since_ns = 0;
+    while (true) {
+      if (receiver_socket.availableBytes() == 0) {
+        // Nothing for a while after the sender is done: the rest is lost
+        const uint64_t now_ns = MonotonicNanos();
+        if (!sending && idle_since_ns != 0 && now_ns - idle_since_ns > 50000000ull) {
+          break;
+        }
+        idle_since_ns = idle_since_ns == 0 ? now_ns : idle_since_ns;
+        std::this_thread::yield();
+        continue;
+      }
+
+      idle_since_ns = 0;
+      const uint32_t bytes = receiver_socket.receiveData(&datagram[0], kUDPDatagramSize, peer);
+      received_bytes += bytes;
+      last_receive_ns = MonotonicNanos();
+    }
+  });
+
+  UDPSocket sender_socket(Socket::Type::Block);
+  std::vector<byte> frame(frame_size, 0xA5);
+  const uint64_t start_ns = MonotonicNanos();
+  for (uint32_t f = 0; f < frames; ++f) {
+    for (uint32_t offset = 0; offset < frame_size; offset += kUDPDatagramSize) {
+      sender_socket.sendData(&frame[offset], std::min(kUDPDatagramSize, frame_size - offset), peer);
+    }
+
+    // Drained when nothing came in for a millisecond
+    const uint64_t sent_ns = MonotonicNanos();
+    while (MonotonicNanos() - std::max(last_receive_ns.load(), sent_ns) < 1000000ull) {
+      std::this_thread::yield();
+    }
+  }
+  sending = false;
+  receiver.join();
+  sender_socket.close();
+  receiver_socket.close();
+
+  // Throughput of what arrived, per frame sent
+  const double seconds = (last_receive_ns - start_ns) / 1.0e9;
+  const uint64_t sent_bytes = (uint64_t)frames * frame_size;
+  BenchResult result = MakeResult("socket.udp", 0, 0, frame_size);
+  result.seconds = received_bytes > 0 ? seconds * sent_bytes / received_bytes / frames : 0.0;
+  result.loss = 1.0 - (double)received_bytes / sent_bytes;
+  ReportResult(result);
+}
+
+static void BenchSockets() {
+  if (!g_json_output) {
+    printf("Socket loopback, 1 sender and 1 receiver thread\n");
+  }
+  // 64K, VGA YUYV, 1080p YUYV
+  const uint32_t frame_sizes[3] = { 65536, 614400, 4147200 };
+  for (uint32_t i = 0; i < 3; ++i) {
+    BenchTCPLoopback(frame_sizes[i]);
+  }
+  for (uint32_t i = 0; i < 3; ++i) {
+    BenchUDPLoopback(frame_sizes[i]);
+  }
+}
+// [\Socket loopback]
+
+// [End to end]
+// Bench e2e: the real Server and Client binaries over loopback. The server
+// runs a synthetic source, N headless clients watch it for a fixed time,
+// and every scenario (wire format, direct or through a relay) must stay
+// within its budgets: sustained fps, p99 capture to receive latency,
+// server CPU per frame and bytes per frame. Results are written as JSON;
+// the exit code is non zero when a budget is missed.
+static const uint32_t kServerPort = 14194;
+static const uint32_t kRelayPort = 14295;
+// Frames at the start of each client left out of the latency figures:
+// the clock offset to the server isn't known yet and buffers are cold
+static const uint32_t kWarmupFrames = 15;
+// For the server or the relay to start listening
+static const uint64_t kListenerTimeoutNs = 5000000000ull;
+
+struct EndToEndBudget {
+  double min_fps_ratio = 0.9;         // of the source frame rate
+  double max_p99_ms = 100.0;          // capture to last payload byte
+  double max_cpu_ms_per_frame = 20.0; // server user + system time
+  double max_bytes_ratio = 1.0;       // payload over the format's frame size
+};
+
+struct EndToEndScenario {
+  const char* name;
+  PixelFormat format;
+  uint32_t layer;
+  bool relay;                         // clients watch a relay, not the server
+};
+
+struct EndToEndConfig {
+  std::string server_path = "./Server/bin/Server";
+  std::string client_path = "./Client/bin/Client";
+  std::string output_path = "e2e_results.json";
+  uint32_t width = 640;
+  uint32_t height = 480;
+  uint32_t fps = 30;
+  uint32_t clients = 4;
+  uint32_t seconds = 10;
+  EndToEndBudget budget;
+};
+
+struct EndToEndResult {
+  uint32_t clients_done = 0;          // clients that printed a summary
+  uint64_t frames = 0;                // all clients, after their warm up
+  double fps = 0.0;                   // slowest client
+  double p50_ms = 0.0;
+  double p99_ms = 0.0;
+  double cpu_ms_per_frame = 0.0;
+  double bytes_per_frame = 0.0;
+  double expected_bytes = 0.0;
+  bool pass = false;
+  std::string failures;
+};
+
+struct ChildProcess {
+  pid_t pid = -1;
+  int32_t output = -1;                // its stdout, when captured
+  std::string pending;                // partial line read so far
+  bool done = false;
+};
+
+// Runs 'args' (args[0] is the path) with stdout piped to us, or thrown
+// away. stderr is left alone so crashes and errors show.
+static bool SpawnProcess(const std::vector<std::string>& args, bool capture_output, ChildProcess* child) {
+  int32_t pipe_fds[2] = { -1, -1 };
+  if (capture_output && pipe(pipe_fds) != 0) {
+    return false;
+  }
+
+  const pid_t pid = fork();
+  if (pid < 0) {
+    return false;
+  }
+  if (pid == 0) {
+    if (capture_output) {
+      dup2(pipe_fds[1], STDOUT_FILENO);
+      ::close(pipe_fds[0]);
+      ::close(pipe_fds[1]);
+    }
+    else {
+      const int32_t null_fd = open("/dev/null", O_WRONLY);
+      dup2(null_fd, STDOUT_FILENO);
+      ::close(null_fd);
+    }
+
+    std::vector<char*> argv;
+    for (uint32_t i = 0; i < args.size(); ++i) {
+      argv.push_back((char*)args[i].c_str());
+    }
+    argv.push_back(nullptr);
+    execv(argv[0], &argv[0]);
+    fprintf(stderr, "e2e: can't run %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+
+  child->pid = pid;
+  if (capture_output) {
+    ::close(pipe_fds[1]);
+    child->output = pipe_fds[0];
+  }
+
+  return true;
+}
+
+static void StopProcess(ChildProcess* child) {
+  if (child->pid <= 0) {
+    return;
+  }
+
+  kill(child->pid, SIGINT);
+  // A second for a clean exit, then it's killed
+  for (uint32_t i = 0; i < 100; ++i) {
+    if (waitpid(child->pid, nullptr, WNOHANG) == child->pid) {
+      child->pid = -1;
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  if (child->pid > 0) {
+    kill(child->pid, SIGKILL);
+    waitpid(child->pid, nullptr, 0);
+    child->pid = -1;
+  }
+  if (child->output >= 0) {
+    ::close(child->output);
+    child->output = -1;
+  }
+}
+
+// Until something accepts connections on 'port'. The clients retry on
+// their own, but a client started before its server spins on connect().
+static bool WaitForListener(uint32_t port, uint64_t timeout_ns) {
+  const uint64_t deadline_ns = MonotonicNanos() + timeout_ns;
+  while (MonotonicNanos() < deadline_ns) {
+    TCPSocket probe(Socket::Type::Block);
+    const bool connected = probe.connect("127.0.0.1", port);
+    probe.close();
+    if (connected) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+
+  return false;
+}
+
+// User plus system CPU time of a process, from /proc
+static double ProcessCpuSeconds(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int32_t)pid);
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return 0.0;
+  }
+
+  char buffer[1024];
+  const size_t size = fread(buffer, 1, sizeof(buffer) - 1, file);
+  fclose(file);
+  buffer[size] = '\0';
+
+  // Fields after the command name, which may have spaces: state is 3rd,
+  // utime and stime are the 14th and 15th
+  const char* fields = strrchr(buffer, ')');
+  unsigned long long user_ticks = 0;
+  unsigned long long system_ticks = 0;
+  if (!fields || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+    &user_ticks, &system_ticks) != 2) {
+    return 0.0;
+  }
+
+  return (double)(user_ticks + system_ticks) / sysconf(_SC_CLK_TCK);
+}
+
+// The number after "key": in a one line JSON object. False when it's
+// missing or not a number (null).
+static bool JsonNumber(const std::string& line, const char* key, double* value) {
+  const std::string pattern = std::string("\"") + key + "\":";
+  const size_t position = line.find(pattern);
+  if (position == std::string::npos) {
+    return false;
+  }
+
+  char* end = nullptr;
+  const char* start = line.c_str() + position + pattern.size();
+  *value = strtod(start, &end);
+  return end != start;
+}
+
+static double Percentile(std::vector<double>* samples, double fraction) {
+  if (samples->empty()) {
+    return 0.0;
+  }
+
+  std::sort(samples->begin(), samples->end());
+  const size_t index = std::min(samples->size() - 1, (size_t)(fraction * samples->size()));
+  return (*samples)[index];
+}
+
+static EndToEndResult RunEndToEnd(const EndToEndConfig& config, const EndToEndScenario& scenario) {
+  EndToEndResult result;
+  const uint32_t frame_limit = config.fps * config.seconds + kWarmupFrames;
+  char source[64];
+  snprintf(source, sizeof(source), "synthetic:%ux%u@%u", config.width, config.height, config.fps);
+  char layer[16];
+  snprintf(layer, sizeof(layer), "%u", scenario.layer);
+  char frames[16];
+  snprintf(frames, sizeof(frames), "%u", frame_limit);
+  char relay_port[16];
+  snprintf(relay_port, sizeof(relay_port), "%u", kRelayPort);
+  char relay_address[32];
+  snprintf(relay_address, sizeof(relay_address), "127.0.0.1:%u", kRelayPort);
+  const std::vector<std::string> format_args = { "--format", PixelFormatName(scenario.format),
+    "--layer", layer };
+
+  ChildProcess server;
+  if (!SpawnProcess({ config.server_path, "--log-level", "warning", source }, false, &server)) {
+    result.failures = "can't start the server";
+    return result;
+  }
+
+  ChildProcess relay;
+  bool listening = WaitForListener(kServerPort, kListenerTimeoutNs);
+  if (listening && scenario.relay) {
+    std::vector<std::string> args = { config.client_path, "--log-level", "warning", "--relay", relay_port };
+    args.insert(args.end(), format_args.begin(), format_args.end());
+    listening = SpawnProcess(args, false, &relay) && WaitForListener(kRelayPort, kListenerTimeoutNs);
+  }
+  if (!listening) {
+    StopProcess(&relay);
+    StopProcess(&server);
+    result.failures = "nothing listening to connect to";
+    return result;
+  }
+
+  std::vector<ChildProcess> clients(config.clients);
+  for (uint32_t i = 0; i < config.clients; ++i) {
+    std::vector<std::string> args = { config.client_path, "--headless", "--frames", frames,
+      "--log-level", "warning" };
+    args.insert(args.end(), format_args.begin(), format_args.end());
+    if (scenario.relay) {
+      args.push_back(relay_address);
+    }
+    SpawnProcess(args, true, &clients[i]);
+  }
+
+  // Server CPU is measured from the first frame after every client's warm
+  // up to the end of the first client, so all clients are watching
+  std::vector<uint32_t> client_frames(config.clients, 0);
+  std::vector<double> latencies;
+  std::vector<double> client_fps(config.clients, 0.0);
+  double payload_bytes = 0.0;
+  uint32_t warm_clients = 0;
+  double cpu_start = 0.0;
+  double cpu_end = 0.0;
+  uint64_t frames_start_ns = 0;
+  uint64_t frames_end_ns = 0;
+  const uint64_t deadline_ns = MonotonicNanos() + (config.seconds * 3ull + 10) * 1000000000ull;
+  uint32_t running = config.clients;
+  while (running > 0 && MonotonicNanos() < deadline_ns) {
+    std::vector<struct pollfd> poll_fds;
+    std::vector<uint32_t> poll_clients;
+    for (uint32_t i = 0; i < config.clients; ++i) {
+      if (!clients[i].done && clients[i].output >= 0) {
+        struct pollfd entry = { clients[i].output, POLLIN, 0 };
+        poll_fds.push_back(entry);
+        poll_clients.push_back(i);
+      }
+    }
+    if (poll(poll_fds.data(), poll_fds.size(), 100) <= 0) {
+      continue;
+    }
+
+    for (uint32_t p = 0; p < poll_fds.size(); ++p) {
+      if ((poll_fds[p].revents & (POLLIN | POLLHUP)) == 0) {
+        continue;
+      }
+
+      const uint32_t c = poll_clients[p];
+      ChildProcess& client = clients[c];
+      char buffer[4096];
+      const ssize_t bytes = read(client.output, buffer, sizeof(buffer));
+      if (bytes <= 0) {
+        client.done = true;
+        --running;
+        if (frames_end_ns == 0) {
+          frames_end_ns = MonotonicNanos();
+          cpu_end = ProcessCpuSeconds(server.pid);
+        }
+        continue;
+      }
+
+      client.pending.append(buffer, bytes);
+      size_t line_end = 0;
+      while ((line_end = client.pending.find('\n')) != std::string::npos) {
+        const std::string line = client.pending.substr(0, line_end);
+        client.pending.erase(0, line_end + 1);
+        if (line.empty() || line[0] != '{') {
+          continue;
+        }
+
+        double value = 0.0;
+        if (line.find("\"summary\":true") != std::string::npos) {
+          if (JsonNumber(line, "fps", &value)) {
+            client_fps[c] = value;
+            ++result.clients_done;
+          }
+          continue;
+        }
+
+        if (++client_frames[c] == kWarmupFrames && ++warm_clients == config.clients) {
+          frames_start_ns = MonotonicNanos();
+          cpu_start = ProcessCpuSeconds(server.pid);
+        }
+        if (client_frames[c] <= kWarmupFrames) {
+          continue;
+        }
+
+        // Capture to the header arriving, plus receiving the payload
+        double end_to_end_ms = 0.0;
+        double latency_ms = 0.0;
+        double receive_ms = 0.0;
+        if (JsonNumber(line, "end_to_end_ms", &end_to_end_ms) && JsonNumber(line, "latency_ms", &latency_ms) &&
+          JsonNumber(line, "receive_ms", &receive_ms)) {
+          latencies.push_back(end_to_end_ms - latency_ms + receive_ms);
+        }
+        if (JsonNumber(line, "bytes", &value)) {
+          payload_bytes += value;
+        }
+        ++result.frames;
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < config.clients; ++i) {
+    StopProcess(&clients[i]);
+  }
+  StopProcess(&relay);
+  StopProcess(&server);
+
+  // Frame sizes of the layer the clients asked for
+  const uint32_t width = config.width >> scenario.layer;
+  const uint32_t height = config.height >> scenario.layer;
+  result.expected_bytes = FrameSize(scenario.format, width, height);
+  result.fps = client_fps.empty() ? 0.0 : *std::min_element(client_fps.begin(), client_fps.end());
+  result.p50_ms = Percentile(&latencies, 0.50);
+  result.p99_ms = Percentile(&latencies, 0.99);
+  result.bytes_per_frame = result.frames > 0 ? payload_bytes / result.frames : 0.0;
+  if (frames_end_ns > frames_start_ns && frames_start_ns != 0) {
+    const double seconds = (frames_end_ns - frames_start_ns) / 1.0e9;
+    result.cpu_ms_per_frame = (cpu_end - cpu_start) * 1000.0 / (seconds * config.fps);
+  }
+
+  const EndToEndBudget& budget = config.budget;
+  char failure[128];
+  if (result.clients_done < config.clients) {
+    snprintf(failure, sizeof(failure), "%u of %u clients finished; ", result.clients_done, config.clients);
+    result.failures += failure;
+  }
+  if (result.fps < budget.min_fps_ratio * config.fps) {
+    snprintf(failure, sizeof(failure), "fps %.2f < %.2f; ", result.fps, budget.min_fps_ratio * config.fps);
+    result.failures += failure;
+  }
+  if (latencies.empty() || result.p99_ms > budget.max_p99_ms) {
+    snprintf(failure, sizeof(failure), "p99 %.2fms > %.2fms; ", result.p99_ms, budget.max_p99_ms);
+    result.failures += failure;
+  }
+  if (result.cpu_ms_per_frame > budget.max_cpu_ms_per_frame) {
+    snprintf(failure, sizeof(failure), "server cpu %.3fms/frame > %.3fms; ", result.cpu_ms_per_frame,
+      budget.max_cpu_ms_per_frame);
+    result.failures += failure;
+  }
+  if (result.bytes_per_frame > budget.max_bytes_ratio * result.expected_bytes) {
+    snprintf(failure, sizeof(failure), "%.0f bytes/frame > %.0f; ", result.bytes_per_frame,
+      budget.max_bytes_ratio * result.expected_bytes);
+    result.failures += failure;
+  }
+  result.pass = result.failures.empty();
+
+  return result;
+}
+
+// Bench e2e [--server path] [--client path] [--out file] [--clients n]
+//           [--seconds n] [--source WIDTHxHEIGHT@FPS] [--min-fps-ratio r]
+//           [--max-p99-ms ms] [--max-cpu-ms ms]
+static int BenchEndToEnd(int argc, char** argv) {
+  EndToEndConfig config;
+  for (int32_t i = 2; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--server") == 0 && has_value) {
+      config.server_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--client") == 0 && has_value) {
+      config.client_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--out") == 0 && has_value) {
+      config.output_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--clients") == 0 && has_value) {
+      config.clients = std::max(1, atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--seconds") == 0 && has_value) {
+      config.seconds = std::max(1, atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--source") == 0 && has_value) {
+      if (sscanf(argv[++i], "%ux%u@%u", &config.width, &config.height, &config.fps) != 3 || config.fps == 0) {
+        printf("Bad source %s, use WIDTHxHEIGHT@FPS\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--min-fps-ratio") == 0 && has_value) {
+      config.budget.min_fps_ratio = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--max-p99-ms") == 0 && has_value) {
+      config.budget.max_p99_ms = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--max-cpu-ms") == 0 && has_value) {
+      config.budget.max_cpu_ms_per_frame = atof(argv[++i]);
+    }
+  }
+
+  // A viewer process going away must not take us with it
+  signal(SIGPIPE, SIG_IGN);
+  // Probing for listeners fails until they are up, that's expected
+  LogSetLevel(LogLevel::Off);
+
+  const EndToEndScenario scenarios[] = {
+    { "tcp.yuyv", PixelFormat::YUYV, 0, false },
+    { "tcp.i420", PixelFormat::I420, 0, false },
+    { "tcp.nv12", PixelFormat::NV12, 0, false },
+    { "tcp.i420.layer1", PixelFormat::I420, 1, false },
+    { "relay.i420", PixelFormat::I420, 0, true },
+  };
+  const uint32_t scenario_count = sizeof(scenarios) / sizeof(scenarios[0]);
+
+  FILE* file = fopen(config.output_path.c_str(), "w");
+  if (!file) {
+    printf("Can't write %s\n", config.output_path.c_str());
+    return 1;
+  }
+  fprintf(file, "{\"source\":\"%ux%u@%u\",\"clients\":%u,\"seconds\":%u,\"budget\":{\"min_fps\":%.2f,"
+    "\"max_p99_ms\":%.2f,\"max_cpu_ms_per_frame\":%.3f,\"max_bytes_ratio\":%.3f},\"scenarios\":[",
+    config.width, config.height, config.fps, config.clients, config.seconds,
+    config.budget.min_fps_ratio * config.fps, config.budget.max_p99_ms, config.budget.max_cpu_ms_per_frame,
+    config.budget.max_bytes_ratio);
+
+  printf("End to end: %ux%u@%u synthetic source, %u clients, %us per scenario\n", config.width,
+    config.height, config.fps, config.clients, config.seconds);
+  bool all_pass = true;
+  for (uint32_t s = 0; s < scenario_count; ++s) {
+    const EndToEndScenario& scenario = scenarios[s];
+    const EndToEndResult result = RunEndToEnd(config, scenario);
+    all_pass = all_pass && result.pass;
+
+    printf("%-16s %6.2f fps  p50 %6.2fms  p99 %6.2fms  server %6.3fms cpu/frame  %8.0f bytes/frame  %s%s\n",
+      scenario.name, result.fps, result.p50_ms, result.p99_ms, result.cpu_ms_per_frame,
+      result.bytes_per_frame, result.pass ? "OK" : "FAIL: ", result.failures.c_str());
+    fprintf(file, "%s\n{\"name\":\"%s\",\"format\":\"%s\",\"layer\":%u,\"relay\":%s,\"clients_done\":%u,"
+      "\"frames\":%llu,\"fps\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"server_cpu_ms_per_frame\":%.4f,"
+      "\"bytes_per_frame\":%.1f,\"expected_bytes_per_frame\":%.1f,\"pass\":%s,\"failures\":\"%s\"}",
+      s > 0 ? "," : "", scenario.name, PixelFormatName(scenario.format), scenario.layer,
+      scenario.relay ? "true" : "false", result.clients_done, (unsigned long long)result.frames,
+      result.fps, result.p50_ms, result.p99_ms, result.cpu_ms_per_frame, result.bytes_per_frame,
+      result.expected_bytes, result.pass ? "true" : "false", result.failures.c_str());
+  }
+  fprintf(file, "\n],\"pass\":%s}\n", all_pass ? "true" : "false");
+  fclose(file);
+
+  printf("%s, results in %s\n", all_pass ? "All budgets met" : "Budgets missed", config.output_path.c_str());
+  return all_pass ? 0 : 1;
+}
+// [\End to end]
+
+// [Viewer load]
+// Bench viewers: how many viewers one server can feed. Opens lightweight
+// viewer connections from this one process, all on one Poller, adding
+// 'step' more every 'step_seconds' up to 'max_viewers'. Every frame
+// header is checked (magic, format, size) and every viewer's sequence
+// numbers must go up: gaps are frames the server skipped for it, going
+// back is an error. A share of the viewers can be throttled to emulate
+// slow links, the server must skip frames for them without the others
+// suffering. After each step: aggregate throughput and the latency of
+// every frame, capture to last byte on this machine's clock.
+static const uint32_t kViewerScratchSize = 256 * 1024;
+// A viewer that isn't connected after this is dropped and opened again
+static const uint64_t kViewerConnectTimeoutNs = 3000000000ull;
+// Throttled viewers may take this much at once after a pause
+static const uint32_t kThrottleBurstBytes = 64 * 1024;
+
+struct LoadConfig {
+  std::string server_ip = "127.0.0.1";
+  uint32_t server_port = kServerPort;
+  uint32_t max_viewers = 1000;
+  uint32_t start_viewers = 50;
+  uint32_t step = 50;
+  double step_seconds = 5.0;
+  double slow_fraction = 0.0;       // of the viewers, throttled
+  uint32_t slow_kbps = 2000;
+  PixelFormat format = PixelFormat::I420;
+  uint32_t layer = 2;               // small frames: the server's fan out, not the link
+};
+
+struct LoadViewer {
+  TCPSocket* socket = nullptr;
+  bool connected = false;
+  uint64_t opened_ns = 0;
+  bool throttled = false;
+  bool paused = false;              // throttled and out of budget
+  double budget_bytes = 0.0;
+  uint64_t refill_ns = 0;
+  FrameHeader header;
+  uint32_t header_bytes = 0;
+  uint32_t payload_remaining = 0;
+  bool has_sequence = false;
+  uint32_t last_sequence = 0;
+  ClockSync clock;
+  // Since the last report
+  uint32_t frames = 0;
+};
+
+struct LoadStats {
+  uint64_t frames = 0;
+  uint64_t bytes = 0;
+  uint64_t skipped = 0;             // sequence gaps
+  uint64_t bad_headers = 0;
+  uint64_t out_of_order = 0;
+  uint64_t disconnects = 0;
+  std::vector<double> latencies_ms; // synchronized, unthrottled viewers
+};
+
+static bool SendControl(LoadViewer* viewer, const ControlMessage& message) {
+  // 32 bytes into an empty send buffer: all or nothing in practice
+  return viewer->socket->sendData((byte*)&message, sizeof(message)) == sizeof(message);
+}
+
+static void PingViewerClock(LoadViewer* viewer) {
+  const uint64_t now_us = MonotonicMicros();
+  if (viewer->clock.pingDue(now_us)) {
+    ControlMessage message = MakeControlMessage(ControlType::Ping);
+    message.args[0] = viewer->clock.startPing(now_us);
+    SendControl(viewer, message);
+  }
+}
+
+static void StartViewer(Poller* poller, LoadViewer* viewer, const LoadConfig& config);
+
+static void OpenViewer(Poller* poller, LoadViewer* viewer, const LoadConfig& config) {
+  viewer->socket = new TCPSocket(Socket::Type::NonBlock);
+  viewer->connected = false;
+  viewer->opened_ns = MonotonicNanos();
+  viewer->paused = false;
+  viewer->budget_bytes = kThrottleBurstBytes;
+  viewer->refill_ns = viewer->opened_ns;
+  viewer->header_bytes = 0;
+  viewer->payload_remaining = 0;
+  viewer->has_sequence = false;
+  viewer->clock.reset();
+  // Writable once the connection is up (or has failed)
+  poller->add(*viewer->socket, Poller::kWritable, viewer);
+  if (viewer->socket->connect(config.server_ip.c_str(), config.server_port)) {
+    StartViewer(poller, viewer, config);
+  }
+}
+
+static void CloseViewer(Poller* poller, LoadViewer* viewer) {
+  poller->remove(*viewer->socket);
+  viewer->socket->close();
+  delete viewer->socket;
+  viewer->socket = nullptr;
+  viewer->connected = false;
+}
+
+// Connected: ask for the stream, from now on only reads matter
+static void StartViewer(Poller* poller, LoadViewer* viewer, const LoadConfig& config) {
+  viewer->connected = true;
+  ControlMessage format = MakeControlMessage(ControlType::SetFormat);
+  format.args[0] = (uint32_t)config.format;
+  ControlMessage layer = MakeControlMessage(ControlType::SetLayer);
+  layer.args[0] = config.layer;
+  SendControl(viewer, format);
+  SendControl(viewer, layer);
+  PingViewerClock(viewer);
+  poller->modify(*viewer->socket, Poller::kReadable, viewer);
+}
+
+static bool ValidFrameHeader(const FrameHeader& header) {
+  if (header.magic != kFrameMagic) {
+    return false;
+  }
+  if (header.flags & kFrameFlagClock) {
+    return header.payload_size == 0;
+  }
+
+  return header.format < (uint8_t)PixelFormat::Count && header.layer < kLayerCount &&
+    header.payload_size == FrameSize((PixelFormat)header.format, header.width, header.height);
+}
+
+// A whole frame (or clock answer) is in
+static void FinishFrame(LoadViewer* viewer, LoadStats* stats) {
+  const FrameHeader& header = viewer->header;
+  const uint64_t now_us = MonotonicMicros();
+  if (header.flags & kFrameFlagClock) {
+    viewer->clock.onPong(header.sequence, header.capture_us, header.process_us, now_us);
+    return;
+  }
+
+  if (viewer->has_sequence && header.sequence <= viewer->last_sequence) {
+    ++stats->out_of_order;
+  }
+  else if (viewer->has_sequence) {
+    stats->skipped += header.sequence - viewer->last_sequence - 1;
+  }
+  viewer->has_sequence = true;
+  viewer->last_sequence = header.sequence;
+
+  ++viewer->frames;
+  ++stats->frames;
+  stats->bytes += sizeof(header) + header.payload_size;
+  // Throttled viewers lag by design, they would only hide the others
+  if (!viewer->throttled && viewer->clock.synchronized() && header.capture_us != 0) {
+    const uint64_t capture_us = viewer->clock.toLocal(header.capture_us);
+    stats->latencies_ms.push_back(now_us > capture_us ? (now_us - capture_us) / 1000.0 : 0.0);
+  }
+  PingViewerClock(viewer);
+}
+
+// Reads what the viewer has (what its budget allows, if throttled).
+// Returns false if the viewer must be closed.
+static bool ReadViewer(LoadViewer* viewer, byte* scratch, LoadStats* stats) {
+  while (true) {
+    uint32_t wanted = 0;
+    byte* destination = scratch;
+    if (viewer->header_bytes < sizeof(FrameHeader)) {
+      wanted = sizeof(FrameHeader) - viewer->header_bytes;
+      destination = (byte*)&viewer->header + viewer->header_bytes;
+    }
+    else {
+      wanted = std::min(viewer->payload_remaining, kViewerScratchSize);
+    }
+    if (viewer->throttled) {
+      wanted = std::min(wanted, (uint32_t)viewer->budget_bytes);
+      if (wanted == 0) {
+        return true;
+      }
+    }
+
+    const uint32_t read = viewer->socket->receiveData(destination, wanted);
+    if (!viewer->socket->isConnected()) {
+      return false;
+    }
+    if (viewer->throttled) {
+      viewer->budget_bytes -= read;
+    }
+
+    if (viewer->header_bytes < sizeof(FrameHeader)) {
+      viewer->header_bytes += read;
+      if (viewer->header_bytes == sizeof(FrameHeader)) {
+        if (!ValidFrameHeader(viewer->header)) {
+          ++stats->bad_headers;
+          return false;
+        }
+        viewer->payload_remaining = viewer->header.payload_size;
+      }
+    }
+    else {
+      viewer->payload_remaining -= read;
+    }
+    if (viewer->header_bytes == sizeof(FrameHeader) && viewer->payload_remaining == 0) {
+      FinishFrame(viewer, stats);
+      viewer->header_bytes = 0;
+    }
+
+    // Short read: drained for now, the poller says when there's more
+    if (read < wanted) {
+      return true;
+    }
+  }
+}
+
+static void ReportLoad(uint32_t viewers, uint32_t connected, double seconds, LoadStats* stats,
+  const std::vector<LoadViewer>& all) {
+  std::vector<double> viewer_fps;
+  std::vector<double> slow_fps;
+  for (uint32_t i = 0; i < all.size(); ++i) {
+    if (all[i].connected) {
+      (all[i].throttled ? slow_fps : viewer_fps).push_back(all[i].frames / seconds);
+    }
+  }
+
+  const double fps = stats->frames / seconds;
+  const double mbps = stats->bytes * 8.0 / seconds / 1.0e6;
+  const double skipped = stats->frames + stats->skipped > 0 ?
+    (double)stats->skipped / (stats->frames + stats->skipped) : 0.0;
+  const double p50 = Percentile(&stats->latencies_ms, 0.50);
+  const double p95 = Percentile(&stats->latencies_ms, 0.95);
+  const double p99 = Percentile(&stats->latencies_ms, 0.99);
+  const double max = stats->latencies_ms.empty() ? 0.0 : stats->latencies_ms.back();
+  const double min_fps = viewer_fps.empty() ? 0.0 : *std::min_element(viewer_fps.begin(), viewer_fps.end());
+  const double median_fps = Percentile(&viewer_fps, 0.5);
+  const double median_slow_fps = Percentile(&slow_fps, 0.5);
+
+  if (g_json_output) {
+    printf("{\"viewers\":%u,\"connected\":%u,\"fps\":%.1f,\"mbps\":%.1f,\"viewer_fps_p50\":%.2f,"
+      "\"viewer_fps_min\":%.2f,\"slow_fps_p50\":%.2f,\"latency_ms\":[%.3f,%.3f,%.3f,%.3f],\"skipped\":%.4f,"
+      "\"bad_headers\":%llu,\"out_of_order\":%llu,\"disconnects\":%llu}\n", viewers, connected, fps, mbps,
+      median_fps, min_fps, median_slow_fps, p50, p95, p99, max, skipped, (unsigned long long)stats->bad_headers,
+      (unsigned long long)stats->out_of_order, (unsigned long long)stats->disconnects);
+    fflush(stdout);
+    return;
+  }
+
+  // p99 as a bar, one '#' per 5 ms, to see where it bends
+  char bar[41];
+  const uint32_t bar_length = std::min<uint32_t>(40, (uint32_t)(p99 / 5.0));
+  memset(bar, '#', bar_length);
+  bar[bar_length] = '\0';
+  printf("%6u %6u %9.1f %8.1f %7.2f %7.2f %7.2f %8.2f %8.2f %8.2f %8.2f %6.2f%% %5llu  %s\n", viewers,
+    connected, fps, mbps, median_fps, min_fps, median_slow_fps, p50, p95, p99, max, skipped * 100.0,
+    (unsigned long long)(stats->bad_headers + stats->out_of_order + stats->disconnects), bar);
+  fflush(stdout);
+}
+
+// Bench viewers [ip[:port]] [--max n] [--start n] [--step n] [--step-seconds s]
+//               [--slow fraction] [--slow-kbps n] [--format f] [--layer n] [--json]
+static int BenchViewerLoad(int argc, char** argv) {
+  LoadConfig config;
+  for (int32_t i = 2; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--max") == 0 && has_value) {
+      config.max_viewers = std::max(1, atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--start") == 0 && has_value) {
+      config.start_viewers = std::max(1, atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--step") == 0 && has_value) {
+      config.step = std::max(1, atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--step-seconds") == 0 && has_value) {
+      config.step_seconds = std::max(0.5, atof(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--slow") == 0 && has_value) {
+      config.slow_fraction = std::min(1.0, std::max(0.0, atof(argv[++i])));
+    }
+    else if (strcmp(argv[i], "--slow-kbps") == 0 && has_value) {
+      config.slow_kbps = std::max(1, atoi(argv[++i]));
+    }
+    else if (strcmp(argv[i], "--format") == 0 && has_value) {
+      if (!ParsePixelFormat(argv[++i], &config.format)) {
+        printf("Bad format %s, use yuyv, i420 or nv12\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--layer") == 0 && has_value) {
+      config.layer = std::min((uint32_t)atoi(argv[++i]), kLayerCount - 1);
+    }
+    else if (argv[i][0] != '-') {
+      const char* port = strchr(argv[i], ':');
+      config.server_ip = std::string(argv[i], port ? port - argv[i] : strlen(argv[i]));
+      if (port) {
+        config.server_port = (uint32_t)atoi(port + 1);
+      }
+    }
+  }
+
+  // One descriptor per viewer
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  Poller poller;
+  if (!poller.isValid()) {
+    return 1;
+  }
+
+  if (!g_json_output) {
+    printf("Viewers of %s:%u, %s layer %u, %.0f%% throttled to %u kbps, %.1fs per step\n",
+      config.server_ip.c_str(), config.server_port, PixelFormatName(config.format), config.layer,
+      config.slow_fraction * 100.0, config.slow_kbps, config.step_seconds);
+    printf("%6s %6s %9s %8s %7s %7s %7s %8s %8s %8s %8s %7s %5s  %s\n", "total", "conn", "frames/s", "Mbit/s",
+      "fps p50", "fps min", "slow", "p50 ms", "p95 ms", "p99 ms", "max ms", "skip", "err", "p99");
+  }
+
+  // Never reallocated: the poller holds pointers into it
+  std::vector<LoadViewer> viewers(config.max_viewers);
+  std::vector<byte> scratch(kViewerScratchSize);
+  const double slow_bytes_per_ns = config.slow_kbps * 1000.0 / 8.0 / 1.0e9;
+  uint32_t opened = 0;
+  LoadStats stats;
+  uint64_t step_start_ns = MonotonicNanos();
+  Poller::Event events[256];
+  while (true) {
+    // Ramp up: the first step opens 'start_viewers', every next one 'step'
+    const uint32_t target = opened == 0 ? config.start_viewers : std::min(config.max_viewers, opened + config.step);
+    while (opened < std::min(target, config.max_viewers)) {
+      LoadViewer& viewer = viewers[opened];
+      // Spread evenly: every 1 / slow_fraction viewers one is throttled
+      viewer.throttled = (uint32_t)((opened + 1) * config.slow_fraction) != (uint32_t)(opened * config.slow_fraction);
+      OpenViewer(&poller, &viewer, config);
+      ++opened;
+    }
+
+    const uint64_t step_end_ns = step_start_ns + (uint64_t)(config.step_seconds * 1.0e9);
+    while (MonotonicNanos() < step_end_ns) {
+      const uint32_t count = poller.wait(events, 256, 5);
+      for (uint32_t e = 0; e < count; ++e) {
+        LoadViewer* viewer = (LoadViewer*)events[e].user;
+        if (!viewer->connected) {
+          // Writable: the connect() went through, or failed
+          if (viewer->socket->connect(config.server_ip.c_str(), config.server_port)) {
+            StartViewer(&poller, viewer, config);
+          }
+          continue;
+        }
+        if (!ReadViewer(viewer, &scratch[0], &stats) ||
+          ((events[e].events & Poller::kClosed) && viewer->socket->availableBytes() == 0)) {
+          ++stats.disconnects;
+          CloseViewer(&poller, viewer);
+          OpenViewer(&poller, viewer, config);
+          continue;
+        }
+        if (viewer->throttled && viewer->budget_bytes < 1.0) {
+          viewer->paused = true;
+          poller.modify(*viewer->socket, 0, viewer);
+        }
+      }
+
+      // Budgets refill at the link rate, and stuck connects start over
+      const uint64_t now_ns = MonotonicNanos();
+      for (uint32_t i = 0; i < opened; ++i) {
+        LoadViewer& viewer = viewers[i];
+        if (!viewer.connected && now_ns - viewer.opened_ns > kViewerConnectTimeoutNs) {
+          CloseViewer(&poller, &viewer);
+          OpenViewer(&poller, &viewer, config);
+          continue;
+        }
+        if (viewer.throttled) {
+          viewer.budget_bytes = std::min((double)kThrottleBurstBytes,
+            viewer.budget_bytes + (now_ns - viewer.refill_ns) * slow_bytes_per_ns);
+          viewer.refill_ns = now_ns;
+          if (viewer.paused && viewer.budget_bytes >= 1.0) {
+            viewer.paused = false;
+            poller.modify(*viewer.socket, Poller::kReadable, &viewer);
+          }
+        }
+      }
+    }
+
+    uint32_t connected = 0;
+    for (uint32_t i = 0; i < opened; ++i) {
+      connected += viewers[i].connected ? 1 : 0;
+    }
+    const double seconds = (MonotonicNanos() - step_start_ns) / 1.0e9;
+    ReportLoad(opened, connected, seconds, &stats, viewers);
+
+    stats = LoadStats();
+    for (uint32_t i = 0; i < opened; ++i) {
+      viewers[i].frames = 0;
+    }
+    step_start_ns = MonotonicNanos();
+    if (opened >= config.max_viewers) {
+      break;
+    }
+  }
+
+  for (uint32_t i = 0; i < opened; ++i) {
+    if (viewers[i].socket) {
+      CloseViewer(&poller, &viewers[i]);
+    }
+  }
+
+  return 0;
+}
+// [\Viewer load]
+
+// [Socket presets]
+// Bench presets: what each SocketOptions preset does to latency over
+// loopback.
+//  control: a 40 byte header and a 32 byte message written separately,
+//    answered with 40 bytes. With Nagle the second write waits for the
+//    ACK of the first, which the other side delays.
+//  frames: 640x480 YUYV at 30 fps to a viewer that reads at 100 Mbit/s,
+//    about 20 fps. The sender starts a frame only when the last one is
+//    all in the socket, like the server, so what the kernel queues is
+//    latency the viewer sees.
+static const uint32_t kPresetPort = 14292;
+static const uint32_t kControlRounds = 100;
+static const uint32_t kPresetFrameSize = 614400;
+static const double kPresetReaderBytesPerSecond = 100.0e6 / 8.0;
+static const double kPresetSeconds = 3.0;
+// How long the viewer waits in one read
+static const uint64_t kPresetReadWaitNs = 10000000;
+
+// Connects 'sender' to 'listener', the accepted end goes to 'receiver'
+static bool ConnectPair(TCPListener* listener, TCPSocket* sender, TCPSocket** receiver) {
+  if (!listener->bind(kPresetPort) || !listener->listen()) {
+    return false;
+  }
+  while (!sender->connect("127.0.0.1", kPresetPort)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  *receiver = listener->accept();
+  return *receiver != nullptr;
+}
+
+static bool ReceiveAll(TCPSocket* socket, byte* buffer, uint32_t size) {
+  uint32_t received = 0;
+  while (received < size && socket->isConnected()) {
+    received += socket->receiveData(buffer + received, size - received);
+  }
+
+  return received == size;
+}
+
+static void BenchControlLatency(const char* preset, const SocketOptions& options) {
+  TCPListener listener(Socket::Type::Block, 8, options);
+  TCPSocket sender(Socket::Type::Block, options);
+  TCPSocket* receiver = nullptr;
+  if (!ConnectPair(&listener, &sender, &receiver)) {
+    printf("presets: can't connect on port %u\n", kPresetPort);
+    return;
+  }
+
+  std::thread answer([&]() {
+    byte request[sizeof(FrameHeader) + sizeof(ControlMessage)];
+    FrameHeader header = MakeClockHeader(0);
+    for (uint32_t i = 0; i < kControlRounds; ++i) {
+      if (!ReceiveAll(receiver, request, sizeof(request))) {
+        return;
+      }
+      receiver->sendData((byte*)&header, sizeof(header));
+    }
+  });
+
+  std::vector<double> round_trips_us;
+  FrameHeader header = MakeClockHeader(0);
+  ControlMessage message = MakeControlMessage(ControlType::Ping);
+  for (uint32_t i = 0; i < kControlRounds; ++i) {
+    const uint64_t start_ns = MonotonicNanos();
+    sender.sendData((byte*)&header, sizeof(header));
+    sender.sendData((byte*)&message, sizeof(message));
+    FrameHeader reply;
+    if (!ReceiveAll(&sender, (byte*)&reply, sizeof(reply))) {
+      break;
+    }
+    round_trips_us.push_back((MonotonicNanos() - start_ns) / 1000.0);
+  }
+  answer.join();
+  receiver->close();
+  delete receiver;
+  sender.close();
+  listener.close();
+
+  const double p50 = Percentile(&round_trips_us, 0.50);
+  const double p99 = Percentile(&round_trips_us, 0.99);
+  if (g_json_output) {
+    printf("{\"name\":\"preset.control.%s\",\"rounds\":%u,\"p50_us\":%.1f,\"p99_us\":%.1f}\n", preset,
+      (uint32_t)round_trips_us.size(), p50, p99);
+  }
+  else {
+    printf("%-12s control  round trip p50 %9.1f us  p99 %9.1f us\n", preset, p50, p99);
+  }
+}
+
+static void BenchFrameLatency(const char* preset, const SocketOptions& options) {
+  TCPListener listener(Socket::Type::Block, 8, options);
+  TCPSocket sender(Socket::Type::NonBlock, options);
+  TCPSocket* receiver = nullptr;
+  if (!ConnectPair(&listener, &sender, &receiver)) {
+    printf("presets: can't connect on port %u\n", kPresetPort);
+    return;
+  }
+
+  // The viewer: a frame at a time, no faster than its link
+  std::atomic<bool> finished(false);
+  std::vector<double> latencies_ms;
+  std::thread viewer([&]() {
+    std::vector<byte> frame(kPresetFrameSize);
+    const uint64_t start_ns = MonotonicNanos();
+    uint64_t received = 0;
+    while (!finished) {
+      const uint64_t allowed = (uint64_t)((MonotonicNanos() - start_ns) * kPresetReaderBytesPerSecond / 1.0e9);
+      if (allowed <= received) {
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+        continue;
+      }
+
+      const uint32_t offset = (uint32_t)(received % kPresetFrameSize);
+      const uint32_t wanted = (uint32_t)std::min<uint64_t>(allowed - received, kPresetFrameSize - offset);
+      // The receiver is blocking: only ever wait a little, so 'finished'
+      // is seen even once the sender has nothing more to send
+      uint32_t read = 0;
+      const Socket::TransferStatus status = receiver->receiveExact(&frame[offset], wanted,
+        MonotonicNanos() + kPresetReadWaitNs, &read);
+      if (status == Socket::TransferStatus::PeerClosed || status == Socket::TransferStatus::Error) {
+        break;
+      }
+      received += read;
+      if (read > 0 && received % kPresetFrameSize == 0) {
+        uint64_t sent_ns = 0;
+        memcpy(&sent_ns, &frame[0], sizeof(sent_ns));
+        latencies_ms.push_back((MonotonicNanos() - sent_ns) / 1.0e6);
+      }
+    }
+  });
+
+  // The server: a new frame every 33 ms if the last one is out
+  std::vector<byte> frame(kPresetFrameSize, 0x80);
+  const uint64_t frame_interval_ns = 1000000000ull / 30;
+  const uint64_t start_ns = MonotonicNanos();
+  uint64_t next_frame_ns = start_ns;
+  uint32_t sent = kPresetFrameSize;
+  uint32_t frames = 0;
+  uint32_t skipped = 0;
+  while (MonotonicNanos() - start_ns < (uint64_t)(kPresetSeconds * 1.0e9)) {
+    const uint64_t now_ns = MonotonicNanos();
+    if (now_ns >= next_frame_ns) {
+      next_frame_ns += frame_interval_ns;
+      if (sent < kPresetFrameSize) {
+        ++skipped;
+      }
+      else {
+        memcpy(&frame[0], &now_ns, sizeof(now_ns));
+        sent = 0;
+        ++frames;
+      }
+    }
+
+    const uint32_t bytes = sent < kPresetFrameSize ? sender.sendData(&frame[sent], kPresetFrameSize - sent) : 0;
+    sent += bytes;
+    if (bytes == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  finished = true;
+  sender.close();
+  viewer.join();
+  receiver->close();
+  delete receiver;
+  listener.close();
+
+  const double p50 = Percentile(&latencies_ms, 0.50);
+  const double p99 = Percentile(&latencies_ms, 0.99);
+  const double fps = latencies_ms.size() / kPresetSeconds;
+  if (g_json_output) {
+    printf("{\"name\":\"preset.frames.%s\",\"frames_sent\":%u,\"skipped\":%u,\"fps\":%.2f,\"p50_ms\":%.3f,"
+      "\"p99_ms\":%.3f}\n", preset, frames, skipped, fps, p50, p99);
+  }
+  else {
+    printf("%-12s frames   latency    p50 %9.2f ms  p99 %9.2f ms  %5.1f fps delivered, %u skipped\n",
+      preset, p50, p99, fps, skipped);
+  }
+}
+
+static void BenchSocketPresets() {
+  const char* presets[3] = { "default", "low-latency", "throughput" };
+  for (uint32_t i = 0; i < 3; ++i) {
+    SocketOptions options;
+    ParseSocketPreset(presets[i], &options);
+    BenchControlLatency(presets[i], options);
+    BenchFrameLatency(presets[i], options);
+  }
+}
+// [\Socket presets]
+
+// [I/O engines]
+// Bench io [viewers] [seconds]: the server's fan out on each IoEngine
+// backend. One thread is the server: a multishot accept, the frame pool as
+// registered buffers, every 33 ms a frame from the pool to every viewer as
+// a header and payload send chain (skipped for a viewer whose last chain
+// isn't done), a recording of every frame to a file, and a multishot
+// receive per viewer for its control messages. Another thread is the
+// viewers, plain reads, a Ping back for every frame.
+static const uint32_t kIoPort = 14293;
+static const uint32_t kIoFrameSize = 460800;        // 640x480 I420
+static const uint32_t kIoPoolFrames = 4;
+// The recording wraps around, the file stays small
+static const uint32_t kIoRecordingFrames = 16;
+static const uint64_t kIoAcceptTag = ~0ull;
+static const uint64_t kIoWriteTag = ~0ull - 1;
+
+struct IoViewer {
+  TCPSocket* socket;
+  bool sending;
+  uint32_t slot;          // pool frame being sent
+  bool closed;
+};
+
+struct IoEngineResult {
+  uint32_t viewers;
+  uint32_t frames;        // produced after every viewer was connected
+  uint64_t chains;        // send chains done
+  uint64_t skipped;       // a chain still going when the frame was due
+  uint64_t writes;
+  uint64_t control_bytes;
+  uint64_t syscalls;
+  double cpu_seconds;     // of the server thread
+  double seconds;
+};
+
+static double ThreadCpuSeconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1.0e6;
+}
+
+// All the viewers, until 'finished'
+static void RunIoViewers(uint32_t count, const std::atomic<bool>* finished) {
+  Poller poller;
+  std::vector<TCPSocket*> sockets;
+  std::vector<uint64_t> received(count, 0);
+  for (uint32_t i = 0; i < count; ++i) {
+    TCPSocket* socket = new TCPSocket(Socket::Type::NonBlock);
+    while (!socket->connect("127.0.0.1", kIoPort) && !finished->load()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    poller.add(*socket, Poller::kReadable, (void*)(uintptr_t)i);
+    sockets.push_back(socket);
+  }
+
+  const uint64_t frame_bytes = sizeof(FrameHeader) + kIoFrameSize;
+  std::vector<byte> scratch(256 * 1024);
+  const ControlMessage ping = MakeControlMessage(ControlType::Ping);
+  Poller::Event events[256];
+  while (!finished->load()) {
+    const uint32_t ready = poller.wait(events, 256, 10);
+    for (uint32_t e = 0; e < ready; ++e) {
+      const uint32_t i = (uint32_t)(uintptr_t)events[e].user;
+      uint32_t read = 0;
+      while ((read = sockets[i]->receiveData(&scratch[0], (uint32_t)scratch.size())) > 0) {
+        const uint64_t before = received[i] / frame_bytes;
+        received[i] += read;
+        if (received[i] / frame_bytes > before) {
+          sockets[i]->sendData((byte*)&ping, sizeof(ping));
+        }
+      }
+      if (!sockets[i]->isConnected() || (events[e].events & Poller::kClosed)) {
+        poller.remove(*sockets[i]);
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < sockets.size(); ++i) {
+    sockets[i]->close();
+    delete sockets[i];
+  }
+}
+
+static bool RunIoEngine(IoEngine::Backend backend, uint32_t viewer_count, double seconds, IoEngineResult* result) {
+  IoEngine* engine = IoEngine::Create(backend == IoEngine::Backend::IoUring);
+  if (engine->backend() != backend) {
+    delete engine;
+    return false;
+  }
+
+  TCPListener listener(Socket::Type::NonBlock, 128, SocketOptions::LowLatencyVideo());
+  if (!listener.bind(kIoPort) || !listener.listen()) {
+    printf("io: can't listen on port %u\n", kIoPort);
+    delete engine;
+    return false;
+  }
+
+  // Every pool frame is its header followed by its payload
+  const uint32_t slot_size = sizeof(FrameHeader) + kIoFrameSize;
+  std::vector<byte> pool((size_t)kIoPoolFrames * slot_size, 0x80);
+  struct iovec registered[kIoPoolFrames];
+  for (uint32_t i = 0; i < kIoPoolFrames; ++i) {
+    registered[i].iov_base = &pool[(size_t)i * slot_size];
+    registered[i].iov_len = slot_size;
+  }
+  engine->registerBuffers(registered, kIoPoolFrames);
+
+  char path[] = "/tmp/bench_io_XXXXXX";
+  const int32_t file = mkstemp(path);
+  if (file < 0) {
+    printf("io: can't create a recording file\n");
+    delete engine;
+    return false;
+  }
+  unlink(path);
+
+  std::atomic<bool> finished(false);
+  std::thread viewer_thread(RunIoViewers, viewer_count, &finished);
+
+  engine->acceptMultishot(listener, kIoAcceptTag);
+  std::vector<IoViewer> viewers;
+  uint32_t in_flight[kIoPoolFrames] = { 0 };
+  bool writing = false;
+  IoEngine::Completion completions[256];
+
+  memset(result, 0, sizeof(*result));
+  result->viewers = viewer_count;
+  const uint64_t frame_interval_ns = 1000000000ull / 30;
+  const uint64_t start_ns = MonotonicNanos();
+  uint64_t next_frame_ns = start_ns;
+  uint64_t measure_start_ns = 0;
+  uint64_t syscalls_start = 0;
+  double cpu_start = 0.0;
+  uint32_t sequence = 0;
+  while (true) {
+    const uint64_t now_ns = MonotonicNanos();
+    const bool measuring = measure_start_ns != 0;
+    if (measuring && now_ns - measure_start_ns >= (uint64_t)(seconds * 1.0e9)) {
+      break;
+    }
+    // Everyone should be in after a few seconds
+    if (!measuring && now_ns - start_ns > 10000000000ull) {
+      break;
+    }
+    if (!measuring && viewers.size() == viewer_count) {
+      measure_start_ns = now_ns;
+      syscalls_start = engine->syscalls();
+      cpu_start = ThreadCpuSeconds();
+    }
+
+    const uint32_t slot = sequence % kIoPoolFrames;
+    if (now_ns >= next_frame_ns && in_flight[slot] == 0) {
+      next_frame_ns += frame_interval_ns;
+      FrameHeader* header = (FrameHeader*)&pool[(size_t)slot * slot_size];
+      *header = MakeFrameHeader(sequence++, PixelFormat::I420, 640, 480, kIoFrameSize);
+
+      for (uint32_t i = 0; i < viewers.size(); ++i) {
+        IoViewer& viewer = viewers[i];
+        if (viewer.closed) {
+          continue;
+        }
+        if (viewer.sending) {
+          result->skipped += measuring ? 1 : 0;
+          continue;
+        }
+        struct iovec chain[2];
+        chain[0].iov_base = header;
+        chain[0].iov_len = sizeof(FrameHeader);
+        chain[1].iov_base = (byte*)header + sizeof(FrameHeader);
+        chain[1].iov_len = kIoFrameSize;
+        if (engine->sendChain(*viewer.socket, chain, 2, i)) {
+          viewer.sending = true;
+          viewer.slot = slot;
+          ++in_flight[slot];
+        }
+      }
+      if (!writing) {
+        const uint64_t offset = (uint64_t)(header->sequence % kIoRecordingFrames) * slot_size;
+        writing = engine->write(file, (byte*)header, slot_size, offset, kIoWriteTag);
+      }
+      result->frames += measuring ? 1 : 0;
+    }
+
+    const int32_t timeout_ms = next_frame_ns > now_ns ? (int32_t)((next_frame_ns - now_ns + 999999) / 1000000) : 0;
+    const uint32_t count = engine->wait(completions, 256, timeout_ms);
+    for (uint32_t c = 0; c < count; ++c) {
+      const IoEngine::Completion& completion = completions[c];
+      switch (completion.op) {
+        case IoEngine::Op::Accept: {
+          if (completion.result >= 0) {
+            IoViewer viewer = { listener.adopt(completion.result), false, 0, false };
+            engine->receiveMultishot(*viewer.socket, viewers.size());
+            viewers.push_back(viewer);
+          }
+          break;
+        }
+        case IoEngine::Op::Receive: {
+          if (completion.result > 0) {
+            result->control_bytes += completion.result;
+          }
+          else if (!completion.more) {
+            viewers[completion.tag].closed = true;
+          }
+          break;
+        }
+        case IoEngine::Op::Send: {
+          IoViewer& viewer = viewers[completion.tag];
+          viewer.sending = false;
+          --in_flight[viewer.slot];
+          if (completion.result < 0) {
+            viewer.closed = true;
+          }
+          result->chains += measure_start_ns != 0 ? 1 : 0;
+          break;
+        }
+        case IoEngine::Op::Write: {
+          writing = false;
+          result->writes += measure_start_ns != 0 ? 1 : 0;
+          break;
+        }
+        default: {
+          break;
+        }
+      }
+    }
+  }
+
+  if (measure_start_ns != 0) {
+    result->seconds = (MonotonicNanos() - measure_start_ns) / 1.0e9;
+    result->syscalls = engine->syscalls() - syscalls_start;
+    result->cpu_seconds = ThreadCpuSeconds() - cpu_start;
+  }
+
+  finished = true;
+  viewer_thread.join();
+  // The kernel may still be sending from the pool: everything is cancelled
+  // and the engine gone before the pool is
+  for (uint32_t i = 0; i < viewers.size(); ++i) {
+    engine->cancel(*viewers[i].socket);
+  }
+  engine->cancel(listener);
+  engine->wait(completions, 256, 10);
+  delete engine;
+  for (uint32_t i = 0; i < viewers.size(); ++i) {
+    viewers[i].socket->close();
+    delete viewers[i].socket;
+  }
+  listener.close();
+  ::close(file);
+
+  return measure_start_ns != 0;
+}
+
+static void ReportIoEngine(const char* name, const IoEngineResult& result) {
+  const double frames = std::max(result.frames, 1u);
+  const double syscalls_per_frame = result.syscalls / frames;
+  const double fps = result.chains / std::max(result.seconds, 1.0e-9) / std::max(result.viewers, 1u);
+  // Share of a core the server thread needs for each viewer
+  const double cpu_per_viewer = result.cpu_seconds / std::max(result.seconds, 1.0e-9) /
+    std::max(result.viewers, 1u) * 100.0;
+  if (g_json_output) {
+    printf("{\"name\":\"io.%s\",\"viewers\":%u,\"frames\":%u,\"fps_per_viewer\":%.2f,\"skipped\":%llu,"
+      "\"writes\":%llu,\"syscalls_per_frame\":%.2f,\"syscalls_per_frame_viewer\":%.3f,"
+      "\"cpu_percent_per_viewer\":%.3f}\n", name, result.viewers, result.frames, fps,
+      (unsigned long long)result.skipped, (unsigned long long)result.writes, syscalls_per_frame,
+      syscalls_per_frame / std::max(result.viewers, 1u), cpu_per_viewer);
+  }
+  else {
+    printf("%-9s %4u viewers %6.1f fps each  %8.2f syscalls/frame (%6.3f per viewer)  %6.3f%% CPU per viewer"
+      "  %llu skipped, %llu writes\n", name, result.viewers, fps, syscalls_per_frame,
+      syscalls_per_frame / std::max(result.viewers, 1u), cpu_per_viewer, (unsigned long long)result.skipped,
+      (unsigned long long)result.writes);
+  }
+}
+
+static void BenchIoEngines(uint32_t viewers, double seconds) {
+  const IoEngine::Backend backends[2] = { IoEngine::Backend::IoUring, IoEngine::Backend::Epoll };
+  const char* names[2] = { "io_uring", "epoll" };
+  for (uint32_t i = 0; i < 2; ++i) {
+    IoEngineResult result;
+    if (!RunIoEngine(backends[i], viewers, seconds, &result)) {
+      printf("%-9s not available\n", names[i]);
+      continue;
+    }
+    ReportIoEngine(names[i], result);
+  }
+}
+// [\I/O engines]
+
+// [Zero-copy receive]
+// Bench zerocopy: CPU time of the receiving thread per GB, for frames read
+// with recv() into a buffer and for frames received through a
+// ZeroCopyReceiver. The sender writes whole frames back to back over
+// loopback for kZeroCopySeconds.
+static const uint32_t kZeroCopyPort = 14294;
+static const double kZeroCopySeconds = 2.0;
+static const uint32_t kZeroCopyWindows = 3;
+
+struct ZeroCopyResult {
+  uint64_t bytes;
+  double cpu_seconds;
+  double seconds;
+  uint64_t mapped_bytes;
+};
+
+static bool RunZeroCopyReceive(uint32_t frame_size, bool zero_copy, ZeroCopyResult* result) {
+  TCPListener listener(Socket::Type::Block, 8, SocketOptions::Throughput());
+  if (!listener.bind(kZeroCopyPort) || !listener.listen()) {
+    printf("zerocopy: can't listen on port %u\n", kZeroCopyPort);
+    return false;
+  }
+
+  std::atomic<bool> finished(false);
+  std::thread sender([&]() {
+    TCPSocket socket(Socket::Type::Block, SocketOptions::Throughput());
+    while (!socket.connect("127.0.0.1", kZeroCopyPort) && !finished.load()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::vector<byte> frame(frame_size, 0x80);
+    while (!finished.load() && socket.isConnected()) {
+      uint32_t sent = 0;
+      while (sent < frame_size && socket.isConnected()) {
+        sent += socket.sendData(&frame[sent], frame_size - sent);
+      }
+    }
+    socket.close();
+  });
+
+  TCPSocket* receiver = listener.accept();
+  if (!receiver) {
+    finished = true;
+    sender.join();
+    return false;
+  }
+
+  ZeroCopyReceiver windows(zero_copy ? kZeroCopyWindows : 0, frame_size);
+  std::vector<byte> buffer(zero_copy ? 0 : frame_size);
+  memset(result, 0, sizeof(*result));
+  const uint64_t start_ns = MonotonicNanos();
+  const double cpu_start = ThreadCpuSeconds();
+  uint32_t frames = 0;
+  bool connected = true;
+  while (connected && MonotonicNanos() - start_ns < (uint64_t)(kZeroCopySeconds * 1.0e9)) {
+    if (!zero_copy) {
+      connected = ReceiveAll(receiver, &buffer[0], frame_size);
+    }
+    else {
+      byte* window = windows.window(frames % kZeroCopyWindows);
+      uint32_t received = 0;
+      while (connected && received < frame_size) {
+        const int32_t bytes = windows.receive(*receiver, window, received, frame_size - received, 100);
+        connected = bytes >= 0;
+        received += bytes > 0 ? (uint32_t)bytes : 0;
+      }
+    }
+    result->bytes += connected ? frame_size : 0;
+    ++frames;
+  }
+  result->cpu_seconds = ThreadCpuSeconds() - cpu_start;
+  result->seconds = (MonotonicNanos() - start_ns) / 1.0e9;
+  result->mapped_bytes = windows.mappedBytes();
+
+  finished = true;
+  receiver->close();
+  delete receiver;
+  sender.join();
+  listener.close();
+  return true;
+}
+
+static void BenchZeroCopyReceive() {
+  // 640x480 and 1920x1080 YUYV, 3840x2160 I420
+  const uint32_t frame_sizes[3] = { 614400, 4147200, 12441600 };
+  // The receiver hangs up on a sender in the middle of a frame
+  signal(SIGPIPE, SIG_IGN);
+  for (uint32_t i = 0; i < 3; ++i) {
+    ZeroCopyResult copy;
+    ZeroCopyResult mapped;
+    if (!RunZeroCopyReceive(frame_sizes[i], false, &copy) || !RunZeroCopyReceive(frame_sizes[i], true, &mapped)) {
+      continue;
+    }
+
+    const double copy_ms_per_gb = copy.cpu_seconds * 1000.0 / std::max(copy.bytes / 1.0e9, 1.0e-9);
+    const double mapped_ms_per_gb = mapped.cpu_seconds * 1000.0 / std::max(mapped.bytes / 1.0e9, 1.0e-9);
+    const double mapped_share = mapped.bytes > 0 ? (double)mapped.mapped_bytes / mapped.bytes : 0.0;
+    if (g_json_output) {
+      printf("{\"name\":\"zerocopy.%u\",\"frame_bytes\":%u,\"copy_cpu_ms_per_gb\":%.2f,\"copy_gbps\":%.3f,"
+        "\"zero_copy_cpu_ms_per_gb\":%.2f,\"zero_copy_gbps\":%.3f,\"mapped_share\":%.3f}\n", frame_sizes[i],
+        frame_sizes[i], copy_ms_per_gb, copy.bytes * 8.0 / copy.seconds / 1.0e9, mapped_ms_per_gb,
+        mapped.bytes * 8.0 / mapped.seconds / 1.0e9, mapped_share);
+    }
+    else {
+      printf("%9u byte frames  copy %8.1f ms CPU/GB (%5.2f Gbit/s)  zero-copy %8.1f ms CPU/GB (%5.2f Gbit/s, "
+        "%5.1f%% mapped)\n", frame_sizes[i], copy_ms_per_gb, copy.bytes * 8.0 / copy.seconds / 1.0e9,
+        mapped_ms_per_gb, mapped.bytes * 8.0 / mapped.seconds / 1.0e9, mapped_share * 100.0);
+    }
+  }
+}
+// [\Zero-copy receive]
+
+int main(int argc, char** argv) {
+  // --json anywhere: kernel and socket results as one JSON object per line
+  for (int32_t i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--json") == 0) {
+      g_json_output = true;
+    }
+  }
+
+  // Bench kernels: pixel kernels at 640x480 and 1920x1080
+  if (argc > 1 && strcmp(argv[1], "kernels") == 0) {
+    BenchKernels();
+    return 0;
+  }
+  // Bench sockets: TCP and UDP throughput over loopback
+  if (argc > 1 && strcmp(argv[1], "sockets") == 0) {
+    BenchSockets();
+    return 0;
+  }
+  // Bench e2e [options]: server and clients over loopback, against budgets
+  if (argc > 1 && strcmp(argv[1], "e2e") == 0) {
+    return BenchEndToEnd(argc, argv);
+  }
+  // Bench viewers [ip[:port]] [options]: server fan out as viewers ramp up
+  if (argc > 1 && strcmp(argv[1], "viewers") == 0) {
+    return BenchViewerLoad(argc, argv);
+  }
+  // Bench presets: latency with each SocketOptions preset
+  if (argc > 1 && strcmp(argv[1], "presets") == 0) {
+    BenchSocketPresets();
+    return 0;
+  }
+  // Bench io [viewers] [seconds]: frame fan out on io_uring and on epoll
+  if (argc > 1 && strcmp(argv[1], "io") == 0) {
+    const uint32_t viewers = (argc > 2 && isdigit(argv[2][0])) ? (uint32_t)atoi(argv[2]) : 16;
+    const double seconds = (argc > 3 && isdigit(argv[3][0])) ? atof(argv[3]) : 5.0;
+    if (g_json_output) {
+      LogSetLevel(LogLevel::Warning);
+    }
+    BenchIoEngines(std::max(viewers, 1u), seconds);
+    return 0;
+  }
+  // Bench zerocopy: receive CPU per GB, recv() against TCP_ZEROCOPY_RECEIVE
+  if (argc > 1 && strcmp(argv[1], "zerocopy") == 0) {
+    if (g_json_output) {
+      LogSetLevel(LogLevel::Warning);
+    }
+    BenchZeroCopyReceive();
+    return 0;
+  }
+  // Bench suite: kernels and sockets, what to run before and after a change
+  if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+    BenchKernels();
+    BenchSockets();
+    return 0;
+  }
+
+  // Bench rate: only the rate controller simulation
+  if (argc > 1 && strcmp(argv[1], "rate") == 0) {
+    SimulateRateControl();
+    return CheckRateStartupDraining() ? 0 : 1;
+  }
+  // Bench triple [values]: only the triple buffer stress test
+  if (argc > 1 && strcmp(argv[1], "triple") == 0) {
+    const uint64_t values = (argc > 2) ? (uint64_t)atoll(argv[2]) : 2000000;
+    return StressTripleBuffer(values) ? 0 : 1;
+  }
+
+  // Bench metrics [threads]: metrics overhead and concurrent recording
+  if (argc > 1 && strcmp(argv[1], "metrics") == 0) {
+    const uint32_t threads = (argc > 2) ? (uint32_t)atoi(argv[2]) : 4;
+    return BenchMetrics(std::max(threads, 1u), 2000000) ? 0 : 1;
+  }
+
+  // Bench decode [threads]: only the striped CPU decode at 1080p and 4K
+  if (argc > 1 && strcmp(argv[1], "decode") == 0) {
+    const uint32_t threads = (argc > 2) ? (uint32_t)atoi(argv[2]) : 0;
+    const bool match_1080 = BenchStripedDecode(1920, 1080, threads, 20);
+    const bool match_2160 = BenchStripedDecode(3840, 2160, threads, 10);
+    return (match_1080 && match_2160) ? 0 : 1;
+  }
+
+  uint32_t iterations = (argc > 1) ? (uint32_t)atoi(argv[1]) : 50;
+  if (iterations == 0) {
+    iterations = 1;
+  }
+
+  printf("Best SIMD level: %s\n", SimdLevelName(DetectSimdLevel()));
+
+  BenchMotionEstimation(640, 480, iterations);
+  BenchMotionEstimation(1280, 720, iterations);
+  BenchMotionEstimation(1920, 1080, iterations);
+
+  SimulateRateControl();
+
+  return CheckRateStartupDraining() ? 0 : 1;
+}
@@ -1,12 +1,29 @@
+#include <algorithm>
 #include <atomic>
 #include <csignal>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <iostream>
+#include <memory>
 #include <thread>
+#include <vector>
 
+#include "bounded_queue.h"
 #include "chrono.h"
+#include "clock_sync.h"
+#include "log.h"
+#include "metrics.h"
+#include "pixels.h"
+#include "poller.h"
+#include "protocol.h"
 #include "sockets.h"
+#include "stripe_pool.h"
+#include "trace.h"
+#include "triple_buffer.h"
+#include "zero_copy.h"
 
 #ifdef __PLATFORM_MACOSX__
   #include <OpenGL/gl3.h>
@@ -32,10 +49,15 @@ GLFWwindow* g_window = nullptr;
 //byte* g_data = nullptr;
 uint32_t g_window_width       = 640;
 uint32_t g_window_height      = 480;
-uint32_t g_image_width        = 640;
+uint32_t g_image_width        = 640;  // largest frame we can receive
 uint32_t g_image_height       = 480;
+uint32_t g_texture_width      = 0;
+uint32_t g_texture_height     = 0;
+uint32_t g_payload_texture_width  = 0;
+uint32_t g_payload_texture_height = 0;
 uint32_t g_bytes_read         = 0;
 bool g_program_should_finish  = false;
+bool g_hidden_window          = false;
 
 std::atomic<uint64_t> g_frame_count;
 
@@ -46,17 +68,223 @@ GLuint g_vertex_shader_id       = 0;
 GLuint g_fragment_shader_id     = 0;
 GLuint g_program_id             = 0;
 GLuint g_uvs_id                 = 0;
-GLuint g_texture_id             = 0;
+GLuint g_texture_id             = 0;  // RGBA frame drawn on the quad
+
+// YUV to RGBA on the GPU: the payload goes up as it came from the wire
+// and a full screen pass converts it into g_texture_id
+GLuint g_payload_texture_id     = 0;
+GLuint g_convert_program_id     = 0;
+GLuint g_convert_framebuffer_id = 0;
+GLint g_convert_format_location       = -1;
+GLint g_convert_frame_size_location   = -1;
+GLint g_convert_coefficients_location = -1;
+ColorMatrix g_color_matrix = ColorMatrix::BT601;
+
+// [Latency]
+// Where a frame's time goes, from the camera to the screen
+enum class LatencyStage : uint32_t {
+  Capture = 0,      // camera to the frame in server memory
+  Process,          // server: conversion and waiting for the socket
+  Send,             // server socket to the header being in here
+  Receive,          // header to the last payload byte
+  Decode,
+  Upload,           // queuing the GL upload and conversion
+  Present,          // upload to the buffer swap returning
+  EndToEnd,         // capture to present; headless: capture to decoded
+  Count
+};
+static const char* kLatencyStageNames[(uint32_t)LatencyStage::Count] = {
+  "capture", "process", "send", "receive", "decode", "upload", "present", "end_to_end"
+};
+
+struct FrameTiming {
+  FrameTiming() {
+    sequence = 0;
+    capture_ms = 0.0;
+    for (uint32_t i = 0; i < (uint32_t)LatencyStage::Count; ++i) {
+      stage_ms[i] = -1.0f;
+    }
+  }
+
+  void set(LatencyStage stage, double ms) {
+    stage_ms[(uint32_t)stage] = ms > 0.0 ? (float)ms : 0.0f;
+  }
+  float get(LatencyStage stage) const {
+    return stage_ms[(uint32_t)stage];
+  }
+
+  uint32_t sequence;    // of the frame, for the trace
+  double capture_ms;    // on NowMs() clock, 0 while the server clock offset is unknown
+  float stage_ms[(uint32_t)LatencyStage::Count];  // negative when not measured
+};
+
+// Per stage histograms since the last clear(), for percentiles. Only the
+// thread that finishes frames touches it.
+class LatencyStats {
+public:
+  void add(const FrameTiming& timing) {
+    for (uint32_t i = 0; i < (uint32_t)LatencyStage::Count; ++i) {
+      if (timing.stage_ms[i] >= 0.0f) {
+        stages[i].record((uint64_t)(timing.stage_ms[i] * 1.0e6));
+      }
+    }
+  }
+
+  // Milliseconds; 'fraction' in [0, 1], 0 without samples
+  float percentile(LatencyStage stage, float fraction) const {
+    return (float)(stages[(uint32_t)stage].percentile(fraction) / 1.0e6);
+  }
+
+  uint32_t count(LatencyStage stage) const {
+    return (uint32_t)stages[(uint32_t)stage].count();
+  }
+
+  void clear() {
+    for (uint32_t i = 0; i < (uint32_t)LatencyStage::Count; ++i) {
+      stages[i].clear();
+    }
+  }
+
+private:
+  LatencyHistogram stages[(uint32_t)LatencyStage::Count];
+};
 
-byte** g_recv_data_ptr    = nullptr;
-byte* g_recv_data_buffer  = nullptr;
-byte** g_draw_buffer_ptr  = nullptr;
+// Offset to the server's clock, network thread only
+ClockSync g_clock_sync;
+
+// Per stage timings of every thread, printed with the latency report
+Histogram g_receive_histogram("client.receive");
+Histogram g_decode_histogram("client.decode");
+Histogram g_upload_histogram("client.upload");
+Counter g_frames_received("client.frames_received");
+Counter g_bytes_received("client.bytes_received");
+Counter g_frames_skipped("client.frames_skipped");
+MetricsReport g_metrics_report;
+// [\Latency]
+
+// Frames are kept as received (YUYV, I420 or NV12), never as RGBA
 byte* g_draw_buffer       = nullptr;
+byte* g_payload_buffer    = nullptr;  // skipped frames are drained through it
+uint32_t g_payload_buffer_size = 0;
+
+// A frame as it came from the wire. 'data' is a mapped pixel unpack buffer
+// when 'upload_buffer' isn't 0, client memory otherwise.
+struct ReceivedFrame {
+  byte* data;
+  GLuint upload_buffer;
+  uint32_t width;
+  uint32_t height;
+  PixelFormat format;
+  FrameTiming timing;
+};
+
+// Network -> render handoff. The network thread always has a slot to
+// receive into and the render thread always uploads the newest frame, so
+// neither ever waits for the other; frames the renderer didn't get to are
+// dropped. Pixel buffers stay mapped except while the renderer uploads
+// from them, and the invalidating remap means reusing one never waits
+// for the GPU either.
+TripleBuffer<ReceivedFrame> g_frames;
+bool g_use_upload_buffers = true;
+uint32_t g_upload_count = 0;
+
+// --cpu-decode: frames are converted to RGBA on the CPU and uploaded as
+// RGBA. Receive, decode and render are separate stages joined by bounded
+// queues, so receiving frame n + 1 overlaps decoding frame n; a full queue
+// stops the stage feeding it. Every frame is shown, in order. The buffers
+// go round through the free queues.
+struct DecodedFrame {
+  byte* data;
+  uint32_t width;
+  uint32_t height;
+  PixelFormat format;     // of the payload, also once 'data' is RGBA
+  uint32_t sequence;
+  uint32_t stream;
+  uint32_t payload_size;
+  double header_ms;       // NowMs() when the header was in
+  FrameTiming timing;
+  uint64_t checksum;      // of the payload, with --checksum
+};
+static const uint32_t kDecodeQueueDepth = 3;
+bool g_cpu_decode = false;
+uint32_t g_decode_threads = 0;  // stripes per frame, 0 is one per hardware thread
+BoundedQueue<byte*> g_free_payloads(kDecodeQueueDepth);
+BoundedQueue<DecodedFrame> g_decode_queue(kDecodeQueueDepth);
+BoundedQueue<byte*> g_free_rgba_frames(kDecodeQueueDepth);
+BoundedQueue<DecodedFrame> g_render_queue(kDecodeQueueDepth);
+// --zero-copy: the payload buffers are windows of a ZeroCopyReceiver, the
+// whole pages of a frame are mapped into them instead of copied
+bool g_zero_copy = false;
+ZeroCopyReceiver* g_zero_copy_receiver = nullptr;
+static const int32_t kZeroCopyWaitMs = 100;
+// Between connection attempts, while the server is away
+static const uint32_t kConnectRetryMs = 10;
+
+// --headless: no window and no GL at all. The CPU decode pipeline runs
+// as usual and its last stage prints a JSON line per frame instead of
+// drawing.
+bool g_headless = false;
+bool g_checksum_frames = false;   // FNV-1a of every payload
+bool g_discard_frames = false;    // receive only, no decode
+
+// --relay port: no window either. Frames from upstream are served as they
+// are, payload untouched, to any number of downstream viewers, which can
+// be relays themselves. Payloads are shared between viewers and only
+// freed when the last one is done with them.
+typedef std::shared_ptr<std::vector<byte>> FrameData;
+
+struct RelayFrame {
+  FrameHeader header;
+  FrameData payload;
+  double header_ms = 0.0;     // NowMs() when the header came in upstream
+};
 
+struct RelayViewer {
+  TCPSocket* socket;
+
+  // Mailbox, latest frame wins, as in the server
+  RelayFrame sending;
+  bool is_sending;
+  uint32_t bytes_sent;
+  RelayFrame pending;
+  bool has_pending;
+  // Answer to the viewer's last clock ping, on our clock
+  bool has_pong;
+  uint32_t pong_id;
+  uint64_t ping_received_us;
+
+  uint64_t frames_sent;
+  uint64_t frames_skipped;
+  ControlMessage control;       // control message being received
+  uint32_t control_bytes_read;
+  uint32_t poll_events;         // what the relay loop wakes up for
+};
+
+bool g_relay = false;
+uint16_t g_relay_port = 14194;
+TripleBuffer<RelayFrame> g_relay_frames;   // network -> relay loop
+PollerWakeup g_relay_wakeup;               // a frame in g_relay_frames
+std::vector<RelayViewer> g_relay_viewers;  // relay loop only
+// Payload buffers nobody references any more, back for the network thread
+// to receive into. Whoever drops the last reference returns the buffer,
+// past the capacity it's freed.
+static const uint32_t kRelayFreePayloads = 8;
+BoundedQueue<std::vector<byte>*> g_relay_free_payloads(kRelayFreePayloads);
+
+const char* g_server_ip = "127.0.0.1";
+uint32_t g_server_port = 14194;
+PixelFormat g_requested_format = PixelFormat::YUYV;
+uint32_t g_requested_layer = 0;
+uint32_t g_requested_stream = 0;
+uint32_t g_requested_region[5] = { 0, 0, 0, 0, 0 };  // x, y, width, height, scale
+uint32_t g_max_receive_rate = 0;  // bytes/s, 0 is unlimited
+uint64_t g_throttle_bytes = 0;
+Chrono g_throttle_chrono;
+
+// --socket-preset, for the upstream socket and the relay's viewers
+SocketOptions g_socket_options = SocketOptions::LowLatencyVideo();
 TCPSocket g_socket(Socket::Type::NonBlock);
 NetworkState g_network_state = NetworkState::NotConnected;
-std::atomic<bool> g_can_sync_network;
-std::atomic<bool> g_can_receive_data;
 
 
 class Mat4 {
@@ -122,7 +350,9 @@ static float near = 0.1f;
 static float far = 1000.0f;
 
 void InterruptSignalHandler(int32_t param) {
-  glfwSetWindowShouldClose(g_window, true);
+  if (g_window) {
+    glfwSetWindowShouldClose(g_window, true);
+  }
   g_program_should_finish = true;
 }
 
@@ -225,6 +455,66 @@ static const char* fragment_shader_text =
 "  color = vec4(texture(target_texture, o_uv).rgb, 1.0);\n"
 "}\n";
 
+static const char* convert_vertex_shader_text =
+"#version 330 core\n"
+"void main() {\n"
+"  // One triangle covering the whole target\n"
+"  vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+"  gl_Position = vec4(position * 2.0 - 1.0, 0.0, 1.0);\n"
+"}\n";
+
+// Same math as ConvertToRGBA(), fixed point included, so both agree to the bit.
+// 'payload' holds the frame bytes as R8, frame_size.x texels per row.
+static const char* convert_fragment_shader_text =
+"#version 330 core\n"
+"uniform sampler2D payload;\n"
+"uniform int format;\n"
+"uniform ivec2 frame_size;\n"
+"uniform vec4 coefficients;\n"
+"out vec4 color;\n"
+"float Sample(int index) {\n"
+"  ivec2 texel = ivec2(index % frame_size.x, index / frame_size.x);\n"
+"  return floor(texelFetch(payload, texel, 0).r * 255.0 + 0.5);\n"
+"}\n"
+"void main() {\n"
+"  int x = int(gl_FragCoord.x);\n"
+"  int y = int(gl_FragCoord.y);\n"
+"  int pixel = y * frame_size.x + x;\n"
+"  float luma = 0.0;\n"
+"  float cb = 0.0;\n"
+"  float cr = 0.0;\n"
+"  if (format == 0) {\n"
+"    // YUYV: Y0 U Y1 V\n"
+"    int pair = (pixel & ~1) * 2;\n"
+"    luma = Sample(pixel * 2);\n"
+"    cb = Sample(pair + 1);\n"
+"    cr = Sample(pair + 3);\n"
+"  }\n"
+"  else {\n"
+"    int chroma_width = (frame_size.x + 1) / 2;\n"
+"    int chroma_height = (frame_size.y + 1) / 2;\n"
+"    int luma_size = frame_size.x * frame_size.y;\n"
+"    int chroma = (y / 2) * chroma_width + x / 2;\n"
+"    luma = Sample(pixel);\n"
+"    if (format == 1) {\n"
+"      // I420: U plane then V plane\n"
+"      cb = Sample(luma_size + chroma);\n"
+"      cr = Sample(luma_size + chroma_width * chroma_height + chroma);\n"
+"    }\n"
+"    else {\n"
+"      // NV12: interleaved UV plane\n"
+"      cb = Sample(luma_size + chroma * 2);\n"
+"      cr = Sample(luma_size + chroma * 2 + 1);\n"
+"    }\n"
+"  }\n"
+"  cb -= 128.0;\n"
+"  cr -= 128.0;\n"
+"  vec3 rgb = vec3(luma + floor(coefficients.x * cr / 1024.0),\n"
+"    luma - floor((coefficients.y * cb + coefficients.z * cr) / 1024.0),\n"
+"    luma + floor(coefficients.w * cb / 1024.0));\n"
+"  color = vec4(clamp(rgb, 0.0, 255.0) / 255.0, 1.0);\n"
+"}\n";
+
 bool CheckGLError(const char* tag = "") {
   GLenum error = glGetError();
   switch(error) {
@@ -275,6 +565,7 @@ void InitializeGraphics() {
   #ifdef __PLATFORM_MACOSX__
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
   #endif
+  glfwWindowHint(GLFW_VISIBLE, g_hidden_window ? GL_FALSE : GL_TRUE);
 
   g_window = glfwCreateWindow(g_window_width, g_window_height, "Window", NULL, NULL);
   if (!g_window) {
@@ -292,6 +583,489 @@ void InitializeGraphics() {
   #endif
 }
 
+// [Texture upload]
+// CPU time of the calling thread, to see what the render loop really costs
+static double ThreadCpuMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1.0e6;
+}
+
+static byte* MapUploadBuffer(GLuint buffer_id) {
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_id);
+  // Invalidating lets the driver hand us fresh storage if the GPU is still
+  // reading the old contents
+  byte* data = (byte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, g_payload_buffer_size,
+    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  return data;
+}
+
+static void DestroyFrameSlots() {
+  for (uint32_t i = 0; i < TripleBuffer<ReceivedFrame>::SlotCount(); ++i) {
+    ReceivedFrame& frame = g_frames.slot(i);
+    if (frame.upload_buffer != 0) {
+      if (frame.data) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, frame.upload_buffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      }
+      glDeleteBuffers(1, &frame.upload_buffer);
+    }
+    else {
+      free(frame.data);
+    }
+    frame.data = nullptr;
+    frame.upload_buffer = 0;
+  }
+}
+
+// Must run before the network thread starts: it decides where frames are
+// received to
+static void InitializeFrameSlots() {
+  const uint32_t slot_count = TripleBuffer<ReceivedFrame>::SlotCount();
+  for (uint32_t i = 0; i < slot_count; ++i) {
+    ReceivedFrame& frame = g_frames.slot(i);
+    frame = ReceivedFrame();
+    frame.format = PixelFormat::YUYV;
+  }
+
+  if (g_use_upload_buffers) {
+    bool mapped = true;
+    for (uint32_t i = 0; i < slot_count; ++i) {
+      ReceivedFrame& frame = g_frames.slot(i);
+      glGenBuffers(1, &frame.upload_buffer);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, frame.upload_buffer);
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, g_payload_buffer_size, nullptr, GL_STREAM_DRAW);
+      frame.data = MapUploadBuffer(frame.upload_buffer);
+      mapped = mapped && frame.data != nullptr;
+    }
+
+    if (!mapped || CheckGLError("InitializeFrameSlots")) {
+      printf("Pixel buffer objects not usable, uploading from client memory\n");
+      DestroyFrameSlots();
+      g_use_upload_buffers = false;
+    }
+  }
+
+  if (!g_use_upload_buffers) {
+    for (uint32_t i = 0; i < slot_count; ++i) {
+      ReceivedFrame& frame = g_frames.slot(i);
+      frame.data = (byte*)malloc(g_payload_buffer_size);
+      memset(frame.data, 0, g_payload_buffer_size);
+    }
+  }
+}
+
+// Converts the payload texture into g_texture_id
+static void ConvertFrame(uint32_t width, uint32_t height, PixelFormat format) {
+  int32_t c[4];
+  GetColorMatrixCoefficients(g_color_matrix, c);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, g_convert_framebuffer_id);
+  glViewport(0, 0, width, height);
+  glUseProgram(g_convert_program_id);
+  glUniform1i(g_convert_format_location, (GLint)format);
+  glUniform2i(g_convert_frame_size_location, width, height);
+  glUniform4f(g_convert_coefficients_location, (float)c[0], (float)c[1], (float)c[2], (float)c[3]);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+
+  int32_t framebuffer_width = 0;
+  int32_t framebuffer_height = 0;
+  glfwGetFramebufferSize(g_window, &framebuffer_width, &framebuffer_height);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, framebuffer_width, framebuffer_height);
+  glUseProgram(g_program_id);
+}
+
+// Takes the newest received frame, if there is one we haven't drawn yet,
+// and converts it to RGBA on the GPU. From a pixel buffer the upload is
+// only queued; either way the CPU never touches the pixels.
+// Returns whether there was a frame, and its timing so far.
+static bool UploadNewFrame(FrameTiming* timing) {
+  if (!g_frames.update()) {
+    return false;
+  }
+  ReceivedFrame& frame = g_frames.readSlot();
+  *timing = frame.timing;
+
+  // The payload as bytes, frame width bytes per row
+  const uint32_t payload_size = FrameSize(frame.format, frame.width, frame.height);
+  const uint32_t payload_rows = (payload_size + frame.width - 1) / frame.width;
+
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, g_payload_texture_id);
+  if (frame.width != g_payload_texture_width || payload_rows != g_payload_texture_height) {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, frame.width, payload_rows,
+      0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+    g_payload_texture_width = frame.width;
+    g_payload_texture_height = payload_rows;
+  }
+
+  if (frame.upload_buffer != 0) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, frame.upload_buffer);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 
+      frame.width, payload_rows, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // Mapped again right away: the network thread gets this slot back on
+    // some later publish and must find it writable
+    frame.data = MapUploadBuffer(frame.upload_buffer);
+    if (!frame.data) {
+      LOG_WARNING("Failed to map pixel buffer, uploading from client memory\n");
+      glDeleteBuffers(1, &frame.upload_buffer);
+      frame.upload_buffer = 0;
+      frame.data = (byte*)malloc(g_payload_buffer_size);
+      if (!frame.data) {
+        LOG_ERROR("Out of memory for a frame slot, frames landing in it are dropped\n");
+      }
+      g_use_upload_buffers = false;
+    }
+  }
+  else {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 
+      frame.width, payload_rows, GL_RED, GL_UNSIGNED_BYTE, frame.data);
+  }
+  glActiveTexture(GL_TEXTURE0);
+
+  // Layers change the frame size; the quad stretches whatever we get
+  if (frame.width != g_texture_width || frame.height != g_texture_height) {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, frame.width, frame.height, 
+      0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    g_texture_width = frame.width;
+    g_texture_height = frame.height;
+  }
+
+  ConvertFrame(frame.width, frame.height, frame.format);
+
+  ++g_upload_count;
+  return true;
+}
+
+static GLuint CompileShader(GLenum type, const char* text, const char* name) {
+  GLuint shader_id = glCreateShader(type);
+  glShaderSource(shader_id, 1, &text, NULL);
+  glCompileShader(shader_id);
+  GLint compiling_success = 0;
+  glGetShaderiv(shader_id, GL_COMPILE_STATUS, &compiling_success);
+  if (!compiling_success) {
+    printf("Failed to compile %s shader\n", name);
+    GLint log_size = 0;
+    glGetShaderiv(shader_id, GL_INFO_LOG_LENGTH, &log_size);
+    char* log = (char*)malloc(log_size);
+    GLint read = 0;
+    glGetShaderInfoLog(shader_id, log_size, &read, log);
+    printf("Error: %s\n", log);
+    free(log);
+  }
+
+  return shader_id;
+}
+
+static void InitializeFrameConversion() {
+  GLuint vertex_shader_id = CompileShader(GL_VERTEX_SHADER, convert_vertex_shader_text, "conversion vertex");
+  GLuint fragment_shader_id = CompileShader(GL_FRAGMENT_SHADER, convert_fragment_shader_text, "conversion fragment");
+  g_convert_program_id = glCreateProgram();
+  glAttachShader(g_convert_program_id, vertex_shader_id);
+  glAttachShader(g_convert_program_id, fragment_shader_id);
+  glLinkProgram(g_convert_program_id);
+  glDeleteShader(vertex_shader_id);
+  glDeleteShader(fragment_shader_id);
+  CheckGLError("glLinkProgram conversion");
+
+  glUseProgram(g_convert_program_id);
+  glUniform1i(glGetUniformLocation(g_convert_program_id, "payload"), 1);
+  g_convert_format_location = glGetUniformLocation(g_convert_program_id, "format");
+  g_convert_frame_size_location = glGetUniformLocation(g_convert_program_id, "frame_size");
+  g_convert_coefficients_location = glGetUniformLocation(g_convert_program_id, "coefficients");
+  glUseProgram(g_program_id);
+
+  // Rows of I420/NV12 chroma and odd widths aren't 4 byte aligned
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+  glActiveTexture(GL_TEXTURE1);
+  glGenTextures(1, &g_payload_texture_id);
+  glBindTexture(GL_TEXTURE_2D, g_payload_texture_id);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glActiveTexture(GL_TEXTURE0);
+
+  glGenFramebuffers(1, &g_convert_framebuffer_id);
+  glBindFramebuffer(GL_FRAMEBUFFER, g_convert_framebuffer_id);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, g_texture_id, 0);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    printf("Frame conversion framebuffer is not complete\n");
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  CheckGLError("InitializeFrameConversion");
+}
+
+// Client --decode-check: converts synthetic frames of every format with
+// both matrices on the GPU, reads them back and compares them with
+// ConvertToRGBA(). Run it under a software driver (LIBGL_ALWAYS_SOFTWARE=1)
+// to validate the shader without a GPU.
+static bool RunDecodeCheck() {
+  const uint32_t sizes[2][2] = { { 640, 480 }, { 160, 120 } };
+  std::vector<byte> yuyv(FrameSize(PixelFormat::YUYV, g_image_width, g_image_height));
+  std::vector<byte> expected(g_image_width * g_image_height * 4);
+  std::vector<byte> result(g_image_width * g_image_height * 4);
+  bool all_match = true;
+
+  InitializeFrameSlots();
+  for (uint32_t s = 0; s < 2; ++s) {
+    const uint32_t width = sizes[s][0];
+    const uint32_t height = sizes[s][1];
+    // Every Y, U and V value shows up somewhere
+    for (uint32_t i = 0; i < width * height * 2; ++i) {
+      yuyv[i] = (byte)((i * 7 + (i / (width * 2)) * 13) ^ (i >> 9));
+    }
+
+    for (uint8_t f = 0; f < (uint8_t)PixelFormat::Count; ++f) {
+      const PixelFormat format = (PixelFormat)f;
+      if (format == PixelFormat::YUYV) {
+        memcpy(g_draw_buffer, &yuyv[0], width * height * 2);
+      }
+      else if (format == PixelFormat::I420) {
+        ConvertYUYVToI420(&yuyv[0], width * 2, width, height, g_draw_buffer);
+      }
+      else {
+        ConvertYUYVToNV12(&yuyv[0], width * 2, width, height, g_draw_buffer);
+      }
+
+      for (uint8_t m = 0; m < (uint8_t)ColorMatrix::Count; ++m) {
+        g_color_matrix = (ColorMatrix)m;
+        ConvertToRGBA(format, g_draw_buffer, width, height, &expected[0], g_color_matrix);
+
+        // Through the same path as received frames
+        ReceivedFrame& frame = g_frames.writeSlot();
+        memcpy(frame.data, g_draw_buffer, FrameSize(format, width, height));
+        frame.width = width;
+        frame.height = height;
+        frame.format = format;
+        g_frames.publish();
+        FrameTiming timing;
+        UploadNewFrame(&timing);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, g_convert_framebuffer_id);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &result[0]);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        uint32_t mismatches = 0;
+        uint32_t max_difference = 0;
+        for (uint32_t i = 0; i < width * height * 4; ++i) {
+          const uint32_t difference = (uint32_t)abs((int32_t)result[i] - (int32_t)expected[i]);
+          if (difference > 0) {
+            ++mismatches;
+            max_difference = std::max(max_difference, difference);
+          }
+        }
+
+        printf("Decode check %ux%u %s %s: %u mismatching bytes (max difference %u)\n",
+          width, height, PixelFormatName(format), ColorMatrixName(g_color_matrix),
+          mismatches, max_difference);
+        all_match = all_match && mismatches == 0;
+      }
+    }
+  }
+
+  DestroyFrameSlots();
+  CheckGLError("RunDecodeCheck");
+  return all_match;
+}
+
+// Client --upload-bench n: no network, a new synthetic frame on every loop
+// drawn to a hidden window, once through pixel buffers and once from client
+// memory. LIBGL_ALWAYS_SOFTWARE=1 (plus xvfb-run without a display) runs it
+// on llvmpipe.
+static void RunUploadBench(uint32_t frames) {
+  const uint32_t frame_size = g_payload_buffer_size;
+  glfwSwapInterval(0);
+
+  for (uint32_t pass = 0; pass < 2; ++pass) {
+    g_use_upload_buffers = (pass == 0);
+    InitializeFrameSlots();
+    if (pass == 0 && !g_use_upload_buffers) {
+      DestroyFrameSlots();
+      continue;
+    }
+
+    const uint32_t uploads_before = g_upload_count;
+    double cpu_ms = 0.0;
+    Chrono c;
+    c.start();
+    for (uint32_t i = 0; i < frames; ++i) {
+      // What the network thread would do
+      ReceivedFrame& frame = g_frames.writeSlot();
+      memset(frame.data, (int)(i & 0xFF), frame_size);
+      frame.width = g_image_width;
+      frame.height = g_image_height;
+      frame.format = PixelFormat::YUYV;
+      g_frames.publish();
+
+      const double cpu_start = ThreadCpuMs();
+      FrameTiming timing;
+      glClear(GL_COLOR_BUFFER_BIT);
+      UploadNewFrame(&timing);
+      glDrawArrays(GL_TRIANGLES, 0, 6);
+      glfwSwapBuffers(g_window);
+      cpu_ms += ThreadCpuMs() - cpu_start;
+    }
+    glFinish();
+    c.stop();
+
+    printf("Upload %s: %.3f ms CPU per frame, %.1f fps, %u uploads\n",
+      g_use_upload_buffers ? "pixel buffers" : "client memory", cpu_ms / frames,
+      frames / c.timeAsSeconds(), g_upload_count - uploads_before);
+    DestroyFrameSlots();
+  }
+
+  CheckGLError("RunUploadBench");
+}
+// [\Texture upload]
+
+// [CPU decode]
+static double NowMs() {
+  return std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t ChecksumFrame(const byte* data, uint32_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (uint32_t i = 0; i < size; ++i) {
+    hash = (hash ^ data[i]) * 1099511628211ull;
+  }
+
+  return hash;
+}
+
+static void InitializeDecodeBuffers() {
+  if (g_zero_copy) {
+    g_zero_copy_receiver = new ZeroCopyReceiver(kDecodeQueueDepth, g_payload_buffer_size);
+    if (!g_zero_copy_receiver->isValid()) {
+      delete g_zero_copy_receiver;
+      g_zero_copy_receiver = nullptr;
+    }
+  }
+
+  for (uint32_t i = 0; i < kDecodeQueueDepth; ++i) {
+    g_free_payloads.push(g_zero_copy_receiver ? g_zero_copy_receiver->window(i) :
+      (byte*)malloc(g_payload_buffer_size));
+    g_free_rgba_frames.push((byte*)malloc(g_image_width * g_image_height * 4));
+  }
+}
+
+// Zero-copy windows go with their receiver
+static void FreeBuffer(byte* buffer) {
+  if (!g_zero_copy_receiver || !g_zero_copy_receiver->owns(buffer)) {
+    free(buffer);
+  }
+}
+
+// Only once the stages are stopped
+static void DestroyDecodeBuffers() {
+  byte* buffer = nullptr;
+  DecodedFrame frame;
+  while (g_free_payloads.tryPop(&buffer)) {
+    FreeBuffer(buffer);
+  }
+  while (g_free_rgba_frames.tryPop(&buffer)) {
+    free(buffer);
+  }
+  while (g_decode_queue.tryPop(&frame)) {
+    FreeBuffer(frame.data);
+  }
+  while (g_render_queue.tryPop(&frame)) {
+    free(frame.data);
+  }
+
+  if (g_zero_copy_receiver) {
+    LOG_STATS("Zero-copy receive: %.1f MB mapped, %.1f MB copied\n", g_zero_copy_receiver->mappedBytes() / 1.0e6,
+      g_zero_copy_receiver->copiedBytes() / 1.0e6);
+    delete g_zero_copy_receiver;
+    g_zero_copy_receiver = nullptr;
+  }
+}
+
+static void CloseDecodeQueues() {
+  g_free_payloads.close();
+  g_decode_queue.close();
+  g_free_rgba_frames.close();
+  g_render_queue.close();
+}
+
+// Hands a buffer back to its free queue; after shutdown nobody takes it
+static void ReleaseBuffer(BoundedQueue<byte*>* queue, byte* buffer) {
+  if (!queue->push(buffer)) {
+    FreeBuffer(buffer);
+  }
+}
+
+// Decode stage. One frame at a time, split in stripes across the pool,
+// which keeps the frames in the order they were received.
+void DecodeTask() {
+  MetricsRegisterThread();
+  TraceSetThreadName("decode");
+  StripePool pool(g_decode_threads);
+  LOG_INFO("Decoding on the CPU with %u threads\n", pool.threadCount());
+
+  DecodedFrame frame;
+  while (g_decode_queue.pop(&frame)) {
+    byte* rgba = nullptr;
+    if (!g_free_rgba_frames.pop(&rgba)) {
+      FreeBuffer(frame.data);
+      break;
+    }
+
+    frame.checksum = g_checksum_frames ? ChecksumFrame(frame.data, frame.payload_size) : 0;
+
+    const uint64_t start_ns = MonotonicNanos();
+    if (!g_discard_frames) {
+      ConvertToRGBAStriped(&pool, frame.format, frame.data, frame.width, frame.height, rgba, g_color_matrix);
+    }
+    const uint64_t decode_ns = MonotonicNanos() - start_ns;
+    g_decode_histogram.record(decode_ns);
+    TraceSpan("decode", frame.sequence, start_ns, start_ns + decode_ns);
+    frame.timing.set(LatencyStage::Decode, decode_ns / 1.0e6);
+
+    ReleaseBuffer(&g_free_payloads, frame.data);
+    frame.data = rgba;
+    if (!g_render_queue.push(frame)) {
+      free(rgba);
+      break;
+    }
+  }
+}
+
+// Render stage: uploads the oldest decoded frame, if there is one.
+// Returns whether there was one, and its timing so far.
+static bool UploadDecodedFrame(FrameTiming* timing) {
+  DecodedFrame frame;
+  if (!g_render_queue.tryPop(&frame)) {
+    return false;
+  }
+  *timing = frame.timing;
+
+  if (frame.width != g_texture_width || frame.height != g_texture_height) {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, frame.width, frame.height, 
+      0, GL_RGBA, GL_UNSIGNED_BYTE, frame.data);
+    g_texture_width = frame.width;
+    g_texture_height = frame.height;
+  }
+  else {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 
+      frame.width, frame.height, GL_RGBA, GL_UNSIGNED_BYTE, frame.data);
+  }
+
+  ReleaseBuffer(&g_free_rgba_frames, frame.data);
+  ++g_upload_count;
+  return true;
+}
+
+// [\CPU decode]
+
 void InitializeOpenGLStuff() {
   printf("Initializing OpenGL...\n");
 
@@ -358,7 +1132,7 @@ void InitializeOpenGLStuff() {
     free(log);
   }
 
-  GLuint g_program_id = glCreateProgram();
+  g_program_id = glCreateProgram();
   glAttachShader(g_program_id, g_vertex_shader_id);
   glAttachShader(g_program_id, g_fragment_shader_id);
   glLinkProgram(g_program_id);
@@ -410,6 +1184,8 @@ void InitializeOpenGLStuff() {
   memset(g_draw_buffer, 0, g_image_width * g_image_height * 4);
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, g_image_width, g_image_height, 
     0, GL_RGBA, GL_UNSIGNED_BYTE, g_draw_buffer);
+  g_texture_width = g_image_width;
+  g_texture_height = g_image_height;
 
   Mat4 m, p, mvp;
   m.setIdentity();
@@ -445,63 +1221,239 @@ void InitializeOpenGLStuff() {
   glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*)p.matrix);
 }
 
-void AddAlphaChannelData(byte** buffer, uint32_t size, uint32_t new_size) {
-  // First, convert the image from YUYV to RGB
-  // Allocate RGB buffer (3 channels)
-  byte* tmp_buffer = (byte*)malloc(g_image_width * g_image_height * 3);
-  YUYVtoRGB(*buffer, tmp_buffer);
-  memcpy(*buffer, tmp_buffer, g_image_width * g_image_height * 3);
-  free(tmp_buffer);
+// Simulates a slow link: sleeps so we never read faster than
+// g_max_receive_rate on average
+static void ThrottleReceive(uint32_t bytes) {
+  if (g_max_receive_rate == 0) {
+    return;
+  }
 
-  byte* aux_buffer = (byte*)malloc(new_size);
-  memset(aux_buffer, 0, new_size);
+  g_throttle_bytes += bytes;
+  g_throttle_chrono.stop();
+  const float expected = (float)g_throttle_bytes / g_max_receive_rate;
+  const float elapsed = g_throttle_chrono.timeAsSeconds();
+  if (expected > elapsed) {
+    std::this_thread::sleep_for(std::chrono::duration<float>(expected - elapsed));
+  }
+  else if (elapsed - expected > 1.0f) {
+    // Idle for a while, don't let it turn into a burst
+    g_throttle_bytes = 0;
+    g_throttle_chrono.start();
+  }
+}
 
-  byte* rgb   = *buffer;
-  byte* rgba  = aux_buffer;
-  for (uint32_t i = 0; i < g_image_width * g_image_height; ++i) {
-    *(rgba + 0) = *(rgb + 0);
-    *(rgba + 1) = *(rgb + 1);
-    *(rgba + 2) = *(rgb + 2);
-    *(rgba + 3) = 255;
+// Waits for data this long at a time, to notice g_program_should_finish
+static const uint64_t kReceiveSliceNs = 100ull * 1000 * 1000;
+// Largest read while --max-rate throttles, so the rate stays even
+static const uint32_t kThrottledReadSize = 64 * 1024;
+
+// Waits until 'size' bytes are received. False on shutdown or when the
+// connection is lost (the socket is closed then, to reconnect).
+static bool ReceiveBuffer(byte* buffer, uint32_t size) {
+  g_bytes_read = 0;
+  while (g_bytes_read < size && g_socket.isConnected()) {
+    uint32_t wanted = size - g_bytes_read;
+    if (g_max_receive_rate != 0) {
+      wanted = std::min(wanted, kThrottledReadSize);
+    }
+    uint32_t bytes_read = 0;
+    const Socket::TransferStatus status = g_socket.receiveExact(buffer + g_bytes_read, wanted,
+      MonotonicNanos() + kReceiveSliceNs, &bytes_read);
+    g_bytes_read += bytes_read;
+    ThrottleReceive(bytes_read);
+
+    if (status == Socket::TransferStatus::PeerClosed || status == Socket::TransferStatus::Error) {
+      LOG_WARNING("Connection lost (%s), reconnecting...\n", TransferStatusName(status));
+      g_socket.close();
+      return false;
+    }
+    if (g_program_should_finish == true) {
+      return false;
+    }
+  }
 
-    rgb  += 3;
-    rgba += 4;
+  return g_bytes_read == size;
+}
+
+// ReceiveBuffer() into one of the zero-copy windows
+static bool ReceiveZeroCopy(byte* window, uint32_t size) {
+  g_bytes_read = 0;
+  while (g_bytes_read < size) {
+    uint32_t wanted = size - g_bytes_read;
+    if (g_max_receive_rate != 0) {
+      wanted = std::min(wanted, kThrottledReadSize);
+    }
+    const int32_t bytes_read = g_zero_copy_receiver->receive(g_socket, window, g_bytes_read, wanted,
+      kZeroCopyWaitMs);
+    if (bytes_read < 0) {
+      g_socket.close();
+      return false;
+    }
+    g_bytes_read += bytes_read;
+    ThrottleReceive(bytes_read);
+
+    if (g_program_should_finish == true || g_socket.isConnected() == false) {
+      return false;
+    }
   }
 
-  memcpy(*buffer, aux_buffer, new_size);
+  return true;
+}
+
+// Control messages are a few bytes: one that can't go out in this long
+// means the connection is as good as gone
+static const uint64_t kControlSendTimeoutNs = 250ull * 1000 * 1000;
 
-  //SaveImageRGB(nullptr, *buffer, g_image_width, g_image_height, 4);
+static bool SendBuffer(const byte* buffer, uint32_t size) {
+  // Already lost, reconnecting
+  if (g_socket.isConnected() == false) {
+    return false;
+  }
 
-  // release old buffer
-  free(aux_buffer);
+  const Socket::TransferStatus status = g_socket.sendAll(buffer, size, MonotonicNanos() + kControlSendTimeoutNs);
+  if (status != Socket::TransferStatus::Complete) {
+    LOG_WARNING("Control message not sent (%s), reconnecting...\n", TransferStatusName(status));
+    g_socket.close();
+    return false;
+  }
+
+  return true;
 }
 
-void NetworkTask() {
-  printf("Initializing network...\n");
+static void RequestFormat(PixelFormat format) {
+  ControlMessage message = MakeControlMessage(ControlType::SetFormat);
+  message.args[0] = (uint32_t)format;
+  SendBuffer((const byte*)&message, sizeof(message));
+}
 
-  g_recv_data_buffer = (byte*)malloc(g_image_width * g_image_height * 4);
-  memset(g_recv_data_buffer, 0, g_image_width * g_image_height * 4);
-  g_recv_data_ptr = &g_recv_data_buffer;
+static void RequestLayer(uint32_t layer) {
+  ControlMessage message = MakeControlMessage(ControlType::SetLayer);
+  message.args[0] = layer;
+  SendBuffer((const byte*)&message, sizeof(message));
+}
 
-  g_can_sync_network = false;
-  g_can_receive_data = true;
+static void RequestStream(uint32_t stream) {
+  ControlMessage message = MakeControlMessage(ControlType::SetStream);
+  message.args[0] = stream;
+  SendBuffer((const byte*)&message, sizeof(message));
+}
+
+static void RequestRegion(const uint32_t region[5]) {
+  ControlMessage message = MakeControlMessage(ControlType::SetRegion);
+  for (uint32_t i = 0; i < 5; ++i) {
+    message.args[i] = region[i];
+  }
+  SendBuffer((const byte*)&message, sizeof(message));
+}
+
+// Asks the server for another clock sample, if one is due
+static void PingServerClock() {
+  const uint64_t now_us = MonotonicMicros();
+  if (!g_clock_sync.pingDue(now_us)) {
+    return;
+  }
+
+  ControlMessage message = MakeControlMessage(ControlType::Ping);
+  message.args[0] = g_clock_sync.startPing(now_us);
+  SendBuffer((const byte*)&message, sizeof(message));
+}
+
+// The server side of the frame's timing, from its header. Until the clock
+// offset is known we can't tell how long the frame took to get here.
+static FrameTiming TimingFromHeader(const FrameHeader& header, double header_ms, uint64_t header_us) {
+  FrameTiming timing;
+  timing.sequence = header.sequence;
+  timing.set(LatencyStage::Capture, header.capture_delay_us / 1000.0);
+  timing.set(LatencyStage::Process, header.process_us / 1000.0);
+  if (g_clock_sync.synchronized() && header.capture_us != 0) {
+    const double age_ms = (int64_t)(header_us - g_clock_sync.toLocal(header.capture_us)) / 1000.0;
+    timing.capture_ms = header_ms - age_ms;
+    timing.set(LatencyStage::Send, age_ms - (header.capture_delay_us + header.process_us) / 1000.0);
+  }
+
+  return timing;
+}
+
+// [Relay]
+static void RecyclePayload(std::vector<byte>* payload) {
+  if (!g_relay_free_payloads.tryPush(payload)) {
+    delete payload;
+  }
+}
+
+// Storage for a new frame of 'size' bytes: a recycled buffer if there is
+// one. It comes back to g_relay_free_payloads once the last viewer is done.
+static FrameData AcquirePayload(uint32_t size) {
+  std::vector<byte>* payload = nullptr;
+  if (!g_relay_free_payloads.tryPop(&payload)) {
+    payload = new std::vector<byte>();
+  }
+  payload->resize(size);
+
+  return FrameData(payload, RecyclePayload);
+}
+
+// Network thread, relay mode: whatever the payload is, it goes downstream
+// byte for byte
+static bool ReceiveRelayFrame(const FrameHeader& header, double header_ms) {
+  RelayFrame& frame = g_relay_frames.writeSlot();
+  // Let go of the slot's old payload first, it may be the one to reuse
+  frame.payload.reset();
+  frame.payload = AcquirePayload(header.payload_size);
+  if (header.payload_size > 0 && !ReceiveBuffer(frame.payload->data(), header.payload_size)) {
+    return false;
+  }
+
+  // Downstream viewers sync their clocks with us, not with upstream
+  frame.header = header;
+  frame.header.capture_us = (g_clock_sync.synchronized() && header.capture_us != 0)
+    ? g_clock_sync.toLocal(header.capture_us) : 0;
+  frame.header_ms = header_ms;
+  g_relay_frames.publish();
+  g_relay_wakeup.notify();
+  return true;
+}
+// [\Relay]
+
+void NetworkTask() {
+  MetricsRegisterThread();
+  TraceSetThreadName("network");
+  LOG_INFO("Initializing network...\n");
+
+  g_payload_buffer = (byte*)malloc(g_payload_buffer_size);
 
   bool success = false;
-  bool ignore_sync_flag = false;
   while (!g_program_should_finish) {
     switch (g_network_state) {
       case NetworkState::NotConnected: {
+        success = false;
         while (!success && !g_program_should_finish) {
-          success = g_socket.connect("127.0.0.1", 14194);
-        	//success = g_socket.connect("192.168.1.40", 14194);
+          success = g_socket.connect(g_server_ip, g_server_port);
+          if (!success) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(kConnectRetryMs));
+          }
+        }
+        if (!success) {
+          break;
         }
 
-        printf("Connected to the server!\n");
+        LOG_INFO("Connected to the server!\n");
         g_network_state = NetworkState::Connected;
 
         break;
       }
       case NetworkState::Connected: {
+        g_clock_sync.reset();
+        PingServerClock();
+        // Stream first, switching it drops the region
+        if (g_requested_stream > 0) {
+          RequestStream(g_requested_stream);
+        }
+        RequestFormat(g_requested_format);
+        RequestLayer(g_requested_layer);
+        if (g_requested_region[2] > 0) {
+          RequestRegion(g_requested_region);
+        }
         g_network_state = NetworkState::Receiving;
 
         break;
@@ -512,29 +1464,103 @@ void NetworkTask() {
           break;
         }
 
-        uint32_t bytes_read = 0;
-        g_bytes_read = 0;
-
-        if (g_can_receive_data == true) {
-          while (g_bytes_read < g_image_width * g_image_height * 2) {
-            bytes_read = g_socket.receiveData((*g_recv_data_ptr) + g_bytes_read, (g_image_width * g_image_height * 2) - g_bytes_read);
+        PingServerClock();
+        FrameHeader header;
+        if (!ReceiveBuffer((byte*)&header, sizeof(header))) {
+          break;
+        }
+        const double header_ms = NowMs();
+        const uint64_t header_us = MonotonicMicros();
+        if (header.magic != kFrameMagic) {
+          LOG_WARNING("Lost frame synchronization, reconnecting...\n");
+          g_socket.close();
+          break;
+        }
+        if (header.flags & kFrameFlagClock) {
+          g_clock_sync.onPong(header.sequence, header.capture_us, header.process_us, header_us);
+          break;
+        }
 
-            g_bytes_read += bytes_read;
+        // Anything up to the largest frame we'd take ourselves is relayed
+        if (g_relay && header.payload_size <= g_payload_buffer_size) {
+          ReceiveRelayFrame(header, header_ms);
+          break;
+        }
 
-            if (g_program_should_finish == true) {
+        // Frames that don't fit what we have allocated are skipped
+        const bool fits = header.width <= g_image_width && header.height <= g_image_height && 
+          header.format < (uint8_t)PixelFormat::Count && header.payload_size <= g_payload_buffer_size &&
+          header.payload_size == FrameSize((PixelFormat)header.format, header.width, header.height);
+        // The payload goes straight where the next stage takes it from,
+        // the GPU upload or the CPU decoder; frames we skip are drained
+        // through g_payload_buffer, also those for a slot that lost its
+        // memory (see UploadNewFrame())
+        ReceivedFrame& frame = g_frames.writeSlot();
+        byte* payload = frame.data;
+        if (fits && (g_cpu_decode || payload)) {
+          if (g_cpu_decode && !g_free_payloads.pop(&payload)) {
+            break;
+          }
+          const bool received = g_zero_copy_receiver ? ReceiveZeroCopy(payload, header.payload_size) :
+            ReceiveBuffer(payload, header.payload_size);
+          if (!received) {
+            if (g_cpu_decode) {
+              ReleaseBuffer(&g_free_payloads, payload);
+            }
+            break;
+          }
+        }
+        else {
+          uint32_t remaining = header.payload_size;
+          while (remaining > 0) {
+            uint32_t chunk = remaining < g_payload_buffer_size ? remaining : g_payload_buffer_size;
+            if (!ReceiveBuffer(g_payload_buffer, chunk)) {
               break;
             }
+            remaining -= chunk;
           }
+          if (remaining == 0) {
+            g_frames_skipped.add();
+          }
+          break;
+        }
 
-          printf("Received %u bytes\n", g_bytes_read);
-          printf("Received image (frame %u)\n", g_frame_count.load());
-          AddAlphaChannelData(g_recv_data_ptr, g_image_width * g_image_height * 2, g_image_width * g_image_height * 4);
-
-          // The order is important
-          g_can_receive_data = false;
-          g_can_sync_network = true;
+        const double receive_ms = NowMs() - header_ms;
+        g_receive_histogram.record((uint64_t)(receive_ms * 1.0e6));
+        TraceSpan("receive", header.sequence, (uint64_t)(header_ms * 1.0e6),
+          (uint64_t)((header_ms + receive_ms) * 1.0e6));
+        g_frames_received.add();
+        g_bytes_received.add(sizeof(header) + header.payload_size);
+        if (g_cpu_decode) {
+          DecodedFrame decoded;
+          decoded.data = payload;
+          decoded.width = header.width;
+          decoded.height = header.height;
+          decoded.format = (PixelFormat)header.format;
+          decoded.sequence = header.sequence;
+          decoded.stream = header.stream;
+          decoded.payload_size = header.payload_size;
+          decoded.header_ms = header_ms;
+          decoded.timing = TimingFromHeader(header, header_ms, header_us);
+          decoded.timing.set(LatencyStage::Receive, receive_ms);
+          decoded.checksum = 0;
+          if (!g_decode_queue.push(decoded)) {
+            FreeBuffer(payload);
+          }
+          break;
         }
 
+        frame.width = header.width;
+        frame.height = header.height;
+        frame.format = (PixelFormat)header.format;
+        frame.timing = TimingFromHeader(header, header_ms, header_us);
+        frame.timing.set(LatencyStage::Receive, receive_ms);
+
+        // Never waits: if the renderer is still on an older frame this
+        // one replaces whatever was waiting for it
+        g_frames.publish();
+        // The order is important
+
         break;
       } // case NetworkState::Receiving
     } // switch
@@ -543,13 +1569,516 @@ void NetworkTask() {
   g_socket.close();
 }
 
-int main() {
-  signal(SIGINT, InterruptSignalHandler);
+// [Latency]
+static const float kLatencyPercentiles[3] = { 0.5f, 0.95f, 0.99f };
+static const double kLatencyStatsIntervalMs = 5000.0;
+
+// One line per measured stage: p50/p95/p99 in milliseconds
+static void PrintLatencyPercentiles(const LatencyStats* stats) {
+  for (uint32_t i = 0; i < (uint32_t)LatencyStage::Count; ++i) {
+    const LatencyStage stage = (LatencyStage)i;
+    if (stats->count(stage) > 0) {
+      LOG_STATS("Latency %-10s p50 %7.2fms  p95 %7.2fms  p99 %7.2fms  (%u frames)\n", kLatencyStageNames[i],
+        stats->percentile(stage, kLatencyPercentiles[0]), stats->percentile(stage, kLatencyPercentiles[1]),
+        stats->percentile(stage, kLatencyPercentiles[2]), stats->count(stage));
+    }
+  }
+}
 
+// "latency":{"stage":[p50,p95,p99],...} for the stages that were measured
+static void PrintLatencyPercentilesJson(const LatencyStats* stats) {
+  printf("\"latency\":{");
+  const char* separator = "";
+  for (uint32_t i = 0; i < (uint32_t)LatencyStage::Count; ++i) {
+    const LatencyStage stage = (LatencyStage)i;
+    if (stats->count(stage) > 0) {
+      printf("%s\"%s\":[%.3f,%.3f,%.3f]", separator, kLatencyStageNames[i],
+        stats->percentile(stage, kLatencyPercentiles[0]), stats->percentile(stage, kLatencyPercentiles[1]),
+        stats->percentile(stage, kLatencyPercentiles[2]));
+      separator = ",";
+    }
+  }
+  printf("}");
+}
+// [\Latency]
+
+// Client --headless [--frames n] [--checksum] [--discard]: receive and
+// decode without a window. Prints one JSON object per line: one per frame,
+// then a summary. 'latency_ms' goes from the frame header arriving to the
+// frame leaving the decoder, 'end_to_end_ms' from the capture (null until
+// the clock offset to the server is known). The summary has p50/p95/p99
+// of every stage.
+static int RunHeadless(uint32_t frame_limit) {
+  g_cpu_decode = true;
+  InitializeDecodeBuffers();
+  std::thread decode_thread(DecodeTask);
   std::thread network_thread(NetworkTask);
 
+  uint32_t frames = 0;
+  uint64_t bytes = 0;        // after the first frame
+  double receive_ms = 0.0;
+  double decode_ms = 0.0;
+  double latency_ms = 0.0;
+  double max_latency_ms = 0.0;
+  double first_ms = 0.0;
+  double last_ms = 0.0;
+  LatencyStats latency_stats;
+  DecodedFrame frame;
+  while (!g_program_should_finish && (frame_limit == 0 || frames < frame_limit) &&
+    g_render_queue.pop(&frame)) {
+    last_ms = NowMs();
+    if (frames == 0) {
+      first_ms = last_ms;
+    }
+    else {
+      bytes += frame.payload_size;
+    }
+    const double latency = last_ms - frame.header_ms;
+    char end_to_end[32] = "null";
+    if (frame.timing.capture_ms > 0.0) {
+      frame.timing.set(LatencyStage::EndToEnd, last_ms - frame.timing.capture_ms);
+      snprintf(end_to_end, sizeof(end_to_end), "%.3f", frame.timing.get(LatencyStage::EndToEnd));
+    }
+    latency_stats.add(frame.timing);
+
+    const float frame_receive_ms = frame.timing.get(LatencyStage::Receive);
+    const float frame_decode_ms = frame.timing.get(LatencyStage::Decode);
+    printf("{\"frame\":%u,\"stream\":%u,\"sequence\":%u,\"width\":%u,\"height\":%u,\"format\":\"%s\","
+      "\"bytes\":%u,\"receive_ms\":%.3f,\"decode_ms\":%.3f,\"latency_ms\":%.3f,\"end_to_end_ms\":%s,"
+      "\"checksum\":\"%016llx\"}\n",
+      frames, frame.stream, frame.sequence, frame.width, frame.height, PixelFormatName(frame.format),
+      frame.payload_size, frame_receive_ms, frame_decode_ms, latency, end_to_end,
+      (unsigned long long)frame.checksum);
+    fflush(stdout);
+
+    ++frames;
+    receive_ms += frame_receive_ms;
+    decode_ms += frame_decode_ms;
+    latency_ms += latency;
+    max_latency_ms = std::max(max_latency_ms, latency);
+    ReleaseBuffer(&g_free_rgba_frames, frame.data);
+  }
+
+  g_program_should_finish = true;
+  CloseDecodeQueues();
+  network_thread.join();
+  decode_thread.join();
+  DestroyDecodeBuffers();
+
+  // Whatever the threads logged goes out first, the summary is last
+  LogFlush();
+  // The first frame starts the clock, so n frames make n - 1 intervals
+  const double seconds = (last_ms - first_ms) / 1000.0;
+  const uint32_t divisor = std::max(frames, 1u);
+  printf("{\"summary\":true,\"frames\":%u,\"seconds\":%.3f,\"fps\":%.2f,\"mbps\":%.2f,"
+    "\"receive_ms\":%.3f,\"decode_ms\":%.3f,\"latency_ms\":%.3f,\"max_latency_ms\":%.3f,",
+    frames, seconds, seconds > 0.0 ? (frames - 1) / seconds : 0.0,
+    seconds > 0.0 ? bytes * 8.0 / seconds / 1.0e6 : 0.0,
+    receive_ms / divisor, decode_ms / divisor, latency_ms / divisor, max_latency_ms);
+  PrintLatencyPercentilesJson(&latency_stats);
+  printf("}\n");
+
+  return frames > 0 ? 0 : 1;
+}
+// [Relay]
+static void AcceptRelayViewers(TCPListener* listener, Poller* poller) {
+  TCPSocket* socket = listener->accept();
+  while (socket) {
+    LOG_INFO("Relay viewer connected\n");
+    RelayViewer viewer;
+    viewer.socket = socket;
+    viewer.is_sending = false;
+    viewer.bytes_sent = 0;
+    viewer.has_pending = false;
+    viewer.has_pong = false;
+    viewer.pong_id = 0;
+    viewer.ping_received_us = 0;
+    viewer.frames_sent = 0;
+    viewer.frames_skipped = 0;
+    viewer.control_bytes_read = 0;
+    viewer.poll_events = Poller::kReadable;
+    g_relay_viewers.push_back(viewer);
+    poller->add(*socket, Poller::kReadable, nullptr);
+
+    socket = listener->accept();
+  }
+}
+
+// Downstream viewers get the upstream stream as it is: what they ask for
+// is the upstream connection's business, so their requests are dropped.
+// Clock pings are answered here, the frames they get carry our clock.
+static void DrainRelayControl(RelayViewer* viewer) {
+  while (viewer->socket->isConnected()) {
+    // Only what is there already, which is also how a viewer that left is
+    // noticed
+    byte* destination = (byte*)&viewer->control + viewer->control_bytes_read;
+    uint32_t bytes_read = 0;
+    const Socket::TransferStatus status = viewer->socket->receiveExact(destination,
+      sizeof(ControlMessage) - viewer->control_bytes_read, MonotonicNanos(), &bytes_read);
+
+    viewer->control_bytes_read += bytes_read;
+    if (viewer->control_bytes_read == sizeof(ControlMessage)) {
+      viewer->control_bytes_read = 0;
+      if (viewer->control.magic == kControlMagic && viewer->control.type == (uint8_t)ControlType::Ping) {
+        viewer->has_pong = true;
+        viewer->pong_id = viewer->control.args[0];
+        viewer->ping_received_us = MonotonicMicros();
+      }
+    }
+    if (status != Socket::TransferStatus::Complete) {
+      break;
+    }
+  }
+}
+
+static void RemoveDisconnectedRelayViewers(Poller* poller) {
+  for (uint32_t i = 0; i < g_relay_viewers.size();) {
+    if (!g_relay_viewers[i].socket->isConnected()) {
+      LOG_INFO("Relay viewer disconnected\n");
+      poller->remove(*g_relay_viewers[i].socket);
+      delete g_relay_viewers[i].socket;
+      g_relay_viewers.erase(g_relay_viewers.begin() + i);
+    }
+    else {
+      ++i;
+    }
+  }
+}
+
+// Writes as much of the viewer's mailbox as the socket takes without
+// blocking. Returns the time the last frame it finished spent in this
+// relay, from its header arriving upstream, or a negative value.
+static double PumpRelayViewer(RelayViewer* viewer, Poller* poller) {
+  double hop_ms = -1.0;
+  while (viewer->socket->isConnected()) {
+    if (!viewer->is_sending) {
+      if (viewer->has_pong) {
+        const uint64_t now_us = MonotonicMicros();
+        viewer->sending = RelayFrame();
+        viewer->sending.header = MakeClockHeader(viewer->pong_id);
+        viewer->sending.header.capture_us = now_us;
+        viewer->sending.header.process_us = (uint32_t)(now_us - viewer->ping_received_us);
+        viewer->has_pong = false;
+      }
+      else if (viewer->has_pending) {
+        viewer->sending = viewer->pending;
+        viewer->pending.payload.reset();
+        viewer->has_pending = false;
+      }
+      else {
+        break;
+      }
+      viewer->is_sending = true;
+      viewer->bytes_sent = 0;
+    }
+
+    const FrameHeader& header = viewer->sending.header;
+    const uint32_t total_size = sizeof(header) + header.payload_size;
+    byte* src = nullptr;
+    uint32_t remaining = 0;
+    if (viewer->bytes_sent < sizeof(header)) {
+      src = (byte*)&header + viewer->bytes_sent;
+      remaining = sizeof(header) - viewer->bytes_sent;
+    }
+    else {
+      const uint32_t offset = viewer->bytes_sent - sizeof(header);
+      src = viewer->sending.payload->data() + offset;
+      remaining = header.payload_size - offset;
+    }
+
+    const uint32_t sent = viewer->socket->sendData(src, remaining);
+    if (sent == 0) {
+      break;
+    }
+
+    viewer->bytes_sent += sent;
+    if (viewer->bytes_sent == total_size && (header.flags & kFrameFlagClock)) {
+      viewer->is_sending = false;
+    }
+    else if (viewer->bytes_sent == total_size) {
+      hop_ms = NowMs() - viewer->sending.header_ms;
+      viewer->is_sending = false;
+      viewer->sending.payload.reset();
+      ++viewer->frames_sent;
+    }
+  }
+
+  // Woken up when the socket takes more, only while there is more
+  const bool has_output = viewer->is_sending || viewer->has_pending || viewer->has_pong;
+  const uint32_t events = Poller::kReadable | (has_output ? Poller::kWritable : 0);
+  if (viewer->socket->isConnected() && events != viewer->poll_events) {
+    poller->modify(*viewer->socket, events, nullptr);
+    viewer->poll_events = events;
+  }
+  return hop_ms;
+}
+
+static const double kRelayStatsIntervalMs = 5000.0;
+// Longest wait with nothing to do, to notice g_program_should_finish
+static const int32_t kRelayWaitMs = 100;
+static const uint32_t kMaxRelayEvents = 64;
+
+// Client --relay port: connects upstream like a viewer and serves the
+// frames on 'port'. Chain relays by pointing one at another.
+static int RunRelay() {
+  // A viewer going away must not kill the relay
+  signal(SIGPIPE, SIG_IGN);
+
+  TCPListener listener(Socket::Type::NonBlock, 128, g_socket_options);
+  if (!listener.bind(g_relay_port) || !listener.listen()) {
+    printf("Can't listen on port %u\n", g_relay_port);
+    return 1;
+  }
+  printf("Relaying %s to port %u\n", g_server_ip, g_relay_port);
+
+  // Sockets and new frames, what the loop waits on
+  Poller poller;
+  poller.add(listener, Poller::kReadable, nullptr);
+  poller.add(g_relay_wakeup, nullptr);
+
+  std::thread network_thread(NetworkTask);
+
+  uint64_t frames_in = 0;
+  uint32_t hops = 0;
+  double hop_ms = 0.0;
+  double max_hop_ms = 0.0;
+  double last_stats_ms = NowMs();
+  while (!g_program_should_finish) {
+    Poller::Event events[kMaxRelayEvents];
+    poller.wait(events, kMaxRelayEvents, kRelayWaitMs);
+    g_relay_wakeup.clear();
+
+    AcceptRelayViewers(&listener, &poller);
+    for (uint32_t i = 0; i < g_relay_viewers.size(); ++i) {
+      DrainRelayControl(&g_relay_viewers[i]);
+    }
+    RemoveDisconnectedRelayViewers(&poller);
+
+    if (g_relay_frames.update()) {
+      const RelayFrame& frame = g_relay_frames.readSlot();
+      for (uint32_t i = 0; i < g_relay_viewers.size(); ++i) {
+        RelayViewer& viewer = g_relay_viewers[i];
+        if (viewer.has_pending) {
+          ++viewer.frames_skipped;
+        }
+        viewer.pending = frame;
+        viewer.has_pending = true;
+      }
+      ++frames_in;
+    }
+
+    for (uint32_t i = 0; i < g_relay_viewers.size(); ++i) {
+      const double frame_hop_ms = PumpRelayViewer(&g_relay_viewers[i], &poller);
+      if (frame_hop_ms >= 0.0) {
+        hop_ms += frame_hop_ms;
+        max_hop_ms = std::max(max_hop_ms, frame_hop_ms);
+        ++hops;
+      }
+    }
+
+    // Hop latency: upstream header in to last byte handed to the
+    // downstream socket, so it includes receiving the payload
+    if (NowMs() - last_stats_ms >= kRelayStatsIntervalMs) {
+      LOG_STATS("Relay: %llu frames in, %u viewers, hop latency %.2fms (max %.2fms)\n",
+        (unsigned long long)frames_in, (uint32_t)g_relay_viewers.size(),
+        hops > 0 ? hop_ms / hops : 0.0, max_hop_ms);
+      for (uint32_t i = 0; i < g_relay_viewers.size(); ++i) {
+        LOG_STATS("Relay viewer %u: %llu frames sent, %llu skipped\n", i,
+          (unsigned long long)g_relay_viewers[i].frames_sent,
+          (unsigned long long)g_relay_viewers[i].frames_skipped);
+      }
+      hops = 0;
+      hop_ms = 0.0;
+      max_hop_ms = 0.0;
+      last_stats_ms = NowMs();
+    }
+  }
+
+  network_thread.join();
+  for (uint32_t i = 0; i < g_relay_viewers.size(); ++i) {
+    g_relay_viewers[i].socket->close();
+    delete g_relay_viewers[i].socket;
+  }
+  g_relay_viewers.clear();
+  listener.close();
+
+  // Buffers still in the triple buffer are freed with it
+  g_relay_free_payloads.close();
+  std::vector<byte>* payload = nullptr;
+  while (g_relay_free_payloads.tryPop(&payload)) {
+    delete payload;
+  }
+
+  return 0;
+}
+// [\Relay]
+
+int main(int argc, char** argv) {
+  // Rendering and the relay loop run here
+  MetricsRegisterThread();
+  signal(SIGINT, InterruptSignalHandler);
+
+  // Client [server ip[:port]] [--stream n] [--format yuyv|i420|nv12] [--layer 0|1|2]
+  //        [--region x,y,width,height[,scale]] [--max-kbps n]
+  //        [--no-pbo] [--upload-bench frames] [--matrix bt601|bt709] [--decode-check]
+  //        [--cpu-decode [threads]] [--max-size widthxheight]
+  //        [--headless] [--frames n] [--checksum] [--discard] [--relay port]
+  //        [--trace file] [--log-level debug|info|warning|error|off]
+  //        [--socket-preset default|low-latency|throughput] [--zero-copy]
+  uint32_t upload_bench_frames = 0;
+  uint32_t frame_limit = 0;
+  bool decode_check = false;
+  for (int32_t i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      if (!ParsePixelFormat(argv[++i], &g_requested_format)) {
+        printf("Unknown pixel format %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--layer") == 0 && i + 1 < argc) {
+      g_requested_layer = (uint32_t)atoi(argv[++i]);
+      if (g_requested_layer >= kLayerCount) {
+        printf("Layer must be between 0 and %u\n", kLayerCount - 1);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+      g_requested_stream = (uint32_t)atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--region") == 0 && i + 1 < argc) {
+      uint32_t* r = g_requested_region;
+      if (sscanf(argv[++i], "%u,%u,%u,%u,%u", &r[0], &r[1], &r[2], &r[3], &r[4]) < 4) {
+        printf("Region must be x,y,width,height[,scale]\n");
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--matrix") == 0 && i + 1 < argc) {
+      if (!ParseColorMatrix(argv[++i], &g_color_matrix)) {
+        printf("Unknown color matrix %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--decode-check") == 0) {
+      decode_check = true;
+      g_hidden_window = true;
+    }
+    else if (strcmp(argv[i], "--cpu-decode") == 0) {
+      g_cpu_decode = true;
+      if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+        g_decode_threads = (uint32_t)atoi(argv[++i]);
+      }
+    }
+    else if (strcmp(argv[i], "--relay") == 0 && i + 1 < argc) {
+      g_relay = true;
+      g_relay_port = (uint16_t)atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--headless") == 0) {
+      // stdout is the JSON stream
+      g_headless = true;
+      LogAllToStderr();
+    }
+    else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frame_limit = (uint32_t)atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--checksum") == 0) {
+      g_checksum_frames = true;
+    }
+    else if (strcmp(argv[i], "--discard") == 0) {
+      g_discard_frames = true;
+    }
+    else if (strcmp(argv[i], "--zero-copy") == 0) {
+#ifndef __linux__
+      printf("--zero-copy needs Linux (TCP_ZEROCOPY_RECEIVE)\n");
+      return 1;
+#endif
+      // Only the CPU decode pipeline receives into plain memory
+      g_zero_copy = true;
+    }
+    else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+      // Frames bigger than this are skipped, every buffer is this big
+      if (sscanf(argv[++i], "%ux%u", &g_image_width, &g_image_height) != 2 ||
+        g_image_width == 0 || g_image_height == 0) {
+        printf("Size must be widthxheight\n");
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--no-pbo") == 0) {
+      g_use_upload_buffers = false;
+    }
+    else if (strcmp(argv[i], "--upload-bench") == 0 && i + 1 < argc) {
+      upload_bench_frames = (uint32_t)atoi(argv[++i]);
+      g_hidden_window = true;
+    }
+    else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+      LogLevel level = LogLevel::Info;
+      if (!ParseLogLevel(argv[++i], &level)) {
+        printf("Unknown log level %s\n", argv[i]);
+        return 1;
+      }
+      LogSetLevel(level);
+    }
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      // Per frame spans, see trace.h
+      TraceEnable("client", argv[++i]);
+      TraceSetThreadName("main");
+    }
+    else if (strcmp(argv[i], "--socket-preset") == 0 && i + 1 < argc) {
+      if (!ParseSocketPreset(argv[++i], &g_socket_options)) {
+        printf("Unknown socket preset %s, use default, low-latency or throughput\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--max-kbps") == 0 && i + 1 < argc) {
+      // Throttled reads, to see how the server copes with a slow viewer
+      g_max_receive_rate = (uint32_t)atoi(argv[++i]) * 1000 / 8;
+      g_throttle_chrono.start();
+    }
+    else {
+      // ip[:port], relays listen on other ports
+      g_server_ip = argv[i];
+      char* port = strchr(argv[i], ':');
+      if (port) {
+        *port = '\0';
+        g_server_port = (uint32_t)atoi(port + 1);
+      }
+    }
+  }
+
+  g_socket.setOptions(g_socket_options);
+
+  // Largest payload we accept, every frame buffer is this size
+  g_payload_buffer_size = FrameSize(PixelFormat::YUYV, g_image_width, g_image_height);
+  if (g_relay) {
+    return RunRelay();
+  }
+  if (g_headless) {
+    return RunHeadless(frame_limit);
+  }
+
   InitializeGraphics();
   InitializeOpenGLStuff();
+  InitializeFrameConversion();
+  if (upload_bench_frames > 0 || decode_check) {
+    bool success = true;
+    if (decode_check) {
+      success = RunDecodeCheck();
+    }
+    if (upload_bench_frames > 0) {
+      RunUploadBench(upload_bench_frames);
+    }
+    free(g_draw_buffer);
+    glfwDestroyWindow(g_window);
+    glfwTerminate();
+    return success ? 0 : 1;
+  }
+  InitializeFrameSlots();
+  std::thread decode_thread;
+  if (g_cpu_decode) {
+    InitializeDecodeBuffers();
+    decode_thread = std::thread(DecodeTask);
+  }
+
+  std::thread network_thread(NetworkTask);
 
   //free(g_draw_buffer);
   //g_draw_buffer = (byte*)malloc(g_image_width * g_image_height * 4);
@@ -559,63 +2088,81 @@ int main() {
     *(ptr + 3) = 255;
     ptr += 4;
   }*/
-  g_draw_buffer_ptr = &g_draw_buffer;
 
   g_frame_count = 0;
   Chrono c;
+  double cpu_ms = 0.0;
+  double wall_ms = 0.0;
+  uint32_t stats_frames = 0;
+  uint32_t stats_uploads = 0;
+  LatencyStats latency_stats;
+  double last_latency_ms = NowMs();
   while (!glfwWindowShouldClose(g_window)) {
   	c.start();
+    const double cpu_start = ThreadCpuMs();
     glClear(GL_COLOR_BUFFER_BIT);
-	  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 
-	  	g_image_width, g_image_height, GL_RGBA, GL_UNSIGNED_BYTE, *g_draw_buffer_ptr);
+    FrameTiming timing;
+    const double upload_start_ms = NowMs();
+    const bool uploaded = g_cpu_decode ? UploadDecodedFrame(&timing) : UploadNewFrame(&timing);
+    const double upload_ms = NowMs() - upload_start_ms;
 
     glDrawArrays(GL_TRIANGLES, 0, 6);
 
+    cpu_ms += ThreadCpuMs() - cpu_start;
     c.stop();
+    wall_ms += c.timeAsMilliseconds();
     //printf("Frame time: %.2f ms\n", c.timeAsMilliseconds());
-
-    // Sync point
-    // Swap between drawing buffer and the received buffer by network.
-    // Only start to sync when the program is connected to the server, 
-    //  because otherwise the program could be hung.
-    if (g_can_sync_network == true && g_network_state != NetworkState::NotConnected) {
-      printf("Switching pointers (frame %u)\n", g_frame_count.load());
-      if (g_draw_buffer_ptr == &g_draw_buffer) {
-        g_draw_buffer_ptr = &g_recv_data_buffer;
-        g_recv_data_ptr   = &g_draw_buffer;
-      }
-      else {
-        g_draw_buffer_ptr = &g_draw_buffer;
-        g_recv_data_ptr   = &g_recv_data_buffer;
-      }
-
-      while (g_can_receive_data == true) {
-        // Spin lock
-        // Because there are no mutexes, g_can_receive_data
-        // can still be true in NetworkTask(),
-        // so wait here to be false and don't mess things up
-
-        // fuck, seems like this never happens
-      }
-
-      g_can_sync_network = false;
-      g_can_receive_data = true;
+    if (++stats_frames == 300) {
+      LOG_STATS("Render: %.3f ms CPU, %.3f ms wall per frame, %u uploads (%s)\n",
+        cpu_ms / stats_frames, wall_ms / stats_frames, g_upload_count - stats_uploads,
+        g_cpu_decode ? "cpu decode" : (g_use_upload_buffers ? "pixel buffers" : "client memory"));
+      cpu_ms = 0.0;
+      wall_ms = 0.0;
+      stats_frames = 0;
+      stats_uploads = g_upload_count;
     }
 
     ++g_frame_count;
 
     glfwSwapBuffers(g_window);
+    if (uploaded) {
+      const double present_ms = NowMs();
+      timing.set(LatencyStage::Upload, upload_ms);
+      g_upload_histogram.record((uint64_t)(upload_ms * 1.0e6));
+      TraceSpan("upload", timing.sequence, (uint64_t)(upload_start_ms * 1.0e6),
+        (uint64_t)((upload_start_ms + upload_ms) * 1.0e6));
+      TraceSpan("present", timing.sequence, (uint64_t)((upload_start_ms + upload_ms) * 1.0e6),
+        (uint64_t)(present_ms * 1.0e6));
+      timing.set(LatencyStage::Present, present_ms - upload_start_ms - upload_ms);
+      if (timing.capture_ms > 0.0) {
+        timing.set(LatencyStage::EndToEnd, present_ms - timing.capture_ms);
+      }
+      latency_stats.add(timing);
+    }
+    if (NowMs() - last_latency_ms >= kLatencyStatsIntervalMs) {
+      PrintLatencyPercentiles(&latency_stats);
+      g_metrics_report.print();
+      latency_stats.clear();
+      last_latency_ms = NowMs();
+    }
     glfwPollEvents();
   }
 
   // CLEANUP
+  // Wakes up the stages blocked on a queue
+  CloseDecodeQueues();
   network_thread.join();
+  if (decode_thread.joinable()) {
+    decode_thread.join();
+  }
+  DestroyDecodeBuffers();
+  DestroyFrameSlots();
 
   if (g_draw_buffer) {
     free(g_draw_buffer);
   }
-  if (g_recv_data_buffer) {
-    free(g_recv_data_buffer);
+  if (g_payload_buffer) {
+    free(g_payload_buffer);
   }
 
   glfwDestroyWindow(g_window);
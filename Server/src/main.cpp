@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cerrno>
@@ -5,7 +6,10 @@
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #ifdef __PLATFORM_LINUX__
@@ -20,75 +24,333 @@
 #include <unistd.h>
 // \v4l
 #endif
+#include <poll.h>
+#include <sys/timerfd.h>
 
+#include "bounded_queue.h"
 #include "chrono.h"
+#include "clock_sync.h"
+#include "io_engine.h"
+#include "log.h"
+#include "metrics.h"
+#include "metrics_http.h"
+#include "motion.h"
+#include "pixels.h"
+#include "poller.h"
+#include "protocol.h"
+#include "rate_control.h"
 #include "sockets.h"
+#include "trace.h"
+#include "triple_buffer.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
 typedef uint8_t byte;
 
-enum class ProcessingState {
-  NotProcessing = 0,
-  Processing
+// Part of the frame a viewer is interested in, in full resolution pixels
+struct Region {
+  uint32_t x = 0;
+  uint32_t y = 0;
+  uint32_t width = 0;           // 0 means the whole frame
+  uint32_t height = 0;
+  uint32_t scale = 0;           // downscaled by 2^scale
 };
 
-enum class NetworkState {
-  NoPeerConnected = 0,
-  PeerConnected,
-  Sending
+// Frame data handed to the viewers. Shared by every viewer sending the
+// same variant and kept alive until the last one is done with it, so the
+// capture buffers can be recycled as soon as the frame is published.
+typedef std::shared_ptr<std::vector<byte>> FrameData;
+
+// A frame waiting in, or going out through, a viewer's mailbox
+struct OutgoingFrame {
+  FrameHeader header;
+  FrameData payload;
+  double ready_ms = 0.0;        // when the network task got the frame
+  uint32_t source_size = 0;     // bytes of the captured frame it came from
+};
+
+// What the metrics endpoint knows about a viewer. Only NetworkTask()
+// claims and writes the slots, with relaxed stores; the endpoint reads them
+// from its own thread.
+struct ViewerStats {
+  std::atomic<bool> active;
+  std::atomic<uint32_t> id;
+  std::atomic<uint32_t> stream;
+  std::atomic<uint32_t> rate_step;
+  std::atomic<uint32_t> queued_bytes;     // socket send queue, after the last frame
+  std::atomic<uint32_t> mailbox_frames;   // on the wire plus waiting
+  std::atomic<uint64_t> frames_sent;
+  std::atomic<uint64_t> frames_skipped;
+  std::atomic<uint64_t> bytes_sent;
+  std::atomic<uint64_t> source_bytes;     // captured bytes the sent frames came from
+};
+
+struct Viewer {
+  Viewer(TCPSocket* socket);
+
+  TCPSocket* socket;
+  uint32_t id;                  // what its operations are tagged with
+  uint32_t stream;              // camera the viewer watches
+  PixelFormat format;           // what the viewer asked to receive
+  uint32_t layer;               // simulcast layer being sent
+  uint32_t requested_layer;     // switched to on the next keyframe
+  Region region;                // replaces the layer when it has a size
+  Region requested_region;
+  FrameData region_data;              // the region, ready to send
+  std::vector<byte> region_scaled[2]; // downscale steps of the region
+  RateController rate;          // lowers layer/frame rate on slow links
+  ViewerStats* stats;           // never null, see ClaimViewerStats()
+
+  // Mailbox, latest frame wins: the frame on the wire is always finished,
+  // but only the newest frame waits behind it. Older ones are skipped.
+  OutgoingFrame sending;
+  bool is_sending;
+  // The header of 'sending' as the engine sends it. On the heap, where it
+  // stays put while g_viewers moves the viewers around.
+  std::unique_ptr<FrameHeader> wire_header;
+  double send_start_ms;
+  OutgoingFrame pending;
+  bool has_pending;
+  // Answer to the viewer's last clock ping, goes out before the next frame
+  bool has_pong;
+  uint32_t pong_id;
+  uint64_t ping_received_us;
+
+  uint64_t frames_sent;
+  uint64_t frames_skipped;      // replaced in the mailbox before being sent
+  float frame_age_ms;           // age of the last frame when it started out
+  float max_frame_age_ms;       // since the last stats report
+  ControlMessage control;       // control message being received
+  uint32_t control_bytes_read;
+  bool receiving;               // its multishot receive is still armed
+  // Cancelled, removed once nothing of it is left in the engine
+  bool closing;
+};
+
+// A converted copy of the frame being sent
+struct FrameVariant {
+  FrameData data;
+  uint32_t sequence = 0;
+  bool valid = false;
 };
 
-// GLOBAL VARIABLES
 #ifndef __PLATFORM_LINUX__
 struct v4l2_buffer{};
 struct v4l2_format{struct fmt{struct pix{int sizeimage;}pix;}fmt;};
 #endif
-struct v4l2_buffer g_bufferinfo;
-struct v4l2_format g_format;
-int32_t g_fd = -1;
-uint32_t g_bytes_sent = 0;
-bool g_program_should_finish = false;
-std::atomic<bool> g_can_read_data_buffer;
-std::atomic<bool> g_can_send_data;
-std::atomic<bool> g_can_sync_processing;
-std::atomic<bool> g_can_process_data;
-std::atomic<bool> g_can_sync_network;
-std::atomic<bool> g_can_start_processing;
-std::atomic<bool> g_can_start_network;
 
-byte** g_read_ptr      = nullptr;
-byte** g_read_copy_ptr = nullptr;
-byte** g_process_ptr   = nullptr;
-byte** g_send_ptr      = nullptr;
+// A captured frame. Buffers come from the FramePool and go back to it
+// once nobody references them any more.
+struct CapturedFrame {
+  FrameData data;
+  uint32_t sequence = 0;
+  uint64_t capture_us = 0;        // MonotonicMicros() clock
+  uint32_t capture_delay_us = 0;  // capture to the copy being done
+};
 
-Chrono g_chrono;
-float elapsed_time = 0.0f;
+// One capture source, exposed to viewers as stream 'stream'. V4L2 devices
+// and synthetic sources look the same to the capture loop: a descriptor
+// that becomes readable when there is a frame (the device itself, or a
+// timerfd ticking at the synthetic frame rate).
+struct Camera {
+  Camera();
+
+  uint32_t stream;
+  std::string device;           // "synthetic" for test patterns
+  bool synthetic;
+  int32_t fd;
+  uint32_t width;
+  uint32_t height;
+  uint32_t fps;
+  uint32_t sequence;            // increases by one per captured frame
+  struct v4l2_buffer bufferinfo;
+  struct v4l2_format format;
+  std::vector<byte> capture_buffer;   // the driver writes here (USERPTR)
+
+  // Capture -> processing and capture -> network: the capture loop
+  // publishes every frame and never waits, the other side picks up the
+  // newest one when it gets to it
+  TripleBuffer<CapturedFrame> processing_frames;
+  TripleBuffer<CapturedFrame> network_frames;
+
+  // Only touched by ProcessingTask(): motion of the last processed frame
+  // against the previous one, for the inter-frame encoder and the analytics
+  FrameData previous_frame;
+  MotionField motion_field;
+
+  // Only touched by NetworkTask()
+  FrameVariant variants[kLayerCount][(uint32_t)PixelFormat::Count];
+
+  // For the metrics endpoint. Each has a single writer, the capture loop
+  // unless noted.
+  std::atomic<uint64_t> frames_captured;
+  std::atomic<uint64_t> frames_processed;         // ProcessingTask()
+  // Overwritten in the triple buffer before the other side took them
+  std::atomic<uint64_t> frames_dropped_processing;
+  std::atomic<uint64_t> frames_dropped_network;   // only while viewers are connected
+  // Frames the driver dropped (gaps in the V4L2 sequence) or timer ticks
+  // missed by a synthetic source
+  std::atomic<uint64_t> sequence_gaps;
+  uint32_t driver_sequence;
+  bool has_driver_sequence;
+};
 
-ProcessingState g_processing_state = ProcessingState::NotProcessing;
-NetworkState g_network_state = NetworkState::NoPeerConnected;
+// Capture buffers shared by every camera. Only the capture loop takes
+// buffers. Whichever thread lets go of a frame last hands its buffer back
+// through the free list, whose lock orders that thread's last reads of it
+// before the capture loop writes the next frame into it.
+class FramePool {
+public:
+  FramePool() : free_buffers(kMaxFreeBuffers) {
+  }
 
+  ~FramePool() {
+    free_buffers.close();
+    std::vector<byte>* buffer = nullptr;
+    while (free_buffers.tryPop(&buffer)) {
+      delete buffer;
+    }
+  }
+
+  FrameData acquire(uint32_t size) {
+    std::vector<byte>* buffer = nullptr;
+    if (!free_buffers.tryPop(&buffer)) {
+      buffer = new std::vector<byte>();
+      buffer_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    // Cameras of different sizes share buffers, which only ever grow
+    buffer->resize(size);
+
+    return FrameData(buffer, Recycle{ this });
+  }
+
+  // Readable from any thread
+  uint32_t size() const {
+    return buffer_count.load(std::memory_order_relaxed);
+  }
+
+private:
+  // More than this many free at once are given back to the system
+  static const uint32_t kMaxFreeBuffers = 16;
+
+  // The deleter of every FrameData acquire() hands out
+  struct Recycle {
+    FramePool* pool;
+
+    void operator()(std::vector<byte>* buffer) const {
+      pool->release(buffer);
+    }
+  };
+
+  void release(std::vector<byte>* buffer) {
+    if (!free_buffers.tryPush(buffer)) {
+      delete buffer;
+      buffer_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  BoundedQueue<std::vector<byte>*> free_buffers;
+  std::atomic<uint32_t> buffer_count{0};
+};
+
+// GLOBAL VARIABLES
+bool g_program_should_finish = false;
+
+// Set up by main() before any thread starts, never resized afterwards
+std::vector<Camera*> g_cameras;
+
+// Per stage timings, printed with the viewer stats
+Histogram g_capture_histogram("server.capture");
+Histogram g_process_histogram("server.process_image");
+Histogram g_motion_histogram("server.motion");
+Histogram g_convert_histogram("server.convert");
+Histogram g_send_histogram("server.send");
+Counter g_changed_pixels("server.changed_pixels");
+Counter g_frames_sent("server.frames_sent");
+Counter g_bytes_sent("server.bytes_sent");
+// Time spent waiting for something to do
+Counter g_capture_wait("server.capture_wait_ns");
+Counter g_processing_wait("server.processing_wait_ns");
+Counter g_network_idle("server.network_idle_ns");
+MetricsReport g_metrics_report;
+FramePool g_frame_pool;         // capture loop only
+
+// --socket-preset, for every viewer
+SocketOptions g_socket_options = SocketOptions::LowLatencyVideo();
+
+// Only touched by NetworkTask()
+std::vector<Viewer> g_viewers;
+// Where each viewer is in g_viewers, by id (what its operations are tagged
+// with), so a completion finds its viewer without a scan
+std::unordered_map<uint64_t, uint32_t> g_viewer_slots;
+// The listener, every viewer and g_network_wakeup, io_uring where the
+// kernel has it (and --epoll isn't given), epoll otherwise
+IoEngine* g_network_io = nullptr;
+bool g_allow_uring = true;
+// A camera published a frame in network_frames (or it's time to finish)
+PollerWakeup g_network_wakeup;
+uint32_t g_next_viewer_id = 0;
+// Viewers past kMaxViewerStats share the spare slot, which isn't exported
+static const uint32_t kMaxViewerStats = 32;
+ViewerStats g_viewer_stats[kMaxViewerStats];
+ViewerStats g_spare_viewer_stats;
+// Written by NetworkTask(), the capture loop only counts network drops
+// while somebody is watching
+std::atomic<uint32_t> g_viewer_count{0};
+
+MotionSearchParams g_motion_params;
 
 void InterruptSignalHandler(int32_t param) {
   g_program_should_finish = true;
+  // An eventfd write is safe in a signal handler
+  g_network_wakeup.notify();
+}
+
+Camera::Camera() {
+  stream = 0;
+  synthetic = false;
+  fd = -1;
+  width = 640;
+  height = 480;
+  fps = 30;
+  sequence = 0;
+  memset(&bufferinfo, 0, sizeof(bufferinfo));
+  memset(&format, 0, sizeof(format));
+  frames_captured = 0;
+  frames_processed = 0;
+  frames_dropped_processing = 0;
+  frames_dropped_network = 0;
+  sequence_gaps = 0;
+  driver_sequence = 0;
+  has_driver_sequence = false;
+}
+
+// For counters with a single writer: no read-modify-write needed, readers
+// on other threads just see the last store
+static void Increment(std::atomic<uint64_t>* counter, uint64_t amount = 1) {
+  counter->store(counter->load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
 }
 
-void InitializeVideoDevice(const char* device_path) {
+// Opens the device non-blocking: the capture loop only dequeues once
+// poll() says a frame is ready
+bool InitializeVideoDevice(Camera* camera) {
 #ifdef __PLATFORM_LINUX__
   Chrono c;
   c.start();
 
-  g_fd = -1;
+  const char* device_path = camera->device.c_str();
+  camera->fd = -1;
   errno = 0;
-  if ((g_fd = open(device_path, O_RDWR)) < 0) {
-    printf("open: %s\n", strerror(errno));
+  if ((camera->fd = open(device_path, O_RDWR | O_NONBLOCK)) < 0) {
+    printf("open %s: %s\n", device_path, strerror(errno));
+    return false;
   }
 
   struct v4l2_capability cap;
   memset(&cap, 0, sizeof(cap));
   errno = 0;
-  if (ioctl(g_fd, VIDIOC_QUERYCAP, &cap) < 0) {
+  if (ioctl(camera->fd, VIDIOC_QUERYCAP, &cap) < 0) {
     printf("VIDIOC_QUERYCAP: %s\n", strerror(errno));
   }
 
@@ -96,29 +358,32 @@ void InitializeVideoDevice(const char* device_path) {
     fprintf(stderr, "The device %s does not handle video capture\n", device_path);
   }
 
-  // struct v4l2_format format;
-  g_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  g_format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-  g_format.fmt.pix.width = 640;
-  g_format.fmt.pix.height = 480;
-  g_format.fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+  struct v4l2_format& format = camera->format;
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+  format.fmt.pix.width = camera->width;
+  format.fmt.pix.height = camera->height;
+  format.fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
 
   errno = 0;
-  if (ioctl(g_fd, VIDIOC_S_FMT, &g_format) < 0) {
+  if (ioctl(camera->fd, VIDIOC_S_FMT, &format) < 0) {
     printf("VIDIOC_S_FMT: %s\n", strerror(errno));
   }
+  // The driver may have picked another size
+  camera->width = format.fmt.pix.width;
+  camera->height = format.fmt.pix.height;
 
   struct v4l2_streamparm fps;
   memset(&fps, 0, sizeof(fps));
   fps.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   errno = 0;
-  if (ioctl(g_fd, VIDIOC_G_PARM, &fps) < 0) {
+  if (ioctl(camera->fd, VIDIOC_G_PARM, &fps) < 0) {
     printf("VIDIOC_G_PARM: %s\n", strerror(errno));
   }
   fps.parm.capture.timeperframe.numerator = 1;
-  fps.parm.capture.timeperframe.denominator = 30;
+  fps.parm.capture.timeperframe.denominator = camera->fps;
   errno = 0;
-  if (ioctl(g_fd, VIDIOC_S_PARM, &fps) < 0) {
+  if (ioctl(camera->fd, VIDIOC_S_PARM, &fps) < 0) {
     printf("VIDIOC_S_PARM: %s\n", strerror(errno));
   }
 
@@ -126,7 +391,7 @@ void InitializeVideoDevice(const char* device_path) {
   control.id = V4L2_CID_EXPOSURE_AUTO;
   control.value = V4L2_EXPOSURE_MANUAL;
   errno = 0;
-  if (ioctl(g_fd, VIDIOC_S_EXT_CTRLS, &control) < 0) {
+  if (ioctl(camera->fd, VIDIOC_S_EXT_CTRLS, &control) < 0) {
     printf("Set auto exposure: %s\n", strerror(errno));
   }
 
@@ -134,17 +399,10 @@ void InitializeVideoDevice(const char* device_path) {
   control.id = V4L2_CID_FOCUS_AUTO;
   control.value = false;
   errno = 0;
-  if (ioctl(g_fd, VIDIOC_S_EXT_CTRLS, &control) < 0) {
+  if (ioctl(camera->fd, VIDIOC_S_EXT_CTRLS, &control) < 0) {
     printf("Setting auto focus: %s\n", strerror(errno));
   }
 
-  // byte* buffer = (byte*)malloc(g_format.fmt.pix.sizeimage);
-  // //void* buffer = nullptr;
-  // //posix_memalign(&buffer, 16, g_format.fmt.pix.sizeimage);
-  // if (!buffer) {
-  //   printf("Error requesting memory: malloc()\n");
-  // }
-
   struct v4l2_requestbuffers bufferrequest;
   memset(&bufferrequest, 0, sizeof(bufferrequest));
   bufferrequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -152,88 +410,159 @@ void InitializeVideoDevice(const char* device_path) {
   bufferrequest.count = 1;
 
   errno = 0;
-  if (ioctl(g_fd, VIDIOC_REQBUFS, &bufferrequest) < 0) {
+  if (ioctl(camera->fd, VIDIOC_REQBUFS, &bufferrequest) < 0) {
     printf("VIDIOC_REQBUFS: %s\n", strerror(errno));
   }
 
-  // struct v4l2_buffer bufferinfo;
-  memset(&g_bufferinfo, 0, sizeof(g_bufferinfo));
-
-  g_bufferinfo.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  g_bufferinfo.memory = V4L2_MEMORY_USERPTR;
-  g_bufferinfo.index = 0;
-  g_bufferinfo.m.userptr = (unsigned long)(*g_read_ptr);
-  g_bufferinfo.length = g_format.fmt.pix.sizeimage;
+  camera->capture_buffer.resize(format.fmt.pix.sizeimage);
+  memset(&camera->bufferinfo, 0, sizeof(camera->bufferinfo));
+  camera->bufferinfo.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  camera->bufferinfo.memory = V4L2_MEMORY_USERPTR;
+  camera->bufferinfo.index = 0;
+  camera->bufferinfo.m.userptr = (unsigned long)camera->capture_buffer.data();
+  camera->bufferinfo.length = format.fmt.pix.sizeimage;
 
   c.stop();
-  printf("Time to init: %.2fms\n", c.timeAsMilliseconds());
+  printf("Time to init %s: %.2fms\n", device_path, c.timeAsMilliseconds());
+  return true;
+#else
+  return false;
 #endif
 }
 
-void EnableVideoStreaming() {
+bool EnableVideoStreaming(Camera* camera) {
 #ifdef __PLATFORM_LINUX__  
-  Chrono c;
-  c.start();
-
-  if (ioctl(g_fd, VIDIOC_QBUF, &g_bufferinfo) < 0) {
+  if (ioctl(camera->fd, VIDIOC_QBUF, &camera->bufferinfo) < 0) {
     printf("VIDIOC_QBUF: %s\n", strerror(errno));
-    close(g_fd);
-    return;
+    return false;
   }
-  c.stop();
-  printf("Time to queue buffer: %.2fms\n", c.timeAsMilliseconds());
 
-  c.start();
   // Activate streaming
-  int32_t type = g_bufferinfo.type;
+  int32_t type = camera->bufferinfo.type;
   errno = 0;
-  if(ioctl(g_fd, VIDIOC_STREAMON, &type) < 0){
+  if(ioctl(camera->fd, VIDIOC_STREAMON, &type) < 0){
     printf("VIDIOC_STREAMON: %s\n", strerror(errno));
-    close(g_fd);
-    exit(1);
+    return false;
   }
-  c.stop();
-  printf("Time to enable streaming: %.2fms\n", c.timeAsMilliseconds());
 #endif
+  return true;
 }
 
-void DisableVideoStreaming() {
+void DisableVideoStreaming(Camera* camera) {
 #ifdef __PLATFORM_LINUX__
-  int32_t type = g_bufferinfo.type;
+  int32_t type = camera->bufferinfo.type;
   errno = 0;
   // Deactivate streaming
-  if(ioctl(g_fd, VIDIOC_STREAMOFF, &type) < 0){
+  if(ioctl(camera->fd, VIDIOC_STREAMOFF, &type) < 0){
     printf("VIDIOC_STREAMOFF: %s\n", strerror(errno));
-    close(g_fd);
-    exit(1);
   }
 #endif
 }
 
-void GrabCameraFrame(byte** target_buffer) {
-#ifdef __PLATFORM_LINUX__
-  Chrono c;
+// Synthetic source: a timerfd at the source's frame rate stands in for
+// the device
+bool InitializeSyntheticSource(Camera* camera) {
+  camera->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (camera->fd < 0) {
+    printf("timerfd_create: %s\n", strerror(errno));
+    return false;
+  }
 
-  c.start();
+  struct itimerspec period;
+  memset(&period, 0, sizeof(period));
+  period.it_interval.tv_nsec = 1000000000L / camera->fps;
+  period.it_value = period.it_interval;
+  if (timerfd_settime(camera->fd, 0, &period, nullptr) < 0) {
+    printf("timerfd_settime: %s\n", strerror(errno));
+    return false;
+  }
 
-  g_bufferinfo.m.userptr = (unsigned long)(*target_buffer);
+  return true;
+}
 
+// Scrolling bars plus a box moving diagonally, so motion estimation and the
+// viewers have something to look at. The chroma tells the streams apart.
+static void GenerateSyntheticFrame(const Camera* camera, byte* yuyv) {
+  const uint32_t width = camera->width;
+  const uint32_t height = camera->height;
+  const uint32_t shift = camera->sequence * 4;
+  const byte u = (byte)(128 + 48 * ((camera->stream + 1) % 3) - 48);
+  const byte v = (byte)(128 + 48 * (camera->stream % 3) - 48);
+
+  byte* row = yuyv;
+  for (uint32_t x = 0; x < width; x += 2) {
+    row[x * 2 + 0] = (byte)(((x + shift) & 0x40) ? 200 : 60);
+    row[x * 2 + 1] = u;
+    row[x * 2 + 2] = (byte)(((x + 1 + shift) & 0x40) ? 200 : 60);
+    row[x * 2 + 3] = v;
+  }
+  for (uint32_t y = 1; y < height; ++y) {
+    memcpy(yuyv + y * width * 2, row, width * 2);
+  }
+
+  const uint32_t box = std::min(width, height) / 4 & ~1u;
+  const uint32_t box_x = (camera->sequence * 6) % (width - box) & ~1u;
+  const uint32_t box_y = (camera->sequence * 4) % (height - box);
+  for (uint32_t y = box_y; y < box_y + box; ++y) {
+    byte* p = yuyv + y * width * 2 + box_x * 2;
+    for (uint32_t x = 0; x < box * 2; x += 2) {
+      p[x] = 235;
+    }
+  }
+}
+
+// Called when the camera's descriptor is readable. Returns the new frame,
+// or nullptr if there wasn't one after all. 'capture_us' is when the frame
+// was taken: the driver's timestamp if it is on the monotonic clock, the
+// timer tick for synthetic sources.
+static FrameData CaptureFrame(Camera* camera, uint64_t* capture_us) {
+  *capture_us = MonotonicMicros();
+  if (camera->synthetic) {
+    uint64_t expirations = 0;
+    if (read(camera->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      return FrameData();
+    }
+    if (expirations > 1) {
+      Increment(&camera->sequence_gaps, expirations - 1);
+    }
+
+    FrameData frame = g_frame_pool.acquire(FrameSize(PixelFormat::YUYV, camera->width, camera->height));
+    TraceScope trace("generate", camera->sequence + 1);
+    GenerateSyntheticFrame(camera, frame->data());
+    return frame;
+  }
+
+#ifdef __PLATFORM_LINUX__
   errno = 0;
-  // The buffer's waiting in the outgoing queue.
-  if(ioctl(g_fd, VIDIOC_DQBUF, &g_bufferinfo) < 0){
-    printf("VIDIOC_DQBUF: %s\n", strerror(errno));
-    close(g_fd);
-    exit(1);
+  if (ioctl(camera->fd, VIDIOC_DQBUF, &camera->bufferinfo) < 0) {
+    if (errno != EAGAIN) {
+      LOG_ERROR("VIDIOC_DQBUF %s: %s\n", camera->device.c_str(), strerror(errno));
+    }
+    return FrameData();
+  }
+  if ((camera->bufferinfo.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+    *capture_us = (uint64_t)camera->bufferinfo.timestamp.tv_sec * 1000000 +
+      (uint64_t)camera->bufferinfo.timestamp.tv_usec;
+  }
+  if (camera->has_driver_sequence && camera->bufferinfo.sequence > camera->driver_sequence + 1) {
+    Increment(&camera->sequence_gaps, camera->bufferinfo.sequence - camera->driver_sequence - 1);
+  }
+  camera->driver_sequence = camera->bufferinfo.sequence;
+  camera->has_driver_sequence = true;
+
+  FrameData frame = g_frame_pool.acquire((uint32_t)camera->capture_buffer.size());
+  {
+    TraceScope trace("copy", camera->sequence + 1);
+    memcpy(frame->data(), camera->capture_buffer.data(), camera->capture_buffer.size());
   }
 
   errno = 0;
-  if (ioctl(g_fd, VIDIOC_QBUF, &g_bufferinfo) < 0) {
-    printf("VIDIOC_QBUF: %s\n", strerror(errno));
-    close(g_fd);
-    exit(1);
+  if (ioctl(camera->fd, VIDIOC_QBUF, &camera->bufferinfo) < 0) {
+    LOG_ERROR("VIDIOC_QBUF %s: %s\n", camera->device.c_str(), strerror(errno));
   }
-  c.stop();
-  //printf("Time to get frame: %.2fms\n", c.timeAsMilliseconds());
+  return frame;
+#else
+  return FrameData();
 #endif
 }
 
@@ -242,8 +571,7 @@ void ProcessImage(byte* src_image, unsigned int src_size,
   assert(src_size == dst_size && "src image size differs from dst image size");
   assert(offset < src_size && "offset out of bounds");
 
-  Chrono c;
-  c.start();
+  ScopedTimer timer(&g_process_histogram);
 
   unsigned int count = 0;
   byte* src_ptr = src_image;
@@ -253,158 +581,763 @@ void ProcessImage(byte* src_image, unsigned int src_size,
       ++count;
     }
   }
-  c.stop();
 
-  printf("Pixels that differ: %u\n", count);
-  printf("Time to process image: %.2fms\n", c.timeAsMilliseconds());
+  g_changed_pixels.add(count);
 }
 
+// One processing thread for every camera: each newest frame is compared
+// with the camera's previous one
 void ProcessingTask() {
-  byte r = 0;
-  byte g = 64;
-  byte b = 128;
-
+  MetricsRegisterThread();
+  TraceSetThreadName("processing");
   while (!g_program_should_finish) {
-    if (g_can_process_data == true) {
-
-      switch (g_processing_state) {
-        case ProcessingState::NotProcessing: {
-          g_processing_state = ProcessingState::Processing;
+    bool processed = false;
+    for (uint32_t i = 0; i < g_cameras.size(); ++i) {
+      Camera* camera = g_cameras[i];
+      if (!camera->processing_frames.update()) {
+        continue;
+      }
 
-          break;
-        }
-        case ProcessingState::Processing: {
-          // byte* ptr = *g_read_ptr;
-          // for (uint32_t i = 0; i < g_format.fmt.pix.sizeimage; i += 3) {
-          //   *(ptr + 0) = r;
-          //   *(ptr + 1) = g;
-          //   *(ptr + 2) = b;
-
-          //   ptr += 3;
-          // }
-          // r++; g++; b++;
-          // r %= 255; g %= 255; b %= 255;
-
-          ProcessImage(*g_read_copy_ptr, g_format.fmt.pix.sizeimage, 
-              *g_process_ptr, g_format.fmt.pix.sizeimage, nullptr, 0);
-
-          break;
+      const FrameData& frame = camera->processing_frames.readSlot().data;
+      const uint32_t sequence = camera->processing_frames.readSlot().sequence;
+      if (camera->previous_frame && camera->previous_frame->size() == frame->size()) {
+        {
+          TraceScope trace("process_image", sequence);
+          ProcessImage(frame->data(), (uint32_t)frame->size(),
+            camera->previous_frame->data(), (uint32_t)camera->previous_frame->size(), nullptr, 0);
         }
+
+        TraceScope trace("motion", sequence);
+        ScopedTimer timer(&g_motion_histogram);
+        EstimateMotion(frame->data(), camera->previous_frame->data(), camera->width, camera->height,
+          camera->width * 2, LumaLayout::YUYV, g_motion_params, &camera->motion_field);
       }
+      camera->previous_frame = frame;
+      Increment(&camera->frames_processed);
+      processed = true;
+    }
 
-      g_can_process_data = false;
-      g_can_sync_processing = true;
+    if (!processed) {
+      const uint64_t wait_start_ns = MonotonicNanos();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      g_processing_wait.add(MonotonicNanos() - wait_start_ns);
     }
   }
 }
 
 
-void NetworkTask() {
-  TCPListener listener(Socket::Type::Block, 128);
-  listener.bind(14194);
-  listener.listen();
+// [Viewers]
+Viewer::Viewer(TCPSocket* _socket) {
+  socket = _socket;
+  id = 0;
+  stream = 0;
+  format = PixelFormat::YUYV;
+  layer = 0;
+  requested_layer = 0;
+  stats = &g_spare_viewer_stats;
+  is_sending = false;
+  wire_header.reset(new FrameHeader());
+  send_start_ms = 0.0;
+  has_pending = false;
+  has_pong = false;
+  pong_id = 0;
+  ping_received_us = 0;
+  frames_sent = 0;
+  frames_skipped = 0;
+  frame_age_ms = 0.0f;
+  max_frame_age_ms = 0.0f;
+  memset(&control, 0, sizeof(control));
+  control_bytes_read = 0;
+  receiving = false;
+  closing = false;
+}
 
-  TCPSocket* socket = nullptr;
+// Cancels whatever the engine is doing for the viewer. It's removed once
+// the last of it has completed, see RemoveClosedViewers().
+static void CloseViewer(Viewer* viewer) {
+  if (!viewer->closing) {
+    viewer->closing = true;
+    g_network_io->cancel(*viewer->socket);
+  }
+}
 
-  g_can_send_data = true;
-  g_chrono.start();
+// Clamps the region to the frame and aligns it so that, after 'scale'
+// halvings, it is still whole YUYV macropixels and 4:2:0 chroma blocks.
+// Returns an empty region (whole frame) when nothing is left.
+static Region NormalizeRegion(const Camera* camera, uint32_t x, uint32_t y,
+  uint32_t width, uint32_t height, uint32_t scale) {
+  Region region;
+  if (scale >= kLayerCount) {
+    scale = kLayerCount - 1;
+  }
+  x &= ~1u;
+  y &= ~1u;
+  if (width == 0 || height == 0 || x >= camera->width || y >= camera->height) {
+    return region;
+  }
+
+  width = std::min(width, camera->width - x);
+  height = std::min(height, camera->height - y);
+  width -= width % (4u << scale);
+  height -= height % (2u << scale);
+  if (width == 0 || height == 0) {
+    return region;
+  }
 
-  byte r = 0;
-  byte g = 64;
-  byte b = 128;
+  region.x = x;
+  region.y = y;
+  region.width = width;
+  region.height = height;
+  region.scale = scale;
 
-  bool success = false;
-  while (!g_program_should_finish) {
-    //if (g_can_start_network == true) 
+  return region;
+}
+
+static void HandleViewerControl(Viewer* viewer, const ControlMessage& message) {
+  if (message.magic != kControlMagic) {
+    LOG_WARNING("Invalid control message from viewer, disconnecting it\n");
+    CloseViewer(viewer);
+    return;
+  }
+
+  switch ((ControlType)message.type) {
+    case ControlType::SetFormat: {
+      if (message.args[0] < (uint32_t)PixelFormat::Count) {
+        viewer->format = (PixelFormat)message.args[0];
+        LOG_INFO("Viewer switched to %s\n", PixelFormatName(viewer->format));
+      }
+
+      break;
+    }
+    case ControlType::SetLayer: {
+      if (message.args[0] < kLayerCount) {
+        viewer->requested_layer = message.args[0];
+      }
+
+      break;
+    }
+    case ControlType::SetRegion: {
+      viewer->requested_region = NormalizeRegion(g_cameras[viewer->stream], message.args[0], message.args[1],
+        message.args[2], message.args[3], message.args[4]);
+      if (viewer->requested_region.width > 0) {
+        LOG_INFO("Viewer region %ux%u at (%u, %u), 1/%u scale\n",
+          viewer->requested_region.width, viewer->requested_region.height,
+          viewer->requested_region.x, viewer->requested_region.y,
+          1u << viewer->requested_region.scale);
+      }
+
+      break;
+    }
+    case ControlType::Ping: {
+      // A newer ping replaces one we haven't answered yet
+      viewer->has_pong = true;
+      viewer->pong_id = message.args[0];
+      viewer->ping_received_us = MonotonicMicros();
+
+      break;
+    }
+    case ControlType::SetStream: {
+      if (message.args[0] < g_cameras.size()) {
+        viewer->stream = message.args[0];
+        viewer->stats->stream.store(viewer->stream, std::memory_order_relaxed);
+        viewer->region = Region();
+        viewer->requested_region = Region();
+        LOG_INFO("Viewer switched to stream %u (%s)\n", viewer->stream,
+          g_cameras[viewer->stream]->device.c_str());
+      }
+
+      break;
+    }
+    default: {
+      LOG_WARNING("Unknown control message %u\n", message.type);
+
+      break;
+    }
+  }
+}
+
+// Control messages may arrive split across receives; keep the partial one
+static void ReceiveViewerControl(Viewer* viewer, const byte* data, uint32_t size) {
+  while (size > 0 && !viewer->closing) {
+    const uint32_t taken = std::min(size, (uint32_t)sizeof(ControlMessage) - viewer->control_bytes_read);
+    memcpy((byte*)&viewer->control + viewer->control_bytes_read, data, taken);
+    data += taken;
+    size -= taken;
+
+    viewer->control_bytes_read += taken;
+    if (viewer->control_bytes_read == sizeof(ControlMessage)) {
+      viewer->control_bytes_read = 0;
+      HandleViewerControl(viewer, viewer->control);
+    }
+  }
+}
+
+// A free metrics slot for a new viewer, zeroed, or the spare one
+static ViewerStats* ClaimViewerStats(uint32_t id) {
+  for (uint32_t i = 0; i < kMaxViewerStats; ++i) {
+    ViewerStats* stats = &g_viewer_stats[i];
+    if (stats->active.load(std::memory_order_relaxed)) {
+      continue;
+    }
+
+    stats->id.store(id, std::memory_order_relaxed);
+    stats->stream.store(0, std::memory_order_relaxed);
+    stats->rate_step.store(0, std::memory_order_relaxed);
+    stats->queued_bytes.store(0, std::memory_order_relaxed);
+    stats->mailbox_frames.store(0, std::memory_order_relaxed);
+    stats->frames_sent.store(0, std::memory_order_relaxed);
+    stats->frames_skipped.store(0, std::memory_order_relaxed);
+    stats->bytes_sent.store(0, std::memory_order_relaxed);
+    stats->source_bytes.store(0, std::memory_order_relaxed);
+    stats->active.store(true, std::memory_order_release);
+    return stats;
+  }
+
+  return &g_spare_viewer_stats;
+}
+
+static void ReleaseViewerStats(ViewerStats* stats) {
+  stats->active.store(false, std::memory_order_release);
+}
+
+// 'descriptor' is a connection the listener's multishot accept got
+static void AcceptViewer(TCPListener* listener, int32_t descriptor) {
+  LOG_INFO("Peer connected!\n");
+  g_viewers.push_back(Viewer(listener->adopt(descriptor)));
+  Viewer& viewer = g_viewers.back();
+  viewer.id = g_next_viewer_id++;
+  viewer.stats = ClaimViewerStats(viewer.id);
+  g_viewer_slots[viewer.id] = (uint32_t)g_viewers.size() - 1;
+  // Control messages, and how a viewer that left is noticed
+  viewer.receiving = g_network_io->receiveMultishot(*viewer.socket, viewer.id);
+  if (!viewer.receiving) {
+    CloseViewer(&viewer);
+  }
+  g_viewer_count.store((uint32_t)g_viewers.size(), std::memory_order_relaxed);
+}
+
+static Viewer* FindViewer(uint64_t id) {
+  auto it = g_viewer_slots.find(id);
+  return it != g_viewer_slots.end() ? &g_viewers[it->second] : nullptr;
+}
+
+// Closed viewers the engine has no receive or send of left. The last
+// viewer takes the slot of a removed one.
+static void RemoveClosedViewers() {
+  for (uint32_t i = 0; i < g_viewers.size();) {
+    if (g_viewers[i].closing && !g_viewers[i].receiving && !g_viewers[i].is_sending) {
+      LOG_INFO("Peer disconnected\n");
+      ReleaseViewerStats(g_viewers[i].stats);
+      g_viewers[i].socket->close();
+      delete g_viewers[i].socket;
+      g_viewer_slots.erase(g_viewers[i].id);
+      if (i + 1 < g_viewers.size()) {
+        g_viewers[i] = std::move(g_viewers.back());
+        g_viewer_slots[g_viewers[i].id] = i;
+      }
+      g_viewers.pop_back();
+    }
+    else {
+      ++i;
+    }
+  }
+  g_viewer_count.store((uint32_t)g_viewers.size(), std::memory_order_relaxed);
+}
+// [\Viewers]
+
+// Storage for a new frame of 'size' bytes. Reuses the buffer in 'data'
+// unless some viewer is still sending the frame it holds.
+static void PrepareFrameData(FrameData* data, uint32_t size) {
+  if (!*data || data->use_count() > 1) {
+    data->reset(new std::vector<byte>(size));
+  }
+  else {
+    (*data)->resize(size);
+  }
+}
+
+// The frame being sent downscaled to 'layer', as YUYV. Layer 0 is read
+// straight from the capture buffer, nothing is made for it.
+static const byte* GetLayerYUYV(Camera* camera, uint32_t layer, uint32_t sequence,
+  const byte* send_buffer) {
+  if (layer == 0) {
+    return send_buffer;
+  }
+
+  const byte* src = GetLayerYUYV(camera, layer - 1, sequence, send_buffer);
+  const uint32_t src_width = camera->width >> (layer - 1);
+  const uint32_t src_height = camera->height >> (layer - 1);
+  const uint32_t width = camera->width >> layer;
+  const uint32_t height = camera->height >> layer;
+
+  FrameVariant& scaled = camera->variants[layer][(uint32_t)PixelFormat::YUYV];
+  if (!scaled.valid || scaled.sequence != sequence) {
+    PrepareFrameData(&scaled.data, FrameSize(PixelFormat::YUYV, width, height));
+    DownscaleYUYV2x(src, src_width * 2, src_width, src_height, scaled.data->data(), width * 2);
+    scaled.sequence = sequence;
+    scaled.valid = true;
+  }
+
+  return scaled.data->data();
+}
+
+// Returns the frame being sent, downscaled to 'layer' (0 is full resolution)
+// and converted to 'format'. Each layer/format pair is produced at most once
+// per frame and shared by all the viewers subscribed to it. Full resolution
+// YUYV is the captured frame itself, shared without a copy.
+static FrameData GetFrameVariant(Camera* camera, uint32_t layer, PixelFormat format,
+  uint32_t sequence, const FrameData& captured, uint32_t* width, uint32_t* height, uint32_t* size) {
+  *width = camera->width >> layer;
+  *height = camera->height >> layer;
+  *size = FrameSize(format, *width, *height);
+
+  if (layer == 0 && format == PixelFormat::YUYV) {
+    return captured;
+  }
+
+  const byte* yuyv = GetLayerYUYV(camera, layer, sequence, captured->data());
+
+  // Downscaled YUYV layers are already variants; this is a 4:2:0
+  // conversion
+  FrameVariant& variant = camera->variants[layer][(uint32_t)format];
+  if (!variant.valid || variant.sequence != sequence) {
+    PrepareFrameData(&variant.data, *size);
+    if (format == PixelFormat::I420) {
+      ConvertYUYVToI420(yuyv, *width * 2, *width, *height, variant.data->data());
+    }
+    else {
+      ConvertYUYVToNV12(yuyv, *width * 2, *width, *height, variant.data->data());
+    }
+    variant.sequence = sequence;
+    variant.valid = true;
+  }
+
+  return variant.data;
+}
+
+// Crops the viewer's region out of the frame being sent, downscales it and
+// converts it to the viewer's format. The crop is a view into the shared
+// frame, so only the region itself is ever read or copied.
+static FrameData GetRegionVariant(Viewer* viewer, const Camera* camera, const byte* send_buffer,
+  uint32_t* width, uint32_t* height, uint32_t* size) {
+  const Region& region = viewer->region;
+  YUYVView view = CropYUYVView(MakeYUYVView(send_buffer, camera->width, camera->height),
+    region.x, region.y, region.width, region.height);
+
+  *width = view.width >> region.scale;
+  *height = view.height >> region.scale;
+  *size = FrameSize(viewer->format, *width, *height);
+
+  for (uint32_t i = 0; i < region.scale; ++i) {
+    // The last step of a YUYV region goes straight to the viewer
+    byte* dst = nullptr;
+    if (i + 1 == region.scale && viewer->format == PixelFormat::YUYV) {
+      PrepareFrameData(&viewer->region_data, *size);
+      dst = viewer->region_data->data();
+    }
+    else {
+      std::vector<byte>& scaled = viewer->region_scaled[i & 1];
+      scaled.resize(FrameSize(PixelFormat::YUYV, view.width / 2, view.height / 2));
+      dst = &scaled[0];
+    }
+    DownscaleYUYV2x(view.data, view.stride, view.width, view.height, dst, view.width);
+    view = MakeYUYVView(dst, view.width / 2, view.height / 2);
+  }
+
+  if (viewer->format == PixelFormat::YUYV && region.scale > 0) {
+    return viewer->region_data;
+  }
+
+  PrepareFrameData(&viewer->region_data, *size);
+  byte* dst = viewer->region_data->data();
+  if (viewer->format == PixelFormat::YUYV) {
+    CopyYUYVView(view, dst);
+  }
+  else if (viewer->format == PixelFormat::I420) {
+    ConvertYUYVToI420(view.data, view.stride, view.width, view.height, dst);
+  }
+  else {
+    ConvertYUYVToNV12(view.data, view.stride, view.width, view.height, dst);
+  }
+
+  return viewer->region_data;
+}
+
+// Monotonic milliseconds for the rate controllers
+static double NowMs() {
+  return std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// [Mailbox]
+// Makes 'frame' the viewer's next frame. Whatever was still waiting is
+// older, so it is dropped; a frame already on the wire is left alone.
+static void PostFrame(Viewer* viewer, const OutgoingFrame& frame) {
+  if (viewer->has_pending) {
+    ++viewer->frames_skipped;
+    viewer->stats->frames_skipped.store(viewer->frames_skipped, std::memory_order_relaxed);
+  }
+  viewer->pending = frame;
+  viewer->has_pending = true;
+}
+
+// Converts the camera's new frame for every viewer of its stream that is
+// due one and posts it to their mailboxes. Nothing here waits for a socket.
+static void PublishFrame(Camera* camera, const CapturedFrame& captured) {
+  const double now_ms = NowMs();
+  const uint32_t sequence = captured.sequence;
+  const byte* send_buffer = captured.data->data();
+
+  for (uint32_t i = 0; i < g_viewers.size(); ++i) {
+    Viewer& viewer = g_viewers[i];
+    if (viewer.stream != camera->stream || viewer.closing) {
+      continue;
+    }
+
+    // The link can't take this frame rate
+    if (!viewer.rate.shouldSend(sequence)) {
+      continue;
+    }
+
+    // Raw frames are all keyframes, so layer and region switches happen on
+    // the next frame
+    viewer.layer = std::max(viewer.requested_layer, viewer.rate.currentStep().layer);
+    viewer.region = viewer.requested_region;
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t payload_size = 0;
+    uint32_t layer = viewer.layer;
+    OutgoingFrame frame;
     {
-      //g_can_start_network = false;
-
-      g_chrono.stop();
-      elapsed_time += g_chrono.timeAsMilliseconds();
-      //printf("elapsed_time: %.2f\n", elapsed_time);
-      //if (elapsed_time >= 330.3333f) {
-      if (elapsed_time >= 0.0f) {
-        //printf("Can send data\n");
-        elapsed_time = 0.0f;
-        g_can_send_data = true;
+      TraceScope trace("convert", sequence);
+      ScopedTimer timer(&g_convert_histogram);
+      if (viewer.region.width > 0) {
+        frame.payload = GetRegionVariant(&viewer, camera, send_buffer, &width, &height, &payload_size);
+        layer = viewer.region.scale;
       }
-      g_chrono.start();
+      else {
+        frame.payload = GetFrameVariant(camera, viewer.layer, viewer.format, sequence,
+          captured.data, &width, &height, &payload_size);
+      }
+    }
+    frame.header = MakeFrameHeader(sequence, viewer.format,
+      width, height, payload_size, layer, kFrameFlagKeyframe, camera->stream);
+    frame.header.capture_us = captured.capture_us;
+    frame.header.capture_delay_us = captured.capture_delay_us;
+    frame.ready_ms = now_ms;
+    frame.source_size = (uint32_t)captured.data->size();
+
+    PostFrame(&viewer, frame);
+    viewer.rate.markSent(sequence);
+  }
+}
 
-      switch (g_network_state) {
-        case NetworkState::NoPeerConnected: {
-          while (!socket && !g_program_should_finish) {
-            socket = listener.accept();
-          }
+static void UpdateMailboxStats(Viewer* viewer) {
+  viewer->stats->mailbox_frames.store((viewer->is_sending ? 1 : 0) + (viewer->has_pending ? 1 : 0),
+    std::memory_order_relaxed);
+}
 
-          printf("Peer connected!\n");
+// Hands the next thing in the viewer's mailbox to the engine, header and
+// payload as one send chain, unless the last one is still going out
+static void StartViewerSend(Viewer* viewer) {
+  if (viewer->is_sending || viewer->closing) {
+    return;
+  }
 
-          g_network_state = NetworkState::PeerConnected;
+  const uint64_t now_us = MonotonicMicros();
+  if (viewer->has_pong) {
+    // Clock answers go first, waiting behind a frame would only make the
+    // round trip longer
+    viewer->sending = OutgoingFrame();
+    viewer->sending.header = MakeClockHeader(viewer->pong_id);
+    viewer->sending.header.capture_us = now_us;
+    viewer->sending.header.process_us = (uint32_t)(now_us - viewer->ping_received_us);
+    viewer->has_pong = false;
+  }
+  else if (viewer->has_pending) {
+    viewer->sending = viewer->pending;
+    viewer->pending.payload.reset();
+    viewer->has_pending = false;
+    FrameHeader& header = viewer->sending.header;
+    const uint64_t ready_us = header.capture_us + header.capture_delay_us;
+    header.process_us = (uint32_t)(now_us > ready_us ? now_us - ready_us : 0);
+  }
+  else {
+    return;
+  }
+  viewer->send_start_ms = NowMs();
+  if (viewer->sending.payload) {
+    viewer->frame_age_ms = (float)(viewer->send_start_ms - viewer->sending.ready_ms);
+    viewer->max_frame_age_ms = std::max(viewer->max_frame_age_ms, viewer->frame_age_ms);
+  }
 
-          break;
-        }
+  *viewer->wire_header = viewer->sending.header;
+  struct iovec buffers[2];
+  uint32_t count = 1;
+  buffers[0].iov_base = viewer->wire_header.get();
+  buffers[0].iov_len = sizeof(FrameHeader);
+  if (viewer->wire_header->payload_size > 0) {
+    buffers[1].iov_base = viewer->sending.payload->data();
+    buffers[1].iov_len = viewer->wire_header->payload_size;
+    count = 2;
+  }
+  if (!g_network_io->sendChain(*viewer->socket, buffers, count, viewer->id)) {
+    LOG_ERROR("Couldn't queue a send for viewer %u\n", viewer->id);
+    viewer->sending.payload.reset();
+    CloseViewer(viewer);
+    return;
+  }
 
-        case NetworkState::PeerConnected: {
-          if (!socket->isConnected()) {
-            g_network_state = NetworkState::NoPeerConnected;
-          }
-          else if (g_can_send_data) {
-            //printf("Sending...\n");
-            g_network_state = NetworkState::Sending;
-          }
+  viewer->is_sending = true;
+  UpdateMailboxStats(viewer);
+}
 
-          break;
-        }
+// The engine is done with the viewer's send chain, 'result' bytes of it
+// went out (or -errno)
+static void FinishViewerSend(Viewer* viewer, int32_t result) {
+  const FrameHeader& header = *viewer->wire_header;
+  const uint32_t total_size = sizeof(header) + header.payload_size;
+  viewer->is_sending = false;
+  if (result != (int32_t)total_size) {
+    // Failed or cancelled, the connection is no good anymore
+    if (!viewer->closing) {
+      LOG_INFO("Send to viewer %u: %s\n", viewer->id, result < 0 ? strerror(-result) : "short send");
+    }
+    viewer->sending.payload.reset();
+    CloseViewer(viewer);
+    UpdateMailboxStats(viewer);
+    return;
+  }
+  if (header.flags & kFrameFlagClock) {
+    return;
+  }
+
+  const double now_ms = NowMs();
+  const float send_ms = (float)(now_ms - viewer->send_start_ms);
+  viewer->sending.payload.reset();
+  ++viewer->frames_sent;
+
+  const uint32_t rate_step = viewer->rate.step();
+  const uint32_t queued_bytes = viewer->socket->queuedBytes();
+  viewer->rate.onFrameSent(total_size, send_ms, queued_bytes, now_ms);
+
+  ViewerStats* stats = viewer->stats;
+  stats->frames_sent.store(viewer->frames_sent, std::memory_order_relaxed);
+  Increment(&stats->bytes_sent, total_size);
+  Increment(&stats->source_bytes, viewer->sending.source_size);
+  stats->queued_bytes.store(queued_bytes, std::memory_order_relaxed);
+  stats->rate_step.store(viewer->rate.step(), std::memory_order_relaxed);
+  if (viewer->rate.step() != rate_step) {
+    LOG_INFO("Viewer rate step %u -> %u (layer %u, 1/%u fps): %.0f KB/s, %.1fms queued\n",
+      rate_step, viewer->rate.step(), viewer->rate.currentStep().layer,
+      viewer->rate.currentStep().frame_divisor, viewer->rate.throughput() / 1024.0f,
+      viewer->rate.queueDelay());
+  }
+  UpdateMailboxStats(viewer);
+
+  g_send_histogram.record((uint64_t)(send_ms * 1.0e6));
+  TraceSpan("send", header.sequence, (uint64_t)(viewer->send_start_ms * 1.0e6), (uint64_t)(now_ms * 1.0e6));
+  g_frames_sent.add();
+  g_bytes_sent.add(total_size);
+}
+
+static void PrintViewerStats() {
+  for (uint32_t i = 0; i < g_viewers.size(); ++i) {
+    Viewer& viewer = g_viewers[i];
+    LOG_STATS("Viewer %u (stream %u): %llu frames sent, %llu skipped, frame age %.1fms (max %.1fms)\n", viewer.id,
+      viewer.stream, (unsigned long long)viewer.frames_sent, (unsigned long long)viewer.frames_skipped,
+      viewer.frame_age_ms, viewer.max_frame_age_ms);
+    viewer.max_frame_age_ms = 0.0f;
+  }
+}
+// [\Mailbox]
+
+static const double kViewerStatsIntervalMs = 5000.0;
+static const uint32_t kMaxNetworkCompletions = 64;
+// Completion tags that aren't viewer ids
+static const uint64_t kListenerTag = ~0ull;
+static const uint64_t kWakeupTag = ~0ull - 1;
+
+static void HandleNetworkCompletion(TCPListener* listener, const IoEngine::Completion& completion) {
+  switch (completion.op) {
+    case IoEngine::Op::Accept: {
+      if (completion.result >= 0) {
+        AcceptViewer(listener, completion.result);
+      }
+      else {
+        LOG_ERROR("Accept: %s\n", strerror(-completion.result));
+      }
+      if (!completion.more) {
+        g_network_io->acceptMultishot(*listener, kListenerTag);
+      }
+
+      break;
+    }
+    case IoEngine::Op::Receive: {
+      Viewer* viewer = FindViewer(completion.tag);
+      if (!viewer) {
+        break;
+      }
+      if (completion.result > 0) {
+        ReceiveViewerControl(viewer, completion.data, (uint32_t)completion.result);
+      }
+      // The viewer left (0), failed, or was cancelled
+      if (!completion.more) {
+        viewer->receiving = false;
+        CloseViewer(viewer);
+      }
+
+      break;
+    }
+    case IoEngine::Op::Send: {
+      Viewer* viewer = FindViewer(completion.tag);
+      if (viewer) {
+        FinishViewerSend(viewer, completion.result);
+      }
 
-        case NetworkState::Sending: {
-          // TODO: do this by combining rgb into a uint32_t and memsetting it
-          // byte* ptr = *g_send_ptr;
-          // for (uint32_t i = 0; i < g_format.fmt.pix.sizeimage; i += 3) {
-          //   *(ptr + 0) = r;
-          //   *(ptr + 1) = g;
-          //   *(ptr + 2) = b;
-
-          //   ptr += 3;
-          // }
-          // r++; g++; b++;
-          // r %= 255; g %= 255; b %= 255;
-
-          if (socket->isConnected() == false) {
-            g_network_state = NetworkState::NoPeerConnected;
-            break;
-          }
-
-          uint32_t bytes_sent = 0;
-          g_bytes_sent = 0;
-          if (g_can_send_data == true) {
-            Chrono send_chrono;
-            send_chrono.start();
-            while (g_bytes_sent < g_format.fmt.pix.sizeimage) {
-              bytes_sent = socket->sendData((*g_send_ptr) + g_bytes_sent, g_format.fmt.pix.sizeimage - g_bytes_sent);
-              
-              g_bytes_sent += bytes_sent;
-
-              if (g_program_should_finish == true) {
-                break;
-              }
-            }
-            send_chrono.stop();
-            
-            printf("Sent %u bytes in %.2fms\n", g_bytes_sent, send_chrono.timeAsMilliseconds());
-
-            // The order is important
-            g_can_send_data = false;
-            g_can_sync_network = true;
-          }
-          else {
-            printf("Can't send data\n");
-          }
-
-          break;
+      break;
+    }
+    default: {
+      // Wakeup: the cameras are looked at after every wait anyway
+      break;
+    }
+  }
+}
+
+void NetworkTask() {
+  MetricsRegisterThread();
+  TraceSetThreadName("network");
+  TCPListener listener(Socket::Type::NonBlock, 128, g_socket_options);
+  listener.bind(14194);
+  listener.listen();
+  g_network_io = IoEngine::Create(g_allow_uring);
+  LOG_INFO("Network I/O with %s\n", g_network_io->backendName());
+  g_network_io->acceptMultishot(listener, kListenerTag);
+  g_network_io->watch(&g_network_wakeup, kWakeupTag);
+
+  double last_stats_ms = NowMs();
+  IoEngine::Completion completions[kMaxNetworkCompletions];
+
+  while (!g_program_should_finish) {
+    // Until a socket is done with something or a camera has a frame.
+    // Nothing else to wake up for but the next stats report.
+    const uint64_t wait_start_ns = MonotonicNanos();
+    const double stats_in_ms = last_stats_ms + kViewerStatsIntervalMs - NowMs();
+    const uint32_t count = g_network_io->wait(completions, kMaxNetworkCompletions,
+      std::max(0, (int32_t)stats_in_ms + 1));
+    g_network_idle.add(MonotonicNanos() - wait_start_ns);
+    for (uint32_t i = 0; i < count; ++i) {
+      HandleNetworkCompletion(&listener, completions[i]);
+    }
+
+    if (NowMs() - last_stats_ms >= kViewerStatsIntervalMs) {
+      PrintViewerStats();
+      g_metrics_report.print();
+      last_stats_ms = NowMs();
+    }
+
+    // Each captured frame is published at most once, frames captured
+    // while a viewer's last one was still going out are skipped
+    if (!g_viewers.empty()) {
+      for (uint32_t i = 0; i < g_cameras.size(); ++i) {
+        Camera* camera = g_cameras[i];
+        if (camera->network_frames.update()) {
+          PublishFrame(camera, camera->network_frames.readSlot());
         }
-      } // switch
-    } // g_can_start_network == true
+      }
+    }
+    for (uint32_t i = 0; i < g_viewers.size(); ++i) {
+      StartViewerSend(&g_viewers[i]);
+    }
+    RemoveClosedViewers();
   }
+
+  // The engine goes first, nothing may be sending from the viewers'
+  // buffers once they are freed
+  for (uint32_t i = 0; i < g_viewers.size(); ++i) {
+    CloseViewer(&g_viewers[i]);
+  }
+  delete g_network_io;
+  g_network_io = nullptr;
+  for (uint32_t i = 0; i < g_viewers.size(); ++i) {
+    ReleaseViewerStats(g_viewers[i].stats);
+    g_viewers[i].socket->close();
+    delete g_viewers[i].socket;
+  }
+  g_viewers.clear();
+  g_viewer_slots.clear();
+  g_viewer_count = 0;
+}
+
+// [Metrics endpoint]
+// What the endpoint adds to the histograms and counters: per stream and
+// per viewer state. Runs on the endpoint's thread, reading atomics only.
+typedef uint64_t (*CameraValue)(const Camera* camera);
+typedef uint64_t (*ViewerValue)(const ViewerStats* stats);
+
+static void AppendCameraSamples(std::string* out, const char* name, const char* label, CameraValue value) {
+  char labels[96];
+  for (uint32_t i = 0; i < g_cameras.size(); ++i) {
+    const Camera* camera = g_cameras[i];
+    snprintf(labels, sizeof(labels), "stream=\"%u\"%s%s", camera->stream, label ? "," : "", label ? label : "");
+    AppendPrometheusSample(out, name, labels, (double)value(camera));
+  }
+}
+
+static void AppendViewerSamples(std::string* out, const char* name, const char* type, ViewerValue value) {
+  AppendPrometheusType(out, name, type);
+  char labels[64];
+  for (uint32_t i = 0; i < kMaxViewerStats; ++i) {
+    const ViewerStats* stats = &g_viewer_stats[i];
+    if (!stats->active.load(std::memory_order_acquire)) {
+      continue;
+    }
+
+    snprintf(labels, sizeof(labels), "viewer=\"%u\",stream=\"%u\"",
+      stats->id.load(std::memory_order_relaxed), stats->stream.load(std::memory_order_relaxed));
+    AppendPrometheusSample(out, name, labels, (double)value(stats));
+  }
+}
+
+static void AppendServerMetrics(std::string* out) {
+  AppendPrometheusType(out, "webcam_stream_frames_captured_total", "counter");
+  AppendCameraSamples(out, "webcam_stream_frames_captured_total", nullptr,
+    [](const Camera* c) -> uint64_t { return c->frames_captured.load(std::memory_order_relaxed); });
+  AppendPrometheusType(out, "webcam_stream_frames_processed_total", "counter");
+  AppendCameraSamples(out, "webcam_stream_frames_processed_total", nullptr,
+    [](const Camera* c) -> uint64_t { return c->frames_processed.load(std::memory_order_relaxed); });
+  AppendPrometheusType(out, "webcam_stream_frames_dropped_total", "counter");
+  AppendCameraSamples(out, "webcam_stream_frames_dropped_total", "stage=\"processing\"",
+    [](const Camera* c) -> uint64_t { return c->frames_dropped_processing.load(std::memory_order_relaxed); });
+  AppendCameraSamples(out, "webcam_stream_frames_dropped_total", "stage=\"network\"",
+    [](const Camera* c) -> uint64_t { return c->frames_dropped_network.load(std::memory_order_relaxed); });
+  AppendPrometheusType(out, "webcam_stream_sequence_gaps_total", "counter");
+  AppendCameraSamples(out, "webcam_stream_sequence_gaps_total", nullptr,
+    [](const Camera* c) -> uint64_t { return c->sequence_gaps.load(std::memory_order_relaxed); });
+
+  AppendPrometheusType(out, "webcam_viewers", "gauge");
+  AppendPrometheusSample(out, "webcam_viewers", nullptr, g_viewer_count.load(std::memory_order_relaxed));
+  AppendPrometheusType(out, "webcam_frame_pool_buffers", "gauge");
+  AppendPrometheusSample(out, "webcam_frame_pool_buffers", nullptr, g_frame_pool.size());
+
+  AppendViewerSamples(out, "webcam_viewer_frames_sent_total", "counter",
+    [](const ViewerStats* v) -> uint64_t { return v->frames_sent.load(std::memory_order_relaxed); });
+  AppendViewerSamples(out, "webcam_viewer_frames_skipped_total", "counter",
+    [](const ViewerStats* v) -> uint64_t { return v->frames_skipped.load(std::memory_order_relaxed); });
+  AppendViewerSamples(out, "webcam_viewer_bytes_sent_total", "counter",
+    [](const ViewerStats* v) -> uint64_t { return v->bytes_sent.load(std::memory_order_relaxed); });
+  // bytes_sent over this is the encode ratio
+  AppendViewerSamples(out, "webcam_viewer_source_bytes_total", "counter",
+    [](const ViewerStats* v) -> uint64_t { return v->source_bytes.load(std::memory_order_relaxed); });
+  AppendViewerSamples(out, "webcam_viewer_send_queue_bytes", "gauge",
+    [](const ViewerStats* v) -> uint64_t { return v->queued_bytes.load(std::memory_order_relaxed); });
+  AppendViewerSamples(out, "webcam_viewer_mailbox_frames", "gauge",
+    [](const ViewerStats* v) -> uint64_t { return v->mailbox_frames.load(std::memory_order_relaxed); });
+  AppendViewerSamples(out, "webcam_viewer_rate_step", "gauge",
+    [](const ViewerStats* v) -> uint64_t { return v->rate_step.load(std::memory_order_relaxed); });
 }
+// [\Metrics endpoint]
 
 // @PRE: yuyv_buffer and rgb_buffer must have been allocated
 static void YUYVtoRGB(byte* yuyv_buffer, byte* rgb_buffer) {
@@ -473,109 +1406,188 @@ static void SaveImage(const char* path, byte* buffer, uint32_t length) {
 	free(tmp_buffer);
 }
 
+// Source argument: a V4L2 device path, or synthetic[:WIDTHxHEIGHT[@FPS]]
+static bool ParseSource(const char* arg, Camera* camera) {
+  if (strncmp(arg, "synthetic", 9) != 0) {
+    camera->device = arg;
+    return true;
+  }
+
+  camera->device = "synthetic";
+  camera->synthetic = true;
+  if (arg[9] == ':' && sscanf(arg + 10, "%ux%u@%u", &camera->width, &camera->height, &camera->fps) < 2) {
+    return false;
+  }
+
+  // Every simulcast layer must still be whole YUYV macropixels
+  const uint32_t alignment = 2u << kLayerCount;
+  return camera->width > 0 && camera->width % alignment == 0 &&
+    camera->height >= (1u << kLayerCount) && camera->fps > 0 && camera->fps <= 1000;
+}
+
+static const double kCaptureStatsIntervalMs = 5000.0;
+
 int main(int argc, char** argv) {
+  // The capture loop runs here
+  MetricsRegisterThread();
   signal(SIGINT, InterruptSignalHandler);
+  // A viewer going away must not kill the server
+  signal(SIGPIPE, SIG_IGN);
   printf("Port translated: %hi\n", htons(14194));
-  g_can_sync_network = false;
-  g_can_sync_processing = false;
-  g_can_process_data = true;
-  g_can_send_data = true;
-  
-  #if defined(__PLATFORM_MACOSX__) || defined(__PLATFORM_WINDOWS__)
-  // No video streaming
-  #else
-  g_format.fmt.pix.sizeimage = 640 * 480 * 3;
-  #endif
-
-  byte* read_ptr      = nullptr;
-  byte* read_copy_ptr = nullptr;
-  byte* process_ptr   = nullptr;
-  byte* send_ptr      = nullptr;
-
-  byte* buffers[4] = {
-    (byte*)malloc(g_format.fmt.pix.sizeimage),
-    (byte*)malloc(g_format.fmt.pix.sizeimage),
-    (byte*)malloc(g_format.fmt.pix.sizeimage),
-    (byte*)malloc(g_format.fmt.pix.sizeimage)
-  };
-  for (uint32_t i = 0; i < 4; ++i) {
-    memset(buffers[i], 0, g_format.fmt.pix.sizeimage);
+
+  // Server [--metrics-port n] [--trace file] [--log-level level] [--epoll]
+  //        [--socket-preset default|low-latency|throughput] [source ...]:
+  // one stream per source, numbered in order. With a metrics port,
+  // GET /metrics there serves Prometheus text. --trace records per frame
+  // spans, see trace.h. The socket preset is for the viewer connections,
+  // see SocketOptions. --epoll keeps the network thread off io_uring.
+  uint32_t metrics_port = 0;
+  for (int32_t i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+      metrics_port = (uint32_t)atoi(argv[++i]);
+      continue;
+    }
+    if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+      LogLevel level = LogLevel::Info;
+      if (!ParseLogLevel(argv[++i], &level)) {
+        printf("Bad log level %s, use debug, info, warning, error or off\n", argv[i]);
+        return 1;
+      }
+      LogSetLevel(level);
+      continue;
+    }
+    if (strcmp(argv[i], "--socket-preset") == 0 && i + 1 < argc) {
+      if (!ParseSocketPreset(argv[++i], &g_socket_options)) {
+        printf("Bad socket preset %s, use default, low-latency or throughput\n", argv[i]);
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--epoll") == 0) {
+      g_allow_uring = false;
+      continue;
+    }
+    if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      TraceEnable("server", argv[++i]);
+      TraceSetThreadName("capture");
+      continue;
+    }
+
+    Camera* camera = new Camera();
+    camera->stream = (uint32_t)g_cameras.size();
+    if (!ParseSource(argv[i], camera)) {
+      printf("Bad source %s, use a device path or synthetic[:WIDTHxHEIGHT[@FPS]] "
+        "(width a multiple of %u)\n", argv[i], 2u << kLayerCount);
+      return 1;
+    }
+    g_cameras.push_back(camera);
+  }
+  if (g_cameras.empty()) {
+    g_cameras.push_back(new Camera());
+    g_cameras.back()->device = "/dev/video0";
   }
-  g_read_ptr      = &buffers[0];
-  g_read_copy_ptr = &buffers[1];
-  g_process_ptr   = &buffers[2];
-  g_send_ptr      = &buffers[3];
 
-  std::thread network_thread(NetworkTask);
-  std::thread process_image_thread(ProcessingTask);
+  std::vector<struct pollfd> poll_fds(g_cameras.size());
+  for (uint32_t i = 0; i < g_cameras.size(); ++i) {
+    Camera* camera = g_cameras[i];
+    const bool ready = camera->synthetic ? InitializeSyntheticSource(camera)
+      : (InitializeVideoDevice(camera) && EnableVideoStreaming(camera));
+    if (!ready) {
+      printf("Can't capture from %s\n", camera->device.c_str());
+      return 1;
+    }
+
+    printf("Stream %u: %s, %ux%u at %u fps\n", camera->stream, camera->device.c_str(),
+      camera->width, camera->height, camera->fps);
+    poll_fds[i].fd = camera->fd;
+    poll_fds[i].events = POLLIN;
+  }
 
-  const char* device = (argc > 1) ? argv[1] : "/dev/video0";
+  MetricsHttpServer metrics_server;
+  if (metrics_port != 0) {
+    metrics_server.start(metrics_port, AppendServerMetrics);
+  }
 
-  #if defined(__PLATFORM_MACOSX__) || defined(__PLATFORM_WINDOWS__)
-  // No video streaming
-  #else
-  InitializeVideoDevice(device);
-  EnableVideoStreaming();
-  #endif
+  std::thread network_thread(NetworkTask);
+  std::thread process_image_thread(ProcessingTask);
 
-  int r = 0;
   /* MAIN LOOP */
-  Chrono c;
-  uint32_t index = 0;
+  // Every camera in one loop: whichever has a frame ready gets served
+  std::vector<uint32_t> frames_captured(g_cameras.size(), 0);
+  double last_stats_ms = NowMs();
   while (g_program_should_finish == false) {
-    c.start();
-
-    memcpy(*g_read_copy_ptr, *g_read_ptr, g_format.fmt.pix.sizeimage);
-    g_can_start_processing = true;
-    g_can_read_data_buffer = true;
-    g_can_start_network = true;
-
-    GrabCameraFrame(g_read_ptr);
-
-    // sync point
-    if (g_can_sync_processing == true && g_can_sync_network == true) {
-      printf("Swapping buffers...\n");
-
-      g_read_ptr      = &buffers[(index) % 3];
-      g_read_copy_ptr = &buffers[(index + 1) % 3];
-      g_process_ptr   = &buffers[(index + 2) % 3];
-      g_send_ptr      = &buffers[(index + 3) % 3];
-      ++index;
-      if (index > 1000000) {
-        // to avoid overflows in long executions
-        index = 0;
+    errno = 0;
+    const uint64_t wait_start_ns = MonotonicNanos();
+    const int32_t ready = poll(poll_fds.data(), poll_fds.size(), 100);
+    g_capture_wait.add(MonotonicNanos() - wait_start_ns);
+    if (ready < 0 && errno != EINTR) {
+      LOG_ERROR("poll: %s\n", strerror(errno));
+      break;
+    }
+
+    for (uint32_t i = 0; i < g_cameras.size(); ++i) {
+      if ((poll_fds[i].revents & POLLIN) == 0) {
+        continue;
       }
 
-      g_can_sync_processing = false;
-      g_can_sync_network = false;
-      g_can_process_data = true;
-      g_can_send_data = true;
-    }
+      Camera* camera = g_cameras[i];
+      CapturedFrame frame;
+      frame.data = CaptureFrame(camera, &frame.capture_us);
+      if (!frame.data) {
+        continue;
+      }
+      const uint64_t ready_us = MonotonicMicros();
+      frame.capture_delay_us = (uint32_t)(ready_us > frame.capture_us ? ready_us - frame.capture_us : 0);
+      g_capture_histogram.record(frame.capture_delay_us * 1000ull);
+      frame.sequence = ++camera->sequence;
+      TraceSpan("capture", frame.sequence, frame.capture_us * 1000, ready_us * 1000);
+      ++frames_captured[i];
+      Increment(&camera->frames_captured);
+
+      // Processing and the network both get every frame, neither waits for
+      // the other. The slot handed back to us held a frame nobody took, let
+      // it go back to the pool now.
+      camera->processing_frames.writeSlot() = frame;
+      if (camera->processing_frames.publish()) {
+        Increment(&camera->frames_dropped_processing);
+      }
+      camera->processing_frames.writeSlot().data.reset();
 
-    // r++;
-    // if (r > 25) {
-    // 	printf("Saving image...\n");
-    // 	SaveImage(nullptr, *g_read_ptr, g_bufferinfo.length);
-    // 	r = -100000;
-    // }
+      camera->network_frames.writeSlot() = frame;
+      const bool watched = g_viewer_count.load(std::memory_order_relaxed) > 0;
+      if (camera->network_frames.publish() && watched) {
+        Increment(&camera->frames_dropped_network);
+      }
+      camera->network_frames.writeSlot().data.reset();
+      if (watched) {
+        g_network_wakeup.notify();
+      }
+    }
 
-    c.stop();
-    //printf("Frame time: %.2fms\n", c.timeAsMilliseconds());
+    if (NowMs() - last_stats_ms >= kCaptureStatsIntervalMs) {
+      const double seconds = (NowMs() - last_stats_ms) / 1000.0;
+      for (uint32_t i = 0; i < g_cameras.size(); ++i) {
+        LOG_STATS("Stream %u: %.1f fps captured\n", i, frames_captured[i] / seconds);
+        frames_captured[i] = 0;
+      }
+      LOG_INFO("Frame pool: %u buffers\n", g_frame_pool.size());
+      last_stats_ms = NowMs();
+    }
   }
   /* \MAIN LOOP */
-  
-  close(g_fd);
 
   network_thread.join();
   process_image_thread.join();
+  metrics_server.stop();
 
-  //free(buffer);
-
-  free(buffers[0]);
-  free(buffers[1]);
-  free(buffers[2]);
-  free(buffers[3]);
+  for (uint32_t i = 0; i < g_cameras.size(); ++i) {
+    if (!g_cameras[i]->synthetic) {
+      DisableVideoStreaming(g_cameras[i]);
+    }
+    close(g_cameras[i]->fd);
+    delete g_cameras[i];
+  }
+  g_cameras.clear();
 
   return 0;
 }
-
@@ -0,0 +1,96 @@
+#ifndef __BOUNDED_QUEUE_H__
+#define __BOUNDED_QUEUE_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+// FIFO between pipeline stages that holds at most 'capacity' items.
+// A full queue blocks the producer, which is how a slow stage slows down
+// the ones feeding it instead of piling up frames. close() wakes everybody
+// up for shutdown: push() fails from then on and pop() fails once the
+// queue is empty.
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(uint32_t _capacity) : capacity(_capacity), closed(false) {
+  }
+
+  // Blocks while the queue is full. Returns false if it was closed.
+  bool push(const T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+
+    items.push_back(item);
+    not_empty.notify_one();
+    return true;
+  }
+
+  // Never blocks: false if the queue is full or closed
+  bool tryPush(const T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (closed || items.size() >= capacity) {
+      return false;
+    }
+
+    items.push_back(item);
+    not_empty.notify_one();
+    return true;
+  }
+
+  // Blocks while the queue is empty. Returns false if it was closed.
+  bool pop(T* item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+
+    *item = items.front();
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  // Never blocks, for threads that have something else to do (rendering)
+  bool tryPop(T* item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (items.empty()) {
+      return false;
+    }
+
+    *item = items.front();
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::unique_lock<std::mutex> lock(mutex);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+  uint32_t size() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return (uint32_t)items.size();
+  }
+
+private:
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+  std::deque<T> items;
+  uint32_t capacity;
+  bool closed;
+};
+
+#endif // __BOUNDED_QUEUE_H__
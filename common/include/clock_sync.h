@@ -0,0 +1,59 @@
+#ifndef __CLOCK_SYNC_H__
+#define __CLOCK_SYNC_H__
+
+#include <chrono>
+#include <cstdint>
+
+// Microseconds on the monotonic clock. On Linux this is CLOCK_MONOTONIC,
+// the clock V4L2 stamps captured buffers with.
+inline uint64_t MonotonicMicros() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Offset between our monotonic clock and the server's, NTP style.
+// We send a ping at t1, the server gets it at t2 and answers at t3, the
+// answer is in at t4. Assuming both directions take as long:
+//   offset = ((t1 - t2) + (t4 - t3)) / 2    (ours minus theirs)
+// The answer carries t3 and t3 - t2. Queues make the two directions
+// asymmetric, which shows up as a longer round trip, so of the last few
+// samples the one with the shortest round trip is used.
+class ClockSync {
+public:
+  ClockSync();
+
+  // Forgets everything, for a new connection
+  void reset();
+
+  // Whether a ping should go out now. Pings are frequent until there are
+  // enough samples, then once a second.
+  bool pingDue(uint64_t now_us) const;
+  // A ping is going out at 'now_us'. Returns its id.
+  uint32_t startPing(uint64_t now_us);
+  // The answer to ping 'id' is in. Answers to anything but the last ping
+  // are ignored.
+  void onPong(uint32_t id, uint64_t remote_send_us, uint32_t remote_hold_us, uint64_t now_us);
+
+  bool synchronized() const;
+  int64_t offset() const;            // microseconds, ours minus theirs
+  uint32_t roundTrip() const;        // microseconds, of the sample in use
+  // A time on the server's clock, on ours
+  uint64_t toLocal(uint64_t remote_us) const;
+
+private:
+  static const uint32_t kSampleCount = 8;
+
+  struct Sample {
+    int64_t offset;
+    uint32_t round_trip;
+  };
+
+  Sample samples[kSampleCount];
+  uint32_t sample_count;       // total, only the last kSampleCount are kept
+  uint32_t best;               // index into 'samples'
+  uint32_t ping_id;
+  uint64_t ping_sent_us;
+  bool ping_pending;
+};
+
+#endif // __CLOCK_SYNC_H__
@@ -0,0 +1,107 @@
+#ifndef __IO_ENGINE_H__
+#define __IO_ENGINE_H__
+
+#include <cstdint>
+
+#include <sys/uio.h>
+
+#include "sockets.h"
+
+class PollerWakeup;
+
+// Completion based I/O for many sockets (and a few files) from one thread.
+// Instead of trying a send or a receive and finding out it would block,
+// the caller queues operations and wait() hands back what completed.
+//
+// Two backends behind the same interface:
+//  io_uring: operations go to the kernel in batches, one io_uring_enter()
+//    submits everything queued and reaps the completions. Accept and
+//    receive are multishot (one submission, a completion per connection
+//    or per chunk of data), received data lands in a ring of buffers the
+//    engine provides, the buffers of a send chain go out as linked sends,
+//    and registered buffers (the frame pool) are pinned once instead of
+//    on every operation.
+//  epoll: the fallback when the kernel has no io_uring (or it's turned
+//    off), and the only backend off Linux. Same operations, done with non
+//    blocking system calls when a Poller says the socket is ready (so
+//    poll() where there is no epoll).
+//
+// syscalls() counts the system calls the engine made, to compare both.
+class IoEngine {
+public:
+  enum class Backend {
+    IoUring = 0,
+    Epoll
+  };
+
+  enum class Op : uint8_t {
+    Accept = 0,
+    Receive,
+    Send,
+    Write,
+    Wakeup
+  };
+
+  struct Completion {
+    uint64_t tag;           // what the operation was queued with
+    Op op;
+    // Accept: the new descriptor, see TCPListener::adopt(). Receive: bytes
+    // in 'data', 0 when the peer closed. Send and Write: bytes written.
+    // Wakeup: 0. Negative: -errno, -ECANCELED after cancel().
+    int32_t result;
+    bool more;              // multishot operation still armed
+    const byte* data;       // Receive: valid until the next wait()
+  };
+
+  // io_uring if 'allow_uring' and the kernel has it, epoll otherwise.
+  // Owned by the caller.
+  static IoEngine* Create(bool allow_uring = true);
+  virtual ~IoEngine();
+
+  virtual Backend backend() const = 0;
+  const char* backendName() const;
+
+  // A completion for every connection the listener gets, until cancel()
+  virtual bool acceptMultishot(const TCPListener& listener, uint64_t tag) = 0;
+  // A completion for every chunk of data the socket gets, until the peer
+  // closes, an error, or cancel()
+  virtual bool receiveMultishot(const Socket& socket, uint64_t tag) = 0;
+  // Sends 'count' buffers in order, as if they were one. One completion
+  // when all of it is out (or on the first error). The buffers must stay
+  // untouched until then. At most one chain per socket at a time.
+  virtual bool sendChain(const Socket& socket, const struct iovec* buffers, uint32_t count, uint64_t tag) = 0;
+  // File write at 'offset'. 'data' must stay untouched until it completes.
+  virtual bool write(int32_t file, const byte* data, uint32_t size, uint64_t offset, uint64_t tag) = 0;
+  // A completion whenever 'wakeup' is notified (the engine clears it), so
+  // other threads can end a wait(). One per engine, for as long as it lives.
+  virtual bool watch(PollerWakeup* wakeup, uint64_t tag) = 0;
+  // Ends the operations of 'socket', before it's closed
+  virtual void cancel(const Socket& socket) = 0;
+  // Memory that is sent from or written from over and over (frame pool
+  // buffers). Once, before any operation is queued.
+  virtual bool registerBuffers(const struct iovec* buffers, uint32_t count) = 0;
+
+  // Submits what's queued and waits up to 'timeout_ms' (-1 for ever) for
+  // something to complete. Returns how many completions were written.
+  virtual uint32_t wait(Completion* completions, uint32_t max_completions, int32_t timeout_ms) = 0;
+
+  uint64_t syscalls() const {
+    return syscall_count;
+  }
+
+protected:
+  IoEngine();
+
+  static int32_t descriptorOf(const Socket& socket) {
+    return socket.getDescriptor();
+  }
+  static int32_t descriptorOf(const PollerWakeup& wakeup);
+
+  uint64_t syscall_count;
+
+private:
+  IoEngine(const IoEngine&) = delete;
+  IoEngine& operator=(const IoEngine&) = delete;
+};
+
+#endif // __IO_ENGINE_H__
@@ -0,0 +1,205 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "metrics.h"
+
+// Logging that keeps stdout off the frame paths.
+//
+// LOG_INFO("Viewer %u connected\n", id) checks the level, copies the
+// arguments (numbers as they are, strings into the record) into the
+// calling thread's own ring buffer and returns: no formatting, no locks,
+// no system calls. A background thread formats the records and writes
+// them, Debug and Info to stdout (stderr after LogAllToStderr()), Warning
+// and Error to stderr. If a ring
+// fills up, messages are dropped and the writer says how many.
+//
+// Every call site lets through kLogRateLimit messages a second; the rest
+// are counted and reported with the next message that gets through, so a
+// message on an EAGAIN path can't flood the output. LOG_STATS is Info
+// without the limit, for periodic reports printing many lines at once.
+//
+// Format strings are checked like printf's. Arguments can be integers,
+// floating point, C strings and pointers, at most kLogMaxArgs of them.
+
+enum class LogLevel : uint32_t {
+  Debug = 0,
+  Info,
+  Warning,
+  Error,
+  Off
+};
+
+static const uint32_t kLogMaxArgs = 8;
+static const uint32_t kLogRateLimit = 20;     // per call site and second
+
+extern std::atomic<uint32_t> g_log_level;
+
+inline bool LogEnabled(LogLevel level) {
+  return (uint32_t)level >= g_log_level.load(std::memory_order_relaxed);
+}
+
+void LogSetLevel(LogLevel level);
+// Debug and Info go to stderr too, for programs whose stdout is data (the
+// headless client's JSON)
+void LogAllToStderr();
+// "debug", "info", "warning", "error" or "off"
+bool ParseLogLevel(const char* name, LogLevel* level);
+// Waits until everything logged so far is written
+void LogFlush();
+
+// One per call site, made by the macros
+struct LogSite {
+  constexpr LogSite(LogLevel _level, uint32_t _rate_limit, const char* _format)
+    : level(_level), rate_limit(_rate_limit), format(_format), window_start_ns(0), window_count(0),
+      suppressed(0) {
+  }
+
+  const LogLevel level;
+  const uint32_t rate_limit;               // messages a second, 0 for no limit
+  const char* const format;
+  std::atomic<uint64_t> window_start_ns;   // rate limiting
+  std::atomic<uint32_t> window_count;
+  std::atomic<uint32_t> suppressed;
+};
+
+// [Log record]
+enum class LogArgType : uint8_t {
+  Signed = 0,
+  Unsigned,
+  Double,
+  String,       // 'value' is the offset of the copy in 'text'
+  Pointer
+};
+
+// Fixed size, so the rings are plain arrays
+struct LogRecord {
+  const LogSite* site;
+  uint64_t time_ns;
+  uint32_t suppressed;        // messages from this site dropped before it
+  uint32_t arg_count;
+  LogArgType types[kLogMaxArgs];
+  uint64_t values[kLogMaxArgs];
+  uint32_t text_size;
+  char text[152];             // the strings, each with its '\0'
+};
+
+inline void LogEncode(LogRecord* record, LogArgType type, uint64_t value) {
+  if (record->arg_count < kLogMaxArgs) {
+    record->types[record->arg_count] = type;
+    record->values[record->arg_count] = value;
+    ++record->arg_count;
+  }
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+LogEncodeArg(LogRecord* record, T value) {
+  if (std::is_signed<T>::value) {
+    LogEncode(record, LogArgType::Signed, (uint64_t)(int64_t)value);
+  }
+  else {
+    LogEncode(record, LogArgType::Unsigned, (uint64_t)value);
+  }
+}
+
+inline void LogEncodeArg(LogRecord* record, double value) {
+  uint64_t bits = 0;
+  memcpy(&bits, &value, sizeof(bits));
+  LogEncode(record, LogArgType::Double, bits);
+}
+
+// Copied, truncated if the record is out of room
+inline void LogEncodeArg(LogRecord* record, const char* value) {
+  if (!value) {
+    value = "(null)";
+  }
+
+  const uint32_t room = (uint32_t)sizeof(record->text) - record->text_size;
+  if (room == 0) {
+    LogEncode(record, LogArgType::String, sizeof(record->text) - 1);
+    return;
+  }
+
+  uint32_t length = (uint32_t)strnlen(value, room - 1);
+  memcpy(record->text + record->text_size, value, length);
+  record->text[record->text_size + length] = '\0';
+  LogEncode(record, LogArgType::String, record->text_size);
+  record->text_size += length + 1;
+}
+
+inline void LogEncodeArg(LogRecord* record, char* value) {
+  LogEncodeArg(record, (const char*)value);
+}
+
+inline void LogEncodeArg(LogRecord* record, const void* value) {
+  LogEncode(record, LogArgType::Pointer, (uint64_t)(uintptr_t)value);
+}
+
+inline void LogEncodeArgs(LogRecord* record) {
+  (void)record;
+}
+
+template <typename T, typename... Args>
+inline void LogEncodeArgs(LogRecord* record, const T& value, const Args&... args) {
+  LogEncodeArg(record, value);
+  LogEncodeArgs(record, args...);
+}
+// [\Log record]
+
+// Rate limiting. Returns false if the message must be dropped, otherwise
+// 'suppressed' is how many were since the last one that went through.
+bool LogAdmit(LogSite* site, uint64_t now_ns, uint32_t* suppressed);
+// A free record in the calling thread's ring, nullptr if it's full
+LogRecord* LogBeginRecord(uint64_t now_ns);
+void LogCommitRecord();
+
+template <typename... Args>
+void LogWrite(LogSite* site, const Args&... args) {
+  static_assert(sizeof...(Args) <= kLogMaxArgs, "too many log arguments");
+  const uint64_t now_ns = MonotonicNanos();
+  uint32_t suppressed = 0;
+  if (!LogAdmit(site, now_ns, &suppressed)) {
+    return;
+  }
+
+  LogRecord* record = LogBeginRecord(now_ns);
+  if (!record) {
+    return;
+  }
+
+  record->site = site;
+  record->suppressed = suppressed;
+  record->arg_count = 0;
+  record->text_size = 0;
+  LogEncodeArgs(record, args...);
+  LogCommitRecord();
+}
+
+// Never called, lets the compiler check the format against the arguments
+inline void LogCheckFormat(const char* format, ...) __attribute__((format(printf, 1, 2)));
+inline void LogCheckFormat(const char* format, ...) {
+  (void)format;
+}
+
+#define LOG_AT(level, rate_limit, format, ...) do { \
+    static LogSite log_site(level, rate_limit, format); \
+    if (LogEnabled(level)) { \
+      LogWrite(&log_site, ##__VA_ARGS__); \
+    } \
+    if (false) { \
+      LogCheckFormat(format, ##__VA_ARGS__); \
+    } \
+  } while (0)
+
+#define LOG_DEBUG(format, ...) LOG_AT(LogLevel::Debug, kLogRateLimit, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(LogLevel::Info, kLogRateLimit, format, ##__VA_ARGS__)
+#define LOG_WARNING(format, ...) LOG_AT(LogLevel::Warning, kLogRateLimit, format, ##__VA_ARGS__)
+#define LOG_ERROR(format, ...) LOG_AT(LogLevel::Error, kLogRateLimit, format, ##__VA_ARGS__)
+#define LOG_STATS(format, ...) LOG_AT(LogLevel::Info, 0, format, ##__VA_ARGS__)
+
+#endif // __LOG_H__
@@ -0,0 +1,162 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Latency histograms and counters cheap enough for the per-frame paths.
+//
+// Values are nanoseconds in log-linear buckets, HDR style: below 32 every
+// value has its own bucket, above that each power of two is split in 32,
+// so any value is known within about 3%. Up to 2^40 ns (18 minutes).
+//
+// Histogram and Counter are recorded from any number of threads. Every
+// thread writes its own shard with relaxed stores, no locks and no
+// read-modify-write, so recording never waits and never bounces cache lines
+// between cores. Whoever reports sums the shards with snapshot(), as often
+// as it likes.
+
+static const uint32_t kHistogramSubBucketBits = 5;
+static const uint32_t kHistogramMaxExponent = 40;
+static const uint32_t kHistogramBucketCount =
+  (kHistogramMaxExponent - kHistogramSubBucketBits + 1) << kHistogramSubBucketBits;
+// Histograms and counters a program can have, each
+static const uint32_t kMaxMetrics = 64;
+
+inline uint64_t MonotonicNanos() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Cheaper clock for short spans: the TSC on x86 (an rdtsc costs about half
+// a clock_gettime), MonotonicNanos() elsewhere. Only differences mean
+// something, TimerTicksToNanos() turns one into nanoseconds. Assumes a
+// constant rate TSC, which x86-64 CPUs have had for over a decade.
+inline uint64_t TimerTicks() {
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+  return __builtin_ia32_rdtsc();
+#else
+  return MonotonicNanos();
+#endif
+}
+uint64_t TimerTicksToNanos(uint64_t ticks);
+
+// Plain histogram, one thread at a time. Also what snapshots come in.
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+
+  void record(uint64_t nanoseconds);
+  void clear();
+  // Adds 'other' to this one / takes it away (other must be older)
+  void merge(const LatencyHistogram& other);
+  void subtract(const LatencyHistogram& other);
+
+  uint64_t count() const;
+  uint64_t sum() const;                      // nanoseconds
+  uint64_t countBelow(uint64_t nanoseconds) const;
+  double mean() const;                       // nanoseconds
+  // Value at 'fraction' (0.5 is the median) of the samples, from the
+  // middle of its bucket. 0 without samples.
+  uint64_t percentile(double fraction) const;
+  uint64_t max() const;                      // top of the highest bucket
+
+  static uint32_t BucketIndex(uint64_t nanoseconds);
+  static uint64_t BucketValue(uint32_t index);   // middle of the bucket
+  static uint64_t BucketTop(uint32_t index);     // largest value in it
+
+private:
+  friend class Histogram;     // snapshots are summed into the buckets
+
+  std::vector<uint64_t> buckets;
+  uint64_t total_count;
+  uint64_t total_sum;
+};
+
+class Histogram {
+public:
+  // 'name' must outlive the histogram, string literals are the idea
+  explicit Histogram(const char* name);
+
+  void record(uint64_t nanoseconds);
+  // A TimerTicks() difference
+  void recordTicks(uint64_t ticks);
+  // Everything recorded so far, by every thread
+  LatencyHistogram snapshot() const;
+  const char* name() const;
+
+private:
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  uint32_t id;
+  const char* histogram_name;
+};
+
+class Counter {
+public:
+  explicit Counter(const char* name);
+
+  void add(uint64_t value = 1);
+  uint64_t value() const;
+  const char* name() const;
+
+private:
+  Counter(const Counter&) = delete;
+  Counter& operator=(const Counter&) = delete;
+
+  uint32_t id;
+  const char* counter_name;
+};
+
+// Makes the calling thread's shards up front, for every histogram there
+// is and any made later, so its first record() neither allocates nor
+// locks. Call it first thing in every thread that records; threads that
+// don't still work, their shards are made on first use.
+void MetricsRegisterThread();
+
+// Records the time until the end of the scope
+class ScopedTimer {
+public:
+  explicit ScopedTimer(Histogram* _histogram) : histogram(_histogram), start(TimerTicks()) {
+  }
+  ~ScopedTimer() {
+    histogram->recordTicks(TimerTicks() - start);
+  }
+
+private:
+  Histogram* histogram;
+  uint64_t start;               // TimerTicks()
+};
+
+// Prints every histogram and counter that changed since the last print(),
+// one line each: count, mean and percentiles for histograms, total and
+// rate for counters. Call it from one thread.
+class MetricsReport {
+public:
+  MetricsReport();
+
+  void print();
+
+private:
+  std::vector<LatencyHistogram> last_histograms;
+  std::vector<uint64_t> last_counters;
+  uint64_t last_print_ns;
+};
+
+// [Prometheus]
+// Text exposition format. Names get a "webcam_" prefix and dots become
+// underscores. Histograms are in seconds, with power of two buckets from
+// ~1us to ~17s. Counters end in _total; those named *_ns are durations
+// and come out as *_seconds_total.
+void AppendPrometheusMetrics(std::string* out);
+// For metrics kept elsewhere: the # TYPE line, then one line per sample.
+// 'labels' is the inside of the braces (name="value",...) or nullptr.
+void AppendPrometheusType(std::string* out, const char* name, const char* type);
+void AppendPrometheusSample(std::string* out, const char* name, const char* labels, double value);
+// [\Prometheus]
+
+#endif // __METRICS_H__
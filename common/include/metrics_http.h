@@ -0,0 +1,45 @@
+#ifndef __METRICS_HTTP_H__
+#define __METRICS_HTTP_H__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "poller.h"
+#include "sockets.h"
+
+// Minimal HTTP server for Prometheus scrapes: GET /metrics answers with
+// every Histogram and Counter in text format, plus whatever 'extra' adds.
+// It has its own thread and its own port and only reads what the frame
+// paths publish (shards and atomics), so a scrape never holds them up.
+// The thread sleeps in a Poller until a connection or stop() comes. One
+// request per connection, the connection is closed after the answer.
+class MetricsHttpServer {
+public:
+  // Appends program specific metrics, see AppendPrometheusSample()
+  typedef std::function<void(std::string* out)> ExtraMetrics;
+
+  MetricsHttpServer();
+  ~MetricsHttpServer();
+
+  bool start(uint32_t port, ExtraMetrics extra);
+  void stop();
+
+private:
+  MetricsHttpServer(const MetricsHttpServer&) = delete;
+  MetricsHttpServer& operator=(const MetricsHttpServer&) = delete;
+
+  void serve();
+  void answer(TCPSocket* socket);
+
+  TCPListener listener;
+  Poller poller;
+  PollerWakeup wakeup;        // stop()
+  ExtraMetrics extra_metrics;
+  std::thread thread;
+  std::atomic<bool> should_finish;
+};
+
+#endif // __METRICS_HTTP_H__
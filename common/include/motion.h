@@ -0,0 +1,67 @@
+#ifndef __MOTION_H__
+#define __MOTION_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "simd.h"
+
+typedef unsigned char byte;
+
+// Block matching motion estimation on 16x16 luma blocks.
+// The estimator works directly on the frames we already have in memory:
+// packed YUYV (luma in the even bytes) or a planar 8 bit luma plane.
+
+enum class LumaLayout {
+  YUYV = 0,
+  Planar
+};
+
+struct MotionVector {
+  int16_t dx;
+  int16_t dy;
+  uint32_t sad;       // SAD of the block displaced by (dx, dy)
+  uint32_t zero_sad;  // SAD of the co-located block, for comparison
+};
+
+struct MotionField {
+  MotionField();
+  ~MotionField();
+
+  void resize(uint32_t image_width, uint32_t image_height);
+  MotionVector& at(uint32_t block_x, uint32_t block_y);
+  const MotionVector& at(uint32_t block_x, uint32_t block_y) const;
+
+  std::vector<MotionVector> vectors;  // row major, blocks_x * blocks_y
+  uint32_t blocks_x;
+  uint32_t blocks_y;
+  uint64_t total_sad;
+  uint64_t total_zero_sad;
+  uint32_t candidates_tested;
+};
+
+struct MotionSearchParams {
+  MotionSearchParams();
+
+  int32_t search_range;     // max displacement in pixels in each axis
+  bool use_predictors;      // also try the left and top neighbour vectors
+};
+
+static const uint32_t kMotionBlockSize = 16;
+
+// Fills 'field' with one vector per 16x16 block of 'current', searched in
+// 'reference' with a large/small diamond pattern. 'stride' is in bytes.
+// Blocks that don't fit entirely in the image are not estimated.
+void EstimateMotion(const byte* current, const byte* reference,
+  uint32_t width, uint32_t height, uint32_t stride, LumaLayout layout,
+  const MotionSearchParams& params, MotionField* field);
+
+// SAD of a single 16x16 luma block with the active kernel
+uint32_t BlockSAD16x16(const byte* a, const byte* b, uint32_t stride, LumaLayout layout);
+
+// Forces the SAD kernel used by the estimator. Returns false (and keeps
+// the current one) when the machine can't run the requested level.
+bool SetMotionKernel(SimdLevel level);
+SimdLevel GetMotionKernel();
+
+#endif // __MOTION_H__
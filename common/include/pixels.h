@@ -0,0 +1,89 @@
+#ifndef __PIXELS_H__
+#define __PIXELS_H__
+
+#include <cstdint>
+
+#include "simd.h"
+
+typedef unsigned char byte;
+
+// Pixel formats we can put on the wire.
+//  YUYV: packed 4:2:2, what the camera gives us (2 bytes/pixel)
+//  I420: planar 4:2:0, Y plane then U plane then V plane (1.5 bytes/pixel)
+//  NV12: planar 4:2:0, Y plane then interleaved UV plane (1.5 bytes/pixel)
+enum class PixelFormat : uint8_t {
+  YUYV = 0,
+  I420,
+  NV12,
+  Count
+};
+
+const char* PixelFormatName(PixelFormat format);
+bool ParsePixelFormat(const char* name, PixelFormat* format);
+
+// YUV to RGB matrices, full range like the camera output we get.
+// BT.601 is what SD sources and most webcams use, BT.709 is HD.
+enum class ColorMatrix : uint8_t {
+  BT601 = 0,
+  BT709,
+  Count
+};
+
+const char* ColorMatrixName(ColorMatrix matrix);
+bool ParseColorMatrix(const char* name, ColorMatrix* matrix);
+// Coefficients in 10 bit fixed point: Cr->R, Cb->G, Cr->G, Cb->B.
+// R = Y + (c[0] * Cr >> 10), G = Y - (c[1] * Cb + c[2] * Cr >> 10),
+// B = Y + (c[3] * Cb >> 10), with Cb and Cr centered on 0.
+void GetColorMatrixCoefficients(ColorMatrix matrix, int32_t coefficients[4]);
+
+// Bytes needed by a tightly packed width x height image
+uint32_t FrameSize(PixelFormat format, uint32_t width, uint32_t height);
+
+// Non-owning window into a packed YUYV image. Rows are 'stride' bytes
+// apart, so a crop is just a different origin and size: every kernel
+// below that takes a stride can read it in place.
+struct YUYVView {
+  const byte* data;
+  uint32_t stride;
+  uint32_t width;
+  uint32_t height;
+};
+
+YUYVView MakeYUYVView(const byte* data, uint32_t width, uint32_t height);
+// Clamps the rectangle to the view. x is rounded down to an even pixel so
+// the view starts on a whole Y0 U Y1 V macropixel.
+YUYVView CropYUYVView(const YUYVView& view, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+// Packs the view tightly into 'dst' (width * height * 2 bytes)
+void CopyYUYVView(const YUYVView& view, byte* dst);
+
+// Packed YUYV (rows 'stride' bytes apart) to tightly packed 4:2:0.
+// Chroma of each pair of rows is averaged vertically. Width must be even.
+void ConvertYUYVToI420(const byte* yuyv, uint32_t stride, uint32_t width, uint32_t height, byte* i420);
+void ConvertYUYVToNV12(const byte* yuyv, uint32_t stride, uint32_t width, uint32_t height, byte* nv12);
+
+// 2x2 box downscale to (width / 2) x (height / 2), rows 'dst_stride'
+// bytes apart. The YUYV version needs a width multiple of 4 and keeps the
+// 4:2:2 layout; the plane version works on any 8 bit plane (Y, U or V).
+void DownscaleYUYV2x(const byte* src, uint32_t src_stride, uint32_t width, uint32_t height,
+  byte* dst, uint32_t dst_stride);
+void DownscalePlane2x(const byte* src, uint32_t src_stride, uint32_t width, uint32_t height,
+  byte* dst, uint32_t dst_stride);
+// Tightly packed I420 to tightly packed I420 at half the size
+void DownscaleI4202x(const byte* src, uint32_t width, uint32_t height, byte* dst);
+
+// Tightly packed 'format' to RGBA (alpha = 255). Chroma is not
+// interpolated: every pixel takes the sample of its 2x1 or 2x2 block.
+void ConvertToRGBA(PixelFormat format, const byte* src, uint32_t width, uint32_t height, byte* rgba,
+  ColorMatrix matrix = ColorMatrix::BT601);
+// Only rows [first_row, first_row + row_count) of the same conversion;
+// 'src' and 'rgba' are still the whole frames. Disjoint row ranges can be
+// converted from different threads.
+void ConvertRowsToRGBA(PixelFormat format, const byte* src, uint32_t width, uint32_t height,
+  uint32_t first_row, uint32_t row_count, byte* rgba, ColorMatrix matrix = ColorMatrix::BT601);
+
+// Forces the instruction set of the conversion kernels. Returns false (and
+// keeps the current one) when the machine can't run the requested level.
+bool SetPixelKernel(SimdLevel level);
+SimdLevel GetPixelKernel();
+
+#endif // __PIXELS_H__
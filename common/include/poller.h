@@ -0,0 +1,103 @@
+#ifndef __POLLER_H__
+#define __POLLER_H__
+
+#include <cstdint>
+#include <vector>
+
+#ifndef __linux__
+#include <poll.h>
+#endif
+
+#include "sockets.h"
+
+// Readiness of many sockets at once, with epoll: one wait() for all of
+// them instead of a poll per socket, so one thread can serve thousands.
+// Level triggered: a socket stays ready until it's drained, so a caller
+// may read some of what's there and come back for the rest later.
+// Where there is no epoll (macOS) it's poll() over everything added,
+// same behaviour, just linear in the number of sockets.
+class PollerWakeup;
+
+class Poller {
+public:
+  // Poller::add() and modify() events, and Event::events
+  static const uint32_t kReadable = 1 << 0;
+  static const uint32_t kWritable = 1 << 1;
+  // Always reported: the peer closed or reset the connection, or the
+  // socket has an error pending
+  static const uint32_t kClosed = 1 << 2;
+
+  struct Event {
+    void* user;             // what the socket was added with
+    uint32_t events;        // kReadable | kWritable | kClosed
+  };
+
+  Poller();
+  ~Poller();
+
+  bool isValid() const;
+
+  // 'events' can be 0, to keep the socket in but stop hearing about it.
+  // A socket that fails or hangs up can still come back once with kClosed.
+  bool add(const Socket& socket, uint32_t events, void* user);
+  bool modify(const Socket& socket, uint32_t events, void* user);
+  bool remove(const Socket& socket);
+  // Readable (kReadable) whenever the wakeup is notified
+  bool add(const PollerWakeup& wakeup, void* user);
+
+  // Waits up to 'timeout_ms' (-1 for ever) for sockets to be ready.
+  // Returns how many events were written to 'events'.
+  uint32_t wait(Event* events, uint32_t max_events, int32_t timeout_ms);
+
+private:
+  Poller(const Poller&) = delete;
+  Poller& operator=(const Poller&) = delete;
+
+#ifdef __linux__
+  int32_t descriptor;       // epoll
+#else
+  struct Entry {
+    int32_t descriptor;
+    uint32_t events;
+    void* user;
+    bool closed_reported;   // with 'events' 0, kClosed comes once
+  };
+
+  bool add(int32_t descriptor, uint32_t events, void* user);
+
+  std::vector<Entry> entries;
+  std::vector<struct pollfd> ready;   // handed to poll(), reused
+  std::vector<uint32_t> polled;       // the entry of each 'ready' one
+#endif
+};
+
+// Wakes a Poller::wait() up from another thread, for work that doesn't
+// come through a socket (frames handed over in a triple buffer). An
+// eventfd (a pipe where there is none): readable from notify() until the
+// waiting thread clear()s it.
+class PollerWakeup {
+public:
+  PollerWakeup();
+  ~PollerWakeup();
+
+  bool isValid() const;
+
+  // Any thread, never blocks
+  void notify();
+  // The waiting thread, before it looks for the work
+  void clear();
+
+private:
+  friend class Poller;
+  friend class IoEngine;
+
+  PollerWakeup(const PollerWakeup&) = delete;
+  PollerWakeup& operator=(const PollerWakeup&) = delete;
+
+  int32_t descriptor;       // what's polled
+#ifndef __linux__
+  int32_t write_descriptor; // the pipe's other end
+#endif
+};
+
+#endif // __POLLER_H__
@@ -0,0 +1,107 @@
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <cstdint>
+#include <cstring>
+
+#include "pixels.h"
+
+// Wire protocol between the server and its viewers.
+// All fields travel in host order; every machine we run on is little endian.
+//
+//  server -> viewer: FrameHeader followed by 'payload_size' bytes of image
+//  viewer -> server: fixed size ControlMessage, at any time
+//
+// Times are microseconds on the server's monotonic clock. Viewers learn
+// the offset to their own clock by sending ControlType::Ping; the answer
+// is a FrameHeader with kFrameFlagClock set and no payload.
+
+static const uint32_t kFrameMagic   = 0x32534357;  // "WCS2"
+static const uint32_t kControlMagic = 0x31434357;  // "WCC1"
+
+// Simulcast layers: layer n is the captured frame downscaled by 2^n
+static const uint32_t kLayerCount = 3;
+
+// FrameHeader::flags
+static const uint8_t kFrameFlagKeyframe = 1 << 0;  // decodable on its own
+static const uint8_t kFrameFlagClock    = 1 << 1;  // answer to a Ping, not a frame
+
+struct FrameHeader {
+  uint32_t magic;
+  uint32_t sequence;      // increases by one per captured frame
+  uint32_t payload_size;
+  uint16_t width;
+  uint16_t height;
+  uint8_t format;         // PixelFormat
+  uint8_t layer;          // simulcast layer, 0 is full resolution
+  uint8_t flags;          // kFrameFlag*
+  uint8_t stream;         // camera the frame comes from
+  uint32_t capture_delay_us;  // capture to the frame being ready in memory
+  uint64_t capture_us;    // when the frame was captured, 0 if unknown.
+                          // Clock answers: when the answer was sent
+  uint32_t process_us;    // frame ready to the header going out: conversion
+                          // and waiting for the socket. Clock answers: time
+                          // between the ping coming in and the answer
+  uint32_t reserved;
+};
+static_assert(sizeof(FrameHeader) == 40, "FrameHeader must not have padding");
+
+enum class ControlType : uint8_t {
+  SetFormat = 0,          // args[0]: PixelFormat
+  SetLayer,               // args[0]: layer, applied on the next keyframe
+  SetRegion,              // args[0..3]: x, y, width, height in full resolution
+                          // pixels, args[4]: downscale by 2^n (< kLayerCount).
+                          // A zero width or height goes back to whole frames.
+                          // Applied on the next keyframe.
+  SetStream,              // args[0]: stream (camera) to receive, the server's
+                          // first camera is stream 0. Clears the region.
+  Ping,                   // args[0]: id, echoed in the answer's sequence
+};
+
+struct ControlMessage {
+  uint32_t magic;
+  uint8_t type;           // ControlType
+  uint8_t reserved[3];
+  uint32_t args[6];
+};
+static_assert(sizeof(ControlMessage) == 32, "ControlMessage must not have padding");
+
+inline FrameHeader MakeFrameHeader(uint32_t sequence, PixelFormat format,
+  uint32_t width, uint32_t height, uint32_t payload_size, uint32_t layer = 0,
+  uint8_t flags = kFrameFlagKeyframe, uint32_t stream = 0) {
+  FrameHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kFrameMagic;
+  header.sequence = sequence;
+  header.payload_size = payload_size;
+  header.width = (uint16_t)width;
+  header.height = (uint16_t)height;
+  header.format = (uint8_t)format;
+  header.layer = (uint8_t)layer;
+  header.flags = flags;
+  header.stream = (uint8_t)stream;
+
+  return header;
+}
+
+// Answer to Ping 'id'; the times are filled in when it goes out
+inline FrameHeader MakeClockHeader(uint32_t id) {
+  FrameHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kFrameMagic;
+  header.sequence = id;
+  header.flags = kFrameFlagClock;
+
+  return header;
+}
+
+inline ControlMessage MakeControlMessage(ControlType type) {
+  ControlMessage message;
+  memset(&message, 0, sizeof(message));
+  message.magic = kControlMagic;
+  message.type = (uint8_t)type;
+
+  return message;
+}
+
+#endif // __PROTOCOL_H__
@@ -0,0 +1,73 @@
+#ifndef __RATE_CONTROL_H__
+#define __RATE_CONTROL_H__
+
+#include <cstdint>
+
+// Per-viewer rate controller.
+// After every frame we tell it how many bytes went out, how long the send
+// blocked and how many bytes are still sitting in the socket send queue
+// (SIOCOUTQ). From that it estimates the throughput the link is delivering
+// and the queueing delay a new frame would see, and walks a ladder of
+// (layer, frame rate) steps to keep that delay under the target.
+//
+// Step 0 is full resolution at the capture rate; every step down halves
+// the bytes per second. Stepping down happens as soon as the delay is over
+// the target and the queue isn't already draining; stepping up is a probe that is only tried after the
+// link has been quiet for a while, and that waits twice as long next time
+// if it failed.
+
+struct RateStep {
+  uint32_t layer;           // simulcast layer to send
+  uint32_t frame_divisor;   // send one captured frame out of this many
+};
+
+struct RateControlParams {
+  RateControlParams();
+
+  float target_delay_ms;    // queueing delay we try to stay under
+  float hold_ms;            // minimum time between two step changes
+  float probe_ms;           // quiet time needed before stepping up
+  float max_probe_ms;       // cap for the probe backoff
+};
+
+class RateController {
+public:
+  RateController();
+  explicit RateController(const RateControlParams& params);
+
+  // 'queued_bytes' is the socket send queue right after the frame was
+  // handed to the kernel, 'now_ms' any monotonic clock.
+  void onFrameSent(uint32_t bytes, float send_ms, uint32_t queued_bytes, double now_ms);
+  // Whether the frame 'sequence' is due, given the last one we sent
+  bool shouldSend(uint32_t sequence) const;
+  void markSent(uint32_t sequence);
+
+  uint32_t step() const;
+  const RateStep& currentStep() const;
+  float throughput() const;        // delivered bytes per second
+  float queueDelay() const;        // milliseconds
+  uint32_t stepChanges() const;
+
+  static uint32_t StepCount();
+
+private:
+  void setStep(uint32_t step, double now_ms);
+
+  RateControlParams params;
+  uint32_t current_step;
+  uint32_t step_changes;
+  uint32_t last_sequence;
+  bool has_sent;
+  uint64_t bytes_sent;
+  uint64_t bytes_delivered;
+  double last_sample_ms;
+  double last_change_ms;
+  double hold_until_ms;
+  double last_up_ms;
+  float probe_wait_ms;
+  float delivery_rate;
+  float queue_delay_ms;
+  float min_delay_ms;
+};
+
+#endif // __RATE_CONTROL_H__
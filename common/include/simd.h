@@ -0,0 +1,94 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <cstdint>
+
+// Instruction set used by the pixel kernels. Every kernel has a Scalar
+// version, the vector ones are picked at runtime (x86) or compile time (ARM).
+enum class SimdLevel {
+  Scalar = 0,
+  SSE2,
+  AVX2,
+  NEON
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define SIMD_X86 1
+  #if defined(__GNUC__) || defined(__clang__)
+    #define SIMD_HAS_AVX2_TARGET 1
+    #define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+  #endif
+  #if defined(__SSE2__)
+    #define SIMD_HAS_SSE2 1
+  #endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #define SIMD_HAS_NEON 1
+#endif
+
+// Best level supported by the machine we are running on
+inline SimdLevel DetectSimdLevel() {
+#if defined(SIMD_HAS_NEON)
+  return SimdLevel::NEON;
+#else
+  #if defined(SIMD_HAS_AVX2_TARGET)
+  // May run from a static initializer, before libgcc filled the cpu model
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SimdLevel::AVX2;
+  }
+  #endif
+  #if defined(SIMD_HAS_SSE2)
+  return SimdLevel::SSE2;
+  #else
+  return SimdLevel::Scalar;
+  #endif
+#endif
+}
+
+// Can a kernel compiled for 'level' run on this machine?
+inline bool IsSimdLevelSupported(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::Scalar: {
+      return true;
+    }
+    case SimdLevel::SSE2: {
+#if defined(SIMD_HAS_SSE2)
+      return true;
+#else
+      return false;
+#endif
+    }
+    case SimdLevel::AVX2: {
+#if defined(SIMD_HAS_AVX2_TARGET)
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#else
+      return false;
+#endif
+    }
+    case SimdLevel::NEON: {
+#if defined(SIMD_HAS_NEON)
+      return true;
+#else
+      return false;
+#endif
+    }
+  }
+
+  return false;
+}
+
+inline const char* SimdLevelName(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::Scalar: return "scalar";
+    case SimdLevel::SSE2:   return "sse2";
+    case SimdLevel::AVX2:   return "avx2";
+    case SimdLevel::NEON:   return "neon";
+  }
+
+  return "unknown";
+}
+
+#endif // __SIMD_H__
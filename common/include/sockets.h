@@ -7,6 +7,7 @@
 #include <vector>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -16,6 +17,39 @@
 
 typedef unsigned char byte;
 
+// Sends that must not raise SIGPIPE pass MSG_NOSIGNAL. Apple has no such
+// flag, its TCP sockets get SO_NOSIGPIPE when they're made instead.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Tuning applied when a socket is made, and again whenever it is remade
+// after a close. Zero or false keeps the system default. The TCP options
+// are left out on UDP sockets.
+struct SocketOptions {
+  bool no_delay = false;          // TCP_NODELAY: small writes go out at once
+  uint32_t send_buffer = 0;       // SO_SNDBUF, bytes (the kernel doubles it)
+  uint32_t receive_buffer = 0;    // SO_RCVBUF, bytes
+  // TCP_NOTSENT_LOWAT: the socket takes new data only while less than
+  // this is waiting unsent, so a frame that can't go out yet waits (and
+  // can be skipped) in our queue instead of aging in the kernel's
+  uint32_t not_sent_lowat = 0;
+  // SO_BUSY_POLL: blocking receives spin on the device queue this long
+  // before sleeping. Needs CAP_NET_ADMIN, Linux only.
+  uint32_t busy_poll_us = 0;
+  // SO_MAX_PACING_RATE: at most this many bytes a second, spread evenly
+  // instead of in bursts. Linux only.
+  uint64_t max_pacing_rate = 0;
+
+  // No Nagle and a small unsent queue: what a live stream wants
+  static SocketOptions LowLatencyVideo();
+  // Large buffers, for bulk transfers where latency doesn't matter
+  static SocketOptions Throughput();
+};
+
+// "default", "low-latency" or "throughput"
+bool ParseSocketPreset(const char* name, SocketOptions* options);
+
 class Socket {
 public:
   enum class Type {
@@ -33,6 +67,17 @@ public:
     Sending
   };
 
+  // How sendAll() and receiveExact() ended
+  enum class TransferStatus {
+    Complete = 0,
+    Timeout,                // the deadline came first
+    PeerClosed,             // the socket is disconnected now
+    Error
+  };
+
+  // sendAll() and receiveExact() deadline that never comes
+  static const uint64_t kNoDeadline = 0;
+
   struct Peer {
     Peer();
     Peer(const std::string& ip, uint32_t port);
@@ -58,8 +103,33 @@ public:
   bool close();
   uint32_t sendData(byte* buffer, uint32_t buffer_size);
   uint32_t receiveData(byte* buffer, uint32_t max_size_to_read);
+  // All 'size' bytes, sleeping until the socket is ready whenever it
+  // isn't, until 'deadline_ns' (MonotonicNanos()). A deadline already past
+  // still moves what can be moved without waiting. 'transferred' gets how
+  // much went through, also when it isn't Complete, to go on from there.
+  TransferStatus sendAll(const byte* buffer, uint32_t size, uint64_t deadline_ns,
+    uint32_t* transferred = nullptr);
+  TransferStatus receiveExact(byte* buffer, uint32_t size, uint64_t deadline_ns,
+    uint32_t* transferred = nullptr);
+  // The same for 'count' buffers one after the other, as many of them per
+  // system call as the socket takes
+  TransferStatus sendAll(const struct iovec* buffers, uint32_t count, uint64_t deadline_ns,
+    uint32_t* transferred = nullptr);
+  TransferStatus receiveExact(const struct iovec* buffers, uint32_t count, uint64_t deadline_ns,
+    uint32_t* transferred = nullptr);
+  // Bytes that can be read right now without blocking
+  uint32_t availableBytes() const;
+  // Bytes written but not yet acknowledged by the peer (send queue). 0
+  // where the platform can't tell
+  uint32_t queuedBytes() const;
+  // Applies 'options' now, and keeps them for when the socket is remade
+  bool setOptions(const SocketOptions& options);
 
 protected:
+  friend class Poller;
+  friend class IoEngine;
+  friend class ZeroCopyReceiver;
+
   enum class ErrorFrom {
     SendData = 0,
     ReceiveData,
@@ -69,7 +139,12 @@ protected:
   virtual void construct(Socket::Type type) = 0;
   virtual void handleError(ErrorFrom from, int32_t error) = 0;
   int32_t getDescriptor() const;
+  bool applyOptions();
+  // sendAll() and receiveExact(), 'buffers' is used up as it goes
+  TransferStatus transfer(bool send, struct iovec* buffers, uint32_t count, uint64_t deadline_ns,
+    uint32_t* transferred);
 
+  SocketOptions options;
   struct sockaddr_in address;
   ReceivingStatus receiving_status;
   SendingStatus sending_status;
@@ -87,7 +162,7 @@ public:
     Ready
   };
 
-  TCPSocket(Type type);
+  TCPSocket(Type type, const SocketOptions& options = SocketOptions());
   ~TCPSocket();
 
   bool connect(const char* ip, uint32_t port);
@@ -97,7 +172,7 @@ public:
 private:
   friend class TCPListener;
   
-  TCPSocket(Socket::Type type, uint32_t descriptor);
+  TCPSocket(Socket::Type type, uint32_t descriptor, const SocketOptions& options);
   TCPSocket();
   virtual void construct(Socket::Type type) override;
   virtual void handleError(ErrorFrom from, int32_t error) override;
@@ -115,11 +190,16 @@ public:
     Accepted
   };
 
-  TCPListener(Socket::Type type, uint32_t queue_size = 32);
+  // Accepted sockets get the same options
+  TCPListener(Socket::Type type, uint32_t queue_size = 32, const SocketOptions& options = SocketOptions());
   ~TCPListener();
 
   bool listen();
+  // Returns a newly accepted connection (owned by the caller) or nullptr
   TCPSocket* accept();
+  // Wraps a connection accepted elsewhere (an IoEngine multishot accept),
+  // owned by the caller
+  TCPSocket* adopt(int32_t descriptor);
   bool close();
 
 private:
@@ -128,13 +208,12 @@ private:
   virtual void handleError(ErrorFrom from, int32_t error) override;
 
   ListeningStatus listening_status;
-  TCPSocket* accepted_socket;
   uint32_t queue_size;
 };
 
 class UDPSocket : public Socket {
 public:
-  UDPSocket(Socket::Type type);
+  UDPSocket(Socket::Type type, const SocketOptions& options = SocketOptions());
   ~UDPSocket();
 
   // TODO: method to broadcast
@@ -147,4 +226,7 @@ private:
   virtual void handleError(ErrorFrom from, int32_t error) override;
 };
 
+// "complete", "timeout", "peer closed" or "error", for logs
+const char* TransferStatusName(Socket::TransferStatus status);
+
 #endif // __SOCKETS_H__
\ No newline at end of file
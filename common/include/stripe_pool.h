@@ -0,0 +1,54 @@
+#ifndef __STRIPE_POOL_H__
+#define __STRIPE_POOL_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pixels.h"
+
+// Fixed set of threads that split one frame at a time into horizontal
+// stripes. run() hands every thread one stripe, works on the first one
+// itself and returns when all of them are done, so frames still come out
+// one after the other, in order; only each frame gets done sooner.
+
+typedef void (*StripeJob)(void* context, uint32_t first_row, uint32_t row_count);
+
+class StripePool {
+public:
+  // 'thread_count' threads work on every job, the caller included.
+  // 0 means one per hardware thread.
+  explicit StripePool(uint32_t thread_count);
+  ~StripePool();
+
+  void run(uint32_t rows, StripeJob job, void* context);
+  uint32_t threadCount() const;
+
+private:
+  StripePool(const StripePool&) = delete;
+  StripePool& operator=(const StripePool&) = delete;
+
+  void workerLoop(uint32_t stripe);
+  void runStripe(uint32_t stripe);
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable work_ready;
+  std::condition_variable work_done;
+  uint64_t generation;      // one per run()
+  uint32_t pending;         // stripes of the current run still going
+  bool should_finish;
+
+  StripeJob job;
+  void* context;
+  uint32_t rows;
+  uint32_t stripe_rows;
+};
+
+// ConvertToRGBA() with the rows split across 'pool'
+void ConvertToRGBAStriped(StripePool* pool, PixelFormat format, const byte* src,
+  uint32_t width, uint32_t height, byte* rgba, ColorMatrix matrix = ColorMatrix::BT601);
+
+#endif // __STRIPE_POOL_H__
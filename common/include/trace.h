@@ -0,0 +1,70 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <atomic>
+#include <cstdint>
+
+#include "metrics.h"
+
+// Per frame tracing, written out in Chrome trace JSON (chrome://tracing,
+// ui.perfetto.dev). Off by default: then every trace point is one branch
+// on a flag that never changes. TraceEnable() turns it on for the rest of
+// the run.
+//
+// Each thread records spans into its own ring buffer: a plain store of
+// the event and of the head, nothing shared, no locks. When the ring is
+// full the oldest spans go, so a long run keeps its last few seconds.
+// Spans carry the frame sequence number, so one frame can be followed
+// from capture to present across threads and, with traces of both sides,
+// across processes (both use the monotonic clock).
+//
+// The trace is written at exit and every time the process gets SIGUSR1
+// (kill -USR1 <pid>), each time with what the rings hold then. Dumping
+// while the other threads keep recording is fine, spans overwritten
+// meanwhile are left out.
+
+extern std::atomic<bool> g_trace_enabled;
+
+inline bool TraceEnabled() {
+  return g_trace_enabled.load(std::memory_order_relaxed);
+}
+
+// 'process_name' shows up in the viewer, the trace goes to 'path'.
+// Both must outlive tracing. Call it once, before the threads start.
+void TraceEnable(const char* process_name, const char* path);
+// Names the calling thread in the trace ("capture", "network"...)
+void TraceSetThreadName(const char* name);
+
+void TraceRecord(const char* name, uint32_t frame, uint64_t start_ns, uint64_t end_ns);
+
+// 'name' must be a string literal, or live as long
+inline void TraceSpan(const char* name, uint32_t frame, uint64_t start_ns, uint64_t end_ns) {
+  if (TraceEnabled()) {
+    TraceRecord(name, frame, start_ns, end_ns);
+  }
+}
+
+// Span from here to the end of the scope
+class TraceScope {
+public:
+  TraceScope(const char* _name, uint32_t _frame) : name(_name), frame(_frame), start_ns(0) {
+    if (TraceEnabled()) {
+      start_ns = MonotonicNanos();
+    }
+  }
+  ~TraceScope() {
+    if (start_ns != 0) {
+      TraceRecord(name, frame, start_ns, MonotonicNanos());
+    }
+  }
+
+private:
+  const char* name;
+  uint32_t frame;
+  uint64_t start_ns;
+};
+
+// Writes the trace now
+bool TraceDump();
+
+#endif // __TRACE_H__
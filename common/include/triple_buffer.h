@@ -0,0 +1,81 @@
+#ifndef __TRIPLE_BUFFER_H__
+#define __TRIPLE_BUFFER_H__
+
+#include <atomic>
+#include <cstdint>
+
+// Wait-free "latest value" handoff between one producer thread and one
+// consumer thread.
+//
+// There are three slots: the producer owns one, the consumer owns one and
+// the third sits in the middle holding the newest published value. Both
+// sides only ever swap their slot with the middle one, with a single
+// atomic exchange, so neither of them waits for the other:
+//  - the producer always has a slot to write into; publishing a value the
+//    consumer never picked up simply overwrites it (latest wins)
+//  - the consumer always reads the newest complete value, and keeps its
+//    slot for as long as it wants
+//
+// Slots are reused, not reset: whatever the producer finds in writeSlot()
+// is some older value (or what was set up through slot() before the
+// threads started).
+template <typename T>
+class TripleBuffer {
+public:
+  TripleBuffer() : shared(2) {
+    write_index = 0;
+    read_index = 1;
+  }
+
+  // Producer: the slot to fill
+  T& writeSlot() {
+    return slots[write_index];
+  }
+
+  // Producer: makes the write slot the newest value and takes the middle
+  // slot to write the next one. Returns true if the value that was in the
+  // middle had never been taken by the consumer, i.e. it is lost.
+  bool publish() {
+    const uint32_t previous = shared.exchange(write_index | kNewValue, std::memory_order_acq_rel);
+    write_index = previous & kIndexMask;
+    return (previous & kNewValue) != 0;
+  }
+
+  // Consumer: moves to the newest value if one was published since the
+  // last call. Returns false (and keeps the current slot) otherwise.
+  bool update() {
+    if ((shared.load(std::memory_order_relaxed) & kNewValue) == 0) {
+      return false;
+    }
+
+    read_index = shared.exchange(read_index, std::memory_order_acq_rel) & kIndexMask;
+    return true;
+  }
+
+  // Consumer: the newest value taken by update()
+  T& readSlot() {
+    return slots[read_index];
+  }
+
+  // Direct access to the slots, only while no thread is using the buffer
+  T& slot(uint32_t index) {
+    return slots[index];
+  }
+  static uint32_t SlotCount() {
+    return 3;
+  }
+
+private:
+  static const uint32_t kIndexMask = 0x3;
+  static const uint32_t kNewValue = 0x4;
+
+  TripleBuffer(const TripleBuffer&) = delete;
+  TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+  T slots[3];
+  std::atomic<uint32_t> shared;   // middle slot index | kNewValue
+  uint32_t write_index;           // producer only
+  uint32_t read_index;            // consumer only
+};
+
+#endif // __TRIPLE_BUFFER_H__
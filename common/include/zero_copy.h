@@ -0,0 +1,78 @@
+#ifndef __ZERO_COPY_H__
+#define __ZERO_COPY_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "sockets.h"
+
+// Receiving large frames without copying them, with TCP_ZEROCOPY_RECEIVE
+// (Linux only, elsewhere the receiver is never valid).
+// Each window is memory mapped from the socket: whole pages of received
+// data are mapped into it where they are, instead of copied by recv().
+// Whatever can't be mapped (the tail of a frame that isn't a whole page,
+// data that the network card didn't put in whole pages, anything after
+// it) is copied into anonymous memory over the rest of the window, so a
+// frame is always contiguous. The window is mapped from the socket again
+// when the next frame starts.
+//
+// Windows are read only and stay valid until they receive again. When
+// nothing has been mapped after the first kZeroCopyGiveUpBytes (loopback,
+// or a path that never lands in whole pages) the receiver stops trying
+// and only copies.
+class ZeroCopyReceiver {
+public:
+  // 'window_count' windows of at least 'window_size' bytes
+  ZeroCopyReceiver(uint32_t window_count, uint32_t window_size);
+  ~ZeroCopyReceiver();
+
+  bool isValid() const;
+
+  uint32_t windowCount() const;
+  byte* window(uint32_t index) const;
+  bool owns(const byte* buffer) const;
+
+  // Receives up to 'size' bytes at 'offset' of 'window' (offset 0 starts a
+  // frame), waiting up to 'timeout_ms' for some. Returns how many were
+  // received, 0 if none came in time, -1 if the peer closed or the
+  // connection failed.
+  int32_t receive(const TCPSocket& socket, byte* window, uint32_t offset, uint32_t size, int32_t timeout_ms);
+
+  uint64_t mappedBytes() const {
+    return mapped_bytes;
+  }
+  uint64_t copiedBytes() const {
+    return copied_bytes;
+  }
+  // Still trying to map
+  bool mapping() const {
+    return enabled;
+  }
+
+private:
+  ZeroCopyReceiver(const ZeroCopyReceiver&) = delete;
+  ZeroCopyReceiver& operator=(const ZeroCopyReceiver&) = delete;
+
+  struct Window {
+    byte* address;
+    int32_t descriptor;     // socket it's mapped from, -1 for none
+    uint32_t copy_from;     // anonymous memory from here to the end
+  };
+
+  Window* find(const byte* address);
+  // The part of 'window' from 'offset' on, mapped from 'descriptor'
+  bool mapSocket(Window* window, int32_t descriptor, uint32_t offset);
+  // The part of 'window' from 'offset' on, as anonymous writable memory
+  bool mapAnonymous(Window* window, uint32_t offset);
+  // recv() without waiting: bytes, 0 if there are none, -1 if closed
+  int32_t copy(Window* window, int32_t descriptor, uint32_t offset, uint32_t size);
+
+  std::vector<Window> windows;
+  uint32_t window_size;     // whole pages
+  uint32_t page_size;
+  bool enabled;
+  uint64_t mapped_bytes;
+  uint64_t copied_bytes;
+};
+
+#endif // __ZERO_COPY_H__
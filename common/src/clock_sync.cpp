@@ -0,0 +1,78 @@
+#include "clock_sync.h"
+
+// Pings go out this often until the sample window is full, then slower
+static const uint64_t kFastPingIntervalUs = 100000;
+static const uint64_t kPingIntervalUs = 1000000;
+// A ping without an answer after this long is given up on
+static const uint64_t kPingTimeoutUs = 2000000;
+
+ClockSync::ClockSync() {
+  ping_id = 0;
+  reset();
+}
+
+void ClockSync::reset() {
+  sample_count = 0;
+  best = 0;
+  ping_sent_us = 0;
+  ping_pending = false;
+}
+
+bool ClockSync::pingDue(uint64_t now_us) const {
+  const uint64_t since_ping_us = now_us - ping_sent_us;
+  if (ping_pending) {
+    return since_ping_us >= kPingTimeoutUs;
+  }
+
+  return since_ping_us >= (sample_count < kSampleCount ? kFastPingIntervalUs : kPingIntervalUs);
+}
+
+uint32_t ClockSync::startPing(uint64_t now_us) {
+  ++ping_id;
+  ping_sent_us = now_us;
+  ping_pending = true;
+
+  return ping_id;
+}
+
+void ClockSync::onPong(uint32_t id, uint64_t remote_send_us, uint32_t remote_hold_us, uint64_t now_us) {
+  if (!ping_pending || id != ping_id) {
+    return;
+  }
+  ping_pending = false;
+
+  const uint64_t elapsed_us = now_us - ping_sent_us;
+  const uint64_t remote_receive_us = remote_send_us - remote_hold_us;
+  Sample sample;
+  sample.offset = ((int64_t)(ping_sent_us - remote_receive_us) + (int64_t)(now_us - remote_send_us)) / 2;
+  sample.round_trip = (uint32_t)(elapsed_us > remote_hold_us ? elapsed_us - remote_hold_us : 0);
+
+  const uint32_t index = sample_count % kSampleCount;
+  samples[index] = sample;
+  ++sample_count;
+
+  // The best sample may just have been overwritten, look at all of them
+  const uint32_t count = sample_count < kSampleCount ? sample_count : kSampleCount;
+  best = 0;
+  for (uint32_t i = 1; i < count; ++i) {
+    if (samples[i].round_trip < samples[best].round_trip) {
+      best = i;
+    }
+  }
+}
+
+bool ClockSync::synchronized() const {
+  return sample_count > 0;
+}
+
+int64_t ClockSync::offset() const {
+  return synchronized() ? samples[best].offset : 0;
+}
+
+uint32_t ClockSync::roundTrip() const {
+  return synchronized() ? samples[best].round_trip : 0;
+}
+
+uint64_t ClockSync::toLocal(uint64_t remote_us) const {
+  return (uint64_t)((int64_t)remote_us + offset());
+}
@@ -0,0 +1,1003 @@
+#include "io_engine.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #include <linux/io_uring.h>
+    // Multishot receive and provided buffer rings came with Linux 6.0
+    #if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+      #define IO_ENGINE_HAS_URING 1
+    #endif
+  #endif
+#endif
+
+#include "log.h"
+#include "poller.h"
+
+// Received data is handed out in buffers this big, there are
+// kReceiveBufferCount of them (a power of two, for the io_uring ring)
+static const uint32_t kReceiveBufferSize = 64 * 1024;
+static const uint32_t kReceiveBufferCount = 64;
+
+IoEngine::IoEngine() : syscall_count(0) {
+}
+
+IoEngine::~IoEngine() {
+}
+
+const char* IoEngine::backendName() const {
+  return backend() == Backend::IoUring ? "io_uring" : "epoll";
+}
+
+int32_t IoEngine::descriptorOf(const PollerWakeup& wakeup) {
+  return wakeup.descriptor;
+}
+
+#ifdef IO_ENGINE_HAS_URING
+// [io_uring]
+static const uint32_t kSubmissionEntries = 256;
+// Multishot operations can post many completions per submission
+static const uint32_t kCompletionEntries = 4096;
+static const uint16_t kReceiveBufferGroup = 0;
+
+class IoUringEngine : public IoEngine {
+public:
+  IoUringEngine();
+  ~IoUringEngine() override;
+
+  bool initialize();
+
+  Backend backend() const override {
+    return Backend::IoUring;
+  }
+
+  bool acceptMultishot(const TCPListener& listener, uint64_t tag) override;
+  bool receiveMultishot(const Socket& socket, uint64_t tag) override;
+  bool sendChain(const Socket& socket, const struct iovec* buffers, uint32_t count, uint64_t tag) override;
+  bool write(int32_t file, const byte* data, uint32_t size, uint64_t offset, uint64_t tag) override;
+  bool watch(PollerWakeup* wakeup, uint64_t tag) override;
+  void cancel(const Socket& socket) override;
+  bool registerBuffers(const struct iovec* buffers, uint32_t count) override;
+  uint32_t wait(Completion* completions, uint32_t max_completions, int32_t timeout_ms) override;
+
+private:
+  // What a submission's user_data points to. Multishot requests live
+  // until their last completion, a send chain until all its sends are in.
+  struct Request {
+    Op op;
+    uint64_t tag;
+    int32_t descriptor;
+    uint32_t pending;       // send chain: completions still to come
+    uint32_t bytes;         // send chain: sent so far
+    int32_t error;          // send chain: first error
+  };
+
+  int32_t enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags, const void* arg, size_t arg_size);
+  // 'count' free submission slots, submitting what's queued if needed
+  bool reserve(uint32_t count);
+  struct io_uring_sqe* nextSqe(Request* request);
+  void queueAccept(Request* request);
+  void queueReceive(Request* request);
+  void queueWakeup(Request* request);
+  // Multishot requests that ended early, again
+  void queueAgain(Request* request);
+  bool bufferRingWorks();
+  // Back to the kernel, seen by it on the next enter()
+  void returnBuffer(uint16_t buffer_id);
+  bool isCancelled(int32_t descriptor) const;
+  // Turns one completion queue entry into what the caller sees, if anything
+  bool reap(const struct io_uring_cqe& cqe, Completion* completion);
+
+  int32_t ring_descriptor;
+  void* ring_memory;
+  size_t ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+
+  // Submission ring
+  uint32_t* sq_head;
+  uint32_t* sq_tail;
+  uint32_t* sq_array;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  uint32_t sq_local_tail;   // published on the next enter()
+  uint32_t to_submit;
+
+  // Completion ring
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // Provided buffers for multishot receives, in a ring shared with the
+  // kernel, or MAP_FAILED if they're provided with submissions
+  struct io_uring_buf_ring* buffer_ring;
+  std::vector<byte> receive_buffers;
+  uint16_t buffer_tail;
+  std::vector<uint16_t> lent_buffers;     // handed out by the last wait()
+
+  std::vector<struct iovec> registered;   // see registerBuffers()
+  PollerWakeup* wakeup;                   // see watch()
+  // Multishot requests that stopped for lack of buffers, armed again once
+  // the caller gives them back
+  std::vector<Request*> rearm;
+  // Cancelled since the completion queue was last empty: what ends for
+  // them now must not be armed again
+  std::vector<int32_t> cancelled;
+};
+
+IoUringEngine::IoUringEngine()
+  : ring_descriptor(-1), ring_memory(MAP_FAILED), ring_size(0), sqes((struct io_uring_sqe*)MAP_FAILED),
+    sqes_size(0), sq_local_tail(0), to_submit(0), buffer_ring((struct io_uring_buf_ring*)MAP_FAILED),
+    buffer_tail(0), wakeup(nullptr) {
+}
+
+IoUringEngine::~IoUringEngine() {
+  if (buffer_ring != MAP_FAILED) {
+    munmap(buffer_ring, kReceiveBufferCount * sizeof(struct io_uring_buf));
+  }
+  if (sqes != MAP_FAILED) {
+    munmap(sqes, sqes_size);
+  }
+  if (ring_memory != MAP_FAILED) {
+    munmap(ring_memory, ring_size);
+  }
+  if (ring_descriptor >= 0) {
+    ::close(ring_descriptor);
+  }
+  // Requests still in flight are gone with the ring
+}
+
+bool IoUringEngine::initialize() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = kCompletionEntries;
+  ring_descriptor = (int32_t)syscall(__NR_io_uring_setup, kSubmissionEntries, &params);
+  if (ring_descriptor < 0) {
+    LOG_INFO("io_uring_setup: %s, using epoll\n", strerror(errno));
+    return false;
+  }
+
+  // The timeout of wait() and the one mapping for both rings
+  const uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if ((params.features & required) != required) {
+    LOG_INFO("io_uring is too old (features %x), using epoll\n", params.features);
+    return false;
+  }
+
+  const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring_size = std::max(sq_size, cq_size);
+  ring_memory = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor,
+    IORING_OFF_SQ_RING);
+  sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    ring_descriptor, IORING_OFF_SQES);
+  if (ring_memory == MAP_FAILED || sqes == MAP_FAILED) {
+    LOG_WARNING("io_uring mmap: %s, using epoll\n", strerror(errno));
+    return false;
+  }
+
+  byte* ring = (byte*)ring_memory;
+  sq_head = (uint32_t*)(ring + params.sq_off.head);
+  sq_tail = (uint32_t*)(ring + params.sq_off.tail);
+  sq_array = (uint32_t*)(ring + params.sq_off.array);
+  sq_mask = *(uint32_t*)(ring + params.sq_off.ring_mask);
+  sq_entries = params.sq_entries;
+  sq_local_tail = *sq_tail;
+  cq_head = (uint32_t*)(ring + params.cq_off.head);
+  cq_tail = (uint32_t*)(ring + params.cq_off.tail);
+  cq_mask = *(uint32_t*)(ring + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+  // The ring of receive buffers, registered as group kReceiveBufferGroup
+  receive_buffers.resize((size_t)kReceiveBufferCount * kReceiveBufferSize);
+  const size_t buffer_ring_size = kReceiveBufferCount * sizeof(struct io_uring_buf);
+  buffer_ring = (struct io_uring_buf_ring*)mmap(nullptr, buffer_ring_size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer_ring == MAP_FAILED) {
+    return false;
+  }
+  for (uint16_t i = 0; i < kReceiveBufferCount; ++i) {
+    returnBuffer(i);
+  }
+  __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+
+  struct io_uring_buf_reg registration;
+  memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = (uint64_t)(uintptr_t)buffer_ring;
+  registration.ring_entries = kReceiveBufferCount;
+  registration.bgid = kReceiveBufferGroup;
+  ++syscall_count;
+  if (syscall(__NR_io_uring_register, ring_descriptor, IORING_REGISTER_PBUF_RING, &registration, 1) == 0) {
+    if (bufferRingWorks()) {
+      return true;
+    }
+    ++syscall_count;
+    syscall(__NR_io_uring_register, ring_descriptor, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+  }
+
+  // Provided the old way: one submission per buffer given back, still no
+  // system call of its own
+  LOG_INFO("io_uring buffer ring unusable, providing buffers\n");
+  munmap(buffer_ring, buffer_ring_size);
+  buffer_ring = (struct io_uring_buf_ring*)MAP_FAILED;
+  struct io_uring_sqe* sqe = nextSqe(nullptr);
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = kReceiveBufferCount;
+  sqe->addr = (uint64_t)(uintptr_t)&receive_buffers[0];
+  sqe->len = kReceiveBufferSize;
+  sqe->buf_group = kReceiveBufferGroup;
+  sqe->off = 0;
+  return true;
+}
+
+// Some kernels take the ring but never hand out its buffers (every receive
+// ends with ENOBUFS). A one byte read that selects a buffer tells.
+bool IoUringEngine::bufferRingWorks() {
+  int32_t pipe_descriptors[2];
+  if (pipe(pipe_descriptors) != 0) {
+    return false;
+  }
+
+  const byte probe = 0;
+  bool works = false;
+  if (::write(pipe_descriptors[1], &probe, 1) == 1) {
+    struct io_uring_sqe* sqe = nextSqe(nullptr);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = pipe_descriptors[0];
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kReceiveBufferGroup;
+    enter(to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+    const uint32_t head = *cq_head;
+    if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      const struct io_uring_cqe& cqe = cqes[head & cq_mask];
+      works = cqe.res == 1;
+      if (cqe.flags & IORING_CQE_F_BUFFER) {
+        returnBuffer((uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+        __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+      }
+      __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  ::close(pipe_descriptors[0]);
+  ::close(pipe_descriptors[1]);
+  return works;
+}
+
+int32_t IoUringEngine::enter(uint32_t count, uint32_t min_complete, uint32_t flags, const void* arg,
+  size_t arg_size) {
+  __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+  ++syscall_count;
+  const int32_t submitted = (int32_t)syscall(__NR_io_uring_enter, ring_descriptor, count, min_complete, flags,
+    arg, arg_size);
+  if (submitted > 0) {
+    to_submit -= std::min((uint32_t)submitted, to_submit);
+  }
+
+  return submitted;
+}
+
+bool IoUringEngine::reserve(uint32_t count) {
+  if (count > sq_entries) {
+    return false;
+  }
+  if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + count > sq_entries) {
+    enter(to_submit, 0, 0, nullptr, 0);
+  }
+
+  return sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + count <= sq_entries;
+}
+
+struct io_uring_sqe* IoUringEngine::nextSqe(Request* request) {
+  const uint32_t index = sq_local_tail & sq_mask;
+  struct io_uring_sqe* sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uint64_t)(uintptr_t)request;
+  sq_array[index] = index;
+  ++sq_local_tail;
+  ++to_submit;
+
+  return sqe;
+}
+
+void IoUringEngine::queueAccept(Request* request) {
+  struct io_uring_sqe* sqe = nextSqe(request);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = request->descriptor;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+void IoUringEngine::queueReceive(Request* request) {
+  struct io_uring_sqe* sqe = nextSqe(request);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = request->descriptor;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kReceiveBufferGroup;
+}
+
+// Multishot poll: a completion each time the eventfd is written to
+void IoUringEngine::queueWakeup(Request* request) {
+  struct io_uring_sqe* sqe = nextSqe(request);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = request->descriptor;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void IoUringEngine::queueAgain(Request* request) {
+  switch (request->op) {
+    case Op::Accept: {
+      queueAccept(request);
+      break;
+    }
+    case Op::Wakeup: {
+      queueWakeup(request);
+      break;
+    }
+    default: {
+      queueReceive(request);
+      break;
+    }
+  }
+}
+
+void IoUringEngine::returnBuffer(uint16_t buffer_id) {
+  if (buffer_ring == MAP_FAILED) {
+    if (reserve(1)) {
+      struct io_uring_sqe* sqe = nextSqe(nullptr);
+      sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd = 1;
+      sqe->addr = (uint64_t)(uintptr_t)&receive_buffers[(size_t)buffer_id * kReceiveBufferSize];
+      sqe->len = kReceiveBufferSize;
+      sqe->buf_group = kReceiveBufferGroup;
+      sqe->off = buffer_id;
+    }
+    return;
+  }
+
+  // Not buffer_ring->bufs: compiled as C++ the header's flexible array sits
+  // after an empty struct, 8 bytes off from where the kernel reads it
+  struct io_uring_buf* buffer = (struct io_uring_buf*)buffer_ring + (buffer_tail & (kReceiveBufferCount - 1));
+  buffer->addr = (uint64_t)(uintptr_t)&receive_buffers[(size_t)buffer_id * kReceiveBufferSize];
+  buffer->len = kReceiveBufferSize;
+  buffer->bid = buffer_id;
+  ++buffer_tail;
+}
+
+bool IoUringEngine::acceptMultishot(const TCPListener& listener, uint64_t tag) {
+  if (!reserve(1)) {
+    return false;
+  }
+
+  queueAccept(new Request{ Op::Accept, tag, descriptorOf(listener), 0, 0, 0 });
+  return true;
+}
+
+bool IoUringEngine::receiveMultishot(const Socket& socket, uint64_t tag) {
+  if (!reserve(1)) {
+    return false;
+  }
+
+  queueReceive(new Request{ Op::Receive, tag, descriptorOf(socket), 0, 0, 0 });
+  return true;
+}
+
+bool IoUringEngine::sendChain(const Socket& socket, const struct iovec* buffers, uint32_t count, uint64_t tag) {
+  if (count == 0 || !reserve(count)) {
+    return false;
+  }
+
+  // Linked: each send starts when the one before is complete, and a short
+  // or failed send cancels the rest. MSG_WAITALL makes the kernel retry
+  // partial sends itself instead of ending the chain.
+  Request* request = new Request{ Op::Send, tag, descriptorOf(socket), count, 0, 0 };
+  for (uint32_t i = 0; i < count; ++i) {
+    struct io_uring_sqe* sqe = nextSqe(request);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = request->descriptor;
+    sqe->addr = (uint64_t)(uintptr_t)buffers[i].iov_base;
+    sqe->len = (uint32_t)buffers[i].iov_len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    if (i + 1 < count) {
+      sqe->flags = IOSQE_IO_LINK;
+    }
+  }
+
+  return true;
+}
+
+bool IoUringEngine::write(int32_t file, const byte* data, uint32_t size, uint64_t offset, uint64_t tag) {
+  if (!reserve(1)) {
+    return false;
+  }
+
+  struct io_uring_sqe* sqe = nextSqe(new Request{ Op::Write, tag, file, 0, 0, 0 });
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = file;
+  sqe->addr = (uint64_t)(uintptr_t)data;
+  sqe->len = size;
+  sqe->off = offset;
+  // From a registered buffer the pages are already pinned
+  for (uint32_t i = 0; i < registered.size(); ++i) {
+    const byte* base = (const byte*)registered[i].iov_base;
+    if (data >= base && data + size <= base + registered[i].iov_len) {
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->buf_index = (uint16_t)i;
+      break;
+    }
+  }
+
+  return true;
+}
+
+bool IoUringEngine::watch(PollerWakeup* _wakeup, uint64_t tag) {
+  if (wakeup || !reserve(1)) {
+    return false;
+  }
+
+  wakeup = _wakeup;
+  queueWakeup(new Request{ Op::Wakeup, tag, descriptorOf(*wakeup), 0, 0, 0 });
+  return true;
+}
+
+void IoUringEngine::cancel(const Socket& socket) {
+  const int32_t descriptor = descriptorOf(socket);
+  if (reserve(1)) {
+    // user_data 0: nothing to report for the cancel itself
+    struct io_uring_sqe* sqe = nextSqe(nullptr);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = descriptor;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    // Now, while the descriptor still is the socket's: it's closed next,
+    // and may be a new connection's by the time of the next wait()
+    enter(to_submit, 0, 0, nullptr, 0);
+  }
+
+  cancelled.push_back(descriptor);
+  // Parked ones aren't in the kernel, they'd never hear of it
+  for (uint32_t i = 0; i < rearm.size();) {
+    if (rearm[i]->descriptor == descriptor) {
+      delete rearm[i];
+      rearm.erase(rearm.begin() + i);
+    }
+    else {
+      ++i;
+    }
+  }
+}
+
+bool IoUringEngine::registerBuffers(const struct iovec* buffers, uint32_t count) {
+  ++syscall_count;
+  if (syscall(__NR_io_uring_register, ring_descriptor, IORING_REGISTER_BUFFERS, buffers, count) != 0) {
+    LOG_WARNING("io_uring_register(BUFFERS): %s\n", strerror(errno));
+    return false;
+  }
+
+  registered.assign(buffers, buffers + count);
+  return true;
+}
+
+bool IoUringEngine::isCancelled(int32_t descriptor) const {
+  return std::find(cancelled.begin(), cancelled.end(), descriptor) != cancelled.end();
+}
+
+bool IoUringEngine::reap(const struct io_uring_cqe& cqe, Completion* completion) {
+  Request* request = (Request*)(uintptr_t)cqe.user_data;
+  if (!request) {
+    return false;
+  }
+
+  const bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+  completion->tag = request->tag;
+  completion->op = request->op;
+  completion->result = cqe.res;
+  completion->more = more;
+  completion->data = nullptr;
+
+  switch (request->op) {
+    case Op::Send: {
+      if (cqe.res >= 0) {
+        request->bytes += (uint32_t)cqe.res;
+      }
+      else if (request->error == 0) {
+        request->error = cqe.res;
+      }
+      if (--request->pending > 0) {
+        return false;
+      }
+
+      completion->result = request->error != 0 ? request->error : (int32_t)request->bytes;
+      completion->more = false;
+      delete request;
+      return true;
+    }
+    case Op::Receive: {
+      if (cqe.flags & IORING_CQE_F_BUFFER) {
+        const uint16_t buffer_id = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        completion->data = &receive_buffers[(size_t)buffer_id * kReceiveBufferSize];
+        lent_buffers.push_back(buffer_id);
+      }
+      if (more) {
+        return cqe.res > 0;
+      }
+
+      // Out of buffers, or stopped for another reason with the
+      // connection still fine: armed again on the next wait()
+      if ((cqe.res == -ENOBUFS || cqe.res > 0) && !isCancelled(request->descriptor)) {
+        rearm.push_back(request);
+        completion->more = true;
+        return cqe.res > 0;
+      }
+      delete request;
+      return true;
+    }
+    case Op::Accept: {
+      if (!more && cqe.res >= 0 && !isCancelled(request->descriptor)) {
+        rearm.push_back(request);
+        completion->more = true;
+      }
+      else if (!more) {
+        delete request;
+      }
+      return true;
+    }
+    case Op::Write: {
+      delete request;
+      return true;
+    }
+    case Op::Wakeup: {
+      if (cqe.res < 0) {
+        delete request;
+        return true;
+      }
+
+      ++syscall_count;
+      wakeup->clear();
+      completion->result = 0;
+      if (!more) {
+        rearm.push_back(request);
+        completion->more = true;
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+uint32_t IoUringEngine::wait(Completion* completions, uint32_t max_completions, int32_t timeout_ms) {
+  // What the caller had since the last wait() is free again
+  if (!lent_buffers.empty()) {
+    for (uint32_t i = 0; i < lent_buffers.size(); ++i) {
+      returnBuffer(lent_buffers[i]);
+    }
+    lent_buffers.clear();
+    if (buffer_ring != MAP_FAILED) {
+      __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+    }
+  }
+  uint32_t armed = 0;
+  for (; armed < rearm.size() && reserve(1); ++armed) {
+    queueAgain(rearm[armed]);
+  }
+  rearm.erase(rearm.begin(), rearm.begin() + armed);
+
+  uint32_t head = *cq_head;
+  const bool ready = head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  if (ready || timeout_ms == 0) {
+    if (to_submit > 0 || timeout_ms == 0) {
+      // GETEVENTS with nothing to wait for flushes overflowed completions
+      enter(to_submit, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+    }
+  }
+  else {
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = timeout_ms > 0 ? (uint64_t)(uintptr_t)&timeout : 0;
+    const int32_t status = enter(to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (status < 0 && errno != ETIME && errno != EINTR) {
+      LOG_ERROR("io_uring_enter: %s\n", strerror(errno));
+    }
+  }
+
+  uint32_t count = 0;
+  head = *cq_head;
+  const uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  // Receives hold a buffer each, don't take more than the caller can have
+  while (head != tail && count < max_completions) {
+    if (reap(cqes[head & cq_mask], &completions[count])) {
+      ++count;
+    }
+    ++head;
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  if (head == tail && to_submit == 0) {
+    cancelled.clear();
+  }
+
+  return count;
+}
+// [\io_uring]
+#endif // IO_ENGINE_HAS_URING
+
+// [epoll]
+class EpollEngine : public IoEngine {
+public:
+  EpollEngine();
+  ~EpollEngine() override;
+
+  Backend backend() const override {
+    return Backend::Epoll;
+  }
+
+  bool acceptMultishot(const TCPListener& listener, uint64_t tag) override;
+  bool receiveMultishot(const Socket& socket, uint64_t tag) override;
+  bool sendChain(const Socket& socket, const struct iovec* buffers, uint32_t count, uint64_t tag) override;
+  bool write(int32_t file, const byte* data, uint32_t size, uint64_t offset, uint64_t tag) override;
+  bool watch(PollerWakeup* wakeup, uint64_t tag) override;
+  void cancel(const Socket& socket) override;
+  bool registerBuffers(const struct iovec* buffers, uint32_t count) override;
+  uint32_t wait(Completion* completions, uint32_t max_completions, int32_t timeout_ms) override;
+
+private:
+  // Everything going on with one descriptor
+  struct Entry {
+    const Socket* socket;
+    int32_t descriptor;
+    bool in_poller;
+    bool accepting;
+    uint64_t accept_tag;
+    bool receiving;
+    uint64_t receive_tag;
+    bool sending;
+    uint64_t send_tag;
+    std::vector<struct iovec> send_buffers;   // what's left, the first one advanced
+    uint32_t send_index;
+    uint32_t bytes_sent;
+  };
+
+  Entry* entryFor(const Socket& socket);
+  void updateInterest(Entry* entry);
+  void complete(Op op, uint64_t tag, int32_t result, bool more, int32_t buffer = -1);
+  // Sends what the socket takes. Returns false once the chain is done.
+  bool flush(Entry* entry);
+  void acceptAll(Entry* entry);
+  void receive(Entry* entry);
+
+  struct Pending {
+    Completion completion;
+    int32_t buffer;         // receive buffer it holds, -1 if none
+  };
+
+  Poller poller;
+  PollerWakeup* wakeup;         // in the poller with a null Entry
+  uint64_t wakeup_tag;
+  std::unordered_map<int32_t, Entry*> entries;
+  std::vector<Pending> pending;
+  std::vector<byte> receive_buffers;
+  std::vector<int32_t> free_buffers;
+  std::vector<int32_t> lent_buffers;        // handed out by the last wait()
+};
+
+EpollEngine::EpollEngine() : wakeup(nullptr), wakeup_tag(0),
+  receive_buffers((size_t)kReceiveBufferCount * kReceiveBufferSize) {
+  for (uint32_t i = 0; i < kReceiveBufferCount; ++i) {
+    free_buffers.push_back((int32_t)i);
+  }
+}
+
+EpollEngine::~EpollEngine() {
+  for (auto it = entries.begin(); it != entries.end(); ++it) {
+    delete it->second;
+  }
+}
+
+EpollEngine::Entry* EpollEngine::entryFor(const Socket& socket) {
+  const int32_t descriptor = descriptorOf(socket);
+  auto it = entries.find(descriptor);
+  if (it != entries.end()) {
+    return it->second;
+  }
+
+  Entry* entry = new Entry();
+  entry->socket = &socket;
+  entry->descriptor = descriptor;
+  entry->in_poller = false;
+  entry->accepting = false;
+  entry->receiving = false;
+  entry->sending = false;
+  entry->send_index = 0;
+  entry->bytes_sent = 0;
+  entries[descriptor] = entry;
+  return entry;
+}
+
+void EpollEngine::updateInterest(Entry* entry) {
+  const uint32_t events = ((entry->accepting || entry->receiving) ? Poller::kReadable : 0) |
+    (entry->sending ? Poller::kWritable : 0);
+  ++syscall_count;
+  if (entry->in_poller) {
+    poller.modify(*entry->socket, events, entry);
+  }
+  else {
+    entry->in_poller = poller.add(*entry->socket, events, entry);
+  }
+}
+
+void EpollEngine::complete(Op op, uint64_t tag, int32_t result, bool more, int32_t buffer) {
+  Pending entry;
+  entry.completion.tag = tag;
+  entry.completion.op = op;
+  entry.completion.result = result;
+  entry.completion.more = more;
+  entry.completion.data = buffer >= 0 ? &receive_buffers[(size_t)buffer * kReceiveBufferSize] : nullptr;
+  entry.buffer = buffer;
+  pending.push_back(entry);
+}
+
+bool EpollEngine::acceptMultishot(const TCPListener& listener, uint64_t tag) {
+  Entry* entry = entryFor(listener);
+  entry->accepting = true;
+  entry->accept_tag = tag;
+  updateInterest(entry);
+  return true;
+}
+
+bool EpollEngine::receiveMultishot(const Socket& socket, uint64_t tag) {
+  Entry* entry = entryFor(socket);
+  entry->receiving = true;
+  entry->receive_tag = tag;
+  updateInterest(entry);
+  return true;
+}
+
+bool EpollEngine::flush(Entry* entry) {
+  while (entry->send_index < entry->send_buffers.size()) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &entry->send_buffers[entry->send_index];
+    message.msg_iovlen = entry->send_buffers.size() - entry->send_index;
+    ++syscall_count;
+    const ssize_t sent = sendmsg(entry->descriptor, &message, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      complete(Op::Send, entry->send_tag, -errno, false);
+      entry->sending = false;
+      return false;
+    }
+
+    entry->bytes_sent += (uint32_t)sent;
+    size_t left = (size_t)sent;
+    while (left > 0 && entry->send_index < entry->send_buffers.size()) {
+      struct iovec& buffer = entry->send_buffers[entry->send_index];
+      const size_t taken = std::min(left, buffer.iov_len);
+      buffer.iov_base = (byte*)buffer.iov_base + taken;
+      buffer.iov_len -= taken;
+      left -= taken;
+      if (buffer.iov_len == 0) {
+        ++entry->send_index;
+      }
+    }
+  }
+
+  complete(Op::Send, entry->send_tag, (int32_t)entry->bytes_sent, false);
+  entry->sending = false;
+  return false;
+}
+
+bool EpollEngine::sendChain(const Socket& socket, const struct iovec* buffers, uint32_t count, uint64_t tag) {
+  Entry* entry = entryFor(socket);
+  if (entry->sending) {
+    return false;
+  }
+
+  entry->sending = true;
+  entry->send_tag = tag;
+  entry->send_buffers.assign(buffers, buffers + count);
+  entry->send_index = 0;
+  entry->bytes_sent = 0;
+  // Most of the time it all fits right away, then the poller never hears
+  // of the chain
+  if (flush(entry)) {
+    updateInterest(entry);
+  }
+  return true;
+}
+
+bool EpollEngine::write(int32_t file, const byte* data, uint32_t size, uint64_t offset, uint64_t tag) {
+  // Files are always ready: written now, reported on the next wait()
+  uint32_t written = 0;
+  while (written < size) {
+    ++syscall_count;
+    const ssize_t bytes = pwrite(file, data + written, size - written, (off_t)(offset + written));
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes <= 0) {
+      complete(Op::Write, tag, bytes < 0 ? -errno : (int32_t)written, false);
+      return true;
+    }
+    written += (uint32_t)bytes;
+  }
+
+  complete(Op::Write, tag, (int32_t)written, false);
+  return true;
+}
+
+bool EpollEngine::watch(PollerWakeup* _wakeup, uint64_t tag) {
+  ++syscall_count;
+  if (wakeup || !poller.add(*_wakeup, nullptr)) {
+    return false;
+  }
+
+  wakeup = _wakeup;
+  wakeup_tag = tag;
+  return true;
+}
+
+void EpollEngine::cancel(const Socket& socket) {
+  auto it = entries.find(descriptorOf(socket));
+  if (it == entries.end()) {
+    return;
+  }
+
+  Entry* entry = it->second;
+  if (entry->accepting) {
+    complete(Op::Accept, entry->accept_tag, -ECANCELED, false);
+  }
+  if (entry->receiving) {
+    complete(Op::Receive, entry->receive_tag, -ECANCELED, false);
+  }
+  if (entry->sending) {
+    complete(Op::Send, entry->send_tag, -ECANCELED, false);
+  }
+  if (entry->in_poller) {
+    ++syscall_count;
+    poller.remove(socket);
+  }
+  delete entry;
+  entries.erase(it);
+}
+
+bool EpollEngine::registerBuffers(const struct iovec* buffers, uint32_t count) {
+  // Nothing to pin: every system call copies anyway
+  (void)buffers;
+  (void)count;
+  return true;
+}
+
+// accept4() is Linux only, elsewhere close on exec is set afterwards
+static int32_t AcceptConnection(int32_t listener) {
+#ifdef __linux__
+  return accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+#else
+  const int32_t descriptor = accept(listener, nullptr, nullptr);
+  if (descriptor >= 0) {
+    fcntl(descriptor, F_SETFD, FD_CLOEXEC);
+  }
+  return descriptor;
+#endif
+}
+
+void EpollEngine::acceptAll(Entry* entry) {
+  while (true) {
+    ++syscall_count;
+    const int32_t descriptor = AcceptConnection(entry->descriptor);
+    if (descriptor < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        complete(Op::Accept, entry->accept_tag, -errno, true);
+      }
+      return;
+    }
+    complete(Op::Accept, entry->accept_tag, descriptor, true);
+  }
+}
+
+void EpollEngine::receive(Entry* entry) {
+  // Level triggered: one read per wait(), whatever is left comes next time
+  if (free_buffers.empty()) {
+    return;
+  }
+
+  const int32_t buffer = free_buffers.back();
+  ++syscall_count;
+  const ssize_t bytes = recv(entry->descriptor, &receive_buffers[(size_t)buffer * kReceiveBufferSize],
+    kReceiveBufferSize, 0);
+  if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+
+  if (bytes > 0) {
+    free_buffers.pop_back();
+    complete(Op::Receive, entry->receive_tag, (int32_t)bytes, true, buffer);
+    return;
+  }
+
+  // Closed or failed: the multishot receive is over
+  complete(Op::Receive, entry->receive_tag, bytes == 0 ? 0 : -errno, false);
+  entry->receiving = false;
+  updateInterest(entry);
+}
+
+uint32_t EpollEngine::wait(Completion* completions, uint32_t max_completions, int32_t timeout_ms) {
+  free_buffers.insert(free_buffers.end(), lent_buffers.begin(), lent_buffers.end());
+  lent_buffers.clear();
+
+  if (pending.size() < max_completions) {
+    Poller::Event events[256];
+    ++syscall_count;
+    const uint32_t count = poller.wait(events, std::min<uint32_t>(256, max_completions),
+      pending.empty() ? timeout_ms : 0);
+    for (uint32_t i = 0; i < count; ++i) {
+      Entry* entry = (Entry*)events[i].user;
+      if (!entry) {
+        ++syscall_count;
+        wakeup->clear();
+        complete(Op::Wakeup, wakeup_tag, 0, true);
+        continue;
+      }
+      const bool readable = (events[i].events & (Poller::kReadable | Poller::kClosed)) != 0;
+      if (readable && entry->accepting) {
+        acceptAll(entry);
+      }
+      if (readable && entry->receiving) {
+        receive(entry);
+      }
+      if ((events[i].events & (Poller::kWritable | Poller::kClosed)) && entry->sending && !flush(entry)) {
+        updateInterest(entry);
+      }
+    }
+  }
+
+  const uint32_t count = std::min<uint32_t>(max_completions, (uint32_t)pending.size());
+  for (uint32_t i = 0; i < count; ++i) {
+    completions[i] = pending[i].completion;
+    if (pending[i].buffer >= 0) {
+      lent_buffers.push_back(pending[i].buffer);
+    }
+  }
+  pending.erase(pending.begin(), pending.begin() + count);
+
+  return count;
+}
+// [\epoll]
+
+IoEngine* IoEngine::Create(bool allow_uring) {
+#ifdef IO_ENGINE_HAS_URING
+  if (allow_uring) {
+    IoUringEngine* engine = new IoUringEngine();
+    if (engine->initialize()) {
+      return engine;
+    }
+    delete engine;
+  }
+#else
+  (void)allow_uring;
+#endif
+
+  return new EpollEngine();
+}
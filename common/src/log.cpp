@@ -0,0 +1,306 @@
+#include "log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records per thread. A thread that logs more than this between two
+// passes of the writer loses messages.
+static const uint32_t kLogRingSize = 512;
+// How often the writer looks at the rings
+static const uint32_t kLogWriteIntervalMs = 5;
+static const uint64_t kLogRateWindowNs = 1000000000ull;
+
+std::atomic<uint32_t> g_log_level((uint32_t)LogLevel::Info);
+static std::atomic<bool> g_log_all_to_stderr(false);
+
+// Single producer (the thread it belongs to), single consumer (the writer)
+struct LogRing {
+  LogRecord records[kLogRingSize];
+  std::atomic<uint64_t> head;     // written by the producer
+  std::atomic<uint64_t> tail;     // written by the writer
+  std::atomic<uint64_t> dropped;  // full ring
+};
+
+struct LogWriter {
+  std::mutex mutex;               // rings list and flushes, never the producers
+  std::vector<LogRing*> rings;
+  std::thread thread;
+  std::atomic<bool> should_finish{false};
+  bool started = false;
+};
+
+static LogWriter& GetWriter() {
+  // Never destroyed: threads may still log while statics go away
+  static LogWriter* writer = new LogWriter();
+  return *writer;
+}
+
+static thread_local LogRing* t_ring = nullptr;
+
+void LogSetLevel(LogLevel level) {
+  g_log_level = (uint32_t)level;
+}
+
+void LogAllToStderr() {
+  g_log_all_to_stderr.store(true, std::memory_order_relaxed);
+}
+
+bool ParseLogLevel(const char* name, LogLevel* level) {
+  static const char* kNames[] = { "debug", "info", "warning", "error", "off" };
+  for (uint32_t i = 0; i <= (uint32_t)LogLevel::Off; ++i) {
+    if (strcmp(name, kNames[i]) == 0) {
+      *level = (LogLevel)i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool LogAdmit(LogSite* site, uint64_t now_ns, uint32_t* suppressed) {
+  if (site->rate_limit == 0) {
+    *suppressed = 0;
+    return true;
+  }
+
+  const uint64_t window_start_ns = site->window_start_ns.load(std::memory_order_relaxed);
+  if (now_ns - window_start_ns >= kLogRateWindowNs) {
+    // Two threads may both start a window, which only lets a few more in
+    site->window_start_ns.store(now_ns, std::memory_order_relaxed);
+    site->window_count.store(0, std::memory_order_relaxed);
+  }
+
+  if (site->window_count.fetch_add(1, std::memory_order_relaxed) >= site->rate_limit) {
+    site->suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  *suppressed = site->suppressed.exchange(0, std::memory_order_relaxed);
+  return true;
+}
+
+// [Writer]
+// Formats one printf conversion ('spec', without length modifiers) with
+// the argument as it was captured
+static void FormatArg(std::string* out, std::string spec, const LogRecord& record, uint32_t index) {
+  char buffer[256];
+  const char conversion = spec.back();
+  if (index >= record.arg_count) {
+    *out += spec;
+    return;
+  }
+
+  const uint64_t value = record.values[index];
+  switch (record.types[index]) {
+    case LogArgType::Signed:
+    case LogArgType::Unsigned: {
+      if (conversion == 'c') {
+        snprintf(buffer, sizeof(buffer), spec.c_str(), (int)value);
+      }
+      else if (conversion == 'f' || conversion == 'e' || conversion == 'g') {
+        snprintf(buffer, sizeof(buffer), spec.c_str(), (double)(int64_t)value);
+      }
+      else {
+        spec.insert(spec.size() - 1, "ll");
+        snprintf(buffer, sizeof(buffer), spec.c_str(), (unsigned long long)value);
+      }
+      break;
+    }
+    case LogArgType::Double: {
+      double number = 0.0;
+      memcpy(&number, &value, sizeof(number));
+      snprintf(buffer, sizeof(buffer), spec.c_str(), number);
+      break;
+    }
+    case LogArgType::String: {
+      snprintf(buffer, sizeof(buffer), spec.c_str(), record.text + value);
+      break;
+    }
+    case LogArgType::Pointer: {
+      snprintf(buffer, sizeof(buffer), "%p", (void*)(uintptr_t)value);
+      break;
+    }
+  }
+
+  *out += buffer;
+}
+
+static void FormatRecord(std::string* out, const LogRecord& record) {
+  const char* format = record.site->format;
+  uint32_t arg = 0;
+  for (const char* c = format; *c; ++c) {
+    if (*c != '%') {
+      *out += *c;
+      continue;
+    }
+    if (c[1] == '%') {
+      *out += '%';
+      ++c;
+      continue;
+    }
+
+    // %[flags][width][.precision][length]conversion, the length is
+    // dropped: every argument was widened when it was captured. A '*'
+    // width or precision takes the next argument, written into the spec
+    // as a number, so snprintf() gets a single argument.
+    std::string spec = "%";
+    ++c;
+    while (*c && strchr("-+ #0123456789.*", *c)) {
+      if (*c != '*') {
+        spec += *c++;
+        continue;
+      }
+
+      const bool precision = spec.back() == '.';
+      const int64_t value = (arg < record.arg_count && record.types[arg] != LogArgType::Double &&
+        record.types[arg] != LogArgType::String) ? (int64_t)record.values[arg] : 0;
+      ++arg;
+      ++c;
+      if (precision && value < 0) {
+        // Negative precision: as if there were none
+        spec.pop_back();
+      }
+      else {
+        spec += std::to_string((long long)value);
+      }
+    }
+    while (*c && strchr("hlqjztL", *c)) {
+      ++c;
+    }
+    if (!*c) {
+      break;
+    }
+    spec += *c;
+    FormatArg(out, spec, record, arg++);
+  }
+
+  if (record.suppressed > 0) {
+    char note[80];
+    snprintf(note, sizeof(note), "(%u similar messages suppressed)\n", record.suppressed);
+    *out += note;
+  }
+}
+
+// With the writer's mutex held
+static void WriteRecords(LogWriter* writer) {
+  const std::vector<LogRing*>& rings = writer->rings;
+
+  // Everything that is in now, in time order across threads
+  struct Pending {
+    uint64_t time_ns;
+    const LogRecord* record;
+  };
+  std::vector<Pending> pending;
+  std::vector<uint64_t> heads(rings.size());
+  uint64_t dropped = 0;
+  for (uint32_t r = 0; r < rings.size(); ++r) {
+    LogRing* ring = rings[r];
+    heads[r] = ring->head.load(std::memory_order_acquire);
+    for (uint64_t i = ring->tail.load(std::memory_order_relaxed); i < heads[r]; ++i) {
+      const LogRecord* record = &ring->records[i % kLogRingSize];
+      Pending entry = { record->time_ns, record };
+      pending.push_back(entry);
+    }
+    dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+  }
+  std::stable_sort(pending.begin(), pending.end(),
+    [](const Pending& a, const Pending& b) { return a.time_ns < b.time_ns; });
+
+  std::string out_text;
+  std::string error_text;
+  const bool all_to_stderr = g_log_all_to_stderr.load(std::memory_order_relaxed);
+  for (uint32_t i = 0; i < pending.size(); ++i) {
+    const LogRecord& record = *pending[i].record;
+    const bool to_stderr = all_to_stderr || record.site->level >= LogLevel::Warning;
+    FormatRecord(to_stderr ? &error_text : &out_text, record);
+  }
+  if (dropped > 0) {
+    char note[64];
+    snprintf(note, sizeof(note), "Log: %llu messages dropped\n", (unsigned long long)dropped);
+    error_text += note;
+  }
+
+  // The records are formatted, the producers can have the slots back
+  for (uint32_t r = 0; r < rings.size(); ++r) {
+    rings[r]->tail.store(heads[r], std::memory_order_release);
+  }
+
+  if (!out_text.empty()) {
+    fwrite(out_text.data(), 1, out_text.size(), stdout);
+    fflush(stdout);
+  }
+  if (!error_text.empty()) {
+    fwrite(error_text.data(), 1, error_text.size(), stderr);
+  }
+}
+
+static void WriterLoop(LogWriter* writer) {
+  while (!writer->should_finish.load(std::memory_order_relaxed)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(kLogWriteIntervalMs));
+    std::unique_lock<std::mutex> lock(writer->mutex);
+    WriteRecords(writer);
+  }
+}
+
+static void StopWriter() {
+  LogWriter& writer = GetWriter();
+  writer.should_finish = true;
+  if (writer.thread.joinable()) {
+    writer.thread.join();
+  }
+  std::unique_lock<std::mutex> lock(writer.mutex);
+  WriteRecords(&writer);
+}
+
+void LogFlush() {
+  LogWriter& writer = GetWriter();
+  std::unique_lock<std::mutex> lock(writer.mutex);
+  WriteRecords(&writer);
+}
+// [\Writer]
+
+// First message of the thread: its ring, and the writer if this is the
+// first message at all
+static LogRing* ThreadRing() {
+  if (!t_ring) {
+    t_ring = new LogRing();
+    t_ring->head = 0;
+    t_ring->tail = 0;
+    t_ring->dropped = 0;
+
+    LogWriter& writer = GetWriter();
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    writer.rings.push_back(t_ring);
+    if (!writer.started) {
+      writer.started = true;
+      writer.thread = std::thread(WriterLoop, &writer);
+      atexit(StopWriter);
+    }
+  }
+
+  return t_ring;
+}
+
+LogRecord* LogBeginRecord(uint64_t now_ns) {
+  LogRing* ring = ThreadRing();
+  const uint64_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) >= kLogRingSize) {
+    // Rare, and the writer resets it
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  LogRecord* record = &ring->records[head % kLogRingSize];
+  record->time_ns = now_ns;
+  return record;
+}
+
+void LogCommitRecord() {
+  LogRing* ring = t_ring;
+  ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
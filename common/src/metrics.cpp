@@ -0,0 +1,467 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <mutex>
+
+#include "log.h"
+
+// [Shards]
+struct HistogramShard {
+  std::atomic<uint64_t> buckets[kHistogramBucketCount];
+  std::atomic<uint64_t> sum;
+};
+
+// Everything one thread records. Never freed: what a thread recorded
+// still counts after it is gone.
+struct ThreadShards {
+  std::atomic<HistogramShard*> histograms[kMaxMetrics];  // allocated on first use
+  std::atomic<uint64_t> counters[kMaxMetrics];
+};
+
+struct MetricsRegistry {
+  std::mutex mutex;
+  std::vector<ThreadShards*> threads;
+  const Histogram* histograms[kMaxMetrics];
+  uint32_t histogram_count = 0;
+  const Counter* counters[kMaxMetrics];
+  uint32_t counter_count = 0;
+};
+
+// Metrics are globals in other translation units, this can't be one
+static MetricsRegistry& GetRegistry() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+static thread_local ThreadShards* t_shards = nullptr;
+
+// First record from a thread
+__attribute__((noinline)) static ThreadShards* MakeThreadShards() {
+  t_shards = new ThreadShards();
+  MetricsRegistry& registry = GetRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  registry.threads.push_back(t_shards);
+
+  return t_shards;
+}
+
+// Inlined into every record(): the cached pointer, one TLS load
+static inline ThreadShards* GetThreadShards() {
+  ThreadShards* shards = t_shards;
+  if (__builtin_expect(shards == nullptr, 0)) {
+    shards = MakeThreadShards();
+  }
+
+  return shards;
+}
+
+// With the registry's mutex held
+static HistogramShard* MakeHistogramShard(ThreadShards* shards, uint32_t id) {
+  HistogramShard* shard = shards->histograms[id].load(std::memory_order_relaxed);
+  if (!shard) {
+    shard = new HistogramShard();
+    shards->histograms[id].store(shard, std::memory_order_release);
+  }
+
+  return shard;
+}
+
+// A thread that didn't call MetricsRegisterThread(), once per histogram.
+// Out of line, record() itself stays a load and two stores.
+__attribute__((noinline)) static HistogramShard* LateHistogramShard(ThreadShards* shards, uint32_t id) {
+  MetricsRegistry& registry = GetRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  return MakeHistogramShard(shards, id);
+}
+
+// Only the owning thread writes, so a plain load and store is enough
+static inline void Increment(std::atomic<uint64_t>* value, uint64_t amount) {
+  value->store(value->load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+// [\Shards]
+
+// [Timer ticks]
+// How long TimerTicks() is measured against steady_clock
+static const uint64_t kTimerCalibrationNs = 2000000;
+
+static double MeasureNanosPerTick() {
+  const uint64_t start_ns = MonotonicNanos();
+  const uint64_t start_ticks = TimerTicks();
+  uint64_t elapsed_ns = 0;
+  while (elapsed_ns < kTimerCalibrationNs) {
+    elapsed_ns = MonotonicNanos() - start_ns;
+  }
+  const uint64_t elapsed_ticks = TimerTicks() - start_ticks;
+
+  return elapsed_ticks > 0 ? (double)elapsed_ns / elapsed_ticks : 1.0;
+}
+
+// Measured once, by the first histogram's constructor (static
+// initialization), so no timer on a hot path pays for it
+static double NanosPerTick() {
+  static const double nanos_per_tick = MeasureNanosPerTick();
+  return nanos_per_tick;
+}
+
+uint64_t TimerTicksToNanos(uint64_t ticks) {
+  return (uint64_t)(ticks * NanosPerTick());
+}
+// [\Timer ticks]
+
+// [LatencyHistogram]
+LatencyHistogram::LatencyHistogram() : buckets(kHistogramBucketCount, 0) {
+  total_count = 0;
+  total_sum = 0;
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds) {
+  ++buckets[BucketIndex(nanoseconds)];
+  ++total_count;
+  total_sum += nanoseconds;
+}
+
+void LatencyHistogram::clear() {
+  std::fill(buckets.begin(), buckets.end(), 0);
+  total_count = 0;
+  total_sum = 0;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (uint32_t i = 0; i < kHistogramBucketCount; ++i) {
+    buckets[i] += other.buckets[i];
+  }
+  total_count += other.total_count;
+  total_sum += other.total_sum;
+}
+
+void LatencyHistogram::subtract(const LatencyHistogram& other) {
+  for (uint32_t i = 0; i < kHistogramBucketCount; ++i) {
+    buckets[i] -= other.buckets[i];
+  }
+  total_count -= other.total_count;
+  total_sum -= other.total_sum;
+}
+
+uint64_t LatencyHistogram::count() const {
+  return total_count;
+}
+
+uint64_t LatencyHistogram::sum() const {
+  return total_sum;
+}
+
+uint64_t LatencyHistogram::countBelow(uint64_t nanoseconds) const {
+  // Buckets never straddle a value: everything under the bucket of
+  // 'nanoseconds' is below it (within the bucket precision)
+  const uint32_t end = BucketIndex(nanoseconds);
+  uint64_t count = 0;
+  for (uint32_t i = 0; i < end; ++i) {
+    count += buckets[i];
+  }
+
+  return count;
+}
+
+double LatencyHistogram::mean() const {
+  return total_count > 0 ? (double)total_sum / total_count : 0.0;
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const {
+  if (total_count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(fraction * total_count + 0.5);
+  rank = std::max<uint64_t>(1, std::min(rank, total_count));
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < kHistogramBucketCount; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return BucketValue(i);
+    }
+  }
+
+  return BucketValue(kHistogramBucketCount - 1);
+}
+
+uint64_t LatencyHistogram::max() const {
+  for (uint32_t i = kHistogramBucketCount; i > 0; --i) {
+    if (buckets[i - 1] > 0) {
+      return BucketTop(i - 1);
+    }
+  }
+
+  return 0;
+}
+
+/*static*/uint32_t LatencyHistogram::BucketIndex(uint64_t nanoseconds) {
+  const uint64_t sub_buckets = 1ull << kHistogramSubBucketBits;
+  if (nanoseconds < sub_buckets) {
+    return (uint32_t)nanoseconds;
+  }
+
+  const uint32_t exponent = 63 - (uint32_t)__builtin_clzll(nanoseconds);
+  if (exponent >= kHistogramMaxExponent) {
+    return kHistogramBucketCount - 1;
+  }
+
+  // The bits right below the leading one pick the sub-bucket
+  const uint32_t shift = exponent - kHistogramSubBucketBits;
+  return ((shift + 1) << kHistogramSubBucketBits) + (uint32_t)((nanoseconds >> shift) - sub_buckets);
+}
+
+/*static*/uint64_t LatencyHistogram::BucketValue(uint32_t index) {
+  const uint64_t sub_buckets = 1ull << kHistogramSubBucketBits;
+  if (index < sub_buckets) {
+    return index;
+  }
+
+  const uint32_t shift = (index >> kHistogramSubBucketBits) - 1;
+  const uint64_t bottom = (sub_buckets + (index & (sub_buckets - 1))) << shift;
+  return bottom + ((1ull << shift) >> 1);
+}
+
+/*static*/uint64_t LatencyHistogram::BucketTop(uint32_t index) {
+  const uint64_t sub_buckets = 1ull << kHistogramSubBucketBits;
+  if (index < sub_buckets) {
+    return index;
+  }
+
+  const uint32_t shift = (index >> kHistogramSubBucketBits) - 1;
+  const uint64_t bottom = (sub_buckets + (index & (sub_buckets - 1))) << shift;
+  return bottom + (1ull << shift) - 1;
+}
+// [\LatencyHistogram]
+
+// [Metrics]
+Histogram::Histogram(const char* name) {
+  histogram_name = name;
+  NanosPerTick();
+  MetricsRegistry& registry = GetRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  assert(registry.histogram_count < kMaxMetrics && "too many histograms");
+  id = std::min(registry.histogram_count, kMaxMetrics - 1);
+  registry.histograms[id] = this;
+  registry.histogram_count = id + 1;
+  // Threads that registered before this histogram existed
+  for (uint32_t i = 0; i < registry.threads.size(); ++i) {
+    MakeHistogramShard(registry.threads[i], id);
+  }
+}
+
+void Histogram::record(uint64_t nanoseconds) {
+  ThreadShards* shards = GetThreadShards();
+  HistogramShard* shard = shards->histograms[id].load(std::memory_order_relaxed);
+  if (!shard) {
+    shard = LateHistogramShard(shards, id);
+  }
+
+  Increment(&shard->buckets[LatencyHistogram::BucketIndex(nanoseconds)], 1);
+  Increment(&shard->sum, nanoseconds);
+}
+
+void Histogram::recordTicks(uint64_t ticks) {
+  record(TimerTicksToNanos(ticks));
+}
+
+LatencyHistogram Histogram::snapshot() const {
+  LatencyHistogram histogram;
+  MetricsRegistry& registry = GetRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  for (uint32_t i = 0; i < registry.threads.size(); ++i) {
+    const HistogramShard* shard = registry.threads[i]->histograms[id].load(std::memory_order_acquire);
+    if (!shard) {
+      continue;
+    }
+
+    // The count comes from the buckets themselves, so a record() landing
+    // halfway through can't make them disagree; only the sum may be a
+    // sample ahead
+    for (uint32_t b = 0; b < kHistogramBucketCount; ++b) {
+      const uint64_t count = shard->buckets[b].load(std::memory_order_relaxed);
+      histogram.buckets[b] += count;
+      histogram.total_count += count;
+    }
+    histogram.total_sum += shard->sum.load(std::memory_order_relaxed);
+  }
+
+  return histogram;
+}
+
+const char* Histogram::name() const {
+  return histogram_name;
+}
+
+Counter::Counter(const char* name) {
+  counter_name = name;
+  MetricsRegistry& registry = GetRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  assert(registry.counter_count < kMaxMetrics && "too many counters");
+  id = std::min(registry.counter_count, kMaxMetrics - 1);
+  registry.counters[id] = this;
+  registry.counter_count = id + 1;
+}
+
+void Counter::add(uint64_t value) {
+  Increment(&GetThreadShards()->counters[id], value);
+}
+
+uint64_t Counter::value() const {
+  uint64_t total = 0;
+  MetricsRegistry& registry = GetRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  for (uint32_t i = 0; i < registry.threads.size(); ++i) {
+    total += registry.threads[i]->counters[id].load(std::memory_order_relaxed);
+  }
+
+  return total;
+}
+
+const char* Counter::name() const {
+  return counter_name;
+}
+
+void MetricsRegisterThread() {
+  ThreadShards* shards = GetThreadShards();
+  MetricsRegistry& registry = GetRegistry();
+  std::unique_lock<std::mutex> lock(registry.mutex);
+  for (uint32_t id = 0; id < registry.histogram_count; ++id) {
+    MakeHistogramShard(shards, id);
+  }
+}
+// [\Metrics]
+
+// [MetricsReport]
+MetricsReport::MetricsReport() {
+  last_print_ns = MonotonicNanos();
+}
+
+void MetricsReport::print() {
+  MetricsRegistry& registry = GetRegistry();
+  uint32_t histogram_count = 0;
+  uint32_t counter_count = 0;
+  {
+    std::unique_lock<std::mutex> lock(registry.mutex);
+    histogram_count = registry.histogram_count;
+    counter_count = registry.counter_count;
+  }
+  last_histograms.resize(histogram_count);
+  last_counters.resize(counter_count, 0);
+
+  const uint64_t now_ns = MonotonicNanos();
+  const double seconds = (now_ns - last_print_ns) / 1.0e9;
+  last_print_ns = now_ns;
+
+  for (uint32_t i = 0; i < histogram_count; ++i) {
+    const Histogram* metric = registry.histograms[i];
+    LatencyHistogram current = metric->snapshot();
+    LatencyHistogram window = current;
+    window.subtract(last_histograms[i]);
+    last_histograms[i] = current;
+    if (window.count() == 0) {
+      continue;
+    }
+
+    LOG_STATS("%-24s %7llu  mean %8.3fms  p50 %8.3fms  p95 %8.3fms  p99 %8.3fms  max %8.3fms\n",
+      metric->name(), (unsigned long long)window.count(), window.mean() / 1.0e6,
+      window.percentile(0.5) / 1.0e6, window.percentile(0.95) / 1.0e6,
+      window.percentile(0.99) / 1.0e6, window.max() / 1.0e6);
+  }
+
+  for (uint32_t i = 0; i < counter_count; ++i) {
+    const Counter* metric = registry.counters[i];
+    const uint64_t current = metric->value();
+    const uint64_t delta = current - last_counters[i];
+    last_counters[i] = current;
+    if (delta == 0) {
+      continue;
+    }
+
+    LOG_STATS("%-24s %7llu  (%.1f/s)\n", metric->name(), (unsigned long long)current,
+      seconds > 0.0 ? delta / seconds : 0.0);
+  }
+}
+// [\MetricsReport]
+
+// [Prometheus]
+static const uint32_t kPrometheusFirstBucketExponent = 10;   // 1.024us
+static const uint32_t kPrometheusLastBucketExponent = 34;    // 17.2s
+
+// webcam_ + the name with anything Prometheus doesn't take as '_'
+static std::string PrometheusName(const char* name, const char* suffix) {
+  std::string result = "webcam_";
+  for (const char* c = name; *c; ++c) {
+    const bool valid = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9');
+    result += valid ? *c : '_';
+  }
+  result += suffix;
+
+  return result;
+}
+
+void AppendPrometheusType(std::string* out, const char* name, const char* type) {
+  *out += "# TYPE ";
+  *out += name;
+  *out += " ";
+  *out += type;
+  *out += "\n";
+}
+
+void AppendPrometheusSample(std::string* out, const char* name, const char* labels, double value) {
+  char number[32];
+  snprintf(number, sizeof(number), "%.9g", value);
+  *out += name;
+  if (labels && labels[0]) {
+    *out += "{";
+    *out += labels;
+    *out += "}";
+  }
+  *out += " ";
+  *out += number;
+  *out += "\n";
+}
+
+void AppendPrometheusMetrics(std::string* out) {
+  MetricsRegistry& registry = GetRegistry();
+  uint32_t histogram_count = 0;
+  uint32_t counter_count = 0;
+  {
+    std::unique_lock<std::mutex> lock(registry.mutex);
+    histogram_count = registry.histogram_count;
+    counter_count = registry.counter_count;
+  }
+
+  for (uint32_t i = 0; i < histogram_count; ++i) {
+    const Histogram* metric = registry.histograms[i];
+    const LatencyHistogram histogram = metric->snapshot();
+    const std::string name = PrometheusName(metric->name(), "_seconds");
+    AppendPrometheusType(out, name.c_str(), "histogram");
+
+    const std::string bucket_name = name + "_bucket";
+    char labels[32];
+    for (uint32_t e = kPrometheusFirstBucketExponent; e <= kPrometheusLastBucketExponent; ++e) {
+      snprintf(labels, sizeof(labels), "le=\"%.9g\"", (double)(1ull << e) / 1.0e9);
+      AppendPrometheusSample(out, bucket_name.c_str(), labels, (double)histogram.countBelow(1ull << e));
+    }
+    AppendPrometheusSample(out, bucket_name.c_str(), "le=\"+Inf\"", (double)histogram.count());
+    AppendPrometheusSample(out, (name + "_sum").c_str(), nullptr, histogram.sum() / 1.0e9);
+    AppendPrometheusSample(out, (name + "_count").c_str(), nullptr, (double)histogram.count());
+  }
+
+  for (uint32_t i = 0; i < counter_count; ++i) {
+    const Counter* metric = registry.counters[i];
+    std::string base = metric->name();
+    const bool duration = base.size() > 3 && base.compare(base.size() - 3, 3, "_ns") == 0;
+    if (duration) {
+      base.resize(base.size() - 3);
+    }
+
+    const std::string name = PrometheusName(base.c_str(), duration ? "_seconds_total" : "_total");
+    AppendPrometheusType(out, name.c_str(), "counter");
+    AppendPrometheusSample(out, name.c_str(), nullptr,
+      duration ? metric->value() / 1.0e9 : (double)metric->value());
+  }
+}
+// [\Prometheus]
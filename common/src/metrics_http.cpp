@@ -0,0 +1,123 @@
+#include "metrics_http.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "log.h"
+#include "metrics.h"
+
+// A client gets this long to send its request and read the answer
+static const uint64_t kRequestTimeoutNs = 1000000000ull;
+static const uint32_t kMaxRequestSize = 4096;
+
+MetricsHttpServer::MetricsHttpServer() : listener(Socket::Type::NonBlock, 8), should_finish(false) {
+}
+
+MetricsHttpServer::~MetricsHttpServer() {
+  stop();
+}
+
+bool MetricsHttpServer::start(uint32_t port, ExtraMetrics extra) {
+  if (!listener.bind(port) || !listener.listen()) {
+    LOG_ERROR("Metrics: can't listen on port %u\n", port);
+    return false;
+  }
+  if (!poller.isValid() || !wakeup.isValid() ||
+      !poller.add(listener, Poller::kReadable, &listener) || !poller.add(wakeup, &wakeup)) {
+    LOG_ERROR("Metrics: can't wait for connections on port %u\n", port);
+    listener.close();
+    return false;
+  }
+
+  extra_metrics = extra;
+  should_finish = false;
+  thread = std::thread(&MetricsHttpServer::serve, this);
+  LOG_INFO("Metrics: http://localhost:%u/metrics\n", port);
+  return true;
+}
+
+void MetricsHttpServer::stop() {
+  if (!thread.joinable()) {
+    return;
+  }
+
+  should_finish = true;
+  wakeup.notify();
+  thread.join();
+  listener.close();
+}
+
+void MetricsHttpServer::serve() {
+  Poller::Event events[2];
+  while (!should_finish) {
+    const uint32_t count = poller.wait(events, 2, -1);
+    for (uint32_t i = 0; i < count; ++i) {
+      if (events[i].user == &wakeup) {
+        wakeup.clear();
+        continue;
+      }
+
+      // Everyone who is waiting, one after the other
+      while (!should_finish) {
+        TCPSocket* socket = listener.accept();
+        if (!socket) {
+          break;
+        }
+
+        answer(socket);
+        socket->close();
+        delete socket;
+      }
+    }
+  }
+}
+
+void MetricsHttpServer::answer(TCPSocket* socket) {
+  const uint64_t deadline_ns = MonotonicNanos() + kRequestTimeoutNs;
+
+  // Only the request line matters, but the whole header is read so the
+  // client doesn't get a reset for unread data. Each round waits for one
+  // byte, then takes whatever else has already come.
+  std::string request;
+  byte buffer[512];
+  while (request.find("\r\n\r\n") == std::string::npos && request.size() < kMaxRequestSize) {
+    Socket::TransferStatus status = socket->receiveExact(buffer, 1, deadline_ns);
+    uint32_t read = 0;
+    if (status == Socket::TransferStatus::Complete) {
+      const uint32_t available = std::min<uint32_t>(socket->availableBytes(), sizeof(buffer) - 1);
+      status = socket->receiveExact(buffer + 1, available, deadline_ns, &read);
+    }
+    if (status != Socket::TransferStatus::Complete) {
+      LOG_DEBUG("Metrics: request not read: %s\n", TransferStatusName(status));
+      return;
+    }
+
+    request.append((const char*)buffer, read + 1);
+  }
+
+  std::string body;
+  const char* status = "200 OK";
+  if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 14, "GET /metrics?") == 0) {
+    AppendPrometheusMetrics(&body);
+    if (extra_metrics) {
+      extra_metrics(&body);
+    }
+  }
+  else {
+    status = "404 Not Found";
+    body = "Try /metrics\n";
+  }
+
+  char header[160];
+  snprintf(header, sizeof(header), "HTTP/1.1 %s\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Content-Length: %u\r\n"
+    "Connection: close\r\n\r\n", status, (uint32_t)body.size());
+  const std::string response = header + body;
+
+  const Socket::TransferStatus sent = socket->sendAll((const byte*)response.data(),
+    (uint32_t)response.size(), deadline_ns);
+  if (sent != Socket::TransferStatus::Complete) {
+    LOG_DEBUG("Metrics: answer not sent: %s\n", TransferStatusName(sent));
+  }
+}
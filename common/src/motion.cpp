@@ -0,0 +1,348 @@
+#include "motion.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+
+#if defined(SIMD_X86)
+  #include <immintrin.h>
+#endif
+#if defined(SIMD_HAS_NEON)
+  #include <arm_neon.h>
+#endif
+
+typedef uint32_t (*SADKernel)(const byte* a, const byte* b, uint32_t stride, LumaLayout layout);
+
+// [SAD kernels]
+static uint32_t SAD16x16Scalar(const byte* a, const byte* b, uint32_t stride, LumaLayout layout) {
+  const uint32_t step = (layout == LumaLayout::YUYV) ? 2 : 1;
+
+  uint32_t sad = 0;
+  for (uint32_t y = 0; y < kMotionBlockSize; ++y) {
+    const byte* row_a = a + y * stride;
+    const byte* row_b = b + y * stride;
+    for (uint32_t x = 0; x < kMotionBlockSize * step; x += step) {
+      int32_t diff = (int32_t)row_a[x] - (int32_t)row_b[x];
+      sad += (uint32_t)(diff < 0 ? -diff : diff);
+    }
+  }
+
+  return sad;
+}
+
+#if defined(SIMD_HAS_SSE2)
+static uint32_t SAD16x16SSE2(const byte* a, const byte* b, uint32_t stride, LumaLayout layout) {
+  __m128i acc = _mm_setzero_si128();
+
+  if (layout == LumaLayout::YUYV) {
+    // 16 luma samples span 32 bytes; zero the chroma bytes so psadbw only
+    // accumulates luma differences
+    const __m128i luma_mask = _mm_set1_epi16(0x00FF);
+    for (uint32_t y = 0; y < kMotionBlockSize; ++y) {
+      const byte* row_a = a + y * stride;
+      const byte* row_b = b + y * stride;
+      __m128i a0 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(row_a)), luma_mask);
+      __m128i a1 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(row_a + 16)), luma_mask);
+      __m128i b0 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(row_b)), luma_mask);
+      __m128i b1 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(row_b + 16)), luma_mask);
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(a0, b0));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(a1, b1));
+    }
+  }
+  else {
+    for (uint32_t y = 0; y < kMotionBlockSize; ++y) {
+      __m128i row_a = _mm_loadu_si128((const __m128i*)(a + y * stride));
+      __m128i row_b = _mm_loadu_si128((const __m128i*)(b + y * stride));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(row_a, row_b));
+    }
+  }
+
+  return (uint32_t)(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+}
+#endif
+
+#if defined(SIMD_HAS_AVX2_TARGET)
+SIMD_TARGET_AVX2
+static uint32_t SAD16x16AVX2(const byte* a, const byte* b, uint32_t stride, LumaLayout layout) {
+  __m256i acc = _mm256_setzero_si256();
+
+  if (layout == LumaLayout::YUYV) {
+    // One YUYV row of the block is exactly one 256 bit register
+    const __m256i luma_mask = _mm256_set1_epi16(0x00FF);
+    for (uint32_t y = 0; y < kMotionBlockSize; ++y) {
+      __m256i row_a = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(a + y * stride)), luma_mask);
+      __m256i row_b = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(b + y * stride)), luma_mask);
+      acc = _mm256_add_epi64(acc, _mm256_sad_epu8(row_a, row_b));
+    }
+  }
+  else {
+    // Two planar rows per register
+    for (uint32_t y = 0; y < kMotionBlockSize; y += 2) {
+      const byte* row_a = a + y * stride;
+      const byte* row_b = b + y * stride;
+      __m256i rows_a = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)row_a)),
+        _mm_loadu_si128((const __m128i*)(row_a + stride)), 1);
+      __m256i rows_b = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)row_b)),
+        _mm_loadu_si128((const __m128i*)(row_b + stride)), 1);
+      acc = _mm256_add_epi64(acc, _mm256_sad_epu8(rows_a, rows_b));
+    }
+  }
+
+  __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+
+  return (uint32_t)_mm_cvtsi128_si32(sum);
+}
+#endif
+
+#if defined(SIMD_HAS_NEON)
+static uint32_t SAD16x16NEON(const byte* a, const byte* b, uint32_t stride, LumaLayout layout) {
+  // 16 rows * 2 * 255 fits in each 16 bit lane
+  uint16x8_t acc = vdupq_n_u16(0);
+
+  if (layout == LumaLayout::YUYV) {
+    for (uint32_t y = 0; y < kMotionBlockSize; ++y) {
+      // vld2 deinterleaves: val[0] is luma, val[1] is chroma
+      uint8x16x2_t row_a = vld2q_u8(a + y * stride);
+      uint8x16x2_t row_b = vld2q_u8(b + y * stride);
+      acc = vabal_u8(acc, vget_low_u8(row_a.val[0]), vget_low_u8(row_b.val[0]));
+      acc = vabal_u8(acc, vget_high_u8(row_a.val[0]), vget_high_u8(row_b.val[0]));
+    }
+  }
+  else {
+    for (uint32_t y = 0; y < kMotionBlockSize; ++y) {
+      uint8x16_t row_a = vld1q_u8(a + y * stride);
+      uint8x16_t row_b = vld1q_u8(b + y * stride);
+      acc = vabal_u8(acc, vget_low_u8(row_a), vget_low_u8(row_b));
+      acc = vabal_u8(acc, vget_high_u8(row_a), vget_high_u8(row_b));
+    }
+  }
+
+  uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(acc));
+
+  return (uint32_t)(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+}
+#endif
+
+static SADKernel SelectSADKernel(SimdLevel level) {
+  switch (level) {
+#if defined(SIMD_HAS_SSE2)
+    case SimdLevel::SSE2: {
+      return SAD16x16SSE2;
+    }
+#endif
+#if defined(SIMD_HAS_AVX2_TARGET)
+    case SimdLevel::AVX2: {
+      return SAD16x16AVX2;
+    }
+#endif
+#if defined(SIMD_HAS_NEON)
+    case SimdLevel::NEON: {
+      return SAD16x16NEON;
+    }
+#endif
+    default: {
+      return SAD16x16Scalar;
+    }
+  }
+}
+
+static SimdLevel g_motion_kernel_level = DetectSimdLevel();
+static SADKernel g_sad_kernel = SelectSADKernel(g_motion_kernel_level);
+// [\SAD kernels]
+
+
+// [MotionField]
+MotionField::MotionField() {
+  blocks_x = 0;
+  blocks_y = 0;
+  total_sad = 0;
+  total_zero_sad = 0;
+  candidates_tested = 0;
+}
+
+MotionField::~MotionField() {
+
+}
+
+void MotionField::resize(uint32_t image_width, uint32_t image_height) {
+  blocks_x = image_width / kMotionBlockSize;
+  blocks_y = image_height / kMotionBlockSize;
+  vectors.resize(blocks_x * blocks_y);
+}
+
+MotionVector& MotionField::at(uint32_t block_x, uint32_t block_y) {
+  assert(block_x < blocks_x && block_y < blocks_y && "block out of bounds");
+  return vectors[block_y * blocks_x + block_x];
+}
+
+const MotionVector& MotionField::at(uint32_t block_x, uint32_t block_y) const {
+  assert(block_x < blocks_x && block_y < blocks_y && "block out of bounds");
+  return vectors[block_y * blocks_x + block_x];
+}
+// [\MotionField]
+
+
+MotionSearchParams::MotionSearchParams() {
+  search_range = 16;
+  use_predictors = true;
+}
+
+struct SearchPoint {
+  int32_t dx;
+  int32_t dy;
+};
+
+// Large and small diamond search patterns
+static const SearchPoint kLargeDiamond[8] = {
+  {  0, -2 }, { -1, -1 }, {  1, -1 }, { -2,  0 },
+  {  2,  0 }, { -1,  1 }, {  1,  1 }, {  0,  2 }
+};
+static const SearchPoint kSmallDiamond[4] = {
+  {  0, -1 }, { -1,  0 }, {  1,  0 }, {  0,  1 }
+};
+
+struct BlockSearch {
+  const byte* current_block;
+  const byte* reference;
+  uint32_t stride;
+  uint32_t bytes_per_pixel;
+  LumaLayout layout;
+  int32_t block_x;  // in pixels
+  int32_t block_y;
+  int32_t min_dx, max_dx;
+  int32_t min_dy, max_dy;
+
+  int32_t best_dx;
+  int32_t best_dy;
+  uint32_t best_sad;
+  uint32_t tested;
+
+  bool inRange(int32_t dx, int32_t dy) const {
+    return dx >= min_dx && dx <= max_dx && dy >= min_dy && dy <= max_dy;
+  }
+
+  // Returns true if the candidate improved the best match
+  bool test(int32_t dx, int32_t dy) {
+    if (!inRange(dx, dy)) {
+      return false;
+    }
+
+    const byte* candidate = reference + (block_y + dy) * stride + (block_x + dx) * bytes_per_pixel;
+    uint32_t sad = g_sad_kernel(current_block, candidate, stride, layout);
+    ++tested;
+    if (sad < best_sad) {
+      best_sad = sad;
+      best_dx = dx;
+      best_dy = dy;
+      return true;
+    }
+
+    return false;
+  }
+};
+
+void EstimateMotion(const byte* current, const byte* reference,
+  uint32_t width, uint32_t height, uint32_t stride, LumaLayout layout,
+  const MotionSearchParams& params, MotionField* field) {
+  assert(current && reference && field);
+
+  field->resize(width, height);
+  field->total_sad = 0;
+  field->total_zero_sad = 0;
+  field->candidates_tested = 0;
+
+  BlockSearch search;
+  search.reference = reference;
+  search.stride = stride;
+  search.bytes_per_pixel = (layout == LumaLayout::YUYV) ? 2 : 1;
+  search.layout = layout;
+
+  const int32_t range = params.search_range;
+  const int32_t max_x = (int32_t)(field->blocks_x * kMotionBlockSize) - (int32_t)kMotionBlockSize;
+  const int32_t max_y = (int32_t)(field->blocks_y * kMotionBlockSize) - (int32_t)kMotionBlockSize;
+
+  for (uint32_t by = 0; by < field->blocks_y; ++by) {
+    for (uint32_t bx = 0; bx < field->blocks_x; ++bx) {
+      search.block_x = (int32_t)(bx * kMotionBlockSize);
+      search.block_y = (int32_t)(by * kMotionBlockSize);
+      search.current_block = current + search.block_y * stride + search.block_x * search.bytes_per_pixel;
+
+      // Keep the displaced block inside the reference frame
+      search.min_dx = std::max(-range, -search.block_x);
+      search.max_dx = std::min(range, max_x - search.block_x);
+      search.min_dy = std::max(-range, -search.block_y);
+      search.max_dy = std::min(range, max_y - search.block_y);
+
+      search.best_dx = 0;
+      search.best_dy = 0;
+      search.best_sad = UINT32_MAX;
+      search.tested = 0;
+      search.test(0, 0);
+      const uint32_t zero_sad = search.best_sad;
+
+      if (params.use_predictors) {
+        if (bx > 0) {
+          const MotionVector& left = field->at(bx - 1, by);
+          search.test(left.dx, left.dy);
+        }
+        if (by > 0) {
+          const MotionVector& top = field->at(bx, by - 1);
+          search.test(top.dx, top.dy);
+        }
+      }
+
+      // Large diamond until the center is the best point, then refine
+      for (int32_t step = 0; step < range; ++step) {
+        const int32_t center_dx = search.best_dx;
+        const int32_t center_dy = search.best_dy;
+        for (uint32_t i = 0; i < 8; ++i) {
+          search.test(center_dx + kLargeDiamond[i].dx, center_dy + kLargeDiamond[i].dy);
+        }
+        if (search.best_dx == center_dx && search.best_dy == center_dy) {
+          break;
+        }
+      }
+      const int32_t center_dx = search.best_dx;
+      const int32_t center_dy = search.best_dy;
+      for (uint32_t i = 0; i < 4; ++i) {
+        search.test(center_dx + kSmallDiamond[i].dx, center_dy + kSmallDiamond[i].dy);
+      }
+
+      MotionVector& vector = field->at(bx, by);
+      vector.dx = (int16_t)search.best_dx;
+      vector.dy = (int16_t)search.best_dy;
+      vector.sad = search.best_sad;
+      vector.zero_sad = zero_sad;
+
+      field->total_sad += search.best_sad;
+      field->total_zero_sad += zero_sad;
+      field->candidates_tested += search.tested;
+    }
+  }
+}
+
+uint32_t BlockSAD16x16(const byte* a, const byte* b, uint32_t stride, LumaLayout layout) {
+  return g_sad_kernel(a, b, stride, layout);
+}
+
+bool SetMotionKernel(SimdLevel level) {
+  if (!IsSimdLevelSupported(level)) {
+    return false;
+  }
+  if (SelectSADKernel(level) == SAD16x16Scalar && level != SimdLevel::Scalar) {
+    // Supported by the cpu but not compiled in
+    return false;
+  }
+
+  g_motion_kernel_level = level;
+  g_sad_kernel = SelectSADKernel(level);
+
+  return true;
+}
+
+SimdLevel GetMotionKernel() {
+  return g_motion_kernel_level;
+}
@@ -0,0 +1,587 @@
+#include "pixels.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#if defined(SIMD_X86)
+  #include <immintrin.h>
+#endif
+#if defined(SIMD_HAS_NEON)
+  #include <arm_neon.h>
+#endif
+
+// Converts one pair of YUYV rows. 'v' is null for NV12, where 'u' receives
+// the interleaved UV row.
+typedef void (*RowPairKernel)(const byte* row0, const byte* row1, uint32_t width,
+  byte* y0, byte* y1, byte* u, byte* v);
+
+typedef void (*DownscaleRowKernel)(const byte* row0, const byte* row1, uint32_t dst_width, byte* dst);
+
+static inline byte Clamp255(int32_t value) {
+  return (byte)(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+// Rounding average, same as pavgb / vrhadd
+static inline byte Avg(byte a, byte b) {
+  return (byte)((a + b + 1) >> 1);
+}
+
+// [Row pair kernels]
+static void RowPairScalar(const byte* row0, const byte* row1, uint32_t width,
+  byte* y0, byte* y1, byte* u, byte* v, uint32_t x) {
+  for (; x < width; x += 2) {
+    const byte* p0 = row0 + x * 2;
+    const byte* p1 = row1 + x * 2;
+    y0[x]     = p0[0];
+    y0[x + 1] = p0[2];
+    y1[x]     = p1[0];
+    y1[x + 1] = p1[2];
+
+    byte cb = Avg(p0[1], p1[1]);
+    byte cr = Avg(p0[3], p1[3]);
+    if (v) {
+      u[x / 2] = cb;
+      v[x / 2] = cr;
+    }
+    else {
+      u[x]     = cb;
+      u[x + 1] = cr;
+    }
+  }
+}
+
+static void RowPairScalarKernel(const byte* row0, const byte* row1, uint32_t width,
+  byte* y0, byte* y1, byte* u, byte* v) {
+  RowPairScalar(row0, row1, width, y0, y1, u, v, 0);
+}
+
+#if defined(SIMD_HAS_SSE2)
+static void RowPairSSE2Kernel(const byte* row0, const byte* row1, uint32_t width,
+  byte* y0, byte* y1, byte* u, byte* v) {
+  const __m128i low_mask = _mm_set1_epi16(0x00FF);
+  const __m128i zero = _mm_setzero_si128();
+
+  // 16 pixels (32 bytes of YUYV) per iteration
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i r0a = _mm_loadu_si128((const __m128i*)(row0 + x * 2));
+    __m128i r0b = _mm_loadu_si128((const __m128i*)(row0 + x * 2 + 16));
+    __m128i r1a = _mm_loadu_si128((const __m128i*)(row1 + x * 2));
+    __m128i r1b = _mm_loadu_si128((const __m128i*)(row1 + x * 2 + 16));
+
+    _mm_storeu_si128((__m128i*)(y0 + x),
+      _mm_packus_epi16(_mm_and_si128(r0a, low_mask), _mm_and_si128(r0b, low_mask)));
+    _mm_storeu_si128((__m128i*)(y1 + x),
+      _mm_packus_epi16(_mm_and_si128(r1a, low_mask), _mm_and_si128(r1b, low_mask)));
+
+    // Vertical average of both rows, then keep the chroma (odd) bytes
+    __m128i ca = _mm_srli_epi16(_mm_avg_epu8(r0a, r1a), 8);
+    __m128i cb = _mm_srli_epi16(_mm_avg_epu8(r0b, r1b), 8);
+    __m128i uv = _mm_packus_epi16(ca, cb);  // U0 V0 U1 V1 ...
+
+    if (v) {
+      _mm_storel_epi64((__m128i*)(u + x / 2), _mm_packus_epi16(_mm_and_si128(uv, low_mask), zero));
+      _mm_storel_epi64((__m128i*)(v + x / 2), _mm_packus_epi16(_mm_srli_epi16(uv, 8), zero));
+    }
+    else {
+      _mm_storeu_si128((__m128i*)(u + x), uv);
+    }
+  }
+
+  RowPairScalar(row0, row1, width, y0, y1, u, v, x);
+}
+#endif
+
+#if defined(SIMD_HAS_NEON)
+static void RowPairNEONKernel(const byte* row0, const byte* row1, uint32_t width,
+  byte* y0, byte* y1, byte* u, byte* v) {
+  // 32 pixels (64 bytes of YUYV) per iteration; vld4 splits Y0 U Y1 V
+  uint32_t x = 0;
+  for (; x + 32 <= width; x += 32) {
+    uint8x16x4_t p0 = vld4q_u8(row0 + x * 2);
+    uint8x16x4_t p1 = vld4q_u8(row1 + x * 2);
+
+    uint8x16x2_t luma;
+    luma.val[0] = p0.val[0];
+    luma.val[1] = p0.val[2];
+    vst2q_u8(y0 + x, luma);
+    luma.val[0] = p1.val[0];
+    luma.val[1] = p1.val[2];
+    vst2q_u8(y1 + x, luma);
+
+    uint8x16_t cb = vrhaddq_u8(p0.val[1], p1.val[1]);
+    uint8x16_t cr = vrhaddq_u8(p0.val[3], p1.val[3]);
+    if (v) {
+      vst1q_u8(u + x / 2, cb);
+      vst1q_u8(v + x / 2, cr);
+    }
+    else {
+      uint8x16x2_t uv;
+      uv.val[0] = cb;
+      uv.val[1] = cr;
+      vst2q_u8(u + x, uv);
+    }
+  }
+
+  RowPairScalar(row0, row1, width, y0, y1, u, v, x);
+}
+#endif
+
+static RowPairKernel SelectRowPairKernel(SimdLevel level) {
+  switch (level) {
+#if defined(SIMD_HAS_SSE2)
+    // The kernel is memory bound, AVX2 uses the SSE2 one
+    case SimdLevel::SSE2:
+    case SimdLevel::AVX2: {
+      return RowPairSSE2Kernel;
+    }
+#endif
+#if defined(SIMD_HAS_NEON)
+    case SimdLevel::NEON: {
+      return RowPairNEONKernel;
+    }
+#endif
+    default: {
+      return RowPairScalarKernel;
+    }
+  }
+}
+
+// [\Row pair kernels]
+
+// [Downscale kernels]
+// All of them average vertically first and then horizontally, so every
+// version gives exactly the same result.
+static void DownscaleRowYUYVScalar(const byte* row0, const byte* row1, uint32_t dst_width,
+  byte* dst, uint32_t x) {
+  // 4 source pixels (8 bytes) give 2 output pixels
+  for (; x < dst_width; x += 2) {
+    const byte* a = row0 + x * 4;
+    const byte* b = row1 + x * 4;
+    byte v[8];
+    for (uint32_t i = 0; i < 8; ++i) {
+      v[i] = Avg(a[i], b[i]);
+    }
+    dst[x * 2 + 0] = Avg(v[0], v[2]);
+    dst[x * 2 + 1] = Avg(v[1], v[5]);
+    dst[x * 2 + 2] = Avg(v[4], v[6]);
+    dst[x * 2 + 3] = Avg(v[3], v[7]);
+  }
+}
+
+static void DownscaleRowPlaneScalar(const byte* row0, const byte* row1, uint32_t dst_width,
+  byte* dst, uint32_t x) {
+  for (; x < dst_width; ++x) {
+    dst[x] = Avg(Avg(row0[x * 2], row1[x * 2]), Avg(row0[x * 2 + 1], row1[x * 2 + 1]));
+  }
+}
+
+static void DownscaleRowYUYVScalarKernel(const byte* row0, const byte* row1, uint32_t dst_width, byte* dst) {
+  DownscaleRowYUYVScalar(row0, row1, dst_width, dst, 0);
+}
+
+static void DownscaleRowPlaneScalarKernel(const byte* row0, const byte* row1, uint32_t dst_width, byte* dst) {
+  DownscaleRowPlaneScalar(row0, row1, dst_width, dst, 0);
+}
+
+#if defined(SIMD_HAS_SSE2)
+static void DownscaleRowYUYVSSE2Kernel(const byte* row0, const byte* row1, uint32_t dst_width, byte* dst) {
+  const __m128i low_byte = _mm_set1_epi16(0x00FF);
+  const __m128i low_word = _mm_set1_epi32(0x0000FFFF);
+  const __m128i low_byte32 = _mm_set1_epi32(0x000000FF);
+
+  // 16 source pixels (32 bytes) give 8 output pixels (16 bytes)
+  uint32_t x = 0;
+  for (; x + 8 <= dst_width; x += 8) {
+    __m128i va = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 4)),
+      _mm_loadu_si128((const __m128i*)(row1 + x * 4)));
+    __m128i vb = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 4 + 16)),
+      _mm_loadu_si128((const __m128i*)(row1 + x * 4 + 16)));
+
+    // Luma: 16 samples, averaged in pairs into 16 bit lanes
+    __m128i luma = _mm_packus_epi16(_mm_and_si128(va, low_byte), _mm_and_si128(vb, low_byte));
+    luma = _mm_avg_epu16(_mm_and_si128(luma, low_byte), _mm_srli_epi16(luma, 8));
+
+    // Chroma: U0 V0 U1 V1 ..., averaging neighbouring UV pairs leaves
+    // [U V 0 0] in every 32 bit lane
+    __m128i chroma = _mm_packus_epi16(_mm_srli_epi16(va, 8), _mm_srli_epi16(vb, 8));
+    chroma = _mm_avg_epu8(_mm_and_si128(chroma, low_word), _mm_srli_epi32(chroma, 16));
+
+    // [Y0 0 Y1 0] | [0 U 0 V]
+    __m128i u = _mm_slli_epi32(_mm_and_si128(chroma, low_byte32), 8);
+    __m128i v = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(chroma, 8), low_byte32), 24);
+    _mm_storeu_si128((__m128i*)(dst + x * 2), _mm_or_si128(luma, _mm_or_si128(u, v)));
+  }
+
+  DownscaleRowYUYVScalar(row0, row1, dst_width, dst, x);
+}
+
+static void DownscaleRowPlaneSSE2Kernel(const byte* row0, const byte* row1, uint32_t dst_width, byte* dst) {
+  const __m128i low_byte = _mm_set1_epi16(0x00FF);
+
+  // 32 source samples give 16 output samples
+  uint32_t x = 0;
+  for (; x + 16 <= dst_width; x += 16) {
+    __m128i va = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 2)),
+      _mm_loadu_si128((const __m128i*)(row1 + x * 2)));
+    __m128i vb = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 2 + 16)),
+      _mm_loadu_si128((const __m128i*)(row1 + x * 2 + 16)));
+    __m128i ha = _mm_avg_epu16(_mm_and_si128(va, low_byte), _mm_srli_epi16(va, 8));
+    __m128i hb = _mm_avg_epu16(_mm_and_si128(vb, low_byte), _mm_srli_epi16(vb, 8));
+    _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(ha, hb));
+  }
+
+  DownscaleRowPlaneScalar(row0, row1, dst_width, dst, x);
+}
+#endif
+
+#if defined(SIMD_HAS_NEON)
+static void DownscaleRowYUYVNEONKernel(const byte* row0, const byte* row1, uint32_t dst_width, byte* dst) {
+  // 32 source pixels (64 bytes) give 16 output pixels (32 bytes)
+  uint32_t x = 0;
+  for (; x + 16 <= dst_width; x += 16) {
+    uint8x16x4_t p0 = vld4q_u8(row0 + x * 4);
+    uint8x16x4_t p1 = vld4q_u8(row1 + x * 4);
+
+    // Luma of every source macropixel, then split even/odd macropixels
+    uint8x16_t luma = vrhaddq_u8(vrhaddq_u8(p0.val[0], p1.val[0]), vrhaddq_u8(p0.val[2], p1.val[2]));
+    uint8x16x2_t luma_split = vuzpq_u8(luma, luma);
+
+    uint8x16_t cb = vrhaddq_u8(p0.val[1], p1.val[1]);
+    uint8x16_t cr = vrhaddq_u8(p0.val[3], p1.val[3]);
+
+    uint8x8x4_t out;
+    out.val[0] = vget_low_u8(luma_split.val[0]);
+    out.val[1] = vrshrn_n_u16(vpaddlq_u8(cb), 1);
+    out.val[2] = vget_low_u8(luma_split.val[1]);
+    out.val[3] = vrshrn_n_u16(vpaddlq_u8(cr), 1);
+    vst4_u8(dst + x * 2, out);
+  }
+
+  DownscaleRowYUYVScalar(row0, row1, dst_width, dst, x);
+}
+
+static void DownscaleRowPlaneNEONKernel(const byte* row0, const byte* row1, uint32_t dst_width, byte* dst) {
+  uint32_t x = 0;
+  for (; x + 16 <= dst_width; x += 16) {
+    uint8x16x2_t p0 = vld2q_u8(row0 + x * 2);
+    uint8x16x2_t p1 = vld2q_u8(row1 + x * 2);
+    vst1q_u8(dst + x, vrhaddq_u8(vrhaddq_u8(p0.val[0], p1.val[0]), vrhaddq_u8(p0.val[1], p1.val[1])));
+  }
+
+  DownscaleRowPlaneScalar(row0, row1, dst_width, dst, x);
+}
+#endif
+
+static DownscaleRowKernel SelectDownscaleYUYVKernel(SimdLevel level) {
+  switch (level) {
+#if defined(SIMD_HAS_SSE2)
+    case SimdLevel::SSE2:
+    case SimdLevel::AVX2: {
+      return DownscaleRowYUYVSSE2Kernel;
+    }
+#endif
+#if defined(SIMD_HAS_NEON)
+    case SimdLevel::NEON: {
+      return DownscaleRowYUYVNEONKernel;
+    }
+#endif
+    default: {
+      return DownscaleRowYUYVScalarKernel;
+    }
+  }
+}
+
+static DownscaleRowKernel SelectDownscalePlaneKernel(SimdLevel level) {
+  switch (level) {
+#if defined(SIMD_HAS_SSE2)
+    case SimdLevel::SSE2:
+    case SimdLevel::AVX2: {
+      return DownscaleRowPlaneSSE2Kernel;
+    }
+#endif
+#if defined(SIMD_HAS_NEON)
+    case SimdLevel::NEON: {
+      return DownscaleRowPlaneNEONKernel;
+    }
+#endif
+    default: {
+      return DownscaleRowPlaneScalarKernel;
+    }
+  }
+}
+// [\Downscale kernels]
+
+static SimdLevel g_pixel_kernel_level = DetectSimdLevel();
+static RowPairKernel g_row_pair_kernel = SelectRowPairKernel(g_pixel_kernel_level);
+static DownscaleRowKernel g_downscale_yuyv_kernel = SelectDownscaleYUYVKernel(g_pixel_kernel_level);
+static DownscaleRowKernel g_downscale_plane_kernel = SelectDownscalePlaneKernel(g_pixel_kernel_level);
+
+
+const char* PixelFormatName(PixelFormat format) {
+  switch (format) {
+    case PixelFormat::YUYV: return "yuyv";
+    case PixelFormat::I420: return "i420";
+    case PixelFormat::NV12: return "nv12";
+    default: break;
+  }
+
+  return "unknown";
+}
+
+bool ParsePixelFormat(const char* name, PixelFormat* format) {
+  for (uint8_t i = 0; i < (uint8_t)PixelFormat::Count; ++i) {
+    if (strcmp(name, PixelFormatName((PixelFormat)i)) == 0) {
+      *format = (PixelFormat)i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+const char* ColorMatrixName(ColorMatrix matrix) {
+  switch (matrix) {
+    case ColorMatrix::BT601: return "bt601";
+    case ColorMatrix::BT709: return "bt709";
+    default: break;
+  }
+
+  return "unknown";
+}
+
+bool ParseColorMatrix(const char* name, ColorMatrix* matrix) {
+  for (uint8_t i = 0; i < (uint8_t)ColorMatrix::Count; ++i) {
+    if (strcmp(name, ColorMatrixName((ColorMatrix)i)) == 0) {
+      *matrix = (ColorMatrix)i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void GetColorMatrixCoefficients(ColorMatrix matrix, int32_t coefficients[4]) {
+  if (matrix == ColorMatrix::BT709) {
+    // 1.5748, 0.1873, 0.4681, 1.8556
+    coefficients[0] = 1613;
+    coefficients[1] = 192;
+    coefficients[2] = 479;
+    coefficients[3] = 1900;
+  }
+  else {
+    // Same coefficients the client always used
+    coefficients[0] = 1440;
+    coefficients[1] = 354;
+    coefficients[2] = 734;
+    coefficients[3] = 1822;
+  }
+}
+
+uint32_t FrameSize(PixelFormat format, uint32_t width, uint32_t height) {
+  switch (format) {
+    case PixelFormat::YUYV: {
+      return width * height * 2;
+    }
+    case PixelFormat::I420:
+    case PixelFormat::NV12: {
+      return width * height + ((width + 1) / 2) * ((height + 1) / 2) * 2;
+    }
+    default: {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+YUYVView MakeYUYVView(const byte* data, uint32_t width, uint32_t height) {
+  YUYVView view;
+  view.data = data;
+  view.stride = width * 2;
+  view.width = width;
+  view.height = height;
+
+  return view;
+}
+
+YUYVView CropYUYVView(const YUYVView& view, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+  x &= ~1u;
+  if (x > view.width) x = view.width;
+  if (y > view.height) y = view.height;
+  if (width > view.width - x) width = view.width - x;
+  if (height > view.height - y) height = view.height - y;
+
+  YUYVView crop;
+  crop.data = view.data + y * view.stride + x * 2;
+  crop.stride = view.stride;
+  crop.width = width;
+  crop.height = height;
+
+  return crop;
+}
+
+void CopyYUYVView(const YUYVView& view, byte* dst) {
+  const uint32_t row_size = view.width * 2;
+  for (uint32_t y = 0; y < view.height; ++y) {
+    memcpy(dst + y * row_size, view.data + y * view.stride, row_size);
+  }
+}
+
+static void ConvertYUYVTo420(const byte* yuyv, uint32_t stride, uint32_t width, uint32_t height,
+  byte* y_plane, byte* u_plane, byte* v_plane) {
+  assert((width & 1) == 0 && "YUYV width must be even");
+
+  // NV12 has a single interleaved plane: one UV pair per chroma sample
+  const uint32_t chroma_stride = v_plane ? width / 2 : width;
+
+  for (uint32_t y = 0; y < height; y += 2) {
+    const byte* row0 = yuyv + y * stride;
+    // With an odd height the last row is averaged with itself
+    const byte* row1 = (y + 1 < height) ? row0 + stride : row0;
+    byte* y0 = y_plane + y * width;
+    byte* y1 = (y + 1 < height) ? y0 + width : y0;
+    byte* u = u_plane + (y / 2) * chroma_stride;
+    byte* v = v_plane ? v_plane + (y / 2) * chroma_stride : nullptr;
+
+    g_row_pair_kernel(row0, row1, width, y0, y1, u, v);
+  }
+}
+
+void ConvertYUYVToI420(const byte* yuyv, uint32_t stride, uint32_t width, uint32_t height, byte* i420) {
+  byte* u_plane = i420 + width * height;
+  byte* v_plane = u_plane + (width / 2) * ((height + 1) / 2);
+  ConvertYUYVTo420(yuyv, stride, width, height, i420, u_plane, v_plane);
+}
+
+void ConvertYUYVToNV12(const byte* yuyv, uint32_t stride, uint32_t width, uint32_t height, byte* nv12) {
+  ConvertYUYVTo420(yuyv, stride, width, height, nv12, nv12 + width * height, nullptr);
+}
+
+void DownscaleYUYV2x(const byte* src, uint32_t src_stride, uint32_t width, uint32_t height,
+  byte* dst, uint32_t dst_stride) {
+  assert((width & 3) == 0 && "YUYV downscale needs a width multiple of 4");
+
+  const uint32_t dst_width = width / 2;
+  const uint32_t dst_height = height / 2;
+  for (uint32_t y = 0; y < dst_height; ++y) {
+    const byte* row0 = src + (y * 2) * src_stride;
+    g_downscale_yuyv_kernel(row0, row0 + src_stride, dst_width, dst + y * dst_stride);
+  }
+}
+
+void DownscalePlane2x(const byte* src, uint32_t src_stride, uint32_t width, uint32_t height,
+  byte* dst, uint32_t dst_stride) {
+  const uint32_t dst_width = width / 2;
+  const uint32_t dst_height = height / 2;
+  for (uint32_t y = 0; y < dst_height; ++y) {
+    const byte* row0 = src + (y * 2) * src_stride;
+    g_downscale_plane_kernel(row0, row0 + src_stride, dst_width, dst + y * dst_stride);
+  }
+}
+
+void DownscaleI4202x(const byte* src, uint32_t width, uint32_t height, byte* dst) {
+  const uint32_t dst_width = width / 2;
+  const uint32_t dst_height = height / 2;
+  const uint32_t chroma_width = (width + 1) / 2;
+  const uint32_t chroma_height = (height + 1) / 2;
+  const uint32_t dst_chroma_width = (dst_width + 1) / 2;
+  const uint32_t dst_chroma_height = (dst_height + 1) / 2;
+
+  const byte* src_u = src + width * height;
+  const byte* src_v = src_u + chroma_width * chroma_height;
+  byte* dst_u = dst + dst_width * dst_height;
+  byte* dst_v = dst_u + dst_chroma_width * dst_chroma_height;
+
+  DownscalePlane2x(src, width, width, height, dst, dst_width);
+  DownscalePlane2x(src_u, chroma_width, chroma_width, chroma_height, dst_u, dst_chroma_width);
+  DownscalePlane2x(src_v, chroma_width, chroma_width, chroma_height, dst_v, dst_chroma_width);
+}
+
+static inline void YUVToRGBA(int32_t y, int32_t cb, int32_t cr, const int32_t c[4], byte* rgba) {
+  cb -= 128;
+  cr -= 128;
+  rgba[0] = Clamp255(y + ((c[0] * cr) >> 10));
+  rgba[1] = Clamp255(y - ((c[1] * cb + c[2] * cr) >> 10));
+  rgba[2] = Clamp255(y + ((c[3] * cb) >> 10));
+  rgba[3] = 255;
+}
+
+void ConvertToRGBA(PixelFormat format, const byte* src, uint32_t width, uint32_t height, byte* rgba,
+  ColorMatrix matrix) {
+  ConvertRowsToRGBA(format, src, width, height, 0, height, rgba, matrix);
+}
+
+void ConvertRowsToRGBA(PixelFormat format, const byte* src, uint32_t width, uint32_t height,
+  uint32_t first_row, uint32_t row_count, byte* rgba, ColorMatrix matrix) {
+  int32_t c[4];
+  GetColorMatrixCoefficients(matrix, c);
+
+  const uint32_t end_row = std::min(first_row + row_count, height);
+  switch (format) {
+    case PixelFormat::YUYV: {
+      const uint32_t end = end_row * width;
+      for (uint32_t i = first_row * width; i < end; i += 2) {
+        const byte* p = src + i * 2;
+        YUVToRGBA(p[0], p[1], p[3], c, rgba + i * 4);
+        YUVToRGBA(p[2], p[1], p[3], c, rgba + i * 4 + 4);
+      }
+
+      break;
+    }
+    case PixelFormat::I420:
+    case PixelFormat::NV12: {
+      const uint32_t chroma_width = (width + 1) / 2;
+      const byte* y_plane = src;
+      const byte* chroma_plane = src + width * height;
+      const bool interleaved = (format == PixelFormat::NV12);
+
+      for (uint32_t y = first_row; y < end_row; ++y) {
+        const byte* y_row = y_plane + y * width;
+        byte* out = rgba + y * width * 4;
+        for (uint32_t x = 0; x < width; ++x) {
+          int32_t cb = 0;
+          int32_t cr = 0;
+          if (interleaved) {
+            const byte* uv = chroma_plane + (y / 2) * chroma_width * 2 + (x / 2) * 2;
+            cb = uv[0];
+            cr = uv[1];
+          }
+          else {
+            const uint32_t chroma_index = (y / 2) * chroma_width + (x / 2);
+            cb = chroma_plane[chroma_index];
+            cr = chroma_plane[chroma_width * ((height + 1) / 2) + chroma_index];
+          }
+          YUVToRGBA(y_row[x], cb, cr, c, out + x * 4);
+        }
+      }
+
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+}
+
+bool SetPixelKernel(SimdLevel level) {
+  if (!IsSimdLevelSupported(level)) {
+    return false;
+  }
+  if (SelectRowPairKernel(level) == RowPairScalarKernel && level != SimdLevel::Scalar) {
+    // Supported by the cpu but not compiled in
+    return false;
+  }
+
+  g_pixel_kernel_level = level;
+  g_row_pair_kernel = SelectRowPairKernel(level);
+  g_downscale_yuyv_kernel = SelectDownscaleYUYVKernel(level);
+  g_downscale_plane_kernel = SelectDownscalePlaneKernel(level);
+
+  return true;
+}
+
+SimdLevel GetPixelKernel() {
+  return g_pixel_kernel_level;
+}
@@ -0,0 +1,320 @@
+#include "poller.h"
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <fcntl.h>
+#endif
+#include <unistd.h>
+
+#include "log.h"
+
+#ifdef __linux__
+// Events taken per wait(); whatever else is ready comes with the next one
+static const uint32_t kMaxWaitEvents = 256;
+
+static uint32_t ToEpollEvents(uint32_t events) {
+  // epoll reports hang ups and errors whatever the mask says. One shot
+  // with nothing else in the mask reports them once at most, then the
+  // socket is disabled until the next modify().
+  if (events == 0) {
+    return EPOLLONESHOT;
+  }
+
+  uint32_t epoll_events = EPOLLRDHUP;
+  if (events & Poller::kReadable) {
+    epoll_events |= EPOLLIN;
+  }
+  if (events & Poller::kWritable) {
+    epoll_events |= EPOLLOUT;
+  }
+
+  return epoll_events;
+}
+
+Poller::Poller() {
+  descriptor = epoll_create1(EPOLL_CLOEXEC);
+  if (descriptor < 0) {
+    LOG_ERROR("epoll_create1: %s\n", strerror(errno));
+  }
+}
+
+Poller::~Poller() {
+  if (descriptor >= 0) {
+    ::close(descriptor);
+  }
+}
+
+bool Poller::isValid() const {
+  return descriptor >= 0;
+}
+
+bool Poller::add(const Socket& socket, uint32_t events, void* user) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = ToEpollEvents(events);
+  event.data.ptr = user;
+  if (epoll_ctl(descriptor, EPOLL_CTL_ADD, socket.getDescriptor(), &event) != 0) {
+    LOG_ERROR("epoll_ctl(ADD): %s\n", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+bool Poller::modify(const Socket& socket, uint32_t events, void* user) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = ToEpollEvents(events);
+  event.data.ptr = user;
+  if (epoll_ctl(descriptor, EPOLL_CTL_MOD, socket.getDescriptor(), &event) != 0) {
+    LOG_ERROR("epoll_ctl(MOD): %s\n", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+bool Poller::remove(const Socket& socket) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  return epoll_ctl(descriptor, EPOLL_CTL_DEL, socket.getDescriptor(), &event) == 0;
+}
+
+bool Poller::add(const PollerWakeup& wakeup, void* user) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = user;
+  if (epoll_ctl(descriptor, EPOLL_CTL_ADD, wakeup.descriptor, &event) != 0) {
+    LOG_ERROR("epoll_ctl(ADD): %s\n", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+uint32_t Poller::wait(Event* events, uint32_t max_events, int32_t timeout_ms) {
+  struct epoll_event ready[kMaxWaitEvents];
+  max_events = max_events < kMaxWaitEvents ? max_events : kMaxWaitEvents;
+
+  const int32_t count = epoll_wait(descriptor, ready, (int32_t)max_events, timeout_ms);
+  if (count < 0) {
+    if (errno != EINTR) {
+      LOG_ERROR("epoll_wait: %s\n", strerror(errno));
+    }
+    return 0;
+  }
+
+  for (int32_t i = 0; i < count; ++i) {
+    const uint32_t epoll_events = ready[i].events;
+    events[i].user = ready[i].data.ptr;
+    events[i].events = 0;
+    if (epoll_events & EPOLLIN) {
+      events[i].events |= kReadable;
+    }
+    if (epoll_events & EPOLLOUT) {
+      events[i].events |= kWritable;
+    }
+    if (epoll_events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      events[i].events |= kClosed;
+    }
+  }
+
+  return (uint32_t)count;
+}
+#else
+static int16_t ToPollEvents(uint32_t events) {
+  int16_t poll_events = 0;
+  if (events & Poller::kReadable) {
+    poll_events |= POLLIN;
+  }
+  if (events & Poller::kWritable) {
+    poll_events |= POLLOUT;
+  }
+
+  return poll_events;
+}
+
+Poller::Poller() {
+}
+
+Poller::~Poller() {
+}
+
+bool Poller::isValid() const {
+  return true;
+}
+
+bool Poller::add(int32_t descriptor, uint32_t events, void* user) {
+  for (uint32_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].descriptor == descriptor) {
+      LOG_ERROR("Poller add: descriptor %d is already in\n", descriptor);
+      return false;
+    }
+  }
+
+  Entry entry = { descriptor, events, user, false };
+  entries.push_back(entry);
+  return true;
+}
+
+bool Poller::add(const Socket& socket, uint32_t events, void* user) {
+  return add(socket.getDescriptor(), events, user);
+}
+
+bool Poller::modify(const Socket& socket, uint32_t events, void* user) {
+  for (uint32_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].descriptor == socket.getDescriptor()) {
+      entries[i].events = events;
+      entries[i].user = user;
+      entries[i].closed_reported = false;
+      return true;
+    }
+  }
+
+  LOG_ERROR("Poller modify: descriptor %d isn't in\n", socket.getDescriptor());
+  return false;
+}
+
+bool Poller::remove(const Socket& socket) {
+  for (uint32_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].descriptor == socket.getDescriptor()) {
+      entries.erase(entries.begin() + i);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool Poller::add(const PollerWakeup& wakeup, void* user) {
+  return add(wakeup.descriptor, kReadable, user);
+}
+
+uint32_t Poller::wait(Event* events, uint32_t max_events, int32_t timeout_ms) {
+  // Silenced sockets that already reported kClosed aren't polled at all,
+  // poll() would report their hang up every time
+  ready.clear();
+  polled.clear();
+  for (uint32_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].events == 0 && entries[i].closed_reported) {
+      continue;
+    }
+    struct pollfd entry;
+    entry.fd = entries[i].descriptor;
+    entry.events = ToPollEvents(entries[i].events);
+    entry.revents = 0;
+    ready.push_back(entry);
+    polled.push_back(i);
+  }
+
+  const int32_t status = poll(ready.empty() ? nullptr : &ready[0], (nfds_t)ready.size(), timeout_ms);
+  if (status < 0) {
+    if (errno != EINTR) {
+      LOG_ERROR("poll: %s\n", strerror(errno));
+    }
+    return 0;
+  }
+
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < ready.size() && count < max_events; ++i) {
+    const int16_t poll_events = ready[i].revents;
+    if (poll_events == 0) {
+      continue;
+    }
+
+    Entry& entry = entries[polled[i]];
+    events[count].user = entry.user;
+    events[count].events = 0;
+    if (poll_events & POLLIN) {
+      events[count].events |= kReadable;
+    }
+    if (poll_events & POLLOUT) {
+      events[count].events |= kWritable;
+    }
+    if (poll_events & (POLLHUP | POLLERR | POLLNVAL)) {
+      events[count].events |= kClosed;
+      entry.closed_reported = true;
+    }
+    ++count;
+  }
+
+  return count;
+}
+#endif
+
+// [PollerWakeup]
+#ifdef __linux__
+PollerWakeup::PollerWakeup() {
+  descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (descriptor < 0) {
+    LOG_ERROR("eventfd: %s\n", strerror(errno));
+  }
+}
+
+PollerWakeup::~PollerWakeup() {
+  if (descriptor >= 0) {
+    ::close(descriptor);
+  }
+}
+#else
+PollerWakeup::PollerWakeup() {
+  int32_t ends[2] = { -1, -1 };
+  if (pipe(ends) != 0) {
+    LOG_ERROR("pipe: %s\n", strerror(errno));
+  }
+  for (uint32_t i = 0; i < 2 && ends[i] >= 0; ++i) {
+    fcntl(ends[i], F_SETFL, fcntl(ends[i], F_GETFL) | O_NONBLOCK);
+    fcntl(ends[i], F_SETFD, FD_CLOEXEC);
+  }
+  descriptor = ends[0];
+  write_descriptor = ends[1];
+}
+
+PollerWakeup::~PollerWakeup() {
+  if (descriptor >= 0) {
+    ::close(descriptor);
+    ::close(write_descriptor);
+  }
+}
+#endif
+
+bool PollerWakeup::isValid() const {
+  return descriptor >= 0;
+}
+
+void PollerWakeup::notify() {
+#ifdef __linux__
+  // Only fails when the counter is about to overflow, which is notified
+  // enough
+  const uint64_t one = 1;
+  if (write(descriptor, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    LOG_ERROR("eventfd write: %s\n", strerror(errno));
+  }
+#else
+  // A full pipe is notified enough too
+  const byte one = 1;
+  if (write(write_descriptor, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    LOG_ERROR("wakeup pipe write: %s\n", strerror(errno));
+  }
+#endif
+}
+
+void PollerWakeup::clear() {
+#ifdef __linux__
+  uint64_t count = 0;
+  if (read(descriptor, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    LOG_ERROR("eventfd read: %s\n", strerror(errno));
+  }
+#else
+  byte drained[64];
+  while (read(descriptor, drained, sizeof(drained)) > 0) {
+  }
+#endif
+}
+// [\PollerWakeup]
@@ -0,0 +1,161 @@
+#include "rate_control.h"
+
+#include <algorithm>
+#include <cfloat>
+
+// Frame rate goes first, then resolution; each step halves the bytes/s
+static const RateStep kRateSteps[] = {
+  { 0, 1 },
+  { 0, 2 },
+  { 1, 1 },
+  { 1, 2 },
+  { 2, 1 },
+  { 2, 2 },
+  { 2, 4 },
+};
+static const uint32_t kRateStepCount = sizeof(kRateSteps) / sizeof(kRateSteps[0]);
+
+// Samples closer than this are merged, send completions come in bursts
+static const double kMinSampleMs = 5.0;
+static const float kRateSmoothing = 0.25f;
+
+RateControlParams::RateControlParams() {
+  target_delay_ms = 100.0f;
+  hold_ms = 500.0f;
+  probe_ms = 2000.0f;
+  max_probe_ms = 8000.0f;
+}
+
+RateController::RateController() : RateController(RateControlParams()) {
+}
+
+RateController::RateController(const RateControlParams& _params) {
+  params = _params;
+  current_step = 0;
+  step_changes = 0;
+  last_sequence = 0;
+  has_sent = false;
+  bytes_sent = 0;
+  bytes_delivered = 0;
+  last_sample_ms = -1.0;
+  last_change_ms = 0.0;
+  hold_until_ms = 0.0;
+  last_up_ms = -1.0e9;
+  probe_wait_ms = params.probe_ms;
+  delivery_rate = 0.0f;
+  queue_delay_ms = 0.0f;
+  // No lowest delay yet: the first samples count as draining, a queue
+  // left over from connecting going down isn't a reason to step down
+  min_delay_ms = FLT_MAX;
+}
+
+void RateController::onFrameSent(uint32_t bytes, float send_ms, uint32_t queued_bytes, double now_ms) {
+  bytes_sent += bytes;
+  // Whatever left the send queue reached the peer (or at least the wire)
+  const uint64_t delivered = bytes_sent > queued_bytes ? bytes_sent - queued_bytes : 0;
+
+  if (last_sample_ms < 0.0) {
+    last_sample_ms = now_ms;
+    last_change_ms = now_ms;
+    hold_until_ms = now_ms + params.hold_ms;
+    bytes_delivered = delivered;
+    return;
+  }
+
+  const double elapsed_ms = now_ms - last_sample_ms;
+  if (elapsed_ms >= kMinSampleMs) {
+    const uint64_t newly_delivered = delivered > bytes_delivered ? delivered - bytes_delivered : 0;
+    const float rate = (float)(newly_delivered * 1000.0 / elapsed_ms);
+    delivery_rate = (delivery_rate == 0.0f) ? rate
+      : delivery_rate + kRateSmoothing * (rate - delivery_rate);
+
+    bytes_delivered = std::max(bytes_delivered, delivered);
+    last_sample_ms = now_ms;
+  }
+
+  // Time this frame spent blocked in send() plus the time to drain what
+  // was still queued ahead of it. The frame itself doesn't count: that's
+  // transmission time, not queueing.
+  const uint32_t standing = queued_bytes > bytes ? queued_bytes - bytes : 0;
+  queue_delay_ms = send_ms;
+  if (standing > 0) {
+    queue_delay_ms += (delivery_rate > 0.0f)
+      ? standing * 1000.0f / delivery_rate
+      : params.target_delay_ms * 4.0f;
+  }
+
+  // Lowest delay since the last step change: while it keeps going down the
+  // queue is draining and the current step is keeping up
+  const bool draining = queue_delay_ms < min_delay_ms;
+  min_delay_ms = std::min(min_delay_ms, queue_delay_ms);
+
+  if (now_ms < hold_until_ms) {
+    return;
+  }
+
+  if (queue_delay_ms > params.target_delay_ms && !draining) {
+    if (current_step + 1 < kRateStepCount) {
+      // Going back down right after a probe: the probe failed, be more
+      // patient before trying again
+      if (now_ms - last_up_ms < probe_wait_ms) {
+        probe_wait_ms = std::min(probe_wait_ms * 2.0f, params.max_probe_ms);
+      }
+      setStep(current_step + 1, now_ms);
+      hold_until_ms = now_ms + params.hold_ms;
+    }
+  }
+  else if (queue_delay_ms < params.target_delay_ms * 0.25f && current_step > 0 &&
+    now_ms - last_change_ms >= probe_wait_ms) {
+    // The last change was a probe that held: the link is fine again
+    if (last_change_ms == last_up_ms) {
+      probe_wait_ms = params.probe_ms;
+    }
+    setStep(current_step - 1, now_ms);
+    last_up_ms = now_ms;
+    hold_until_ms = now_ms + params.hold_ms;
+  }
+}
+
+bool RateController::shouldSend(uint32_t sequence) const {
+  if (!has_sent) {
+    return true;
+  }
+
+  return sequence - last_sequence >= kRateSteps[current_step].frame_divisor;
+}
+
+void RateController::markSent(uint32_t sequence) {
+  last_sequence = sequence;
+  has_sent = true;
+}
+
+uint32_t RateController::step() const {
+  return current_step;
+}
+
+const RateStep& RateController::currentStep() const {
+  return kRateSteps[current_step];
+}
+
+float RateController::throughput() const {
+  return delivery_rate;
+}
+
+float RateController::queueDelay() const {
+  return queue_delay_ms;
+}
+
+uint32_t RateController::stepChanges() const {
+  return step_changes;
+}
+
+/*static*/uint32_t RateController::StepCount() {
+  return kRateStepCount;
+}
+
+/*private*/void RateController::setStep(uint32_t step, double now_ms) {
+  current_step = step;
+  last_change_ms = now_ms;
+  min_delay_ms = queue_delay_ms;
+  ++step_changes;
+}
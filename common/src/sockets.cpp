@@ -1,25 +1,92 @@
 #include "sockets.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstdio>
 
 #include <string>
+#include <vector>
 
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include "log.h"
+
+// 1 if 'descriptor' is ready for 'events' right now, 0 if not, -1 on
+// error. poll() rather than select(): a process with thousands of sockets
+// has descriptors past FD_SETSIZE, which select() can't take.
+static int32_t PollNow(int32_t descriptor, int16_t events) {
+  struct pollfd entry;
+  entry.fd = descriptor;
+  entry.events = events;
+  entry.revents = 0;
+  const int32_t status = poll(&entry, 1, 0);
+  if (status <= 0) {
+    return status;
+  }
 
+  return (entry.revents & (events | POLLERR | POLLHUP)) != 0 ? 1 : 0;
+}
 
-#define IGNORE_PRINTF 0
-#if IGNORE_PRINTF == 1
-  #define printf(fmt, ...) (0)
-#endif
+// poll() timeout until 'deadline_ns': -1 without one, 0 once it's past.
+// Rounded up, a wait that ends just short of the deadline would only come
+// back to wait 0ms over and over.
+static int32_t WaitMs(uint64_t deadline_ns) {
+  if (deadline_ns == Socket::kNoDeadline) {
+    return -1;
+  }
 
-#define error_printf(fmt, ...) (printf(fmt, ##__VA_ARGS__))
-#define IGNORE_ERROR_PRINTF 0
-#if IGNORE_ERROR_PRINTF == 1
-  #undef error_printf
-  #define error_printf(fmt, ...) (0)
-#endif
+  const uint64_t now_ns = MonotonicNanos();
+  if (now_ns >= deadline_ns) {
+    return 0;
+  }
+
+  const uint64_t wait_ms = (deadline_ns - now_ns + 999999) / 1000000;
+  return wait_ms > INT32_MAX ? INT32_MAX : (int32_t)wait_ms;
+}
+
+// IOV_MAX: buffers past it go in the next system call
+static const uint32_t kMaxTransferBuffers = 1024;
+
+// [SocketOptions]
+SocketOptions SocketOptions::LowLatencyVideo() {
+  SocketOptions options;
+  options.no_delay = true;
+  options.not_sent_lowat = 128 * 1024;
+
+  return options;
+}
+
+SocketOptions SocketOptions::Throughput() {
+  SocketOptions options;
+  options.send_buffer = 4 * 1024 * 1024;
+  options.receive_buffer = 4 * 1024 * 1024;
+
+  return options;
+}
+
+bool ParseSocketPreset(const char* name, SocketOptions* options) {
+  if (strcmp(name, "default") == 0) {
+    *options = SocketOptions();
+  }
+  else if (strcmp(name, "low-latency") == 0) {
+    *options = SocketOptions::LowLatencyVideo();
+  }
+  else if (strcmp(name, "throughput") == 0) {
+    *options = SocketOptions::Throughput();
+  }
+  else {
+    return false;
+  }
+
+  return true;
+}
+// [\SocketOptions]
 
 // [Socket]
 // [Socket::Peer]
@@ -81,7 +148,7 @@ bool Socket::bind(uint32_t port) {
   address.sin_port = htons(port);
   ::bind(socket_descriptor, (struct sockaddr*)&address, sizeof(address));
   if (errno != 0) {
-    error_printf("Bind: %s\n", strerror(errno));
+    LOG_ERROR("Bind: %s\n", strerror(errno));
   }
 
   return true;
@@ -96,19 +163,20 @@ bool Socket::close() {
   errno = 0;
   int32_t status = getsockopt(socket_descriptor, SOL_SOCKET, SO_ERROR, &error_state, &sizeofint);
   if (status == -1) {
-    error_printf("getsockopt: %s\n", strerror(errno));
+    LOG_ERROR("getsockopt: %s\n", strerror(errno));
   }
   // at this point, any error in socket_descriptor should have been cleared
   errno = 0;
   shutdown(socket_descriptor, SHUT_RDWR);
-  if (errno != 0) {
-    error_printf("shutdown: %s\n", strerror(errno));
+  // ENOTCONN: the peer went first, or it's a listener. Nothing to shut down
+  if (errno != 0 && errno != ENOTCONN) {
+    LOG_ERROR("shutdown: %s\n", strerror(errno));
   }
 
   errno = 0;
   bool result = ::close(socket_descriptor) > -1;
   if (errno != 0) {
-    error_printf("Close: %s\n", strerror(errno));
+    LOG_ERROR("Close: %s\n", strerror(errno));
   }
 
   closed = result;
@@ -136,7 +204,8 @@ uint32_t Socket::sendData(byte* buffer, uint32_t buffer_size) {
             break;
           }
           case EPIPE: {
-            error_printf("The connection was closed locally\n");
+            LOG_ERROR("The connection was closed locally\n");
+            handleError(ErrorFrom::SendData, ECONNRESET);
 
             break;
           }
@@ -147,7 +216,7 @@ uint32_t Socket::sendData(byte* buffer, uint32_t buffer_size) {
             break;
           }
           default: {
-            error_printf("Send data: %s\n", strerror(errno));
+            LOG_ERROR("Send data: %s\n", strerror(errno));
 
             break;
           }
@@ -160,25 +229,16 @@ uint32_t Socket::sendData(byte* buffer, uint32_t buffer_size) {
     }
   }
   else if (sending_status == SendingStatus::Sending) {
-    fd_set sock_des;
-    memset(&sock_des, 0, sizeof(sock_des));
-    FD_ZERO(&sock_des);
-    FD_SET(socket_descriptor, &sock_des);
-
-    struct timeval timeout;
-    memset(&timeout, 0, sizeof(timeout));
-    //timeout.tv_usec = 1;
     errno = 0;
-
-    status = select(socket_descriptor + 1, nullptr, &sock_des, nullptr, &timeout); // CAREFUL: test this
+    status = PollNow(socket_descriptor, POLLOUT);
     if (status >= 0) {
-      if (FD_ISSET(socket_descriptor, &sock_des) > 0) {
+      if (status > 0) {
         int error_state = 0;
         socklen_t sizeofint = sizeof(int32_t);
         int result = getsockopt(socket_descriptor, SOL_SOCKET, SO_ERROR, &error_state, &sizeofint);
         if (result == 0) {
           if (error_state != 0) {
-            error_printf("Query error value: %s\n", strerror(error_state));
+            LOG_ERROR("Query error value: %s\n", strerror(error_state));
           }
           else {
             errno = 0;
@@ -187,27 +247,27 @@ uint32_t Socket::sendData(byte* buffer, uint32_t buffer_size) {
             //status = ::send(socket_descriptor, buffer, buffer_size, 0);
 
             if (errno != 0) {
-              error_printf("Send data: %s\n", strerror(errno));
+              LOG_ERROR("Send data: %s\n", strerror(errno));
             }
             if (status > 0) {
               bytes_sent = (uint32_t)status;
               sending_status = SendingStatus::CanSend;
             }
             else if (status == 0) {
-              error_printf("Send returned 0 bytes\n");
+              LOG_ERROR("Send returned 0 bytes\n");
             }
           }
         }
         else if (errno != 0) {
-          error_printf("getsockopt: %s\n", strerror(errno));
+          LOG_ERROR("getsockopt: %s\n", strerror(errno));
         }
       }
       else {
-        error_printf("Socket not ready to send\n");
+        LOG_DEBUG("Socket not ready to send\n");
       }
     }
     else {
-      printf("Receive data select(): %s\n", strerror(errno));
+      LOG_ERROR("Receive data poll(): %s\n", strerror(errno));
     }
   }
 
@@ -241,8 +301,8 @@ uint32_t Socket::receiveData(byte* buffer, uint32_t max_size_to_read) {
             break;
           }
           default: {
-            error_printf("Receive data: %s\n", strerror(errno));
-            //error_printf("%u\n", errno);
+            LOG_ERROR("Receive data: %s\n", strerror(errno));
+            //LOG_ERROR("%u\n", errno);
 
             break;
           }
@@ -254,25 +314,17 @@ uint32_t Socket::receiveData(byte* buffer, uint32_t max_size_to_read) {
     }
   }
   else if (receiving_status == ReceivingStatus::Receiving) {
-    fd_set sock_des;
-    memset(&sock_des, 0, sizeof(sock_des));
-    FD_ZERO(&sock_des);
-    FD_SET(socket_descriptor, &sock_des);
-
-    struct timeval timeout;
-    memset(&timeout, 0, sizeof(timeout));
-    //timeout.tv_usec = 1;
     errno = 0;
-    status = select(socket_descriptor + 1, &sock_des, nullptr, nullptr, &timeout);  // CAREFUL: need to ask for fds than can be WRITTEN, not READABLE
+    status = PollNow(socket_descriptor, POLLIN);
     if (status >= 0) {
-      if (FD_ISSET(socket_descriptor, &sock_des) > 0) {
+      if (status > 0) {
         int32_t error_state = 0;
         socklen_t sizeofint = sizeof(int32_t);
         errno = 0;
         int32_t result = getsockopt(socket_descriptor, SOL_SOCKET, SO_ERROR, &error_state, &sizeofint);
         if (result == 0) {
           if (error_state != 0) {
-            error_printf("Query error value: %s\n", strerror(error_state));
+            LOG_ERROR("Query error value: %s\n", strerror(error_state));
           }
           else {
             errno = 0;
@@ -282,7 +334,7 @@ uint32_t Socket::receiveData(byte* buffer, uint32_t max_size_to_read) {
             //status = recv(socket_descriptor, buffer, max_size_to_read, 0);
 
             if (errno != 0) {
-              //error_printf("Receive data: %s\n", strerror(errno));
+              //LOG_ERROR("Receive data: %s\n", strerror(errno));
               if (errno == EINVAL) {
                 
               }
@@ -295,13 +347,13 @@ uint32_t Socket::receiveData(byte* buffer, uint32_t max_size_to_read) {
 
               switch (errno) {
                 case EINVAL: {
-                  error_printf("Receive data: %s\n", strerror(errno));
+                  LOG_ERROR("Receive data: %s\n", strerror(errno));
                 }
                 case EWOULDBLOCK: {
-                  error_printf("Receive data: %s\n", strerror(errno));
+                  LOG_ERROR("Receive data: %s\n", strerror(errno));
                 }
                 default: {
-                  error_printf("Receive data error not handled: %s\n", strerror(errno));
+                  LOG_ERROR("Receive data error not handled: %s\n", strerror(errno));
                 }
               }
             }
@@ -312,29 +364,224 @@ uint32_t Socket::receiveData(byte* buffer, uint32_t max_size_to_read) {
           }
         }
         else if (errno != 0) {
-          error_printf("getsockopt: %s\n", strerror(errno));
+          LOG_ERROR("getsockopt: %s\n", strerror(errno));
         }
       }
       else {
-        error_printf("Socket not ready to receive\n");
+        LOG_DEBUG("Socket not ready to receive\n");
       }
     }
     else {
-      printf("Receive data select(): %s\n", strerror(errno));
+      LOG_ERROR("Receive data poll(): %s\n", strerror(errno));
     }
   }
 
   return bytes_read;
 }
 
+uint32_t Socket::availableBytes() const {
+  int32_t available = 0;
+  if (ioctl(socket_descriptor, FIONREAD, &available) < 0) {
+    LOG_ERROR("ioctl(FIONREAD): %s\n", strerror(errno));
+    return 0;
+  }
+
+  return (uint32_t)available;
+}
+
+uint32_t Socket::queuedBytes() const {
+  int32_t queued = 0;
+#if defined(__linux__)
+  if (ioctl(socket_descriptor, SIOCOUTQ, &queued) < 0) {
+    LOG_ERROR("ioctl(SIOCOUTQ): %s\n", strerror(errno));
+    return 0;
+  }
+#elif defined(SO_NWRITE)
+  socklen_t size = sizeof(queued);
+  if (getsockopt(socket_descriptor, SOL_SOCKET, SO_NWRITE, &queued, &size) < 0) {
+    LOG_ERROR("getsockopt(SO_NWRITE): %s\n", strerror(errno));
+    return 0;
+  }
+#endif
+
+  return (uint32_t)queued;
+}
+
+Socket::TransferStatus Socket::sendAll(const byte* buffer, uint32_t size, uint64_t deadline_ns,
+  uint32_t* transferred) {
+  struct iovec entry = { (void*)buffer, size };
+  return transfer(true, &entry, 1, deadline_ns, transferred);
+}
+
+Socket::TransferStatus Socket::receiveExact(byte* buffer, uint32_t size, uint64_t deadline_ns,
+  uint32_t* transferred) {
+  struct iovec entry = { buffer, size };
+  return transfer(false, &entry, 1, deadline_ns, transferred);
+}
+
+Socket::TransferStatus Socket::sendAll(const struct iovec* buffers, uint32_t count, uint64_t deadline_ns,
+  uint32_t* transferred) {
+  std::vector<struct iovec> remaining(buffers, buffers + count);
+  return transfer(true, remaining.data(), count, deadline_ns, transferred);
+}
+
+Socket::TransferStatus Socket::receiveExact(const struct iovec* buffers, uint32_t count, uint64_t deadline_ns,
+  uint32_t* transferred) {
+  std::vector<struct iovec> remaining(buffers, buffers + count);
+  return transfer(false, remaining.data(), count, deadline_ns, transferred);
+}
+
+bool Socket::setOptions(const SocketOptions& _options) {
+  options = _options;
+  return applyOptions();
+}
+
 /*private*/int32_t Socket::getDescriptor() const {
   return socket_descriptor;
 }
+
+/*private*/Socket::TransferStatus Socket::transfer(bool send, struct iovec* buffers, uint32_t count,
+  uint64_t deadline_ns, uint32_t* transferred) {
+  TransferStatus status = TransferStatus::Complete;
+  uint32_t total = 0;
+  uint32_t index = 0;
+  while (true) {
+    while (index < count && buffers[index].iov_len == 0) {
+      ++index;
+    }
+    if (index == count) {
+      break;
+    }
+
+    // Never blocking in the call itself, whatever the socket's type: the
+    // waiting is done by poll(), which knows about the deadline
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &buffers[index];
+    message.msg_iovlen = std::min(count - index, kMaxTransferBuffers);
+    errno = 0;
+    const ssize_t bytes = send ? sendmsg(socket_descriptor, &message, MSG_DONTWAIT | MSG_NOSIGNAL)
+                               : recvmsg(socket_descriptor, &message, MSG_DONTWAIT);
+    if (bytes > 0) {
+      total += (uint32_t)bytes;
+      size_t left = (size_t)bytes;
+      while (left > 0) {
+        const size_t step = std::min(left, buffers[index].iov_len);
+        buffers[index].iov_base = (byte*)buffers[index].iov_base + step;
+        buffers[index].iov_len -= step;
+        left -= step;
+        if (buffers[index].iov_len == 0) {
+          ++index;
+        }
+      }
+      continue;
+    }
+
+    if (bytes == 0 && !send) {
+      status = TransferStatus::PeerClosed;
+      break;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      const int32_t wait_ms = WaitMs(deadline_ns);
+      if (wait_ms == 0) {
+        status = TransferStatus::Timeout;
+        break;
+      }
+
+      struct pollfd entry = { socket_descriptor, (int16_t)(send ? POLLOUT : POLLIN), 0 };
+      if (poll(&entry, 1, wait_ms) < 0 && errno != EINTR) {
+        LOG_ERROR("Transfer poll(): %s\n", strerror(errno));
+        status = TransferStatus::Error;
+        break;
+      }
+      // Ready, an error to find out about in the next call, or the deadline
+      continue;
+    }
+
+    if (errno == EPIPE || errno == ECONNRESET || errno == ENOTCONN) {
+      status = TransferStatus::PeerClosed;
+    }
+    else {
+      LOG_ERROR("%s: %s\n", send ? "sendmsg" : "recvmsg", strerror(errno));
+      status = TransferStatus::Error;
+    }
+    break;
+  }
+
+  if (status == TransferStatus::PeerClosed) {
+    handleError(send ? ErrorFrom::SendData : ErrorFrom::ReceiveData, ECONNRESET);
+  }
+  if (transferred) {
+    *transferred = total;
+  }
+
+  return status;
+}
+
+/*private*/bool Socket::applyOptions() {
+  // The TCP options are only for TCP sockets
+  int32_t socket_type = 0;
+  socklen_t sizeofint = sizeof(socket_type);
+  getsockopt(socket_descriptor, SOL_SOCKET, SO_TYPE, &socket_type, &sizeofint);
+  const bool stream = socket_type == SOCK_STREAM;
+
+  bool success = true;
+  const auto set = [&](int32_t level, int32_t name, const void* value, socklen_t size, const char* what) {
+    if (setsockopt(socket_descriptor, level, name, value, size) != 0) {
+      LOG_WARNING("setsockopt(%s): %s\n", what, strerror(errno));
+      success = false;
+    }
+  };
+
+  if (options.send_buffer > 0) {
+    set(SOL_SOCKET, SO_SNDBUF, &options.send_buffer, sizeof(options.send_buffer), "SO_SNDBUF");
+  }
+  if (options.receive_buffer > 0) {
+    set(SOL_SOCKET, SO_RCVBUF, &options.receive_buffer, sizeof(options.receive_buffer), "SO_RCVBUF");
+  }
+  // Linux only, skipped where the platform has no such option
+#ifdef SO_BUSY_POLL
+  if (options.busy_poll_us > 0) {
+    set(SOL_SOCKET, SO_BUSY_POLL, &options.busy_poll_us, sizeof(options.busy_poll_us), "SO_BUSY_POLL");
+  }
+#endif
+#ifdef SO_MAX_PACING_RATE
+  if (options.max_pacing_rate > 0) {
+    set(SOL_SOCKET, SO_MAX_PACING_RATE, &options.max_pacing_rate, sizeof(options.max_pacing_rate),
+      "SO_MAX_PACING_RATE");
+  }
+#endif
+  if (stream && options.no_delay) {
+    const int32_t one = 1;
+    set(IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one), "TCP_NODELAY");
+  }
+  if (stream && options.not_sent_lowat > 0) {
+    set(IPPROTO_TCP, TCP_NOTSENT_LOWAT, &options.not_sent_lowat, sizeof(options.not_sent_lowat),
+      "TCP_NOTSENT_LOWAT");
+  }
+
+  return success;
+}
+
+const char* TransferStatusName(Socket::TransferStatus status) {
+  switch (status) {
+    case Socket::TransferStatus::Complete: return "complete";
+    case Socket::TransferStatus::Timeout: return "timeout";
+    case Socket::TransferStatus::PeerClosed: return "peer closed";
+    case Socket::TransferStatus::Error: return "error";
+  }
+
+  return "unknown";
+}
 // [\Socket]
 
 
 // [TCPSocket]
-TCPSocket::TCPSocket(Type _type) {
+TCPSocket::TCPSocket(Type _type, const SocketOptions& _options) {
+  options = _options;
   memset(&address, 0, sizeof(address));
   address.sin_family = AF_INET;
                             // AF_INET
@@ -356,6 +603,13 @@ bool TCPSocket::connect(const char* ip, uint32_t port) {
 
   int32_t status = 0;
   if (connection_status == ConnectionStatus::Disconnected) {
+    if (closed) {
+      // Closed after losing the connection: connecting again needs a new
+      // descriptor
+      socket_descriptor = socket(address.sin_family, SOCK_STREAM, 0);
+      construct(type);
+    }
+
     errno = 0;
     status = ::connect(socket_descriptor, (struct sockaddr*)&address, sizeof(address));
     if (status == -1) {
@@ -363,7 +617,7 @@ bool TCPSocket::connect(const char* ip, uint32_t port) {
         switch (errno) {
           case EINPROGRESS:
           case EALREADY: {
-            error_printf("Cannot stablish connection now; will keep trying\n");
+            LOG_DEBUG("Cannot stablish connection now; will keep trying\n");
             connection_status = ConnectionStatus::Connecting;
 
             break;
@@ -371,58 +625,48 @@ bool TCPSocket::connect(const char* ip, uint32_t port) {
           case EINVAL:
           case ECONNREFUSED: {
             close();
-            construct(type);
 
             break;
           }
           default: {
-            error_printf("Connect error not supported: %s\n", strerror(errno));
+            LOG_ERROR("Connect error not supported: %s\n", strerror(errno));
           }
         }
       }
     }
     else if (status == 0) {
-      error_printf("CONNECTED\n");
+      LOG_DEBUG("CONNECTED\n");
       connection_status = ConnectionStatus::Connected;
     }
   }
   else if (connection_status == ConnectionStatus::Connecting) {
-    fd_set sock_des;
-    memset(&sock_des, 0, sizeof(sock_des));
-    FD_ZERO(&sock_des);
-    FD_SET(socket_descriptor, &sock_des);
-
-    struct timeval timeout;
-    memset(&timeout, 0, sizeof(timeout));
-    //timeout.tv_usec = 1;
     errno = 0;
-    status = select(socket_descriptor + 1, nullptr, &sock_des, nullptr, &timeout);  // CAREFUL: need to ask for fds than can be WRITTEN, not READABLE
+    status = PollNow(socket_descriptor, POLLOUT);  // CAREFUL: need to ask for fds than can be WRITTEN, not READABLE
     if (status >= 0) {
-      if (FD_ISSET(socket_descriptor, &sock_des) > 0) {
+      if (status > 0) {
         int32_t error_state = 0;
         socklen_t sizeofint = sizeof(int32_t);
         int32_t result = getsockopt(socket_descriptor, SOL_SOCKET, SO_ERROR, &error_state, &sizeofint);
         if (result == 0) {
           if (error_state != 0) {
-            error_printf("Query error value: %s\n", strerror(error_state));
+            LOG_ERROR("Query error value: %s\n", strerror(error_state));
             if (error_state == ECONNREFUSED) {
               close();
-              construct(type);
             }
           }
           else {
-            error_printf("No error, connected\n");
+            LOG_DEBUG("No error, connected\n");
             connection_status = ConnectionStatus::Connected;
           }
         }
         else if (errno != 0) {
-          error_printf("getsockopt: %s\n", strerror(errno));
+          LOG_ERROR("getsockopt: %s\n", strerror(errno));
         }
       }
     }
   }
   else {
-    error_printf("Socket already connected, resetting...\n");
+    LOG_WARNING("Socket already connected, resetting...\n");
     close();
     construct(type);
   }
@@ -438,8 +682,9 @@ bool TCPSocket::isConnected() const {
   return connection_status == TCPSocket::ConnectionStatus::Connected;
 }
   
-/*private*/TCPSocket::TCPSocket(Type type, uint32_t descriptor) {
+/*private*/TCPSocket::TCPSocket(Type type, uint32_t descriptor, const SocketOptions& _options) {
   socket_descriptor = descriptor;
+  options = _options;
 
   construct(type);
 }
@@ -467,12 +712,16 @@ bool TCPSocket::isConnected() const {
   uint32_t max_recv_buffer_size = 0;
   setsockopt(socket_descriptor, SOL_SOCKET, SO_REUSEADDR, (int32_t*)&true_int_value, sizeof(int32_t));  // CAREFUL: this violates TCP/IP protocol making it unlikely but possible for the next program that binds on that port to pick up packets intended for the original program
   
-  // TODO: give the option to SO_NOSIGPIPE to be flagable
-  //setsockopt(socket_descriptor, SOL_SOCKET, SO_NOSIGPIPE, (int32_t*)&true_int_value, sizeof(int32_t));
+#ifdef __APPLE__
+  // No MSG_NOSIGNAL there: a peer that left must not kill us on a send
+  setsockopt(socket_descriptor, SOL_SOCKET, SO_NOSIGPIPE, (int32_t*)&true_int_value, sizeof(int32_t));
+#endif
 
   if (type == Type::NonBlock) {
     fcntl(socket_descriptor, F_SETFL, O_NONBLOCK);
   }
+
+  applyOptions();
 }
 
 /*private*/void TCPSocket::handleError(ErrorFrom from, int32_t error) {
@@ -497,9 +746,10 @@ bool TCPSocket::isConnected() const {
 
 
 // [TCPListener]
-TCPListener::TCPListener(Type _type, uint32_t _queue_size) {
-  queue_size = _queue_size;
+TCPListener::TCPListener(Type _type, uint32_t _queue_size, const SocketOptions& _options) {
+  options = _options;
   construct(_type);
+  queue_size = _queue_size;
 }
 
 TCPListener::~TCPListener() {
@@ -515,111 +765,93 @@ bool TCPListener::listen() {
 }
   
 TCPSocket* TCPListener::accept() {
+  TCPSocket* accepted_socket = nullptr;
+
   if (listening_status == ListeningStatus::Listening) {
+    errno = 0;
     int32_t accepted_socket_des = ::accept(socket_descriptor, nullptr, nullptr);
     if (accepted_socket_des >= 0) {
-      if (accepted_socket) {
-        accepted_socket->close();
-        delete accepted_socket;
-      }
-      accepted_socket = new TCPSocket(type, accepted_socket_des);
+      accepted_socket = new TCPSocket(type, accepted_socket_des, options);
       accepted_socket->connection_status = TCPSocket::ConnectionStatus::Connected;
     }
     else {
-      if (errno != 0) {
-        error_printf("Accept: %s\n", strerror(errno));
-      }
-
       if (errno == EAGAIN || errno == EWOULDBLOCK) {  // looks like in MacOSX the following is defined: #define EWOULDBLOCK EAGAIN. But does ::accept() return both?
-        error_printf("Will try to accept connection later...\n");
+        LOG_DEBUG("Will try to accept connection later...\n");
         listening_status = ListeningStatus::WaitingForAccept;
       }
+      else if (errno != 0) {
+        LOG_ERROR("Accept: %s\n", strerror(errno));
+      }
     }
   }
   else if (listening_status == ListeningStatus::WaitingForAccept) {
-    fd_set sock_des;
-    FD_ZERO(&sock_des);
-    FD_SET(socket_descriptor, &sock_des);
-
-    struct timeval timeout;
-    memset(&timeout, 0, sizeof(timeout));
     errno = 0;
-    int32_t status = select(socket_descriptor + 1, &sock_des, nullptr, nullptr, &timeout);
-    //int status = select(socket_descriptor + 1, nullptr, &sock_des, nullptr, &timeout);
-    //if (FD_ISSET(socket_descriptor, &sock_des) > 0) {
+    int32_t status = PollNow(socket_descriptor, POLLIN);
     if (status >= 0) {
-      if (FD_ISSET(socket_descriptor, &sock_des) > 0) {
+      if (status > 0) {
         int32_t error_state = 0;
         socklen_t sizeofint = sizeof(int32_t);
         int32_t result = getsockopt(socket_descriptor, SOL_SOCKET, SO_ERROR, &error_state, &sizeofint);
         if (result == 0) {
           if (error_state != 0) {
-            error_printf("Query error value: %s\n", strerror(error_state));
+            LOG_ERROR("Query error value: %s\n", strerror(error_state));
           }
           else {
-            error_printf("No error\n");
+            errno = 0;
             int32_t accepted_socket_des = ::accept(socket_descriptor, nullptr, nullptr);
-            if (accepted_socket_des >= 0 && accepted_socket) {
-              accepted_socket->close();
-              delete accepted_socket;
+            if (accepted_socket_des >= 0) {
+              accepted_socket = new TCPSocket(type, accepted_socket_des, options);
+              accepted_socket->connection_status = TCPSocket::ConnectionStatus::Connected;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+              LOG_ERROR("Accept: %s\n", strerror(errno));
             }
-            accepted_socket = new TCPSocket(type, accepted_socket_des);
-            accepted_socket->connection_status = TCPSocket::ConnectionStatus::Connected;
 
             listening_status = ListeningStatus::Listening;
           }
         }
-        if (errno != 0) {
-          error_printf("getsockopt: %s\n", strerror(errno));
+        else if (errno != 0) {
+          LOG_ERROR("getsockopt: %s\n", strerror(errno));
         }
-
-        // int accepted_socket_des = ::accept(socket_descriptor, nullptr, nullptr);
-        // if (accepted_socket_des >= 0 && accepted_socket) {
-        //   accepted_socket->close();
-        //   delete accepted_socket;
-        // }
-        // accepted_socket = new TCPSocket(type, accepted_socket_des);
-
-        // listening_status = ListeningStatus::Listening;
       }
     }
     else if (errno != 0) {
-      error_printf("Select: %s\n", strerror(errno));
+      LOG_ERROR("Poll: %s\n", strerror(errno));
     }
   }
 
   return accepted_socket;
 }
 
-// CAREFUL: can make the connected socket to be closed before the connected socket can finish doing its work
+TCPSocket* TCPListener::adopt(int32_t descriptor) {
+  TCPSocket* adopted_socket = new TCPSocket(type, (uint32_t)descriptor, options);
+  adopted_socket->connection_status = TCPSocket::ConnectionStatus::Connected;
+  return adopted_socket;
+}
+
+// Accepted sockets belong to whoever accepted them and are not closed here
 bool TCPListener::close() {
   bool success = true;
 
-  if (accepted_socket) {
-    //success = shutdown(accepted_socket->getDescriptor(), SHUT_RDWR) > -1;
-    success = accepted_socket->close();
-
-    delete accepted_socket;
-  }
-  
   int32_t error_state = 0;
   socklen_t sizeofint = sizeof(int32_t);
   errno = 0;
   int32_t status = getsockopt(socket_descriptor, SOL_SOCKET, SO_ERROR, &error_state, &sizeofint);
   if (status == -1) {
-    error_printf("getsockopt: %s\n", strerror(errno));
+    LOG_ERROR("getsockopt: %s\n", strerror(errno));
   }
   // at this point, any error in socket_descriptor should have been cleared
   errno = 0;
   shutdown(socket_descriptor, SHUT_RDWR);
-  if (errno != 0) {
-    error_printf("shutdown: %s\n", strerror(errno));
+  // ENOTCONN: the peer went first, or it's a listener. Nothing to shut down
+  if (errno != 0 && errno != ENOTCONN) {
+    LOG_ERROR("shutdown: %s\n", strerror(errno));
   }
 
   errno = 0;
   success = (::close(socket_descriptor) > -1) | success;
   if (errno != 0) {
-    error_printf("Close: %s\n", strerror(errno));
+    LOG_ERROR("Close: %s\n", strerror(errno));
   }
 
   listening_status = ListeningStatus::NotListening;
@@ -637,7 +869,6 @@ bool TCPListener::close() {
 
   listening_status = ListeningStatus::NotListening;
 
-  accepted_socket = nullptr;
   queue_size = 32;
   closed = false;
 
@@ -657,16 +888,19 @@ bool TCPListener::close() {
   if (type == Type::NonBlock) {
     fcntl(socket_descriptor, F_SETFL, O_NONBLOCK);
   }
+
+  applyOptions();
 }
 
 /*private*/void TCPListener::handleError(ErrorFrom from, int32_t error) {
-  printf("TCPListener::handleError() not handled\n");
+  LOG_WARNING("TCPListener::handleError() not handled\n");
 }
 // [\TCPListener]
 
 
 // [UDPSocket]
-UDPSocket::UDPSocket(Socket::Type _type) {
+UDPSocket::UDPSocket(Socket::Type _type, const SocketOptions& _options) {
+  options = _options;
   memset(&address, 0, sizeof(address));
   address.sin_family = AF_INET;
   socket_descriptor = socket(address.sin_family, SOCK_DGRAM, 0);
@@ -687,7 +921,7 @@ uint32_t UDPSocket::sendData(byte* buffer, uint32_t buffer_size, const Socket::P
   //   return Socket::sendData(buffer, buffer_size);
   // }
   // else {
-  //   error_printf("UDPSocket::sendData(): peer not ready\n");
+  //   LOG_ERROR("UDPSocket::sendData(): peer not ready\n");
   // }
 
   // return 0;
@@ -705,7 +939,7 @@ uint32_t UDPSocket::receiveData(byte* buffer, uint32_t max_size_to_read, const S
   //   return Socket::receiveData(buffer, max_size_to_read);
   // }
   // else {
-  //   error_printf("UDPSocket::receiveData(): peer not ready\n");
+  //   LOG_ERROR("UDPSocket::receiveData(): peer not ready\n");
   // }
 
   // return 0;
@@ -743,6 +977,8 @@ void UDPSocket::construct(Socket::Type _type) {
   if (type == Type::NonBlock) {
     fcntl(socket_descriptor, F_SETFL, O_NONBLOCK);
   }
+
+  applyOptions();
 }
 
 void UDPSocket::handleError(ErrorFrom from, int32_t error) {
@@ -0,0 +1,112 @@
+#include "stripe_pool.h"
+
+#include <algorithm>
+
+StripePool::StripePool(uint32_t thread_count) {
+  if (thread_count == 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  generation = 0;
+  pending = 0;
+  should_finish = false;
+  job = nullptr;
+  context = nullptr;
+  rows = 0;
+  stripe_rows = 0;
+
+  // Stripe 0 belongs to the thread calling run()
+  for (uint32_t i = 1; i < thread_count; ++i) {
+    workers.push_back(std::thread(&StripePool::workerLoop, this, i));
+  }
+}
+
+StripePool::~StripePool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    should_finish = true;
+    work_ready.notify_all();
+  }
+  for (uint32_t i = 0; i < workers.size(); ++i) {
+    workers[i].join();
+  }
+}
+
+void StripePool::run(uint32_t _rows, StripeJob _job, void* _context) {
+  const uint32_t thread_count = threadCount();
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    job = _job;
+    context = _context;
+    rows = _rows;
+    stripe_rows = (_rows + thread_count - 1) / thread_count;
+    pending = (uint32_t)workers.size();
+    ++generation;
+    work_ready.notify_all();
+  }
+
+  runStripe(0);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  work_done.wait(lock, [this] { return pending == 0; });
+}
+
+uint32_t StripePool::threadCount() const {
+  return (uint32_t)workers.size() + 1;
+}
+
+/*private*/void StripePool::workerLoop(uint32_t stripe) {
+  uint64_t last_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      work_ready.wait(lock, [&] { return should_finish || generation != last_generation; });
+      if (should_finish) {
+        return;
+      }
+      last_generation = generation;
+    }
+
+    runStripe(stripe);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (--pending == 0) {
+      work_done.notify_one();
+    }
+  }
+}
+
+/*private*/void StripePool::runStripe(uint32_t stripe) {
+  // Job fields only change in run(), after every stripe of the last job
+  // is done
+  const uint32_t first_row = stripe * stripe_rows;
+  if (first_row < rows) {
+    job(context, first_row, std::min(stripe_rows, rows - first_row));
+  }
+}
+
+struct ConvertStripeContext {
+  PixelFormat format;
+  const byte* src;
+  uint32_t width;
+  uint32_t height;
+  byte* rgba;
+  ColorMatrix matrix;
+};
+
+static void ConvertStripe(void* context, uint32_t first_row, uint32_t row_count) {
+  const ConvertStripeContext* c = (const ConvertStripeContext*)context;
+  ConvertRowsToRGBA(c->format, c->src, c->width, c->height, first_row, row_count, c->rgba, c->matrix);
+}
+
+void ConvertToRGBAStriped(StripePool* pool, PixelFormat format, const byte* src,
+  uint32_t width, uint32_t height, byte* rgba, ColorMatrix matrix) {
+  ConvertStripeContext context;
+  context.format = format;
+  context.src = src;
+  context.width = width;
+  context.height = height;
+  context.rgba = rgba;
+  context.matrix = matrix;
+  pool->run(height, ConvertStripe, &context);
+}
@@ -0,0 +1,190 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+// Spans kept per thread, the oldest are overwritten. 64K spans of 32 bytes
+// are a few seconds of a busy thread at 30 fps.
+static const uint64_t kTraceRingSize = 1 << 16;
+
+// Fields are atomics so that a dump can read a ring while its thread keeps
+// writing it. Relaxed stores compile to plain moves.
+struct TraceEvent {
+  std::atomic<const char*> name;
+  std::atomic<uint64_t> start_ns;
+  std::atomic<uint64_t> duration_ns;
+  std::atomic<uint32_t> frame;
+};
+
+struct TraceRing {
+  TraceEvent events[kTraceRingSize];
+  std::atomic<uint64_t> head;         // spans ever written
+  std::atomic<const char*> thread_name;
+  uint32_t thread_id;
+};
+
+std::atomic<bool> g_trace_enabled(false);
+
+static std::atomic<bool> s_dump_requested(false);
+static const char* s_process_name = "";
+static const char* s_path = "trace.json";
+// Rings are only added, and never freed: the spans of a thread that is
+// gone are still worth dumping
+static std::mutex s_rings_mutex;
+static std::vector<TraceRing*> s_rings;
+static thread_local TraceRing* t_ring = nullptr;
+
+static TraceRing* ThreadRing() {
+  if (!t_ring) {
+    t_ring = new TraceRing();
+    t_ring->head = 0;
+    t_ring->thread_name = nullptr;
+
+    std::unique_lock<std::mutex> lock(s_rings_mutex);
+    t_ring->thread_id = (uint32_t)s_rings.size() + 1;
+    s_rings.push_back(t_ring);
+  }
+
+  return t_ring;
+}
+
+static void DumpRequestHandler(int32_t signal_number) {
+  (void)signal_number;
+  s_dump_requested.store(true, std::memory_order_relaxed);
+}
+
+static void DumpAtExit() {
+  TraceDump();
+}
+
+// Nothing can be written from the signal handler itself
+static void WatchDumpRequests() {
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (s_dump_requested.exchange(false, std::memory_order_relaxed)) {
+      TraceDump();
+    }
+  }
+}
+
+void TraceEnable(const char* process_name, const char* path) {
+  s_process_name = process_name;
+  s_path = path;
+  g_trace_enabled = true;
+
+  signal(SIGUSR1, DumpRequestHandler);
+  atexit(DumpAtExit);
+  std::thread(WatchDumpRequests).detach();
+}
+
+void TraceSetThreadName(const char* name) {
+  if (TraceEnabled()) {
+    ThreadRing()->thread_name.store(name, std::memory_order_relaxed);
+  }
+}
+
+void TraceRecord(const char* name, uint32_t frame, uint64_t start_ns, uint64_t end_ns) {
+  TraceRing* ring = ThreadRing();
+  const uint64_t head = ring->head.load(std::memory_order_relaxed);
+  // Seqlock style: a reader that sees any of these stores also sees the
+  // head from before them, and knows the slot is being rewritten
+  std::atomic_thread_fence(std::memory_order_release);
+  TraceEvent& event = ring->events[head % kTraceRingSize];
+  event.name.store(name, std::memory_order_relaxed);
+  event.start_ns.store(start_ns, std::memory_order_relaxed);
+  event.duration_ns.store(end_ns > start_ns ? end_ns - start_ns : 0, std::memory_order_relaxed);
+  event.frame.store(frame, std::memory_order_relaxed);
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+struct CopiedEvent {
+  const char* name;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  uint32_t frame;
+};
+
+// Copies what is still valid out of the ring, oldest first
+static void CopyRing(const TraceRing* ring, std::vector<CopiedEvent>* events) {
+  events->clear();
+  const uint64_t head = ring->head.load(std::memory_order_acquire);
+  const uint64_t begin = head > kTraceRingSize ? head - kTraceRingSize : 0;
+  for (uint64_t i = begin; i < head; ++i) {
+    const TraceEvent& event = ring->events[i % kTraceRingSize];
+    CopiedEvent copy;
+    copy.name = event.name.load(std::memory_order_relaxed);
+    copy.start_ns = event.start_ns.load(std::memory_order_relaxed);
+    copy.duration_ns = event.duration_ns.load(std::memory_order_relaxed);
+    copy.frame = event.frame.load(std::memory_order_relaxed);
+    events->push_back(copy);
+  }
+
+  // The thread went on writing: whatever it may have started to overwrite
+  // since (slots from the current head on, one ring back) is dropped
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const uint64_t head_after = ring->head.load(std::memory_order_relaxed);
+  const uint64_t valid_from = head_after + 1 > kTraceRingSize ? head_after + 1 - kTraceRingSize : 0;
+  if (valid_from > begin) {
+    const uint64_t stale = std::min<uint64_t>(valid_from - begin, events->size());
+    events->erase(events->begin(), events->begin() + stale);
+  }
+}
+
+bool TraceDump() {
+  if (!TraceEnabled()) {
+    return false;
+  }
+
+  static std::mutex dump_mutex;
+  std::unique_lock<std::mutex> dump_lock(dump_mutex);
+
+  std::vector<TraceRing*> rings;
+  {
+    std::unique_lock<std::mutex> lock(s_rings_mutex);
+    rings = s_rings;
+  }
+
+  FILE* file = fopen(s_path, "w");
+  if (!file) {
+    printf("Trace: can't write %s\n", s_path);
+    return false;
+  }
+
+  const int32_t pid = (int32_t)getpid();
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"%s\"}}",
+    pid, s_process_name);
+
+  uint64_t span_count = 0;
+  std::vector<CopiedEvent> events;
+  events.reserve(kTraceRingSize);
+  for (uint32_t r = 0; r < rings.size(); ++r) {
+    const TraceRing* ring = rings[r];
+    const char* thread_name = ring->thread_name.load(std::memory_order_relaxed);
+    if (thread_name) {
+      fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+        pid, ring->thread_id, thread_name);
+    }
+
+    CopyRing(ring, &events);
+    for (uint32_t i = 0; i < events.size(); ++i) {
+      const CopiedEvent& event = events[i];
+      fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}", event.name, pid, ring->thread_id,
+        event.start_ns / 1000.0, event.duration_ns / 1000.0, event.frame);
+    }
+    span_count += events.size();
+  }
+
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  printf("Trace: %llu spans written to %s\n", (unsigned long long)span_count, s_path);
+  return true;
+}
@@ -0,0 +1,210 @@
+#include "zero_copy.h"
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+
+// Received without a single page mapped: this path isn't going to map any
+static const uint64_t kZeroCopyGiveUpBytes = 64ull * 1024 * 1024;
+
+ZeroCopyReceiver::ZeroCopyReceiver(uint32_t window_count, uint32_t _window_size)
+  : enabled(true), mapped_bytes(0), copied_bytes(0) {
+  page_size = (uint32_t)sysconf(_SC_PAGESIZE);
+  window_size = (_window_size + page_size - 1) / page_size * page_size;
+
+  // Anonymous until they're mapped from a socket, the first receive does
+  for (uint32_t i = 0; i < window_count; ++i) {
+    void* address = mmap(nullptr, window_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED) {
+      LOG_ERROR("Zero-copy window: %s\n", strerror(errno));
+      break;
+    }
+    Window window = { (byte*)address, -1, 0 };
+    windows.push_back(window);
+  }
+}
+
+ZeroCopyReceiver::~ZeroCopyReceiver() {
+  for (uint32_t i = 0; i < windows.size(); ++i) {
+    munmap(windows[i].address, window_size);
+  }
+}
+
+bool ZeroCopyReceiver::isValid() const {
+  return !windows.empty();
+}
+
+uint32_t ZeroCopyReceiver::windowCount() const {
+  return (uint32_t)windows.size();
+}
+
+byte* ZeroCopyReceiver::window(uint32_t index) const {
+  return windows[index].address;
+}
+
+bool ZeroCopyReceiver::owns(const byte* buffer) const {
+  for (uint32_t i = 0; i < windows.size(); ++i) {
+    if (windows[i].address == buffer) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+ZeroCopyReceiver::Window* ZeroCopyReceiver::find(const byte* address) {
+  for (uint32_t i = 0; i < windows.size(); ++i) {
+    if (windows[i].address == address) {
+      return &windows[i];
+    }
+  }
+
+  return nullptr;
+}
+
+bool ZeroCopyReceiver::mapSocket(Window* window, int32_t descriptor, uint32_t offset) {
+  // Only read only mappings of a TCP socket are allowed, and the kernel
+  // inserts the received pages into them
+  if (mmap(window->address + offset, window_size - offset, PROT_READ, MAP_SHARED | MAP_FIXED, descriptor, 0) ==
+    MAP_FAILED) {
+    LOG_WARNING("Zero-copy receive unavailable (mmap: %s), copying\n", strerror(errno));
+    enabled = false;
+    return false;
+  }
+
+  window->descriptor = descriptor;
+  window->copy_from = window_size;
+  return true;
+}
+
+bool ZeroCopyReceiver::mapAnonymous(Window* window, uint32_t offset) {
+  if (mmap(window->address + offset, window_size - offset, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    LOG_ERROR("Zero-copy window: %s\n", strerror(errno));
+    return false;
+  }
+
+  window->copy_from = offset;
+  return true;
+}
+
+int32_t ZeroCopyReceiver::copy(Window* window, int32_t descriptor, uint32_t offset, uint32_t size) {
+  // Into anonymous memory from here on
+  if (offset < window->copy_from && !mapAnonymous(window, offset)) {
+    return -1;
+  }
+
+  const ssize_t received = recv(descriptor, window->address + offset, size, MSG_DONTWAIT);
+  if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  }
+  if (received <= 0) {
+    return -1;
+  }
+
+  copied_bytes += (uint64_t)received;
+  if (enabled && mapped_bytes == 0 && copied_bytes >= kZeroCopyGiveUpBytes) {
+    LOG_INFO("Zero-copy receive mapped nothing so far, copying from now on\n");
+    enabled = false;
+  }
+  return (int32_t)received;
+}
+
+int32_t ZeroCopyReceiver::receive(const TCPSocket& socket, byte* address, uint32_t offset, uint32_t size,
+  int32_t timeout_ms) {
+  Window* window = find(address);
+  if (!window || offset + size > window_size) {
+    return -1;
+  }
+
+  const int32_t descriptor = socket.getDescriptor();
+  if (!enabled) {
+    // Only copying: a plain receive, waiting only when there's nothing
+    const int32_t received = copy(window, descriptor, offset, size);
+    if (received != 0) {
+      return received;
+    }
+  }
+  else if (offset == 0 && (window->descriptor != descriptor || window->copy_from < window_size)) {
+    mapSocket(window, descriptor, 0);
+  }
+
+  struct pollfd poll_descriptor = { descriptor, POLLIN, 0 };
+  const int32_t ready = poll(&poll_descriptor, 1, timeout_ms);
+  if (ready < 0 && errno != EINTR) {
+    return -1;
+  }
+  if (ready <= 0) {
+    return 0;
+  }
+
+  // Whole pages where the window is (again) mapped from the socket
+  uint32_t skip = 0;
+  if (enabled && offset >= window->copy_from && offset % page_size == 0 && size >= page_size) {
+    mapSocket(window, descriptor, offset);
+  }
+  if (enabled && offset < window->copy_from && size >= page_size) {
+    struct tcp_zerocopy_receive zero_copy;
+    memset(&zero_copy, 0, sizeof(zero_copy));
+    zero_copy.address = (uint64_t)(uintptr_t)(window->address + offset);
+    zero_copy.length = size / page_size * page_size;
+    socklen_t length = sizeof(zero_copy);
+    if (getsockopt(descriptor, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zero_copy, &length) == 0) {
+      if (zero_copy.length > 0) {
+        mapped_bytes += zero_copy.length;
+        return (int32_t)zero_copy.length;
+      }
+      // What has to be read before anything can be mapped again
+      skip = zero_copy.recv_skip_hint;
+    }
+  }
+
+  return copy(window, descriptor, offset, (skip > 0 && skip < size) ? skip : size);
+}
+
+#else
+// TCP_ZEROCOPY_RECEIVE is Linux only: no windows, never valid
+ZeroCopyReceiver::ZeroCopyReceiver(uint32_t window_count, uint32_t _window_size)
+  : window_size(_window_size), page_size(0), enabled(false), mapped_bytes(0), copied_bytes(0) {
+  (void)window_count;
+}
+
+ZeroCopyReceiver::~ZeroCopyReceiver() {
+}
+
+bool ZeroCopyReceiver::isValid() const {
+  return false;
+}
+
+uint32_t ZeroCopyReceiver::windowCount() const {
+  return 0;
+}
+
+byte* ZeroCopyReceiver::window(uint32_t index) const {
+  (void)index;
+  return nullptr;
+}
+
+bool ZeroCopyReceiver::owns(const byte* buffer) const {
+  (void)buffer;
+  return false;
+}
+
+int32_t ZeroCopyReceiver::receive(const TCPSocket& socket, byte* window, uint32_t offset, uint32_t size,
+  int32_t timeout_ms) {
+  (void)socket;
+  (void)window;
+  (void)offset;
+  (void)size;
+  (void)timeout_ms;
+  return -1;
+}
+#endif // __linux__
@@ -0,0 +1,18 @@
+GREEN='\033[0;32m'
+BLUE='\033[0;34m'
+RED='\033[0;31m'
+NC='\033[0m'
+
+echo -e "\n${BLUE} -- Compiling --${NC}"
+
+make config=release -j || exit 1
+
+echo -e "\n${BLUE} -- Loopback performance run --${NC}"
+
+# Extra arguments go to Bench e2e, e.g. --clients 8 --seconds 30
+if ./Bench/bin/Bench e2e --out e2e_results.json "$@"; then
+  echo -e "\n${GREEN} -- Budgets met --${NC}"
+else
+  echo -e "\n${RED} -- Budgets missed, see e2e_results.json --${NC}"
+  exit 1
+fi
@@ -155,4 +155,38 @@ solution "webcam-streaming"
 
     configuration "release"
       defines { "NDEBUG" }
-      flags { "Optimize", "ExtraWarnings" }
\ No newline at end of file
+      flags { "Optimize", "ExtraWarnings" }
+
+  -- Project
+  project "Bench"
+    kind "ConsoleApp"
+    language "C++"
+    location ( "./Bench/" ) 
+    targetdir ("./Bench/bin/")
+
+    buildoptions_cpp("-std=c++11")
+      
+    includedirs { 
+      "./Bench/include/",
+      "./common/include/"
+    }
+    
+    files{ group = "include", "./Bench/include/**.h" } -- include filter and get the files
+    files{ group = "src", "./Bench/src/**.cc", "./Bench/src/**.cpp", "./common/src/**.cpp" } -- src filter and get the files
+       
+    configuration { "macosx" }
+      defines { "__PLATFORM_MACOSX__" }
+       
+    configuration { "linux" }
+      links {
+        "pthread"
+      }
+      defines { "__PLATFORM_LINUX__" }
+
+    configuration "debug"
+      defines { "DEBUG" }
+      flags { "Symbols", "ExtraWarnings"}
+
+    configuration "release"
+      defines { "NDEBUG" }
+      flags { "Optimize", "ExtraWarnings" }